@@ -33,19 +33,33 @@
 #include <sys/mman.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <libgen.h>
 
 #include "nvidia-installer.h"
 #include "user-interface.h"
 #include "backup.h"
 #include "files.h"
 #include "crc.h"
+#include "digest.h"
 #include "misc.h"
 #include "kernel.h"
 #include "conflicting-kernel-modules.h"
 
 #define BACKUP_DIRECTORY "$PKG/var/lib/nvidia"
 #define BACKUP_LOG       (BACKUP_DIRECTORY "/log")
+#define BACKUP_LOG_NEW   (BACKUP_DIRECTORY "/log.new")
 #define BACKUP_MKDIR_LOG (BACKUP_DIRECTORY "/dirs")
+#define BACKUP_CRC_CACHE (BACKUP_DIRECTORY "/crc-cache")
+#define BACKUP_LOG_INDEX (BACKUP_DIRECTORY "/log.idx")
+
+/*
+ * the scan cache is kept outside of BACKUP_DIRECTORY, which uninstalling
+ * the previous driver removes before the cache is used
+ */
+
+#define SCAN_CACHE_DIRECTORY "$PKG/var/cache/nvidia-installer"
+#define SCAN_CACHE_FILE      (SCAN_CACHE_DIRECTORY "/scan-cache")
+#define SCAN_CACHE_DIRECTORY_PERMS (S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH)
 
 
 
@@ -75,6 +89,15 @@
  * BACKED_UP_FILE_NUM: <filename>
  *  <filesize> <permissions> <uid> <gid>
  *
+ * The checksum lines of INSTALLED_FILE and BACKED_UP_FILE_NUM entries
+ * (the line following the filename; the "<filesize>" above is actually
+ * the file's CRC) may end with an additional digest, recorded as
+ * " <algorithm>:<hex digest>" (see digest.c), when a digest other than
+ * the CRC was selected with --backup-log-digest.  The CRC is always
+ * recorded too: older versions of nvidia-installer stop parsing the
+ * line at the end of the last number they expect, and so will still
+ * read these logs.  Digests of an unknown algorithm are ignored, and
+ * the entry is checked against its CRC.
  */
 
 #define BACKUP_LOG_PERMS (S_IRUSR|S_IWUSR)
@@ -90,9 +113,10 @@
 typedef struct {
     
     int    num;
-    char  *filename;
-    char  *target;
+    const char *filename;
+    const char *target;
     uint32 crc;
+    Digest digest;
     mode_t mode;
     uid_t  uid;
     gid_t  gid;
@@ -101,11 +125,78 @@ typedef struct {
 } BackupLogEntry;
 
 
+/*
+ * The backup log is read through a binary index, BACKUP_LOG_INDEX,
+ * built from the text log.  The text log remains the authoritative
+ * copy (it is what older versions of nvidia-installer read); the index
+ * is rebuilt from it whenever it is missing, or does not match the text
+ * log it was built from (e.g. because the text log was appended to by
+ * a --kernel-module-only installation).  The index is used in place,
+ * once mmap(2)ed:
+ *
+ *   BackupLogIndexHeader
+ *   BackupLogIndexEntry entries[num_entries]   in log order
+ *   uint32 sorted[num_entries]                 entry numbers, sorted by
+ *                                              filename
+ *   uint32 hash[hash_size]                     1 + the position in
+ *                                              sorted[] of the first entry
+ *                                              for each distinct filename,
+ *                                              or 0 for an empty slot
+ *   char strings[strings_size]                 NUL-terminated strings;
+ *                                              offset 0 is the empty string
+ *
+ * Entries are kept in log order, because the uninstaller processes them
+ * in that order; lookups by filename go through sorted[] and hash[].
+ * The index is in host byte order.
+ */
+
+#define BACKUP_LOG_INDEX_MAGIC "NVBKIDX"
+#define BACKUP_LOG_INDEX_VERSION 1
+
 typedef struct {
-    char *version;
-    char *description;
+    char     magic[8];
+    uint32   version;
+    uint32   header_size;
+    uint32   entry_size;
+    uint32   num_entries;
+    uint32   hash_size;
+    uint32   strings_size;
+    uint32   version_string;
+    uint32   description_string;
+
+    /* the identity of the text log that the index was built from */
+    uint64_t log_size;
+    uint64_t log_ino;
+    int64_t  log_mtime_sec;
+    int64_t  log_mtime_nsec;
+} BackupLogIndexHeader;
+
+typedef struct {
+    int32_t num;
+    uint32  filename;
+    uint32  target;                  /* 0 if none */
+    uint32  crc;
+    uint32  mode;
+    uint32  uid;
+    uint32  gid;
+    uint32  digest_type;
+    uint8   digest[DIGEST_MAX_LEN];
+} BackupLogIndexEntry;
+
+
+typedef struct {
+    const char *version;
+    const char *description;
     BackupLogEntry *e;
     int n;
+
+    /* the index that the strings above point into */
+    char *index;
+    size_t index_len;
+    int index_mapped;
+    const uint32 *sorted;
+    const uint32 *hash;
+    uint32 hash_size;
 } BackupInfo;
 
 
@@ -124,6 +215,22 @@ static char *create_backwards_compatible_version_string(const char *str);
 
 static int reverse_strlen_compare(const void *a, const void *b);
 
+static void invalidate_installed_file_index(void);
+
+static int write_carried_backup_log_entries(FILE *log);
+
+static FILE *begin_backup_log_rewrite(Options *op);
+
+static int backup_log_entry_superseded(const BackupInfo *b, int i);
+
+static int end_backup_log_rewrite(Options *op, FILE *log);
+
+static void mark_delta_reinstalled(const char *filename);
+
+/* the number to give the next backed up file */
+
+static int backup_file_number = BACKED_UP_FILE_NUM;
+
 
 
 
@@ -131,7 +238,14 @@ static int reverse_strlen_compare(const void *a, const void *b);
 /*
  * init_backup() - initialize the backup engine; this consists of
  * creating a new backup directory, and writing to the log file that
- * we're about to install a new driver version.
+ * we're about to install a new driver version.  When reinstalling the
+ * installed driver in place (see prepare_delta_reinstall()), the backup
+ * directory is kept instead, and the log is replaced by one that starts
+ * with the entries of the files that are already backed up in it, and
+ * of the files and links installed by the earlier installation; the
+ * latter are dropped by finish_delta_reinstall() once the installation
+ * has succeeded.  Until then, e.g. if the installation fails, they keep
+ * the earlier installation's files logged, for a later uninstall.
  */
 
 int init_backup(Options *op, Package *p)
@@ -140,6 +254,13 @@ int init_backup(Options *op, Package *p)
     char *version;
     FILE *log;
     
+    invalidate_installed_file_index();
+
+    if (delta_reinstall_active()) {
+        if ((log = begin_backup_log_rewrite(op)) == NULL) return FALSE;
+        goto write_log;
+    }
+
     /* remove the directory, if it already exists */
 
     if (directory_exists(BACKUP_DIRECTORY)) {
@@ -178,12 +299,19 @@ int init_backup(Options *op, Package *p)
 
     /* write the version and description */
 
+ write_log:
+
     version = create_backwards_compatible_version_string(p->version);
     
     fprintf(log, "%s\n", version);
     fprintf(log, "%s\n", p->description);
 
     nvfree(version);
+
+    if (delta_reinstall_active()) {
+        backup_file_number = write_carried_backup_log_entries(log);
+        return end_backup_log_rewrite(op, log);
+    }
         
     /* close the log file */
 
@@ -200,226 +328,506 @@ int init_backup(Options *op, Package *p)
 
 
 /*
- * do_backup() - backup the specified file.  If it is a regular file,
- * just move it into the backup directory, and add an entry to the log
- * file.
+ * begin_backup_log_rewrite() - create a new backup log under a temporary
+ * name, for end_backup_log_rewrite() to rename into place, so that the
+ * log is replaced at once, even if the installer is interrupted.
  */
 
-int do_backup(Options *op, const char *filename)
+static FILE *begin_backup_log_rewrite(Options *op)
 {
-    int len, ret, ret_val;
-    struct stat stat_buf;
-    char *tmp = NULL;
-    FILE *log;
-    uint32 crc;
+    FILE *log = NULL;
+    int fd;
+
+    fd = open(BACKUP_LOG_NEW, O_WRONLY | O_CREAT | O_TRUNC, BACKUP_LOG_PERMS);
+    if (fd == -1 || fchmod(fd, BACKUP_LOG_PERMS) == -1 ||
+        (log = fdopen(fd, "w")) == NULL) {
+        ui_error(op, "Unable to create backup log file '%s' (%s).",
+                 BACKUP_LOG_NEW, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            unlink(BACKUP_LOG_NEW);
+        }
+    }
 
-    static int backup_file_number = BACKED_UP_FILE_NUM;
+    return log;
 
-    ret_val = FALSE;
+} /* begin_backup_log_rewrite() */
 
-    log = fopen(BACKUP_LOG, "a");
-    if (!log) {
-        ui_error(op, "Unable to open backup log file '%s' (%s).",
+
+
+/*
+ * end_backup_log_rewrite() - flush the new backup log 'log' to disk, and
+ * rename it over BACKUP_LOG.
+ */
+
+static int end_backup_log_rewrite(Options *op, FILE *log)
+{
+    int ret;
+
+    ret = (fflush(log) == 0) && (fsync(fileno(log)) == 0);
+    ret = (fclose(log) == 0) && ret;
+
+    if (!ret || rename(BACKUP_LOG_NEW, BACKUP_LOG) == -1) {
+        ui_error(op, "Unable to replace backup log file '%s' (%s).",
                  BACKUP_LOG, strerror(errno));
+        unlink(BACKUP_LOG_NEW);
         return FALSE;
     }
-    
-    if (lstat(filename, &stat_buf) == -1) {
-        switch (errno) {
-        case ENOENT:
-            ret_val = TRUE;
-            break;
-        default:
-            ui_error(op, "Unable to determine properties for file '%s' (%s).",
-                     filename, strerror(errno));
-        }
-        goto done;
-    }
 
-    if (S_ISREG(stat_buf.st_mode)) {
-        crc = compute_crc(op, filename);
-        len = strlen(BACKUP_DIRECTORY) + 64;
-        tmp = nvalloc(len + 1);
-        snprintf(tmp, len, "%s/%d", BACKUP_DIRECTORY, backup_file_number);
-        if (!nvrename(op, filename, tmp)) {
-            ui_error(op, "Unable to backup file '%s'.", filename);
-            goto done;
-        }
-        
-        fprintf(log, "%d: %s\n", backup_file_number, filename);
-        
-        /* write the filesize, permissions, uid, gid */
-        fprintf(log, "%u %04o %d %d\n", crc, stat_buf.st_mode,
-                stat_buf.st_uid, stat_buf.st_gid);
-        
-        backup_file_number++;
-    } else if (S_ISLNK(stat_buf.st_mode)) {
-        tmp = get_symlink_target(op, filename);
-        
-        ret = unlink(filename);
-        if (ret == -1) {
-            ui_error(op, "Unable to remove symbolic link '%s' (%s).",
-                     filename, strerror(errno));
-            goto done;
-        }
+    invalidate_installed_file_index();
 
-        fprintf(log, "%d: %s\n", BACKED_UP_SYMLINK, filename);
-        fprintf(log, "%s\n", tmp);
-        fprintf(log, "%04o %d %d\n", stat_buf.st_mode,
-                stat_buf.st_uid, stat_buf.st_gid);
-    } else if (S_ISDIR(stat_buf.st_mode)) {
+    return TRUE;
 
-        /* XXX IMPLEMENT ME: recursive moving of a directory */
+} /* end_backup_log_rewrite() */
 
-        ui_error(op, "Unable to backup directory '%s'.", filename);
-        goto done;
-    } else {
-        ui_error(op, "Unable to backup file '%s' (don't know how to deal with "
-                 "file type).", filename);
-        goto done;
-    }
-    
-    ret_val = TRUE;
 
- done:
 
-    nvfree(tmp);
+/*
+ * write_digest() - terminate a checksum line of the backup log, first
+ * appending the digest, if there is one.
+ */
 
-    /* close the log file */
+static void write_digest(FILE *log, const Digest *digest)
+{
+    char *str = digest_to_string(digest);
 
-    if (fclose(log) != 0) {
-        ui_error(op, "Error while closing backup log file '%s' (%s).",
-                 BACKUP_LOG, strerror(errno));
-        ret_val = FALSE;
+    if (str) {
+        fprintf(log, " %s", str);
+        nvfree(str);
     }
-    
-    return ret_val;
-    
-} /* do_backup() */
 
+    fprintf(log, "\n");
+}
+
+
+
+/*
+ * The backup log journal: while a command list is executed, the backup
+ * log is kept open, and entries are appended to it through a stdio
+ * buffer, rather than by opening and closing the log for each entry.
+ * The buffer is flushed and the log synced to disk (a "checkpoint"):
+ *
+ *  - before a file is backed up: the entry for a backed up file is
+ *    written ahead of moving the file into the backup directory, so that
+ *    a crash can never leave a backed up file that the log does not
+ *    know about (an entry left without its backup by a crash before the
+ *    move is recognized by backup_never_made(), and skipped without
+ *    failing the validation of the installation);
+ *
+ *  - before running an external command;
+ *
+ *  - when the journal is closed.
+ *
+ * Entries for installed files and symlinks may be lost by a crash
+ * between checkpoints; at worst, such files are left in place by a
+ * later uninstall.  Entries are written in order, so the only damage a
+ * crash can do to the log is to truncate its last entry, which the
+ * parser ignores.
+ *
+ * Entries written while the journal is not open are appended directly.
+ */
+
+#define BACKUP_LOG_JOURNAL_BUFFER_SIZE (64 * 1024)
 
+static FILE *backup_log_journal;
 
-int log_install_file(Options *op, const char *filename)
+
+/*
+ * open_backup_log_journal() - open the backup log for the journal.  If
+ * it cannot be opened, entries are appended directly (and errors are
+ * reported as they are written).
+ */
+
+int open_backup_log_journal(Options *op)
 {
-    FILE *log;
-    uint32 crc;
-    
-    /* open the log file */
+    if (backup_log_journal) return TRUE;
 
-    log = fopen(BACKUP_LOG, "a");
-    if (!log) {
-        ui_error(op, "Unable to open backup log file '%s' (%s).",
+    backup_log_journal = fopen(BACKUP_LOG, "a");
+    if (!backup_log_journal) return FALSE;
+
+    setvbuf(backup_log_journal, NULL, _IOFBF, BACKUP_LOG_JOURNAL_BUFFER_SIZE);
+
+    return TRUE;
+
+} /* open_backup_log_journal() */
+
+
+/*
+ * sync_backup_log_journal() - checkpoint the journal: write out any
+ * buffered entries, and wait for them to reach the disk.
+ */
+
+int sync_backup_log_journal(Options *op)
+{
+    if (!backup_log_journal) return TRUE;
+
+    if (fflush(backup_log_journal) != 0 ||
+        fdatasync(fileno(backup_log_journal)) != 0) {
+        ui_error(op, "Error while writing backup log file '%s' (%s).",
                  BACKUP_LOG, strerror(errno));
         return FALSE;
     }
-    
-    fprintf(log, "%d: %s\n", INSTALLED_FILE, filename);
-    
-    crc = compute_crc(op, filename);
 
-    fprintf(log, "%u\n", crc);
-    
-    /* close the log file */
+    return TRUE;
 
-    if (fclose(log) != 0) {
+} /* sync_backup_log_journal() */
+
+
+int close_backup_log_journal(Options *op)
+{
+    int ret;
+
+    if (!backup_log_journal) return TRUE;
+
+    ret = sync_backup_log_journal(op);
+
+    if (fclose(backup_log_journal) != 0) {
         ui_error(op, "Error while closing backup log file '%s' (%s).",
                  BACKUP_LOG, strerror(errno));
-        return FALSE;
+        ret = FALSE;
     }
-    
-    return TRUE;
 
-} /* log_install_file() */
+    backup_log_journal = NULL;
 
+    return ret;
 
+} /* close_backup_log_journal() */
 
-int log_create_symlink(Options *op, const char *filename, const char *target)
+
+/*
+ * begin_backup_log_entry() - get the stream to write a backup log entry
+ * to: the journal, if it is open, otherwise the log, opened for this
+ * entry only.
+ */
+
+static FILE *begin_backup_log_entry(Options *op)
 {
     FILE *log;
-    
-    /* open the log file */
+
+    invalidate_installed_file_index();
+
+    if (backup_log_journal) return backup_log_journal;
 
     log = fopen(BACKUP_LOG, "a");
     if (!log) {
         ui_error(op, "Unable to open backup log file '%s' (%s).",
                  BACKUP_LOG, strerror(errno));
+    }
+
+    return log;
+
+} /* begin_backup_log_entry() */
+
+
+/*
+ * end_backup_log_entry() - finish writing a backup log entry; if 'sync'
+ * is TRUE, the entry has reached the disk when this returns TRUE.
+ */
+
+static int end_backup_log_entry(Options *op, FILE *log, int sync)
+{
+    if (log == backup_log_journal) {
+        if (sync) return sync_backup_log_journal(op);
+        if (ferror(log)) {
+            ui_error(op, "Error while writing backup log file '%s'.",
+                     BACKUP_LOG);
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    if (sync && (fflush(log) != 0 || fdatasync(fileno(log)) != 0)) {
+        ui_error(op, "Error while writing backup log file '%s' (%s).",
+                 BACKUP_LOG, strerror(errno));
+        fclose(log);
         return FALSE;
     }
-    
-    fprintf(log, "%d: %s\n", INSTALLED_SYMLINK, filename);
-    fprintf(log, "%s\n", target);
-    
-    /* close the log file */
 
     if (fclose(log) != 0) {
         ui_error(op, "Error while closing backup log file '%s' (%s).",
                  BACKUP_LOG, strerror(errno));
         return FALSE;
     }
-    
+
     return TRUE;
 
-} /* log_create_symlink() */
+} /* end_backup_log_entry() */
 
 
+/*
+ * get_backup_log_size() - get the size of the backup log before an
+ * entry is written to 'log' (as returned by begin_backup_log_entry()),
+ * so that the entry can be removed again with truncate_backup_log().
+ * On failure, the entry is abandoned.
+ */
 
-static int parse_first_line(const char *buf, int *num, char **filename)
+static int get_backup_log_size(Options *op, FILE *log, off_t *size)
 {
-    char *c, *local_buf;
-        
-    if (!buf || !num || !filename) return FALSE;
+    struct stat stat_buf;
 
-    local_buf = nvstrdup(buf);
-    
-    c = local_buf;
-    while ((*c != '\0') && (*c != ':')) {
-        if (!isdigit(*c)) return FALSE;
-        c++;
+    if (fflush(log) != 0 || fstat(fileno(log), &stat_buf) != 0) {
+        ui_error(op, "Error while writing backup log file '%s' (%s).",
+                 BACKUP_LOG, strerror(errno));
+        if (log != backup_log_journal) fclose(log);
+        return FALSE;
     }
-    if (*c == '\0') return FALSE;
-
-    *c = '\0';
-    
-    *num = strtol(local_buf, NULL, 10);
 
-    c++;
-    while(isspace(*c)) c++;
+    *size = stat_buf.st_size;
 
-    *filename = nvstrdup(c);
+    return TRUE;
 
-    free(local_buf);
+} /* get_backup_log_size() */
 
-    return TRUE;
-}
 
+/*
+ * truncate_backup_log() - remove the entries written to the backup log
+ * since it was 'size' bytes long.
+ */
 
-static int parse_mode_uid_gid(const char *buf, mode_t *mode,
-                              uid_t *uid, gid_t *gid)
+static void truncate_backup_log(Options *op, off_t size)
 {
-    char *c, *local_buf, *str;
+    int ret;
 
-    if (!buf || !mode || !uid || !gid) return FALSE;
+    invalidate_installed_file_index();
 
-    local_buf = nvstrdup(buf);
+    if (backup_log_journal) {
+        ret = fflush(backup_log_journal) == 0 &&
+              ftruncate(fileno(backup_log_journal), size) == 0 &&
+              fdatasync(fileno(backup_log_journal)) == 0;
+    } else {
+        ret = truncate(BACKUP_LOG, size) == 0;
+    }
 
-    c = str = local_buf;
-    while ((*c != '\0') && (isdigit(*c))) c++;
-    if (*c == '\0') return FALSE;
-    *c = '\0';
-    *mode = strtol(str, NULL, 8);
+    if (!ret) {
+        ui_error(op, "Unable to remove an entry from backup log file '%s' "
+                 "(%s).", BACKUP_LOG, strerror(errno));
+    }
 
-    str = ++c;
-    while ((*c != '\0') && (isdigit(*c))) c++;
-    if (*c == '\0') return FALSE;
-    *c = '\0';
-    *uid = strtol(str, NULL, 10);
+} /* truncate_backup_log() */
 
-    str = ++c;
-    while ((*c != '\0') && (isdigit(*c))) c++;
-    *c = '\0';
-    *gid = strtol(str, NULL, 10);
-      
-    free(local_buf);
+
+
+/*
+ * do_backup() - backup the specified file.  If it is a regular file,
+ * just move it into the backup directory, and add an entry to the log
+ * file.  The entry is written to disk before the file is moved.
+ */
+
+int do_backup(Options *op, const char *filename)
+{
+    return do_backup_from(op, filename, filename);
+
+} /* do_backup() */
+
+
+
+/*
+ * do_backup_from() - same as do_backup(), for the file 'filename' that
+ * has been moved to 'path' (e.g. by exchange_staged_file()): the file
+ * at 'path' is backed up, and recorded as 'filename'.
+ */
+
+int do_backup_from(Options *op, const char *filename, const char *path)
+{
+    int len, ret, ret_val;
+    struct stat stat_buf;
+    char *tmp = NULL;
+    FILE *log;
+    FileChecksum sum;
+    off_t log_size;
+
+    ret_val = FALSE;
+
+    if (lstat(path, &stat_buf) == -1) {
+        switch (errno) {
+        case ENOENT:
+            ret_val = TRUE;
+            break;
+        default:
+            ui_error(op, "Unable to determine properties for file '%s' (%s).",
+                     filename, strerror(errno));
+        }
+        goto done;
+    }
+
+    if (S_ISREG(stat_buf.st_mode)) {
+        memset(&sum, 0, sizeof(sum));
+        sum.digest.type = op->backup_log_digest;
+        compute_file_checksum(op, path, &sum);
+        len = strlen(BACKUP_DIRECTORY) + 64;
+        tmp = nvalloc(len + 1);
+        snprintf(tmp, len, "%s/%d", BACKUP_DIRECTORY, backup_file_number);
+
+        if ((log = begin_backup_log_entry(op)) == NULL) goto done;
+        if (!get_backup_log_size(op, log, &log_size)) goto done;
+        
+        fprintf(log, "%d: %s\n", backup_file_number, filename);
+        
+        /* write the crc, permissions, uid, gid, and digest */
+        fprintf(log, "%u %04o %d %d", sum.crc, stat_buf.st_mode,
+                stat_buf.st_uid, stat_buf.st_gid);
+        write_digest(log, &sum.digest);
+
+        if (!end_backup_log_entry(op, log, TRUE)) goto done;
+
+        /*
+         * the entry is on disk before the file is moved, so that a crash
+         * cannot lose track of the file; if the move fails, the entry is
+         * removed again, so that the log never records a backup that
+         * does not exist
+         */
+
+        backup_file_number++;
+
+        if (!nvrename(op, path, tmp)) {
+            ui_error(op, "Unable to backup file '%s'.", filename);
+            truncate_backup_log(op, log_size);
+            goto done;
+        }
+    } else if (S_ISLNK(stat_buf.st_mode)) {
+        tmp = get_symlink_target(op, path);
+        if (!tmp) goto done;
+
+        if ((log = begin_backup_log_entry(op)) == NULL) goto done;
+        if (!get_backup_log_size(op, log, &log_size)) goto done;
+
+        fprintf(log, "%d: %s\n", BACKED_UP_SYMLINK, filename);
+        fprintf(log, "%s\n", tmp);
+        fprintf(log, "%04o %d %d\n", stat_buf.st_mode,
+                stat_buf.st_uid, stat_buf.st_gid);
+
+        if (!end_backup_log_entry(op, log, TRUE)) goto done;
+        
+        ret = unlink(path);
+        if (ret == -1) {
+            ui_error(op, "Unable to remove symbolic link '%s' (%s).",
+                     filename, strerror(errno));
+            truncate_backup_log(op, log_size);
+            goto done;
+        }
+    } else if (S_ISDIR(stat_buf.st_mode)) {
+
+        /* XXX IMPLEMENT ME: recursive moving of a directory */
+
+        ui_error(op, "Unable to backup directory '%s'.", filename);
+        goto done;
+    } else {
+        ui_error(op, "Unable to backup file '%s' (don't know how to deal with "
+                 "file type).", filename);
+        goto done;
+    }
+    
+    ret_val = TRUE;
+
+ done:
+
+    nvfree(tmp);
+
+    return ret_val;
+    
+} /* do_backup_from() */
+
+
+
+/*
+ * log_install_file() - record that 'filename' was installed, with the
+ * checksums 'sum' (as computed by compute_file_checksum(), or while the
+ * file was being copied into place).
+ */
+
+int log_install_file(Options *op, const char *filename,
+                     const FileChecksum *sum)
+{
+    FILE *log;
+
+    if ((log = begin_backup_log_entry(op)) == NULL) return FALSE;
+    
+    fprintf(log, "%d: %s\n", INSTALLED_FILE, filename);
+    fprintf(log, "%u", sum->crc);
+    write_digest(log, &sum->digest);
+
+    mark_delta_reinstalled(filename);
+    
+    return end_backup_log_entry(op, log, FALSE);
+
+} /* log_install_file() */
+
+
+
+int log_create_symlink(Options *op, const char *filename, const char *target)
+{
+    FILE *log;
+
+    if ((log = begin_backup_log_entry(op)) == NULL) return FALSE;
+    
+    fprintf(log, "%d: %s\n", INSTALLED_SYMLINK, filename);
+    fprintf(log, "%s\n", target);
+
+    mark_delta_reinstalled(filename);
+    
+    return end_backup_log_entry(op, log, FALSE);
+
+} /* log_create_symlink() */
+
+
+
+static int parse_first_line(const char *buf, int *num, char **filename)
+{
+    char *c, *local_buf;
+        
+    if (!buf || !num || !filename) return FALSE;
+
+    local_buf = nvstrdup(buf);
+    
+    c = local_buf;
+    while ((*c != '\0') && (*c != ':')) {
+        if (!isdigit(*c)) return FALSE;
+        c++;
+    }
+    if (*c == '\0') return FALSE;
+
+    *c = '\0';
+    
+    *num = strtol(local_buf, NULL, 10);
+
+    c++;
+    while(isspace(*c)) c++;
+
+    *filename = nvstrdup(c);
+
+    free(local_buf);
+
+    return TRUE;
+}
+
+
+static int parse_mode_uid_gid(const char *buf, mode_t *mode,
+                              uid_t *uid, gid_t *gid)
+{
+    char *c, *local_buf, *str;
+
+    if (!buf || !mode || !uid || !gid) return FALSE;
+
+    local_buf = nvstrdup(buf);
+
+    c = str = local_buf;
+    while ((*c != '\0') && (isdigit(*c))) c++;
+    if (*c == '\0') return FALSE;
+    *c = '\0';
+    *mode = strtol(str, NULL, 8);
+
+    str = ++c;
+    while ((*c != '\0') && (isdigit(*c))) c++;
+    if (*c == '\0') return FALSE;
+    *c = '\0';
+    *uid = strtol(str, NULL, 10);
+
+    str = ++c;
+    while ((*c != '\0') && (isdigit(*c))) c++;
+    *c = '\0';
+    *gid = strtol(str, NULL, 10);
+      
+    free(local_buf);
 
     return TRUE;
 }
@@ -483,6 +891,25 @@ static int parse_crc(const char *buf, uint32 *crc)
 } /* parse_crc() */
 
 
+/*
+ * parse_digest() - parse the digest, if any, at the end of a checksum
+ * line; digests of an unknown algorithm, and malformed digests, are
+ * silently ignored, leaving the entry to be verified by its CRC.
+ */
+
+static void parse_digest(const char *buf, Digest *digest)
+{
+    const char *str = strrchr(buf, ' ');
+
+    memset(digest, 0, sizeof(*digest));
+
+    if (str && strchr(str, ':') && !parse_digest_string(str + 1, digest)) {
+        memset(digest, 0, sizeof(*digest));
+    }
+
+} /* parse_digest() */
+
+
 /*
  * Syntax for the mkdir log file:
  *
@@ -548,26 +975,21 @@ static int reverse_strlen_compare(const void *a, const void *b)
 
 
 /*
- * rmdir_recursive() - Use BACKUP_MKDIR_LOG to find directories that were
- * created by a previous nvidia-installer, and delete any such directories.
- * Returns TRUE if the log is found and all directories are successfully
- * deleted; returns FALSE if any directories failed to be deleted or the
- * log isn't found. The log enries are processed in reverse order, so that
- * child directories get properly deleted before their parents.
+ * read_mkdir_log() - read the lines of BACKUP_MKDIR_LOG into a newly
+ * allocated array; returns NULL if the log cannot be opened.  Some of
+ * the lines may be NULL or empty.
  */
-static int rmdir_recursive(Options *op)
+static char **read_mkdir_log(int *num_lines)
 {
     FILE *log;
     char **dirs;
-    int eof = FALSE, ret = TRUE, lines, i;
+    int eof = FALSE, lines, i;
 
     /* open the log file */
 
     log = fopen(BACKUP_MKDIR_LOG, "r");
     if (!log) {
-        /* Fail silently: most likely, the current driver was simply installed
-         * with an nvidia-installer that didn't log created directories. */
-        return FALSE;
+        return NULL;
     }
 
     /* Count the number of lines */
@@ -586,6 +1008,35 @@ static int rmdir_recursive(Options *op)
         dirs[i] = fget_next_line(log, &eof); 
     }
 
+    fclose(log);
+
+    *num_lines = lines;
+
+    return dirs;
+}
+
+
+
+/*
+ * rmdir_recursive() - Use BACKUP_MKDIR_LOG to find directories that were
+ * created by a previous nvidia-installer, and delete any such directories.
+ * Returns TRUE if the log is found and all directories are successfully
+ * deleted; returns FALSE if any directories failed to be deleted or the
+ * log isn't found. The log enries are processed in reverse order, so that
+ * child directories get properly deleted before their parents.
+ */
+static int rmdir_recursive(Options *op)
+{
+    char **dirs;
+    int ret = TRUE, lines, i;
+
+    dirs = read_mkdir_log(&lines);
+    if (!dirs) {
+        /* Fail silently: most likely, the current driver was simply installed
+         * with an nvidia-installer that didn't log created directories. */
+        return FALSE;
+    }
+
     qsort(dirs, lines, sizeof(char*), reverse_strlen_compare);
 
     for (i = 0; i < lines; i++) {
@@ -610,50 +1061,237 @@ static int rmdir_recursive(Options *op)
                 op->log_file_name);
     }
 
-    /* close the log file */
-
-    if (fclose(log) != 0) {
-        ui_error(op, "Error while closing mkdir log file '%s' (%s).",
-                 BACKUP_MKDIR_LOG, strerror(errno));
-        return FALSE;
-    }
-
     return ret;
 }
 
 
 
 /*
- * do_uninstall() - this function uninstalls a previously installed
- * driver, by parsing the BACKUP_LOG file.
+ * remove_empty_logged_directories() - delete the directories recorded in
+ * BACKUP_MKDIR_LOG that are empty (e.g. because the files of an earlier
+ * installation that were not installed again have been removed), and
+ * drop them, and any that no longer exist, from the log.
  */
-
-static int do_uninstall(Options *op, const char *version,
-                        const int skip_depmod)
+static void remove_empty_logged_directories(Options *op)
 {
-    BackupLogEntry *e;
-    BackupInfo *b;
-    int i, len, ok;
-    char *tmpstr;
-    float percent;
-    int removal_failed = FALSE, restore_failed = FALSE;
-
-    static const char existing_installation_is_borked[] = 
-        "Your driver installation has been "
-        "altered since it was initially installed; this may happen, "
-        "for example, if you have since installed the NVIDIA driver through "
-        "a mechanism other than nvidia-installer (such as your "
-        "distribution's native package management system).  "
-        "nvidia-installer will attempt to uninstall as best it can.";
-    
-    /* do we even have a backup directory? */
+    char **dirs, **sorted;
+    FILE *log;
+    int lines, i;
 
-    if (access(BACKUP_DIRECTORY, F_OK) == -1) {
-        ui_message(op, "No driver backed up.");
-        return FALSE;
+    dirs = read_mkdir_log(&lines);
+    if (!dirs) {
+        return;
     }
-    
-    if ((b = read_backup_log_file(op)) == NULL) return FALSE;
+
+    sorted = nvalloc(lines * sizeof(char *));
+    memcpy(sorted, dirs, lines * sizeof(char *));
+    qsort(sorted, lines, sizeof(char *), reverse_strlen_compare);
+
+    for (i = 0; i < lines; i++) {
+        if (!sorted[i] || !strlen(sorted[i]) ||
+            strcmp(sorted[i], BACKUP_DIRECTORY) == 0) {
+            continue;
+        }
+        if (rmdir(sorted[i]) == 0) {
+            ui_log(op, "Removed the directory '%s', which is now empty.",
+                   sorted[i]);
+            sorted[i][0] = '\0';
+        } else if (errno == ENOENT) {
+            sorted[i][0] = '\0';
+        }
+    }
+
+    log = fopen(BACKUP_MKDIR_LOG, "w");
+    if (log) {
+        for (i = 0; i < lines; i++) {
+            if (dirs[i] && strlen(dirs[i])) {
+                fprintf(log, "%s\n", dirs[i]);
+            }
+        }
+        fclose(log);
+    }
+
+    for (i = 0; i < lines; i++) {
+        nvfree(dirs[i]);
+    }
+    nvfree(dirs);
+    nvfree(sorted);
+}
+
+
+
+/*
+ * get_logged_directories() - return a newly allocated array of the
+ * directories created so far by this installation, as recorded in
+ * BACKUP_MKDIR_LOG, in the order they were created; the backup
+ * directory itself is left out.  Returns NULL (with '*num' set to 0) if
+ * there are none.
+ */
+char **get_logged_directories(Options *op, int *num)
+{
+    char **dirs;
+    int lines, i, n = 0;
+
+    *num = 0;
+
+    dirs = read_mkdir_log(&lines);
+    if (!dirs) {
+        return NULL;
+    }
+
+    for (i = 0; i < lines; i++) {
+        if (dirs[i] && strlen(dirs[i]) &&
+            strcmp(dirs[i], BACKUP_DIRECTORY) != 0) {
+            dirs[n++] = dirs[i];
+        } else {
+            nvfree(dirs[i]);
+        }
+    }
+
+    if (n == 0) {
+        nvfree(dirs);
+        return NULL;
+    }
+
+    *num = n;
+
+    return dirs;
+}
+
+
+
+/*
+ * restore_backed_up_entry() - restore the backed up file or symbolic
+ * link of entry 'e' to its original location, with its original owner,
+ * group and permissions; returns FALSE if any of this failed.  A symbolic
+ * link that cannot be created is only reported as a failure if
+ * 'report_symlink' is TRUE.
+ */
+
+static int restore_backed_up_entry(Options *op, const BackupLogEntry *e,
+                                   int report_symlink)
+{
+    char *tmpstr;
+    int len, ret = TRUE;
+
+    if (e->num == BACKED_UP_SYMLINK) {
+        if (symlink(e->target, e->filename) == -1) {
+            ui_log(op, "Unable to restore symbolic link "
+                   "%s -> %s (%s).", e->filename, e->target,
+                   strerror(errno));
+            return !report_symlink;
+        }
+
+        /* XXX do we need to chmod the symlink? */
+
+        if (lchown(e->filename, e->uid, e->gid)) {
+            ui_log(op, "Unable to restore owner (%d) and group "
+                   "(%d) for symbolic link '%s' (%s).",
+                   e->uid, e->gid, e->filename, strerror(errno));
+            return FALSE;
+        }
+
+        return TRUE;
+    }
+
+    len = strlen(BACKUP_DIRECTORY) + 64;
+    tmpstr = nvalloc(len + 1);
+    snprintf(tmpstr, len, "%s/%d", BACKUP_DIRECTORY, e->num);
+    if (!nvrename(op, tmpstr, e->filename)) {
+        ui_log(op, "Unable to restore file '%s'.", e->filename);
+        ret = FALSE;
+    } else {
+        if (chown(e->filename, e->uid, e->gid)) {
+            ui_log(op, "Unable to restore owner (%d) and group "
+                   "(%d) for file '%s' (%s).",
+                   e->uid, e->gid, e->filename, strerror(errno));
+            ret = FALSE;
+        } else {
+            if (chmod(e->filename, e->mode) == -1) {
+                ui_log(op, "Unable to restore permissions %04o for "
+                       "file '%s'.", e->mode, e->filename);
+                ret = FALSE;
+            }
+        }
+    }
+    free(tmpstr);
+
+    return ret;
+
+} /* restore_backed_up_entry() */
+
+
+
+/*
+ * remove_installed_dkms_module() - remove the DKMS module of driver
+ * version 'version', if one is installed.
+ */
+
+static void remove_installed_dkms_module(Options *op, const char *version)
+{
+    if (dkms_module_installed(op, version)) {
+        ui_log(op, "DKMS module detected; removing...");
+        if (!dkms_remove_module(op, version)) {
+            ui_warn(op, "Failed to remove installed DKMS module!");
+        }
+    }
+
+} /* remove_installed_dkms_module() */
+
+
+
+/*
+ * unload_conflicting_kernel_modules() - attempt to unload the kernel
+ * module(s), but don't abort if this fails: the kernel may not have been
+ * configured with support for module unloading or the user might have
+ * unloaded it themselves or the module might not have existed at all.
+ */
+
+static void unload_conflicting_kernel_modules(Options *op)
+{
+    int i;
+
+    if (op->skip_module_unload) return;
+
+    for (i = 0; i < num_conflicting_kernel_modules; i++) {
+        rmmod_kernel_module(op, conflicting_kernel_modules[i]);
+    }
+
+} /* unload_conflicting_kernel_modules() */
+
+
+
+/*
+ * do_uninstall() - this function uninstalls a previously installed
+ * driver, by parsing the BACKUP_LOG file.
+ */
+
+static int do_uninstall(Options *op, const char *version,
+                        const int skip_depmod)
+{
+    BackupLogEntry *e;
+    BackupInfo *b;
+    int i, ok;
+    char *tmpstr;
+    float percent;
+    int removal_failed = FALSE, restore_failed = FALSE;
+
+    static const char existing_installation_is_borked[] = 
+        "Your driver installation has been "
+        "altered since it was initially installed; this may happen, "
+        "for example, if you have since installed the NVIDIA driver through "
+        "a mechanism other than nvidia-installer (such as your "
+        "distribution's native package management system).  "
+        "nvidia-installer will attempt to uninstall as best it can.";
+    
+    /* do we even have a backup directory? */
+
+    if (access(BACKUP_DIRECTORY, F_OK) == -1) {
+        ui_message(op, "No driver backed up.");
+        return FALSE;
+    }
+    
+    if ((b = read_backup_log_file(op)) == NULL) return FALSE;
 
     ok = check_backup_log_entries(op, b);
 
@@ -676,14 +1314,7 @@ static int do_uninstall(Options *op, const char *version,
 
     free(tmpstr);
 
-    /* Remove any installed DKMS modules */
-
-    if (dkms_module_installed(op, version)) {
-        ui_log(op, "DKMS module detected; removing...");
-        if (!dkms_remove_module(op, version)) {
-            ui_warn(op, "Failed to remove installed DKMS module!");
-        }
-    }
+    remove_installed_dkms_module(op, version);
 
     /*
      * given the list of Backup logfile entries, perform the necessary
@@ -742,58 +1373,11 @@ static int do_uninstall(Options *op, const char *version,
             /* nothing to do */
             break;
 
-          case BACKED_UP_SYMLINK:
-            if (symlink(e->target, e->filename) == -1) {
-                
-                /*
-                 * XXX only print this warning if
-                 * check_backup_log_entries() didn't see any problems.
-                 */
-
-                if (ok) {
-                    restore_failed = TRUE;
-                }
-
-                ui_log(op, "Unable to restore symbolic link "
-                       "%s -> %s (%s).", e->filename, e->target,
-                       strerror(errno));
-            } else {
-                
-                /* XXX do we need to chmod the symlink? */
-
-                if (lchown(e->filename, e->uid, e->gid)) {
-                    ui_log(op, "Unable to restore owner (%d) and group "
-                           "(%d) for symbolic link '%s' (%s).",
-                           e->uid, e->gid, e->filename, strerror(errno));
-                    restore_failed = TRUE;
-                }
-            }
-            ui_status_update(op, percent, "%s", e->filename);
-            break;
-            
           default:
-            len = strlen(BACKUP_DIRECTORY) + 64;
-            tmpstr = nvalloc(len + 1);
-            snprintf(tmpstr, len, "%s/%d", BACKUP_DIRECTORY, e->num);
-            if (!nvrename(op, tmpstr, e->filename)) {
-                ui_log(op, "Unable to restore file '%s'.", e->filename);
+            if (!restore_backed_up_entry(op, e, ok)) {
                 restore_failed = TRUE;
-            } else {
-                if (chown(e->filename, e->uid, e->gid)) {
-                    ui_log(op, "Unable to restore owner (%d) and group "
-                           "(%d) for file '%s' (%s).",
-                           e->uid, e->gid, e->filename, strerror(errno));
-                    restore_failed = TRUE;
-                } else {
-                    if (chmod(e->filename, e->mode) == -1) {
-                        ui_log(op, "Unable to restore permissions %04o for "
-                               "file '%s'.", e->mode, e->filename);
-                        restore_failed = TRUE;
-                    }
-                }
             }
             ui_status_update(op, percent, "%s", e->filename);
-            free(tmpstr);
             break;
         }
     }
@@ -821,18 +1405,9 @@ static int do_uninstall(Options *op, const char *version,
         /* XXX what to do if this fails?... nothing */
     }
 
-    if (!op->skip_module_unload) {
-        /*
-         * attempt to unload the kernel module(s), but don't abort if this
-         * fails: the kernel may not have been configured with support for
-         * module unloading or the user might have unloaded it themselves or the
-         * module might not have existed at all.
-         */
+    invalidate_installed_file_index();
 
-        for (i = 0; i < num_conflicting_kernel_modules; i++) {
-            rmmod_kernel_module(op, conflicting_kernel_modules[i]);
-        }
-    }
+    unload_conflicting_kernel_modules(op);
 
     if (op->uninstall) {
         /* Update modules.dep and the ldconfig(8) cache to remove entries for
@@ -873,135 +1448,505 @@ static int do_uninstall(Options *op, const char *version,
 
 
 /*
- * read_backup_log_file() - 
+ * backup_log_hash() - FNV-1a hash of a filename, for the index.
  */
 
-static BackupInfo *read_backup_log_file(Options *op)
+static uint32 backup_log_hash(const char *str)
 {
-    struct stat stat_buf;
-    char *buf, *c, *line, *filename;
-    int fd, num, length, line_num = 0;
-    float percent;
-    
-    BackupLogEntry *e;
-    BackupInfo *b = NULL;
-
-    /* check the permissions of the backup directory */
+    uint32 h = 2166136261U;
 
-    if (stat(BACKUP_DIRECTORY, &stat_buf) == -1) {
-        ui_error(op, "Unable to get properties of %s (%s).",
-                 BACKUP_DIRECTORY, strerror(errno));
-        return NULL;
+    while (*str) {
+        h ^= (uint8) *str++;
+        h *= 16777619U;
     }
-    
-    if ((stat_buf.st_mode & PERM_MASK) != BACKUP_DIRECTORY_PERMS) {
-        ui_error(op, "The directory permissions of %s have been changed since"
-                 "the directory was created!", BACKUP_DIRECTORY);
-        return NULL;
+
+    return h;
+}
+
+
+static uint64_t backup_log_index_size(uint64_t num_entries, uint64_t hash_size,
+                                      uint64_t strings_size)
+{
+    return sizeof(BackupLogIndexHeader) +
+           num_entries * sizeof(BackupLogIndexEntry) +
+           num_entries * sizeof(uint32) +
+           hash_size * sizeof(uint32) +
+           strings_size;
+}
+
+
+
+/*
+ * backup_log_index_is_valid() - check that the 'len' bytes at 'index'
+ * are a well formed backup log index, built from the text log described
+ * by 'log_stat'.  Every offset is checked, so that the index can then be
+ * used without further checks.
+ */
+
+static int backup_log_index_is_valid(const char *index, size_t len,
+                                     const struct stat *log_stat)
+{
+    const BackupLogIndexHeader *h = (const BackupLogIndexHeader *) index;
+    const BackupLogIndexEntry *ie;
+    const uint32 *sorted, *hash;
+    const char *strings;
+    char *seen;
+    uint32 i, num_empty = 0;
+    int ret = TRUE;
+
+    if (len < sizeof(*h)) return FALSE;
+
+    if (memcmp(h->magic, BACKUP_LOG_INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != BACKUP_LOG_INDEX_VERSION ||
+        h->header_size != sizeof(BackupLogIndexHeader) ||
+        h->entry_size != sizeof(BackupLogIndexEntry)) {
+        return FALSE;
     }
 
-    if ((fd = open(BACKUP_LOG, O_RDONLY)) == -1) {
-        ui_error(op, "Failure opening %s (%s).", BACKUP_LOG, strerror(errno));
-        return NULL;
+    if (h->log_size != log_stat->st_size ||
+        h->log_ino != log_stat->st_ino ||
+        h->log_mtime_sec != log_stat->st_mtim.tv_sec ||
+        h->log_mtime_nsec != log_stat->st_mtim.tv_nsec) {
+        return FALSE;
     }
 
-    if (fstat(fd, &stat_buf) == -1) {
-        ui_error(op, "Failure getting file properties for %s (%s).",
-                 BACKUP_LOG, strerror(errno));
-        goto pre_map_fail;
+    if (backup_log_index_size(h->num_entries, h->hash_size,
+                              h->strings_size) != len) {
+        return FALSE;
     }
 
-    if ((stat_buf.st_mode & PERM_MASK) != BACKUP_LOG_PERMS) {
-        ui_error(op, "The file permissions of %s have been changed since "
-                 "the file was written!", BACKUP_LOG);
-        goto pre_map_fail;
+    /* the hash table is a power of two in size, and never full */
+
+    if ((h->hash_size & (h->hash_size - 1)) != 0 ||
+        h->hash_size <= h->num_entries) {
+        return FALSE;
     }
 
-    /* map the file */
+    ie = (const BackupLogIndexEntry *) (h + 1);
+    sorted = (const uint32 *) (ie + h->num_entries);
+    hash = sorted + h->num_entries;
+    strings = (const char *) (hash + h->hash_size);
 
-    length = stat_buf.st_size;
+    /* every string is terminated if the last one is */
 
-    buf = mmap(0, length, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
-    if (!buf) {
-        ui_error(op, "Unable to mmap file '%s' (%s).", BACKUP_LOG,
-                 strerror(errno));
-        return NULL;
+    if (h->strings_size == 0 || strings[h->strings_size - 1] != '\0' ||
+        h->version_string >= h->strings_size ||
+        h->description_string >= h->strings_size) {
+        return FALSE;
     }
-    
-    ui_status_begin(op, "Parsing log file:", "Parsing");
 
-    b = nvalloc(sizeof(BackupInfo));
+    for (i = 0; i < h->num_entries; i++) {
+        if (ie[i].filename >= h->strings_size ||
+            ie[i].target >= h->strings_size ||
+            ie[i].digest_type > DIGEST_BLAKE3) {
+            return FALSE;
+        }
+    }
 
-    b->version = get_next_line(buf, &c, buf, length);
-    if (!b->version || !c) goto parse_error;
-    
-    percent = (float) (c - buf) / (float) stat_buf.st_size;
-    ui_status_update(op, percent, NULL);
+    /*
+     * every slot of the hash table points into sorted[], and at least
+     * one is empty, so that every probe sequence terminates
+     */
 
-    b->description = get_next_line(c, &c, buf, length);
-    if (!b->description || !c) goto parse_error;
+    for (i = 0; i < h->hash_size; i++) {
+        if (hash[i] > h->num_entries) return FALSE;
+        if (hash[i] == 0) num_empty++;
+    }
 
-    b->n = 0;
-    b->e = NULL;
-    line_num = 3;
+    if (num_empty == 0) return FALSE;
 
-    while(1) {
+    /* sorted[] is a permutation of the entry numbers */
 
-        percent = (float) (c - buf) / (float) stat_buf.st_size;
-        ui_status_update(op, percent, NULL);
-        
-        /* read and parse the next line */
+    seen = nvalloc(NV_MAX(h->num_entries, 1));
 
-        line = get_next_line(c, &c, buf, length);
-        if (!line) break;
+    for (i = 0; i < h->num_entries; i++) {
+        if (sorted[i] >= h->num_entries || seen[sorted[i]]) {
+            ret = FALSE;
+            break;
+        }
+        seen[sorted[i]] = TRUE;
+    }
 
-        if (!parse_first_line(line, &num, &filename)) goto parse_error;
-        line_num++;
-        free(line);
+    nvfree(seen);
 
-        /* grow the BackupLogEntry array */
+    return ret;
 
-        b->n++;
-        b->e = (BackupLogEntry *)
-            nvrealloc(b->e, sizeof(BackupLogEntry) * b->n);
+} /* backup_log_index_is_valid() */
 
-        memset(&b->e[b->n - 1], 0, sizeof(BackupLogEntry));
 
-        e = &b->e[b->n - 1];
-        e->num = num;
-        e->filename = filename;
+
+/*
+ * backup_info_from_index() - describe the backup log index at 'index'
+ * (which must be valid) with a BackupInfo.  The strings are not copied
+ * out of the index, so the BackupInfo and its entries are a single
+ * allocation; the BackupInfo takes ownership of the index.
+ */
+
+static BackupInfo *backup_info_from_index(char *index, size_t len, int mapped)
+{
+    const BackupLogIndexHeader *h = (const BackupLogIndexHeader *) index;
+    const BackupLogIndexEntry *ie = (const BackupLogIndexEntry *) (h + 1);
+    const char *strings;
+    BackupInfo *b;
+    uint32 i;
+
+    b = nvalloc(sizeof(BackupInfo) + h->num_entries * sizeof(BackupLogEntry));
+
+    b->e = (BackupLogEntry *) (b + 1);
+    b->n = h->num_entries;
+    b->index = index;
+    b->index_len = len;
+    b->index_mapped = mapped;
+    b->sorted = (const uint32 *) (ie + h->num_entries);
+    b->hash = b->sorted + h->num_entries;
+    b->hash_size = h->hash_size;
+
+    strings = (const char *) (b->hash + h->hash_size);
+
+    b->version = strings + h->version_string;
+    b->description = strings + h->description_string;
+
+    for (i = 0; i < h->num_entries; i++) {
+        BackupLogEntry *e = &b->e[i];
+
+        e->num = ie[i].num;
+        e->filename = strings + ie[i].filename;
+        e->target = ie[i].target ? strings + ie[i].target : NULL;
+        e->crc = ie[i].crc;
+        e->mode = ie[i].mode;
+        e->uid = ie[i].uid;
+        e->gid = ie[i].gid;
+        e->digest.type = ie[i].digest_type;
+        memcpy(e->digest.bytes, ie[i].digest, sizeof(e->digest.bytes));
         e->ok = TRUE;
-        
-        switch(e->num) {
+    }
 
-        case INSTALLED_FILE:
-            line = get_next_line(c, &c, buf, length);
-            if (line == NULL) goto parse_error;
-            line_num++;
+    return b;
 
-            if (!parse_crc(line, &e->crc)) goto parse_error;
-            free(line);
-        
-            break;
+} /* backup_info_from_index() */
 
-        case INSTALLED_SYMLINK:
-            line = get_next_line(c, &c, buf, length);
-            if (line == NULL) goto parse_error;
-            line_num++;
-            
-            e->target = line;
-            
-            break;
-            
-        case BACKED_UP_SYMLINK:
+
+
+/*
+ * map_backup_log_index() - map BACKUP_LOG_INDEX, if it is present and
+ * was built from the text log described by 'log_stat'.  Returns NULL if
+ * the index needs to be rebuilt.
+ */
+
+static BackupInfo *map_backup_log_index(const struct stat *log_stat)
+{
+    struct stat stat_buf;
+    char *index;
+    int fd;
+
+    if ((fd = open(BACKUP_LOG_INDEX, O_RDONLY)) == -1) return NULL;
+
+    if (fstat(fd, &stat_buf) == -1 ||
+        (stat_buf.st_mode & PERM_MASK) != BACKUP_LOG_PERMS ||
+        stat_buf.st_size < sizeof(BackupLogIndexHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    index = mmap(0, stat_buf.st_size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (index == MAP_FAILED) return NULL;
+
+    if (!backup_log_index_is_valid(index, stat_buf.st_size, log_stat)) {
+        munmap(index, stat_buf.st_size);
+        return NULL;
+    }
+
+    return backup_info_from_index(index, stat_buf.st_size, TRUE);
+
+} /* map_backup_log_index() */
+
+
+
+typedef struct {
+    const char *filename;
+    uint32 entry;
+} BackupLogSortKey;
+
+static int backup_log_sort_key_compare(const void *a, const void *b)
+{
+    const BackupLogSortKey *ka = a, *kb = b;
+    int ret = strcmp(ka->filename, kb->filename);
+
+    if (ret != 0) return ret;
+
+    return (ka->entry > kb->entry) - (ka->entry < kb->entry);
+}
+
+
+static uint32 add_index_string(char *strings, uint32 *strings_size,
+                               const char *str)
+{
+    uint32 offset = *strings_size;
+    size_t len = strlen(str) + 1;
+
+    memcpy(strings + offset, str, len);
+    *strings_size += len;
+
+    return offset;
+}
+
+
+/*
+ * build_backup_log_index() - build the index for the given contents of
+ * the text log, described by 'log_stat'.  Returns the index, and its
+ * length in 'len'.
+ */
+
+static char *build_backup_log_index(const char *version,
+                                    const char *description,
+                                    const BackupLogEntry *e, uint32 n,
+                                    const struct stat *log_stat, size_t *len)
+{
+    BackupLogIndexHeader *h;
+    BackupLogIndexEntry *ie;
+    BackupLogSortKey *keys;
+    uint32 *sorted, *hash;
+    uint32 i, hash_size, strings_size;
+    size_t total_strings_size;
+    char *index, *strings;
+
+    total_strings_size = 1 + strlen(version) + 1 + strlen(description) + 1;
+    for (i = 0; i < n; i++) {
+        total_strings_size += strlen(e[i].filename) + 1;
+        if (e[i].target) total_strings_size += strlen(e[i].target) + 1;
+    }
+
+    hash_size = 16;
+    while (hash_size < 2 * n) hash_size <<= 1;
+
+    *len = backup_log_index_size(n, hash_size, total_strings_size);
+    index = nvalloc(*len);
+
+    h = (BackupLogIndexHeader *) index;
+    ie = (BackupLogIndexEntry *) (h + 1);
+    sorted = (uint32 *) (ie + n);
+    hash = sorted + n;
+    strings = (char *) (hash + hash_size);
+
+    /* offset 0 is the empty string, used for entries without a target */
+
+    strings[0] = '\0';
+    strings_size = 1;
+
+    memcpy(h->magic, BACKUP_LOG_INDEX_MAGIC, sizeof(h->magic));
+    h->version = BACKUP_LOG_INDEX_VERSION;
+    h->header_size = sizeof(BackupLogIndexHeader);
+    h->entry_size = sizeof(BackupLogIndexEntry);
+    h->num_entries = n;
+    h->hash_size = hash_size;
+    h->version_string = add_index_string(strings, &strings_size, version);
+    h->description_string = add_index_string(strings, &strings_size,
+                                             description);
+    h->log_size = log_stat->st_size;
+    h->log_ino = log_stat->st_ino;
+    h->log_mtime_sec = log_stat->st_mtim.tv_sec;
+    h->log_mtime_nsec = log_stat->st_mtim.tv_nsec;
+
+    for (i = 0; i < n; i++) {
+        ie[i].num = e[i].num;
+        ie[i].filename = add_index_string(strings, &strings_size,
+                                          e[i].filename);
+        ie[i].target = e[i].target ?
+            add_index_string(strings, &strings_size, e[i].target) : 0;
+        ie[i].crc = e[i].crc;
+        ie[i].mode = e[i].mode;
+        ie[i].uid = e[i].uid;
+        ie[i].gid = e[i].gid;
+        ie[i].digest_type = e[i].digest.type;
+        memcpy(ie[i].digest, e[i].digest.bytes, sizeof(ie[i].digest));
+    }
+
+    h->strings_size = strings_size;
+
+    /* sort the entries by filename, keeping log order for equal names */
+
+    keys = nvalloc(NV_MAX(n, 1) * sizeof(BackupLogSortKey));
+    for (i = 0; i < n; i++) {
+        keys[i].filename = e[i].filename;
+        keys[i].entry = i;
+    }
+    qsort(keys, n, sizeof(BackupLogSortKey), backup_log_sort_key_compare);
+
+    for (i = 0; i < n; i++) {
+        sorted[i] = keys[i].entry;
+
+        if (i == 0 || strcmp(keys[i].filename, keys[i - 1].filename) != 0) {
+            uint32 slot = backup_log_hash(keys[i].filename) & (hash_size - 1);
+
+            while (hash[slot] != 0) {
+                slot = (slot + 1) & (hash_size - 1);
+            }
+            hash[slot] = i + 1;
+        }
+    }
+
+    nvfree(keys);
+
+    return index;
+
+} /* build_backup_log_index() */
+
+
+
+/*
+ * write_backup_log_index() - write the index to BACKUP_LOG_INDEX.  A
+ * failure is not fatal: the index will be rebuilt the next time the
+ * backup log is read.
+ */
+
+static void write_backup_log_index(Options *op, const char *index, size_t len)
+{
+    char *tmp = nvstrcat(BACKUP_LOG_INDEX, ".tmp", NULL);
+    int fd, success = FALSE;
+    const char *c = index;
+    size_t remaining = len;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, BACKUP_LOG_PERMS);
+    if (fd == -1) goto done;
+
+    if (fchmod(fd, BACKUP_LOG_PERMS) == -1) goto done;
+
+    while (remaining > 0) {
+        ssize_t ret = write(fd, c, remaining);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            goto done;
+        }
+        c += ret;
+        remaining -= ret;
+    }
+
+    /* make sure that a crash cannot leave an empty index in place */
+
+    if (fsync(fd) == -1) goto done;
+
+    if (close(fd) == -1) {
+        fd = -1;
+        goto done;
+    }
+    fd = -1;
+
+    if (rename(tmp, BACKUP_LOG_INDEX) == -1) goto done;
+
+    success = TRUE;
+
+ done:
+    if (!success) {
+        ui_log(op, "Unable to write backup log index '%s' (%s).",
+               BACKUP_LOG_INDEX, strerror(errno));
+        if (fd != -1) close(fd);
+        unlink(tmp);
+    }
+
+    nvfree(tmp);
+
+} /* write_backup_log_index() */
+
+
+
+/*
+ * parse_backup_log_text() - parse the 'length' bytes of the text log at
+ * 'buf' (see the syntax at the top of this file), and build its index.
+ */
+
+static char *parse_backup_log_text(Options *op, char *buf, int length,
+                                   const struct stat *log_stat,
+                                   size_t *index_len)
+{
+    char *c, *line, *filename, *version = NULL, *description = NULL;
+    char *index = NULL;
+    int i, num, line_num = 0, capacity = 0, n = 0;
+    float percent;
+    BackupLogEntry *entries = NULL, *e;
+
+    ui_status_begin(op, "Parsing log file:", "Parsing");
+
+    /*
+     * a crash while the log was being written may have left its last
+     * line unterminated; ignore it (see the backup log journal)
+     */
+
+    while (length > 0 && buf[length - 1] != '\n') {
+        length--;
+    }
+
+    version = get_next_line(buf, &c, buf, length);
+    if (!version || !c) goto parse_error;
+    
+    percent = (float) (c - buf) / (float) length;
+    ui_status_update(op, percent, NULL);
+
+    description = get_next_line(c, &c, buf, length);
+    if (!description || !c) goto parse_error;
+
+    line_num = 3;
+
+    while(1) {
+
+        percent = (float) (c - buf) / (float) length;
+        ui_status_update(op, percent, NULL);
+        
+        /* read and parse the next line */
+
+        line = get_next_line(c, &c, buf, length);
+        if (!line) break;
+
+        if (!parse_first_line(line, &num, &filename)) goto parse_error;
+        line_num++;
+        free(line);
+
+        /* grow the BackupLogEntry array */
+
+        if (n == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = nvrealloc(entries, sizeof(BackupLogEntry) * capacity);
+        }
+
+        e = &entries[n++];
+        memset(e, 0, sizeof(BackupLogEntry));
+
+        e->num = num;
+        e->filename = filename;
+        e->ok = TRUE;
+        
+        switch(e->num) {
+
+        case INSTALLED_FILE:
+            line = get_next_line(c, &c, buf, length);
+            if (line == NULL) goto incomplete_entry;
+            line_num++;
+
+            if (!parse_crc(line, &e->crc)) goto parse_error;
+            parse_digest(line, &e->digest);
+            free(line);
+        
+            break;
+
+        case INSTALLED_SYMLINK:
+            line = get_next_line(c, &c, buf, length);
+            if (line == NULL) goto incomplete_entry;
+            line_num++;
+            
+            e->target = line;
+            
+            break;
+            
+        case BACKED_UP_SYMLINK:
             line = get_next_line(c, &c, buf, length);
-            if (line == NULL) goto parse_error;
+            if (line == NULL) goto incomplete_entry;
             line_num++;
             
             e->target = line;
 
             line = get_next_line(c, &c, buf, length);
-            if (line == NULL) goto parse_error;
+            if (line == NULL) goto incomplete_entry;
             line_num++;
 
             if (!parse_mode_uid_gid(line, &e->mode, &e->uid, &e->gid))
@@ -1014,40 +1959,140 @@ static BackupInfo *read_backup_log_file(Options *op)
             if (num < BACKED_UP_FILE_NUM) goto parse_error;
             
             line = get_next_line(c, &c, buf, length);
-            if (line == NULL) goto parse_error;
+            if (line == NULL) goto incomplete_entry;
             line_num++;
 
             if (!parse_crc_mode_uid_gid(line, &e->crc, &e->mode,
                                         &e->uid, &e->gid)) goto parse_error;
+            parse_digest(line, &e->digest);
             free(line);
 
             break;
         }
         
         if (!c) break;
+        continue;
+
+    incomplete_entry:
+
+        /* the last entry was cut short, as above */
+
+        ui_log(op, "Ignoring incomplete last entry for '%s' in '%s'.",
+               e->filename, BACKUP_LOG);
+        nvfree((char *) e->filename);
+        nvfree((char *) e->target);
+        n--;
+        break;
     }
 
+    index = build_backup_log_index(version, description, entries, n,
+                                   log_stat, index_len);
+
     ui_status_end(op, "done.");
-    
-    munmap(buf, stat_buf.st_size);
-    close(fd);
-    
-    return b;
+
+    goto done;
 
  parse_error:
     
     ui_status_end(op, "error.");
 
-    munmap(buf, stat_buf.st_size);
-
     ui_error(op, "Error while parsing line %d of '%s'.", line_num, BACKUP_LOG);
 
-    nvfree(b);
+ done:
+
+    for (i = 0; i < n; i++) {
+        nvfree((char *) entries[i].filename);
+        nvfree((char *) entries[i].target);
+    }
+    nvfree(entries);
+    nvfree(version);
+    nvfree(description);
+
+    return index;
+
+} /* parse_backup_log_text() */
+
+
+
+/*
+ * read_backup_log_file() - read the backup log through its index, first
+ * (re)building the index from the text log if necessary.
+ */
+
+static BackupInfo *read_backup_log_file(Options *op)
+{
+    struct stat stat_buf;
+    char *buf, *index;
+    size_t index_len;
+    int fd;
+    
+    BackupInfo *b = NULL;
+
+    /* check the permissions of the backup directory */
+
+    if (stat(BACKUP_DIRECTORY, &stat_buf) == -1) {
+        ui_error(op, "Unable to get properties of %s (%s).",
+                 BACKUP_DIRECTORY, strerror(errno));
+        return NULL;
+    }
+    
+    if ((stat_buf.st_mode & PERM_MASK) != BACKUP_DIRECTORY_PERMS) {
+        ui_error(op, "The directory permissions of %s have been changed since"
+                 "the directory was created!", BACKUP_DIRECTORY);
+        return NULL;
+    }
+
+    if ((fd = open(BACKUP_LOG, O_RDONLY)) == -1) {
+        ui_error(op, "Failure opening %s (%s).", BACKUP_LOG, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &stat_buf) == -1) {
+        ui_error(op, "Failure getting file properties for %s (%s).",
+                 BACKUP_LOG, strerror(errno));
+        goto done;
+    }
+
+    if ((stat_buf.st_mode & PERM_MASK) != BACKUP_LOG_PERMS) {
+        ui_error(op, "The file permissions of %s have been changed since "
+                 "the file was written!", BACKUP_LOG);
+        goto done;
+    }
+
+    /*
+     * the entries in the log are about to be validated; use (and
+     * update) the checksums cached by earlier runs
+     */
+
+    load_crc_cache(op, BACKUP_CRC_CACHE);
+
+    b = map_backup_log_index(&stat_buf);
+    if (b) goto done;
+
+    /* the index is missing or out of date: parse the text log */
+
+    buf = mmap(0, stat_buf.st_size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+    if (buf == MAP_FAILED) {
+        ui_error(op, "Unable to mmap file '%s' (%s).", BACKUP_LOG,
+                 strerror(errno));
+        goto done;
+    }
+
+    index = parse_backup_log_text(op, buf, stat_buf.st_size, &stat_buf,
+                                  &index_len);
+
+    munmap(buf, stat_buf.st_size);
+
+    if (index) {
+        write_backup_log_index(op, index, index_len);
+        b = backup_info_from_index(index, index_len, FALSE);
+    }
 
- pre_map_fail:
+ done:
 
     close(fd);
-    return NULL;
+
+    return b;
 
 } /* read_backup_log_file() */
 
@@ -1059,20 +2104,14 @@ static BackupInfo *read_backup_log_file(Options *op)
 
 static void free_backup_info(BackupInfo *b)
 {
-    int i;
-
     if (!b) return;
-    
-    nvfree(b->version);
-    nvfree(b->description);
-    
-    for (i = 0; i < b->n; i++) {
-        nvfree(b->e[i].filename);
-        nvfree(b->e[i].target);
+
+    if (b->index_mapped) {
+        munmap(b->index, b->index_len);
+    } else {
+        nvfree(b->index);
     }
 
-    nvfree((char *) b->e);
-    
     nvfree((char *) b);
 
 } /* free_backup_info() */
@@ -1080,35 +2119,280 @@ static void free_backup_info(BackupInfo *b)
 
 
 /*
- * check_backup_log_entries() - for each backup log entry, perform
- * some basic sanity checks.  Set the 'ok' field to FALSE if a
- * particular entry should not be uninstalled/restored.
+ * lookup_backup_log_entries() - find the entries for 'filename' through
+ * the index.  Returns the number of such entries; they are the entries
+ * b->e[b->sorted[*first + i]], for i from 0 to the number of entries.
  */
 
-static int check_backup_log_entries(Options *op, BackupInfo *b)
+static int lookup_backup_log_entries(const BackupInfo *b,
+                                     const char *filename, uint32 *first)
 {
-    BackupLogEntry *e;
-    uint32 crc;
-    char *tmpstr;
-    int i, j, len, ret = TRUE;
-    float percent;
+    uint32 slot = backup_log_hash(filename) & (b->hash_size - 1);
+    uint32 probes;
+    int count;
+
+    for (probes = 0; probes < b->hash_size && b->hash[slot] != 0; probes++) {
+        uint32 pos = b->hash[slot] - 1;
+
+        if (strcmp(b->e[b->sorted[pos]].filename, filename) == 0) {
+            *first = pos;
+            for (count = 1; pos + count < b->n; count++) {
+                if (strcmp(b->e[b->sorted[pos + count]].filename,
+                           filename) != 0) {
+                    break;
+                }
+            }
+            return count;
+        }
 
-    ui_status_begin(op, "Validating previous installation:", "Validating");
-    
-    for (i = 0; i < b->n; i++) {
+        slot = (slot + 1) & (b->hash_size - 1);
+    }
 
-        percent = (float) i / (float) (b->n);
+    return 0;
 
-        e = &b->e[i];
+} /* lookup_backup_log_entries() */
 
-        switch (e->num) {
 
-        case INSTALLED_FILE:
 
-            /* check if the file still matches its backup log entry */
+/*
+ * backup_never_made() - whether the file of the backed up file entry
+ * 'e', whose backup should be 'backup', was never moved there: the entry
+ * is journaled before the file is moved (see the backup log journal
+ * above), so a crash in between leaves the entry without its backup,
+ * but the file still in place, and nothing logged as installed over it.
+ * There is then nothing to restore.
+ */
+
+static int backup_never_made(const BackupInfo *b, const BackupLogEntry *e,
+                             const char *backup)
+{
+    uint32 first;
+    int j, count;
+
+    if (access(backup, F_OK) == 0 || errno != ENOENT ||
+        access(e->filename, F_OK) == -1) {
+        return FALSE;
+    }
+
+    count = lookup_backup_log_entries(b, e->filename, &first);
+
+    for (j = 0; j < count; j++) {
+        int num = b->e[b->sorted[first + j]].num;
+
+        if (num == INSTALLED_FILE || num == INSTALLED_SYMLINK) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+
+} /* backup_never_made() */
+
+
+
+/*
+ * backup_log_entry_superseded() - whether the installed file or symbolic
+ * link of entry 'i' is logged again by a later entry; this happens when
+ * a reinstallation in place (see init_backup()) did not complete.  Only
+ * the later entry describes what is installed.
+ */
+
+static int backup_log_entry_superseded(const BackupInfo *b, int i)
+{
+    const BackupLogEntry *e = &b->e[i];
+    uint32 first;
+    int j, k, count;
+
+    if (e->num != INSTALLED_FILE && e->num != INSTALLED_SYMLINK) {
+        return FALSE;
+    }
+
+    count = lookup_backup_log_entries(b, e->filename, &first);
+
+    for (j = 0; j < count; j++) {
+        k = b->sorted[first + j];
+        if (k > i && (b->e[k].num == INSTALLED_FILE ||
+                      b->e[k].num == INSTALLED_SYMLINK)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+
+} /* backup_log_entry_superseded() */
+
+
+
+/*
+ * Validating the backup log is dominated by I/O: stat(2)ing every
+ * installed file and symlink, and reading every installed and backed up
+ * file to checksum it.  prevalidate_backup_log_entries() performs these
+ * checks for all entries concurrently, without reporting anything, and
+ * records which entries are known to be intact.  The validation loops
+ * below then walk the entries in log order on the main thread, as
+ * before, and only check (and report on) the entries that were not
+ * found intact; their messages, any `prelink -u`, and rules that span
+ * several entries are thus applied in the same order, and with the same
+ * results, as a serial validation would.
+ */
+
+typedef struct {
+    const BackupInfo *b;
+    int uninstall;
+    char *intact;
+} BackupLogValidation;
+
+
+/*
+ * symlink_target_matches() - return TRUE if 'filename' is a symbolic link
+ * whose target is exactly 'target'.
+ */
+
+static int symlink_target_matches(const char *filename, const char *target)
+{
+    size_t len = strlen(target);
+    char *buf = nvalloc(len + 2);
+    ssize_t ret;
+    int match;
+
+    /* read one byte more than needed, to detect a longer target */
+
+    ret = readlink(filename, buf, len + 1);
+    match = (ret == (ssize_t) len) && (memcmp(buf, target, len) == 0);
+
+    nvfree(buf);
+
+    return match;
+}
+
+
+/*
+ * prevalidate_backup_log_entry() - perform, silently, the checks that
+ * check_backup_log_entries() (if 'uninstall' is set) or
+ * sanity_check_backup_log_entries() would perform on entry 'i'.  Runs on
+ * a worker thread; see run_parallel_tasks().
+ */
+
+static void prevalidate_backup_log_entry(size_t i, void *data)
+{
+    BackupLogValidation *v = data;
+    const BackupLogEntry *e = &v->b->e[i];
+    struct stat stat_buf;
+    char *tmpstr;
+    int intact;
+
+    switch (e->num) {
+
+    case INSTALLED_FILE:
+
+        if (v->uninstall) {
+
+            /* see check_installed_file() and verify_installed_checksum() */
+
+            intact = (lstat(e->filename, &stat_buf) == 0) &&
+                     S_ISREG(stat_buf.st_mode) &&
+                     (!e->mode || ((stat_buf.st_mode & PERM_MASK) ==
+                                   (e->mode & PERM_MASK))) &&
+                     ((e->crc == 0 && e->digest.type == DIGEST_NONE) ||
+                      file_checksum_matches(e->filename, e->crc, &e->digest));
+        } else {
+            intact = (access(e->filename, F_OK) == 0) &&
+                     file_checksum_matches(e->filename, e->crc, &e->digest);
+        }
+        break;
+
+    case INSTALLED_SYMLINK:
+
+        intact = (access(e->filename, F_OK) == 0) &&
+                 symlink_target_matches(e->filename, e->target);
+        break;
+
+    case BACKED_UP_SYMLINK:
+
+        intact = TRUE;
+        break;
+
+    default:
+
+        tmpstr = nvasprintf("%s/%d", BACKUP_DIRECTORY, e->num);
+        intact = (access(tmpstr, F_OK) == 0) &&
+                 file_checksum_matches(tmpstr, e->crc, &e->digest);
+        nvfree(tmpstr);
+        break;
+    }
+
+    v->intact[i] = intact;
+}
+
+
+/*
+ * prevalidate_backup_log_entries() - check all backup log entries
+ * concurrently; returns an array, which the caller should free, with one
+ * element per entry that is TRUE if the entry is known to be intact.
+ */
+
+static char *prevalidate_backup_log_entries(Options *op, const BackupInfo *b,
+                                            int uninstall)
+{
+    BackupLogValidation v;
+
+    v.b = b;
+    v.uninstall = uninstall;
+    v.intact = nvalloc(NV_MAX(b->n, 1));
+
+    /* the CRC tables must be built before any worker can use them */
+
+    init_crc_engine();
+
+    run_parallel_tasks(op, b->n, prevalidate_backup_log_entry, &v);
+
+    return v.intact;
+}
+
+
+
+/*
+ * check_backup_log_entries() - for each backup log entry, perform
+ * some basic sanity checks.  Set the 'ok' field to FALSE if a
+ * particular entry should not be uninstalled/restored.
+ */
+
+static int check_backup_log_entries(Options *op, BackupInfo *b)
+{
+    BackupLogEntry *e;
+    char *tmpstr, *actual, *expected, *intact;
+    int i, j, len, count, ret = TRUE;
+    uint32 first;
+    float percent;
+
+    ui_status_begin(op, "Validating previous installation:", "Validating");
+
+    intact = prevalidate_backup_log_entries(op, b, TRUE);
+
+    for (i = 0; i < b->n; i++) {
+
+        percent = (float) i / (float) (b->n);
+
+        e = &b->e[i];
+
+        if (backup_log_entry_superseded(b, i)) {
+            e->ok = FALSE;
+            continue;
+        }
+
+        if (intact[i]) {
+            ui_status_update(op, percent, "%s", e->filename);
+            continue;
+        }
+
+        switch (e->num) {
+
+        case INSTALLED_FILE:
+
+            /* check if the file still matches its backup log entry */
 
             e->ok = check_installed_file(op, e->filename, e->mode, e->crc,
-                                         ui_log);
+                                         &e->digest, ui_log);
             ret = ret && e->ok;
  
             ui_status_update(op, percent, "%s", e->filename);
@@ -1148,10 +2432,14 @@ static int check_backup_log_entries(Options *op, BackupInfo *b)
                          * target.
                          */
 
-                        for (j = 0; j < b->n; j++) {
-                            if ((b->e[j].num == BACKED_UP_SYMLINK) &&
-                                (strcmp(b->e[j].filename, e->filename) == 0)) {
-                                b->e[j].ok = FALSE;
+                        count = lookup_backup_log_entries(b, e->filename,
+                                                          &first);
+                        for (j = 0; j < count; j++) {
+                            BackupLogEntry *other =
+                                &b->e[b->sorted[first + j]];
+
+                            if (other->num == BACKED_UP_SYMLINK) {
+                                other->ok = FALSE;
                             }
                         }
                     }
@@ -1178,20 +2466,25 @@ static int check_backup_log_entries(Options *op, BackupInfo *b)
             len = strlen(BACKUP_DIRECTORY) + 64;
             tmpstr = nvalloc(len + 1);
             snprintf(tmpstr, len, "%s/%d", BACKUP_DIRECTORY, e->num);
-            if (access(tmpstr, F_OK) == -1) {
+            if (backup_never_made(b, e, tmpstr)) {
+                ui_log(op, "Backed up file '%s' was never moved to '%s'; "
+                       "it is still in place.", e->filename, tmpstr);
+                e->ok = FALSE;
+            } else if (access(tmpstr, F_OK) == -1) {
                 ui_log(op, "Unable to access backed up file '%s' "
                        "(saved as '%s') (%s).",
                        e->filename, tmpstr, strerror(errno));
                 ret = e->ok = FALSE;
             } else {
-                crc = compute_crc(op, tmpstr);
-                
-                if (crc != e->crc) {
+                if (!verify_file_checksum(op, tmpstr, e->crc, &e->digest,
+                                          &actual, &expected)) {
                     ui_log(op, "Backed up file '%s' (saved as '%s) has "
-                           "different checksum (%" PRIu32 ") than when it was "
-                           "backed up (%" PRIu32").  %s will not be restored.",
-                           e->filename, tmpstr, crc, e->crc, e->filename);
+                           "different checksum (%s) than when it was "
+                           "backed up (%s).  %s will not be restored.",
+                           e->filename, tmpstr, actual, expected, e->filename);
                     ret = e->ok = FALSE;
+                    nvfree(actual);
+                    nvfree(expected);
                 }
             }
             ui_status_update(op, percent, "%s", tmpstr);
@@ -1200,6 +2493,8 @@ static int check_backup_log_entries(Options *op, BackupInfo *b)
         }
     }
 
+    nvfree(intact);
+
     ui_status_end(op, "done.");
 
     return (ret);
@@ -1538,6 +2833,8 @@ int test_installed_files(Options *op)
     if (!b) return FALSE;
     
     ret = sanity_check_backup_log_entries(op, b);
+
+    save_crc_cache(op, BACKUP_CRC_CACHE);
     
     /* free resources associated with b */
     
@@ -1550,33 +2847,162 @@ int test_installed_files(Options *op)
 
 
 /*
- * find_installed_file() - scan the backup log file for the specified
- * filename; return TRUE if the filename is listed as an installed file.
+ * update_backup_log_index() - build the index of the backup log, so that
+ * the next uninstall or sanity check can use it directly.
  */
 
-int find_installed_file(Options *op, char *filename)
+int update_backup_log_index(Options *op)
+{
+    BackupInfo *b = read_backup_log_file(op);
+    int ret = (b != NULL);
+
+    free_backup_info(b);
+
+    return ret;
+
+} /* update_backup_log_index() */
+
+
+
+/*
+ * The installed file index: find_installed_file() may be called once for
+ * each of many files, so the backup log is read only once, and kept
+ * until the log is next written.  Installed files are looked up by name
+ * through the backup log's own index, and by identity through a set of
+ * the (device, inode) pairs of the installed files, so that a file
+ * reached through a different path (e.g. through a symlinked directory)
+ * is still recognized.
+ */
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int used;
+} InstalledInode;
+
+static struct {
+    int loaded;
+    BackupInfo *b;
+    InstalledInode *inodes;
+    size_t inode_slots;
+} installed_file_index;
+
+
+static size_t installed_inode_hash(dev_t dev, ino_t ino)
+{
+    uint64_t h = ((uint64_t) dev * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) ino;
+
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+
+    return (size_t) h;
+}
+
+
+static InstalledInode *find_installed_inode_slot(dev_t dev, ino_t ino)
+{
+    size_t mask = installed_file_index.inode_slots - 1;
+    size_t slot = installed_inode_hash(dev, ino) & mask;
+
+    while (installed_file_index.inodes[slot].used &&
+           (installed_file_index.inodes[slot].dev != dev ||
+            installed_file_index.inodes[slot].ino != ino)) {
+        slot = (slot + 1) & mask;
+    }
+
+    return &installed_file_index.inodes[slot];
+}
+
+
+/*
+ * invalidate_installed_file_index() - discard the installed file index;
+ * called whenever the backup log is written.
+ */
+
+static void invalidate_installed_file_index(void)
+{
+    free_backup_info(installed_file_index.b);
+    nvfree(installed_file_index.inodes);
+    memset(&installed_file_index, 0, sizeof(installed_file_index));
+}
+
+
+/*
+ * load_installed_file_index() - read the backup log and stat(2) each of
+ * the installed files, if this has not already been done since the log
+ * was last written.  Returns FALSE if the backup log cannot be read.
+ */
+
+static int load_installed_file_index(Options *op)
 {
     BackupInfo *b;
-    BackupLogEntry *e;
-    int i, ret = FALSE;
-    
+    struct stat stat_buf;
+    size_t slots = 16;
+    int i;
+
+    if (installed_file_index.loaded) {
+        return installed_file_index.b != NULL;
+    }
+
+    installed_file_index.loaded = TRUE;
+
     if ((b = read_backup_log_file(op)) == NULL) return FALSE;
 
+    while (slots < 2 * (size_t) b->n) slots <<= 1;
+
+    installed_file_index.b = b;
+    installed_file_index.inode_slots = slots;
+    installed_file_index.inodes = nvalloc(slots * sizeof(InstalledInode));
+
     for (i = 0; i < b->n; i++) {
-        e = &b->e[i];
-        if ((e->num == INSTALLED_FILE) && strcmp(filename, e->filename) == 0) {
-            
-            /* XXX should maybe compare inodes rather than
-               filenames? */
+        InstalledInode *inode;
 
-            ret =  TRUE;
-            break;
+        if (b->e[i].num != INSTALLED_FILE) continue;
+        if (stat(b->e[i].filename, &stat_buf) == -1) continue;
+
+        inode = find_installed_inode_slot(stat_buf.st_dev, stat_buf.st_ino);
+        inode->dev = stat_buf.st_dev;
+        inode->ino = stat_buf.st_ino;
+        inode->used = TRUE;
+    }
+
+    return TRUE;
+}
+
+
+
+/*
+ * find_installed_file() - look up the specified filename in the backup
+ * log; return TRUE if the filename, or the file it names, is listed as
+ * an installed file.
+ */
+
+int find_installed_file(Options *op, char *filename)
+{
+    BackupInfo *b;
+    struct stat stat_buf;
+    int i, count;
+    uint32 first;
+    
+    if (!load_installed_file_index(op)) return FALSE;
+
+    b = installed_file_index.b;
+
+    count = lookup_backup_log_entries(b, filename, &first);
+
+    for (i = 0; i < count; i++) {
+        if (b->e[b->sorted[first + i]].num == INSTALLED_FILE) {
+            return TRUE;
         }
     }
 
-    free_backup_info(b);
+    if (stat(filename, &stat_buf) == 0 &&
+        find_installed_inode_slot(stat_buf.st_dev, stat_buf.st_ino)->used) {
+        return TRUE;
+    }
 
-    return ret;
+    return FALSE;
 
 } /* find_installed_file() */
 
@@ -1591,16 +3017,23 @@ int find_installed_file(Options *op, char *filename)
 static int sanity_check_backup_log_entries(Options *op, BackupInfo *b)
 {
     BackupLogEntry *e;
-    uint32 crc;
-    char *tmpstr;
+    char *tmpstr, *actual, *expected, *intact;
     int i, len, ret = TRUE;
     float percent;
     
     ui_status_begin(op, "Validating installation:", "Validating");
 
+    intact = prevalidate_backup_log_entries(op, b, FALSE);
+
     for (i = 0; i < b->n; i++) {
         
         e = &b->e[i];
+        percent = (float) i / (float) (b->n);
+
+        if (intact[i]) {
+            ui_status_update(op, percent, "%s", e->filename);
+            continue;
+        }
         
         switch (e->num) {
 
@@ -1613,14 +3046,15 @@ static int sanity_check_backup_log_entries(Options *op, BackupInfo *b)
                          e->filename);
                 ret = FALSE;
             } else {
-                crc = compute_crc(op, e->filename);
-                
-                if (crc != e->crc) {
+                if (!verify_file_checksum(op, e->filename, e->crc,
+                                          &e->digest, &actual, &expected)) {
                     ui_error(op, "The installed file '%s' has a different "
-                             "checksum (%" PRIu32 ") than when it was "
-                             "installed (%" PRIu32 ").", e->filename, crc,
-                             e->crc);
+                             "checksum (%s) than when it was "
+                             "installed (%s).", e->filename, actual,
+                             expected);
                     ret = FALSE;
+                    nvfree(actual);
+                    nvfree(expected);
                 }
             }
             break;
@@ -1669,29 +3103,34 @@ static int sanity_check_backup_log_entries(Options *op, BackupInfo *b)
             len = strlen(BACKUP_DIRECTORY) + 64;
             tmpstr = nvalloc(len + 1);
             snprintf(tmpstr, len, "%s/%d", BACKUP_DIRECTORY, e->num);
-            if (access(tmpstr, F_OK) == -1) {
+            if (backup_never_made(b, e, tmpstr)) {
+                ui_log(op, "Backed up file '%s' was never moved to '%s'; "
+                       "it is still in place.", e->filename, tmpstr);
+            } else if (access(tmpstr, F_OK) == -1) {
                 ui_error(op, "The backed up file '%s' (saved as '%s') "
                          "no longer exists.", e->filename, tmpstr);
                 ret = FALSE;
             } else {
-                crc = compute_crc(op, tmpstr);
-                
-                if (crc != e->crc) {
+                if (!verify_file_checksum(op, tmpstr, e->crc, &e->digest,
+                                          &actual, &expected)) {
                     ui_error(op, "Backed up file '%s' (saved as '%s) has a "
-                             "different checksum (%" PRIu32 ") than when it "
-                             "was backed up (%" PRIu32 ").", e->filename,
-                             tmpstr, crc, e->crc);
+                             "different checksum (%s) than when it "
+                             "was backed up (%s).", e->filename,
+                             tmpstr, actual, expected);
                     ret = FALSE;
+                    nvfree(actual);
+                    nvfree(expected);
                 }
             }
             free(tmpstr);
             break;
         }
         
-        percent = (float) i / (float) (b->n);
         ui_status_update(op, percent, "%s", e->filename);
     }
 
+    nvfree(intact);
+
     ui_status_end(op, "done.");
     
     return ret;
@@ -1755,3 +3194,740 @@ static char *create_backwards_compatible_version_string(const char *str)
     return version;
     
 } /* create_backwards_compatible_version_string() */
+
+
+
+/*
+ * load_conflict_scan_cache() - load the cache of the directories searched
+ * for conflicting files; see load_scan_cache().
+ */
+
+void load_conflict_scan_cache(Options *op)
+{
+    load_scan_cache(op, SCAN_CACHE_FILE);
+}
+
+
+
+/*
+ * save_conflict_scan_cache() - save the cache of the directories searched
+ * for conflicting files.
+ */
+
+int save_conflict_scan_cache(Options *op)
+{
+    if (op->scan_cache == SCAN_CACHE_OFF) {
+        return TRUE;
+    }
+
+    if (!directory_exists(SCAN_CACHE_DIRECTORY) &&
+        !mkdir_recursive(op, SCAN_CACHE_DIRECTORY,
+                         SCAN_CACHE_DIRECTORY_PERMS, FALSE)) {
+        return FALSE;
+    }
+
+    return save_scan_cache(op, SCAN_CACHE_FILE);
+}
+
+
+
+/*
+ * Delta reinstallation (--delta-reinstall): when the driver version
+ * being installed is the one that is already installed, the existing
+ * installation is not uninstalled first.  prepare_delta_reinstall()
+ * instead validates the files and symbolic links that the backup log
+ * records as installed, and execute_command_list() skips installing
+ * those that are still intact (and, for files, have the size, mode and
+ * checksums of the file to install), carrying their log entries over to
+ * the new log.  init_backup() keeps the files backed up by the earlier
+ * installation, and their log entries.  Installed files that cannot be
+ * kept are replaced, and finish_delta_reinstall() removes those that
+ * the new installation did not install again, restoring any backed up
+ * file that they had replaced.
+ *
+ * Delta upgrades (--delta-upgrade) do the same when a different version
+ * is installed.  Files whose names only differ by the version number,
+ * such as versioned libraries and firmware directories, are additionally
+ * paired up by substituting the old version for the new one in the new
+ * file's destination: if the old file has the size, mode and checksums
+ * of the new one, it is renamed instead of being installed again.
+ */
+
+#define DELTA_UNCHECKED 0
+#define DELTA_KEPT      1
+#define DELTA_REPLACED  2
+
+typedef struct {
+    char *dst;          /* the destination of a file to install */
+    int entry;          /* the entry of the old file it may be renamed from */
+    int state;          /* DELTA_* */
+} DeltaRename;
+
+static struct {
+    BackupInfo *b;
+    char *intact;       /* from prevalidate_backup_log_entries() */
+    char *state;        /* DELTA_*, for installed files and symlinks */
+    char *reinstalled;  /* logged again by this installation */
+    char *restore;      /* backed up files to restore once done */
+    DeltaRename *renames;
+    int num_renames;    /* sorted by dst */
+    long carried_start; /* the earlier installation's installed files, */
+    long carried_end;   /* as carried over at the start of the new log */
+} delta_reinstall;
+
+
+static int find_delta_entry(const char *filename, int num);
+
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+static int compare_delta_renames(const void *a, const void *b)
+{
+    return strcmp(((const DeltaRename *) a)->dst,
+                  ((const DeltaRename *) b)->dst);
+}
+
+
+/*
+ * plan_delta_upgrade() - find the files of the new package 'p' that may
+ * only have been renamed from a file of version 'old_version', whose
+ * installation is being upgraded in place; 'dsts' are the sorted
+ * destinations of the package's files.
+ */
+
+static void plan_delta_upgrade(Package *p, const char *old_version,
+                               char **dsts, int num_dsts)
+{
+    const BackupInfo *b = delta_reinstall.b;
+    char *paired = nvalloc(NV_MAX(b->n, 1));
+    char *old_name;
+    int i, k;
+
+    delta_reinstall.renames =
+        nvalloc(NV_MAX(p->num_entries, 1) * sizeof(DeltaRename));
+
+    for (i = 0; i < p->num_entries; i++) {
+        PackageEntry *pe = &p->entries[i];
+
+        if (!pe->dst || pe->caps.is_symlink ||
+            find_delta_entry(pe->dst, INSTALLED_FILE) >= 0) {
+            continue;
+        }
+
+        old_name = nv_strreplace(pe->dst, p->version, (char *) old_version);
+        k = find_delta_entry(old_name, INSTALLED_FILE);
+
+        if (k >= 0 && !paired[k] && strcmp(old_name, pe->dst) != 0 &&
+            !bsearch(&old_name, dsts, num_dsts, sizeof(char *),
+                     compare_strings)) {
+            DeltaRename *r =
+                &delta_reinstall.renames[delta_reinstall.num_renames++];
+
+            r->dst = nvstrdup(pe->dst);
+            r->entry = k;
+            r->state = DELTA_UNCHECKED;
+            paired[k] = TRUE;
+        }
+
+        nvfree(old_name);
+    }
+
+    qsort(delta_reinstall.renames, delta_reinstall.num_renames,
+          sizeof(DeltaRename), compare_delta_renames);
+
+    nvfree(paired);
+}
+
+
+/*
+ * prepare_delta_reinstall() - if the installed driver is version
+ * p->version (or, with --delta-upgrade, any version), prepare to
+ * reinstall it in place, and return TRUE: the existing installation
+ * should then not be uninstalled.  Otherwise, return FALSE.
+ *
+ * The installed files are replaced rather than removed, but everything
+ * else that do_uninstall() does to the existing installation is still
+ * done here: the distribution's uninstall hooks are run, its DKMS module
+ * is removed and the kernel modules are unloaded.
+ */
+
+int prepare_delta_reinstall(Options *op, Package *p)
+{
+    char *version = NULL, *descr = NULL, *compat_version;
+    char **dsts;
+    int i, num_dsts = 0, num_installed = 0, num_intact = 0, same;
+    BackupInfo *b;
+
+    if (!get_installed_driver_version_and_descr(op, &version, &descr)) {
+        return FALSE;
+    }
+
+    compat_version = create_backwards_compatible_version_string(p->version);
+    same = (strcmp(version, p->version) == 0) ||
+           (strcmp(version, compat_version) == 0);
+    nvfree(compat_version);
+
+    if (!same && !op->delta_upgrade) {
+        ui_log(op, "The installed driver is version %s, not %s; it will be "
+               "uninstalled.", version, p->version);
+        goto fail;
+    }
+
+    if ((b = read_backup_log_file(op)) == NULL) goto fail;
+
+    delta_reinstall.b = b;
+    delta_reinstall.intact = prevalidate_backup_log_entries(op, b, TRUE);
+    delta_reinstall.state = nvalloc(NV_MAX(b->n, 1));
+    delta_reinstall.reinstalled = nvalloc(NV_MAX(b->n, 1));
+    delta_reinstall.restore = nvalloc(NV_MAX(b->n, 1));
+
+    dsts = nvalloc(NV_MAX(p->num_entries, 1) * sizeof(char *));
+    for (i = 0; i < p->num_entries; i++) {
+        if (p->entries[i].dst) {
+            dsts[num_dsts++] = p->entries[i].dst;
+        }
+    }
+    qsort(dsts, num_dsts, sizeof(char *), compare_strings);
+
+    for (i = 0; i < b->n; i++) {
+        const BackupLogEntry *e = &b->e[i];
+
+        if (backup_log_entry_superseded(b, i)) {
+            continue;
+        } else if (e->num == INSTALLED_FILE || e->num == INSTALLED_SYMLINK) {
+            num_installed++;
+            num_intact += delta_reinstall.intact[i];
+        } else if (is_delta_reinstalled_file(e->filename) &&
+                   !bsearch(&e->filename, dsts, num_dsts, sizeof(char *),
+                            compare_strings)) {
+            /*
+             * the file was backed up when the earlier installation
+             * installed its own in its place, which will not be installed
+             * again: it is restored once that has been removed
+             */
+            delta_reinstall.restore[i] = TRUE;
+        }
+    }
+
+    if (same) {
+        ui_log(op, "Reinstalling version %s in place: %d of the %d installed "
+               "files and symbolic links are unchanged.", p->version,
+               num_intact, num_installed);
+    } else {
+        plan_delta_upgrade(p, version, dsts, num_dsts);
+
+        ui_log(op, "Upgrading version %s to %s in place: %d of the %d "
+               "installed files and symbolic links are unchanged since they "
+               "were installed, and %d may only need to be renamed.",
+               version, p->version, num_intact, num_installed,
+               delta_reinstall.num_renames);
+    }
+
+    run_distro_hook(op, "pre-uninstall");
+    remove_installed_dkms_module(op, version);
+    unload_conflicting_kernel_modules(op);
+    run_distro_hook(op, "post-uninstall");
+
+    nvfree(dsts);
+    nvfree(version);
+    nvfree(descr);
+
+    return TRUE;
+
+ fail:
+    nvfree(version);
+    nvfree(descr);
+
+    return FALSE;
+}
+
+
+/*
+ * delta_reinstall_active() - whether prepare_delta_reinstall() has
+ * prepared to reinstall the installed driver in place.
+ */
+
+int delta_reinstall_active(void)
+{
+    return delta_reinstall.b != NULL;
+}
+
+
+/*
+ * find_delta_entry() - find the entry of type 'num' for 'filename' in
+ * the log of the installation being reinstalled, which is not superseded
+ * by a later one; returns its index, or -1.
+ */
+
+static int find_delta_entry(const char *filename, int num)
+{
+    const BackupInfo *b = delta_reinstall.b;
+    uint32 first;
+    int i, n;
+
+    if (!b) return -1;
+
+    n = lookup_backup_log_entries(b, filename, &first);
+
+    for (i = 0; i < n; i++) {
+        int k = b->sorted[first + i];
+
+        if (b->e[k].num == num && !backup_log_entry_superseded(b, k)) {
+            return k;
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+ * is_delta_reinstalled_file() - whether 'filename' was installed, as a
+ * file or a symbolic link, by the installation being reinstalled in
+ * place; it is then not a conflicting file.
+ */
+
+int is_delta_reinstalled_file(const char *filename)
+{
+    return find_delta_entry(filename, INSTALLED_FILE) >= 0 ||
+           find_delta_entry(filename, INSTALLED_SYMLINK) >= 0;
+}
+
+
+/*
+ * log_replaced_entry() - report that the installed file or symbolic link
+ * of entry 'i' cannot be kept, and is replaced.
+ */
+
+static void log_replaced_entry(Options *op, int i)
+{
+    const char *filename = delta_reinstall.b->e[i].filename;
+    struct stat stat_buf;
+
+    if (lstat(filename, &stat_buf) == 0 && !S_ISDIR(stat_buf.st_mode)) {
+        ui_log(op, "Replacing '%s', which differs from the file to install.",
+               filename);
+    }
+}
+
+
+/*
+ * unlink_replaced_file() - remove 'filename', if the installation being
+ * reinstalled installed it, right before it is replaced by a new file,
+ * rather than overwriting it in place (where a running program may still
+ * be using it).  With --staged-install, the new file is renamed over it
+ * instead, so that the destination never goes missing.  This may be
+ * called from any thread.
+ */
+
+void unlink_replaced_file(Options *op, const char *filename)
+{
+    struct stat stat_buf;
+
+    if (!op->staged_install && is_delta_reinstalled_file(filename) &&
+        lstat(filename, &stat_buf) == 0 && !S_ISDIR(stat_buf.st_mode)) {
+        unlink(filename);
+    }
+}
+
+
+static DeltaRename *find_delta_rename(const char *filename)
+{
+    DeltaRename key;
+
+    key.dst = (char *) filename;
+
+    return bsearch(&key, delta_reinstall.renames, delta_reinstall.num_renames,
+                   sizeof(DeltaRename), compare_delta_renames);
+}
+
+
+/*
+ * installed_file_matches() - whether the file 'path', installed as entry
+ * 'i', is unchanged since it was installed, and has the size, the
+ * permissions 'mode' and the checksums of 'srcfile'.
+ */
+
+static int installed_file_matches(int i, const char *path,
+                                  const char *srcfile, mode_t mode)
+{
+    const BackupLogEntry *e = &delta_reinstall.b->e[i];
+    struct stat stat_buf, src_stat_buf;
+
+    if (!delta_reinstall.intact[i] ||
+        stat(path, &stat_buf) != 0 || stat(srcfile, &src_stat_buf) != 0 ||
+        stat_buf.st_size != src_stat_buf.st_size ||
+        (stat_buf.st_mode & PERM_MASK) != (mode & PERM_MASK)) {
+        return FALSE;
+    }
+
+    return file_checksum_matches(srcfile, e->crc, &e->digest);
+}
+
+
+/*
+ * installed_file_is_current() - whether the installed file 'filename'
+ * can be kept, instead of being installed again from 'srcfile' with the
+ * given mode: it must be unchanged since it was installed, and have the size
+ * and checksums of 'srcfile'.  When upgrading, the file of the old
+ * version that 'filename' may be renamed from is checked instead.  This
+ * only examines the files, and may be called from any thread;
+ * keep_installed_file() acts on the result.
+ */
+
+int installed_file_is_current(const char *srcfile, const char *filename,
+                              mode_t mode)
+{
+    DeltaRename *r;
+    int i = find_delta_entry(filename, INSTALLED_FILE);
+
+    if (i >= 0) {
+        return installed_file_matches(i, filename, srcfile, mode);
+    }
+
+    if ((r = find_delta_rename(filename)) != NULL) {
+        return installed_file_matches(r->entry,
+                                      delta_reinstall.b->e[r->entry].filename,
+                                      srcfile, mode);
+    }
+
+    return FALSE;
+}
+
+
+/*
+ * rename_installed_file() - rename the old file of 'r' to its new
+ * destination; returns TRUE if it was renamed.  With --swap-install, it
+ * is linked to its new destination instead, so that it remains under its
+ * old name until the new files have been swapped in, and its old name is
+ * removed by finish_delta_reinstall().
+ */
+
+static int rename_installed_file(Options *op, const DeltaRename *r)
+{
+    const char *old_name = delta_reinstall.b->e[r->entry].filename;
+    struct stat stat_buf;
+    char *dirc;
+    int ret;
+
+    /* never rename over anything, such as a file still to be backed up */
+
+    if (lstat(r->dst, &stat_buf) == 0) return FALSE;
+
+    dirc = nvstrdup(r->dst);
+    ret = mkdir_with_log(op, dirname(dirc), 0755);
+    nvfree(dirc);
+
+    if (!ret) return FALSE;
+
+    if (op->swap_install) {
+        ret = link(old_name, r->dst);
+    } else {
+        ret = rename(old_name, r->dst);
+    }
+
+    if (ret != 0) {
+        ui_log(op, "Unable to rename '%s' to '%s' (%s); installing '%s' "
+               "instead.", old_name, r->dst, strerror(errno), r->dst);
+        return FALSE;
+    }
+
+    ui_log(op, "Renamed '%s', which is unchanged, to '%s'.", old_name,
+           r->dst);
+
+    delta_reinstall.state[r->entry] = DELTA_KEPT;
+    delta_reinstall.reinstalled[r->entry] = !op->swap_install;
+
+    return TRUE;
+}
+
+
+/*
+ * keep_installed_file() - keep the installed file 'filename', if
+ * installed_file_is_current() found that it 'matches', renaming it first
+ * from the old version's name when upgrading; returns TRUE if it was kept,
+ * and, if 'sum' is non-NULL, its checksums in 'sum'.  Otherwise, it is
+ * to be installed again, after unlink_replaced_file().  The decision is
+ * only made once per file.
+ */
+
+int keep_installed_file(Options *op, const char *filename, int matches,
+                        FileChecksum *sum)
+{
+    const BackupLogEntry *e;
+    DeltaRename *r;
+    int i = find_delta_entry(filename, INSTALLED_FILE);
+
+    if (i >= 0) {
+        if (delta_reinstall.state[i] == DELTA_UNCHECKED) {
+            if (matches) {
+                delta_reinstall.state[i] = DELTA_KEPT;
+            } else {
+                delta_reinstall.state[i] = DELTA_REPLACED;
+                log_replaced_entry(op, i);
+            }
+        }
+
+        if (delta_reinstall.state[i] != DELTA_KEPT) return FALSE;
+    } else {
+        if ((r = find_delta_rename(filename)) == NULL) return FALSE;
+
+        if (r->state == DELTA_UNCHECKED) {
+            r->state = (matches && rename_installed_file(op, r)) ?
+                       DELTA_KEPT : DELTA_REPLACED;
+        }
+
+        if (r->state != DELTA_KEPT) return FALSE;
+
+        i = r->entry;
+    }
+
+    e = &delta_reinstall.b->e[i];
+
+    if (sum) {
+        if (e->digest.type == op->backup_log_digest) {
+            sum->crc = e->crc;
+            sum->digest = e->digest;
+        } else {
+            memset(sum, 0, sizeof(*sum));
+            sum->digest.type = op->backup_log_digest;
+            compute_file_checksum(op, filename, sum);
+        }
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * keep_installed_symlink() - whether the installed symbolic link
+ * 'filename' can be kept, instead of being created again to point to
+ * 'target'.  A link that points elsewhere, or a file that the
+ * installation being reinstalled installed there instead, is removed
+ * (see unlink_replaced_file()), so that the link can be created.
+ */
+
+int keep_installed_symlink(Options *op, const char *filename,
+                           const char *target)
+{
+    int i = find_delta_entry(filename, INSTALLED_SYMLINK);
+
+    if (i < 0) {
+        unlink_replaced_file(op, filename);
+        return FALSE;
+    }
+
+    if (delta_reinstall.state[i] == DELTA_UNCHECKED) {
+        if (delta_reinstall.intact[i] &&
+            strcmp(delta_reinstall.b->e[i].target, target) == 0) {
+            delta_reinstall.state[i] = DELTA_KEPT;
+        } else {
+            delta_reinstall.state[i] = DELTA_REPLACED;
+            log_replaced_entry(op, i);
+            unlink_replaced_file(op, filename);
+        }
+    }
+
+    return delta_reinstall.state[i] == DELTA_KEPT;
+}
+
+
+/*
+ * mark_delta_reinstalled() - record that 'filename' was logged as
+ * installed again.  Every entry that the installation being reinstalled
+ * has for it is marked, whether as a file or as a symbolic link, as the
+ * type of a path may change between versions.
+ */
+
+static void mark_delta_reinstalled(const char *filename)
+{
+    const BackupInfo *b = delta_reinstall.b;
+    uint32 first;
+    int i, k, n;
+
+    if (!b) return;
+
+    n = lookup_backup_log_entries(b, filename, &first);
+
+    for (i = 0; i < n; i++) {
+        k = b->sorted[first + i];
+        if (b->e[k].num == INSTALLED_FILE ||
+            b->e[k].num == INSTALLED_SYMLINK) {
+            delta_reinstall.reinstalled[k] = TRUE;
+        }
+    }
+}
+
+
+/*
+ * write_carried_backup_log_entries() - write the entries for the files
+ * backed up by the installation being reinstalled, except those to be
+ * restored, to 'log', followed by those of the files and links that it
+ * installed, and return the number to give the next backed up file.
+ */
+
+static int write_carried_backup_log_entries(FILE *log)
+{
+    const BackupInfo *b = delta_reinstall.b;
+    int i, next = BACKED_UP_FILE_NUM;
+
+    delta_reinstall.carried_start = ftell(log);
+
+    for (i = 0; i < b->n; i++) {
+        const BackupLogEntry *e = &b->e[i];
+
+        if (backup_log_entry_superseded(b, i)) continue;
+
+        if (e->num == INSTALLED_FILE) {
+            fprintf(log, "%d: %s\n", e->num, e->filename);
+            fprintf(log, "%u", e->crc);
+            write_digest(log, &e->digest);
+        } else if (e->num == INSTALLED_SYMLINK) {
+            fprintf(log, "%d: %s\n", e->num, e->filename);
+            fprintf(log, "%s\n", e->target);
+        }
+    }
+
+    delta_reinstall.carried_end = ftell(log);
+
+    for (i = 0; i < b->n; i++) {
+        const BackupLogEntry *e = &b->e[i];
+
+        if (e->num >= BACKED_UP_FILE_NUM) {
+            next = NV_MAX(next, e->num + 1);
+        }
+
+        if (delta_reinstall.restore[i]) continue;
+
+        if (e->num == BACKED_UP_SYMLINK) {
+            fprintf(log, "%d: %s\n", e->num, e->filename);
+            fprintf(log, "%s\n", e->target);
+            fprintf(log, "%04o %d %d\n", e->mode, e->uid, e->gid);
+        } else if (e->num >= BACKED_UP_FILE_NUM) {
+            fprintf(log, "%d: %s\n", e->num, e->filename);
+            fprintf(log, "%u %04o %d %d", e->crc, e->mode, e->uid, e->gid);
+            write_digest(log, &e->digest);
+        }
+    }
+
+    return next;
+}
+
+
+/*
+ * drop_carried_installed_entries() - remove the entries of the files and
+ * links installed by the earlier installation, which init_backup()
+ * carried over, from the backup log: those that were installed again
+ * have been logged again, and the others have been removed.
+ */
+
+static void drop_carried_installed_entries(Options *op)
+{
+    long start = delta_reinstall.carried_start;
+    long end = delta_reinstall.carried_end;
+    struct stat stat_buf;
+    FILE *in, *log;
+    char *buf = NULL;
+    int ret = FALSE;
+
+    if (end <= start) return;
+
+    if ((in = fopen(BACKUP_LOG, "r")) == NULL) goto done;
+
+    if (fstat(fileno(in), &stat_buf) == -1 || stat_buf.st_size < end) {
+        fclose(in);
+        goto done;
+    }
+
+    buf = nvalloc(stat_buf.st_size + 1);
+    ret = fread(buf, 1, stat_buf.st_size, in) == (size_t) stat_buf.st_size;
+    fclose(in);
+
+    if (!ret || (log = begin_backup_log_rewrite(op)) == NULL) {
+        ret = FALSE;
+        goto done;
+    }
+
+    fwrite(buf, 1, start, log);
+    fwrite(buf + end, 1, stat_buf.st_size - end, log);
+
+    ret = !ferror(log) && end_backup_log_rewrite(op, log);
+
+ done:
+    if (!ret) {
+        ui_warn(op, "Unable to remove the entries of the files of the "
+                "earlier installation from the backup log file '%s'; the "
+                "driver may not be uninstalled cleanly.", BACKUP_LOG);
+    }
+
+    nvfree(buf);
+}
+
+
+/*
+ * finish_delta_reinstall() - remove the files and symbolic links of the
+ * earlier installation that were not installed again (and have not
+ * changed since), and the directories that this leaves empty, restore
+ * the files that they had replaced, and forget the earlier installation.
+ */
+
+void finish_delta_reinstall(Options *op)
+{
+    BackupInfo *b = delta_reinstall.b;
+    struct stat stat_buf;
+    int i;
+
+    if (!b) return;
+
+    for (i = 0; i < b->n; i++) {
+        const BackupLogEntry *e = &b->e[i];
+
+        if ((e->num != INSTALLED_FILE && e->num != INSTALLED_SYMLINK) ||
+            delta_reinstall.reinstalled[i] ||
+            backup_log_entry_superseded(b, i)) {
+            continue;
+        }
+
+        if (!delta_reinstall.intact[i]) {
+            ui_log(op, "Leaving '%s', which is no longer installed, in "
+                   "place: it has changed since it was installed.",
+                   e->filename);
+        } else if (unlink(e->filename) == 0) {
+            ui_log(op, "Removed '%s', which is no longer installed.",
+                   e->filename);
+        }
+    }
+
+    for (i = 0; i < b->n; i++) {
+        const BackupLogEntry *e = &b->e[i];
+
+        if (!delta_reinstall.restore[i]) continue;
+
+        if (lstat(e->filename, &stat_buf) == 0) {
+            ui_warn(op, "Unable to restore the backed up file '%s', because "
+                    "a file is in its place.", e->filename);
+        } else if (restore_backed_up_entry(op, e, TRUE)) {
+            ui_log(op, "Restored the backed up file '%s'.", e->filename);
+        }
+    }
+
+    remove_empty_logged_directories(op);
+
+    drop_carried_installed_entries(op);
+
+    for (i = 0; i < delta_reinstall.num_renames; i++) {
+        nvfree(delta_reinstall.renames[i].dst);
+    }
+    nvfree(delta_reinstall.renames);
+
+    free_backup_info(b);
+    nvfree(delta_reinstall.intact);
+    nvfree(delta_reinstall.state);
+    nvfree(delta_reinstall.reinstalled);
+    nvfree(delta_reinstall.restore);
+    memset(&delta_reinstall, 0, sizeof(delta_reinstall));
+}
@@ -21,6 +21,7 @@
 #define __NVIDIA_INSTALLER_BACKUP_H__
 
 #include "nvidia-installer.h"
+#include "digest.h"
 
 #define INSTALLED_SYMLINK  0
 #define INSTALLED_FILE     1
@@ -29,8 +30,13 @@
 
 int init_backup                 (Options*, Package*);
 int do_backup                   (Options*, const char*);
-int log_install_file            (Options*, const char*);
+int do_backup_from              (Options*, const char*, const char*);
+int log_install_file            (Options*, const char*,
+                                 const FileChecksum*);
 int log_create_symlink          (Options*, const char*, const char*);
+int open_backup_log_journal     (Options*);
+int sync_backup_log_journal     (Options*);
+int close_backup_log_journal    (Options*);
 int check_for_existing_driver   (Options*, Package*);
 int uninstall_existing_driver   (Options*, const int, const int);
 int run_existing_uninstaller    (Options*);
@@ -38,8 +44,25 @@ int report_driver_information   (Options*);
 
 int get_installed_driver_version_and_descr(Options *, char **, char **);
 int test_installed_files(Options *op);
+int update_backup_log_index(Options *op);
 int find_installed_file(Options *op, char *filename);
 
+int prepare_delta_reinstall(Options *op, Package *p);
+int delta_reinstall_active(void);
+int installed_file_is_current(const char *srcfile, const char *filename,
+                              mode_t mode);
+int keep_installed_file(Options *op, const char *filename, int matches,
+                        FileChecksum *sum);
+void unlink_replaced_file(Options *op, const char *filename);
+int keep_installed_symlink(Options *op, const char *filename,
+                           const char *target);
+void finish_delta_reinstall(Options *op);
+int is_delta_reinstalled_file(const char *filename);
+
 int log_mkdir(Options *op, const char *dirs);
+char **get_logged_directories(Options *op, int *num);
+
+void load_conflict_scan_cache(Options *op);
+int save_conflict_scan_cache(Options *op);
 
 #endif /* __NVIDIA_INSTALLER_BACKUP_H__ */
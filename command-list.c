@@ -26,7 +26,6 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
-#include <fts.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <string.h>
@@ -34,6 +33,8 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
 
 #include "nvidia-installer.h"
 #include "command-list.h"
@@ -44,6 +45,8 @@
 #include "kernel.h"
 #include "manifest.h"
 #include "conflicting-kernel-modules.h"
+#include "digest.h"
+#include "crc.h"
 
 
 static void free_file_list(FileList* l);
@@ -59,7 +62,38 @@ static void add_command (CommandList *c, int cmd, ...);
 
 static void add_file_to_list(const char*, const char*, FileList*);
 
-static void append_to_rpm_file_list(Options *op, Command *c);
+static StringTable *new_string_table(void);
+static void free_string_table(StringTable *t);
+static char *intern_path(StringTable *t, const char *directory,
+                         const char *filename);
+
+/*
+ * RpmFileList: the RPM spec %files list requested with --rpm-file-list.
+ * The list is written, through a large stdio buffer, to a temporary
+ * file next to it, which starts out with the contents of any existing
+ * list (the list is appended to, across installations) and is renamed
+ * into place when the command list has been executed.  Depending on
+ * op->rpm_file_list_entries, %dir entries are added for the directories
+ * created by the installation, files installed under /etc are marked
+ * %config, and symbolic links are listed.  The %dir entries, including
+ * those of the existing list, are collected and written last, sorted
+ * and without duplicates.
+ */
+
+#define RPM_FILE_LIST_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+    Options *op;
+    FILE *file;
+    char *tmpname;
+    char **dirs;        /* the %dir entries of the existing list */
+    int num_dirs;
+} RpmFileList;
+
+static void open_rpm_file_list(Options *op, RpmFileList *r);
+static void append_to_rpm_file_list(RpmFileList *r, const Command *c);
+static int close_rpm_file_list(RpmFileList *r);
+
 
 static ConflictingFileInfo *build_conflicting_file_list(Options *op, Package *p);
 static void get_conflicting_file_info(const char *file, ConflictingFileInfo *cfi);
@@ -75,10 +109,26 @@ typedef struct {
 } NoRecursionDirectory;
 
 static void find_conflicting_files(Options *op,
-                                   char *path,
+                                   char **paths,
                                    ConflictingFileInfo *files,
                                    FileList *l,
-                                   const NoRecursionDirectory *skipdirs);
+                                   const NoRecursionDirectory *skipdirs,
+                                   int show_progress);
+
+
+/*
+ * The directories searched for conflicting files, recorded while
+ * building the command list (or taken from an imported install plan)
+ * when an install plan is to be exported: the plan fingerprints them.
+ */
+
+static struct {
+    pthread_mutex_t lock;
+    int enabled;
+    char **paths;
+    int num;
+    int capacity;
+} searched_directories = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
 
 /*
@@ -105,17 +155,33 @@ static int path_already_exists(char ***paths, int count, const char *path)
 
 /*
  * Add a new path to the list of paths to search, provided that it exists
- * and is not redundant.
- * XXX we only check to see if the new directory is a subdirectory of any
- * existing directory, and not the other way around.
+ * and is not redundant.  Any paths already in the list that are
+ * subdirectories of the new path are redundant in turn, and are removed.
  */
 static void add_search_path(char ***paths, int *count, const char *path)
 {
-    if (directory_exists(path) && !path_already_exists(paths, *count, path)) {
-        *paths = nvrealloc(*paths, sizeof(char *) * (*count + 1));
-        (*paths)[*count] = nvstrdup(path);
-        (*count)++;
+    int i, j;
+
+    if (!directory_exists(path) || path_already_exists(paths, *count, path)) {
+        return;
+    }
+
+    for (i = j = 0; i < *count; i++) {
+        int is_subdir = FALSE;
+
+        is_subdirectory(path, (*paths)[i], &is_subdir);
+
+        if (is_subdir) {
+            nvfree((*paths)[i]);
+        } else {
+            (*paths)[j++] = (*paths)[i];
+        }
     }
+    *count = j;
+
+    *paths = nvrealloc(*paths, sizeof(char *) * (*count + 1));
+    (*paths)[*count] = nvstrdup(path);
+    (*count)++;
 }
 
 /*
@@ -139,8 +205,9 @@ static void add_search_paths(char ***paths, int *count, const char *pathbase)
 }
 
 /*
- * Build the list of paths under which to search for conflicting files.
- * Returns the number of paths added to the search list.
+ * Build the list of paths under which to search for conflicting files;
+ * none of them is a subdirectory of another, and the list is
+ * NULL-terminated.  Returns the number of paths added to the search list.
  */
 static int get_conflicting_search_paths(const Options *op, char ***paths)
 {
@@ -175,6 +242,9 @@ static int get_conflicting_search_paths(const Options *op, char ***paths)
     }
 #endif
 
+    *paths = nvrealloc(*paths, sizeof(char *) * (ret + 1));
+    (*paths)[ret] = NULL;
+
     return ret;
 }
 
@@ -204,11 +274,18 @@ CommandList *build_command_list(Options *op, Package *p)
 
     get_installable_file_type_list(op, &installable_files);
 
-    l = (FileList *) nvalloc(sizeof(FileList));
     c = (CommandList *) nvalloc(sizeof(CommandList));
+    c->strings = new_string_table();
+
+    l = (FileList *) nvalloc(sizeof(FileList));
+    l->strings = c->strings;
 
     /* find any possibly conflicting modules and/or libraries */
 
+    load_conflict_scan_cache(op);
+
+    searched_directories.enabled = (op->export_install_plan != NULL);
+
     if (!op->no_kernel_module || op->dkms) {
         find_conflicting_kernel_modules(op, l);
     }
@@ -271,12 +348,14 @@ CommandList *build_command_list(Options *op, Package *p)
         ui_status_begin(op, "Searching for conflicting files:", "Searching");
 
         conflicting_files = build_conflicting_file_list(op, p);
+        find_conflicting_files(op, paths, conflicting_files, l, skipdirs,
+                               TRUE);
+        nvfree(conflicting_files);
+
         for (i = 0; i < numpaths; i++) {
-            ui_status_update(op, (i + 1.0f) / numpaths, "Searching: %s", paths[i]);
-            find_conflicting_files(op, paths[i], conflicting_files, l,
-                                   skipdirs);
+            nvfree(paths[i]);
         }
-        nvfree(conflicting_files);
+        nvfree(paths);
 
         ui_status_end(op, "done.");
     }
@@ -294,6 +373,23 @@ CommandList *build_command_list(Options *op, Package *p)
     /* condense the file list */
 
     condense_file_list(p, l);
+
+    /*
+     * when reinstalling in place, the files of the installation being
+     * reinstalled are not conflicting files: they are kept, or replaced
+     * (see keep_installed_file())
+     */
+
+    if (delta_reinstall_active()) {
+        int j = 0;
+
+        for (i = 0; i < l->num; i++) {
+            if (!is_delta_reinstalled_file(l->filename[i])) {
+                l->filename[j++] = l->filename[i];
+            }
+        }
+        l->num = j;
+    }
     
     /*
      * all of the files in the conflicting file list should be backed
@@ -429,13 +525,9 @@ CommandList *build_command_list(Options *op, Package *p)
 
 static void free_file_list(FileList* l)
 {
-    int i;
-
     if (!l) return;
 
-    for (i = 0; i < l->num; i++) {
-        nvfree(l->filename[i]);
-    }
+    /* the filenames themselves belong to l->strings */
 
     nvfree((char *) l->filename);
     nvfree((char *) l);
@@ -445,26 +537,17 @@ static void free_file_list(FileList* l)
 
 
 /*
- * free_command_list() - free the specified commandlist
+ * free_command_list() - free the specified commandlist, and all of the
+ * strings of its commands
  */
 
 void free_command_list(Options *op, CommandList *cl)
 {
-    int i;
-    Command *c;
-
     if (!cl) return;
 
-    for (i = 0; i < cl->num; i++) {
-        c = &cl->cmds[i];
-        if (c->s0) free(c->s0);
-        if (c->s1) free(c->s1);
-        if (c->s2) free(c->s2);
-    }
-
-    if (cl->cmds) free(cl->cmds);
-    
-    free(cl);
+    nvfree(cl->cmds);
+    free_string_table(cl->strings);
+    nvfree(cl);
 
 } /* free_command_list() */
 
@@ -480,6 +563,11 @@ static inline int execute_run_command(Options *op, float percent, const char *cm
     ui_expert(op, "Executing: %s", cmd);
     ui_status_update(op, percent, "Executing: `%s` "
                      "(this may take a moment...)", cmd);
+
+    /* checkpoint the backup log before handing control to cmd */
+
+    sync_backup_log_journal(op);
+
     ret = run_command(op, cmd, &data, TRUE, 0, TRUE);
     if (ret != 0) {
         ui_error(op, "Failed to execute `%s`: %s", cmd, data);
@@ -494,604 +582,2540 @@ static inline int execute_run_command(Options *op, float percent, const char *cm
 } /* execute_run_command() */
 
 /*
- * execute_command_list() - execute the commands in the command list.
+ * Commands are executed in list order by the calling thread, which is
+ * the only thread that interacts with the user, and that writes the
+ * backup log and the RPM file list.  The bulk of the work, copying the
+ * data of installed files (and checksumming it for the backup log), is
+ * however carried out ahead of time by a pool of worker threads: when
+ * execute_command_list() reaches an INSTALL_CMD that has already been
+ * dispatched to a worker, it only waits for the copy to complete, and
+ * then reports and logs it as if the file had just been installed.
  *
- * If any failure occurs, ask the user if they would like to continue.
+ * An INSTALL_CMD is dispatched ahead of time only if:
+ *
+ *  - it has no post-install command (s2), and the directory that it
+ *    installs into already exists (creating directories is logged, and
+ *    so is left to the calling thread);
+ *
+ *  - no command between it and the command currently being executed
+ *    touches the same path (otherwise, it is executed in order, by the
+ *    calling thread).  Paths are compared by the identity (device
+ *    and inode) of their parent directory and their last component, so
+ *    that paths that reach the same file through symbolic links to
+ *    directories are recognized; a SYMLINK_CMD touches both the link
+ *    and its target.  RUN_CMDs, and INSTALL_CMDs with a post-install
+ *    command, may do anything, and so act as barriers: nothing beyond
+ *    them is dispatched until they have been executed.
+ *
+ * When reinstalling in place (see prepare_delta_reinstall()), the worker
+ * also checks whether the installed file can be kept, and only copies
+ * the file if it cannot; the calling thread then keeps it, or reports
+ * that it was replaced.
+ *
+ * Commands are examined for dispatch at most COMMAND_LOOKAHEAD_PER_THREAD
+ * per worker thread ahead of the command currently being executed.  With
+ * a concurrency level of 1, no worker threads are used.
  */
 
-int execute_command_list(Options *op, CommandList *c,
-                         const char *title, const char *msg)
-{
-    int i, ret;
-    float percent;
+#define COMMAND_LOOKAHEAD_PER_THREAD 16
 
-    ui_status_begin(op, title, "%s", msg);
+#define COMMAND_NOT_DISPATCHED 0
+#define COMMAND_DISPATCHED     1
+#define COMMAND_COMPLETED      2
 
-    for (i = 0; i < c->num; i++) {
+typedef struct {
+    int valid;          /* FALSE if the parent directory does not exist */
+    dev_t dev;
+    ino_t ino;
+    const char *name;
+} CommandPathKey;
 
-        percent = (float) i / (float) c->num;
+typedef struct {
+    int state;
+    int num_keys;
+    CommandPathKey keys[2];
+    char *target_path;  /* the target of a SYMLINK_CMD, as a path */
 
-        switch (c->cmds[i].cmd) {
-                
-        case INSTALL_CMD:
-            ui_expert(op, "Installing: %s --> %s",
-                      c->cmds[i].s0, c->cmds[i].s1);
-            ui_status_update(op, percent, "Installing: %s", c->cmds[i].s1);
-            
-            ret = install_file(op, c->cmds[i].s0, c->cmds[i].s1,
-                               c->cmds[i].mode);
-            if (!ret) {
-                ret = continue_after_error(op, "Cannot install %s",
-                                           c->cmds[i].s1);
-                if (!ret) return FALSE;
-            } else {
-                /*
-                 * perform post-install step before logging the backup
-                 */
-                if (c->cmds[i].s2 &&
-                    !execute_run_command(op, percent, c->cmds[i].s2)) {
-                    return FALSE;
-                }
+    /* the result of a dispatched INSTALL_CMD */
+    int ret;
+    char *error_str;
+    FileChecksum sum;
+    int matches;        /* see installed_file_is_current(); not copied */
+} CommandJob;
 
-                log_install_file(op, c->cmds[i].s1);
-                append_to_rpm_file_list(op, &c->cmds[i]);
-            }
-            break;
-            
-        case RUN_CMD:
-            if (!execute_run_command(op, percent, c->cmds[i].s0)) {
-                return FALSE;
-            }
-            break;
+typedef struct {
+    Options *op;
+    CommandList *c;
+    CommandJob *jobs;
 
-        case SYMLINK_CMD:
-            ui_expert(op, "Creating symlink: %s -> %s",
-                      c->cmds[i].s0, c->cmds[i].s1);
-            ui_status_update(op, percent, "Creating symlink: %s",
-                             c->cmds[i].s1);
+    int num_threads;
+    pthread_t *threads;
+    int lookahead;
+    int next;           /* the next command to examine for dispatch */
 
-            ret = install_symlink(op, c->cmds[i].s1, c->cmds[i].s0);
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t completed;
+    int *queue;
+    int queue_head, queue_tail;
+    int shutdown;
 
-            if (!ret) {
-                ret = continue_after_error(op, "Cannot create symlink %s (%s)",
-                                           c->cmds[i].s0, strerror(errno));
-                if (!ret) return FALSE;
-            } else {
-                log_create_symlink(op, c->cmds[i].s0, c->cmds[i].s1);
-            }
-            break;
+    RpmFileList *rpm;   /* for installs completed out of order on abort */
+} CommandScheduler;
 
-        case BACKUP_CMD:
-            ui_expert(op, "Backing up: %s", c->cmds[i].s0);
-            ui_status_update(op, percent, "Backing up: %s", c->cmds[i].s0);
 
-            ret = do_backup(op, c->cmds[i].s0);
-            if (!ret) {
-                ret = continue_after_error(op, "Cannot backup %s",
-                                           c->cmds[i].s0);
-                if (!ret) return FALSE;
-            }
-            break;
+/*
+ * get_command_path_key() - identify 'path' by the device and inode of
+ * its parent directory, and its last component.
+ */
 
-        case DELETE_CMD:
-            ui_expert(op, "Deleting: %s", c->cmds[i].s0);
-            ret = unlink(c->cmds[i].s0);
-            if (ret == -1) {
-                ret = continue_after_error(op, "Cannot delete %s",
-                                           c->cmds[i].s0);
-                if (!ret) return FALSE;
-            }
-            break;
+static void get_command_path_key(const char *path, CommandPathKey *key)
+{
+    struct stat stat_buf;
+    char *dirc = nvstrdup(path);
+    const char *slash = strrchr(path, '/');
 
-        default:
-            /* XXX should never get here */
-            return FALSE;
-            break;
-        }
-    }
+    memset(key, 0, sizeof(*key));
+    key->name = slash ? slash + 1 : path;
 
-    ui_status_end(op, "done.");
+    if (stat(dirname(dirc), &stat_buf) == 0) {
+        key->valid = TRUE;
+        key->dev = stat_buf.st_dev;
+        key->ino = stat_buf.st_ino;
+    }
 
-    return TRUE;
-    
-} /* execute_command_list() */
+    nvfree(dirc);
+}
 
 
 /*
- ***************************************************************************
- * local static routines
- ***************************************************************************
+ * get_command_keys() - (re)compute the path keys of command 'i'.
  */
 
+static void get_command_keys(CommandScheduler *s, int i)
+{
+    Command *cmd = &s->c->cmds[i];
+    CommandJob *job = &s->jobs[i];
 
+    job->num_keys = 0;
 
-/*
- * find_conflicting_kernel_modules() - search for conflicting kernel
- * modules under the kernel module installation prefix.
- */
+    switch (cmd->cmd) {
 
-static void find_conflicting_kernel_modules(Options *op, FileList *l)
-{
-    int i = 0;
-    ConflictingFileInfo *files;
-    char *paths[3];
-    char *tmp = get_kernel_name(op);
-    char **filenames;
+    case INSTALL_CMD:
+        get_command_path_key(cmd->s1, &job->keys[job->num_keys++]);
+        break;
 
-    /* Don't descend into the "build" or "source" directories; these won't
-     * contain modules, and may be symlinks back to an actual source tree. */
-    static const NoRecursionDirectory skipdirs[] = {
-        { 1, "build" },
-        { 1, "source" },
-        { 0, NULL }
-    };
+    case SYMLINK_CMD:
+        get_command_path_key(cmd->s0, &job->keys[job->num_keys++]);
 
-    if (op->kernel_module_installation_path) {
-        paths[i++] = op->kernel_module_installation_path;
-    }
+        if (!job->target_path) {
+            if (cmd->s1[0] == '/') {
+                job->target_path = nvstrdup(cmd->s1);
+            } else {
+                char *dirc = nvstrdup(cmd->s0);
+                job->target_path = nvstrcat(dirname(dirc), "/", cmd->s1, NULL);
+                nvfree(dirc);
+            }
+        }
+        get_command_path_key(job->target_path, &job->keys[job->num_keys++]);
+        break;
 
-    if (tmp) {
-        paths[i++] = nvstrcat("/lib/modules/", tmp, NULL);
+    case BACKUP_CMD:
+    case DELETE_CMD:
+        get_command_path_key(cmd->s0, &job->keys[job->num_keys++]);
+        break;
+
+    default:
+        break;
     }
+}
 
-    paths[i] = NULL;
 
-    /* Build the list of conflicting kernel modules */
+static int is_barrier_command(const Command *cmd)
+{
+    return cmd->cmd == RUN_CMD || (cmd->cmd == INSTALL_CMD && cmd->s2);
+}
 
-    files = nvalloc((num_conflicting_kernel_modules + 1) * sizeof(files[0]));
-    filenames = nvalloc(num_conflicting_kernel_modules * sizeof(filenames[0]));
 
-    for (i = 0; i < num_conflicting_kernel_modules; i++) {
-        filenames[i] = nvstrcat(conflicting_kernel_modules[i], ".ko", NULL);
-        files[i].name = filenames[i];
-        files[i].len = strlen(filenames[i]);
+static int command_keys_are_valid(const CommandJob *job)
+{
+    int k;
+
+    for (k = 0; k < job->num_keys; k++) {
+        if (!job->keys[k].valid) return FALSE;
     }
 
-    for (i = 0; paths[i]; i++) {
-        /*
-         * Recursively search for the conflicting kernel modules
-         * relative to the current prefix.
-         */
+    return TRUE;
+}
+
 
-        find_conflicting_files(op, paths[i], files, l, skipdirs);
+static int commands_conflict(const CommandJob *a, const CommandJob *b)
+{
+    int i, j;
+
+    for (i = 0; i < a->num_keys; i++) {
+        for (j = 0; j < b->num_keys; j++) {
+            if (a->keys[i].dev == b->keys[j].dev &&
+                a->keys[i].ino == b->keys[j].ino &&
+                strcmp(a->keys[i].name, b->keys[j].name) == 0) {
+                return TRUE;
+            }
+        }
     }
 
-    /* free any paths we nvstrcat()'d above  */
+    return FALSE;
+}
 
-    for (i = 1; paths[i]; i++) {
-        nvfree(paths[i]);
-    }
 
-    /* free the kernel module names */
+static void *command_worker(void *arg)
+{
+    CommandScheduler *s = arg;
 
-    for (i = 0; i < num_conflicting_kernel_modules; i++) {
-        nvfree(filenames[i]);
-    }
-    nvfree(filenames);
-    nvfree(files);
-}
+    pthread_mutex_lock(&s->lock);
 
+    while (1) {
+        Command *cmd;
+        CommandJob *job;
+        int i;
 
+        while (s->queue_head == s->queue_tail && !s->shutdown) {
+            pthread_cond_wait(&s->queued, &s->lock);
+        }
+        if (s->shutdown) break;
 
-/*
- * find_existing_files() - given a Package description, search for any
- * of the package files which already exist, and add them to the
- * FileList.
- */
+        i = s->queue[s->queue_head++];
+        cmd = &s->c->cmds[i];
+        job = &s->jobs[i];
 
-static void find_existing_files(Package *p, FileList *l,
-                                PackageEntryFileTypeList *file_type_list)
-{
-    int i;
-    struct stat stat_buf;
+        pthread_mutex_unlock(&s->lock);
 
-    for (i = 0; i < p->num_entries; i++) {
-        if (file_type_list->types[p->entries[i].type]) {
-            if (lstat(p->entries[i].dst, &stat_buf) == 0) {
-                add_file_to_list(NULL, p->entries[i].dst, l);
+        if (delta_reinstall_active()) {
+            job->matches = installed_file_is_current(cmd->s0, cmd->s1,
+                                                     cmd->mode);
+            if (!job->matches) {
+                unlink_replaced_file(s->op, cmd->s1);
             }
         }
+
+        if (job->matches) {
+            job->ret = TRUE;
+        } else if (s->op->staged_install) {
+            job->ret = try_stage_file_with_checksum(cmd->s0, cmd->s1,
+                                                    cmd->mode, &job->sum,
+                                                    &job->error_str);
+        } else {
+            job->ret = try_copy_file_with_checksum(cmd->s0, cmd->s1,
+                                                   cmd->mode, &job->sum,
+                                                   &job->error_str);
+        }
+
+        pthread_mutex_lock(&s->lock);
+
+        job->state = COMMAND_COMPLETED;
+        pthread_cond_broadcast(&s->completed);
     }
-} /* find_existing_files() */
 
+    pthread_mutex_unlock(&s->lock);
 
+    return NULL;
+}
 
-/*
- * ignore_conflicting_file() - ignore (i.e., do not put it on the list
- * of files to backup) the conflicting file 'filename' if requiredString
- * is non-NULL and we cannot find the string in 'filename', or if the
- * file only conflicts on specific architectures, and the file's
- * architecture does not match.
- */
 
-static int ignore_conflicting_file(Options *op,
-                                   const char *filename,
-                                   const ConflictingFileInfo info)
+static void init_command_scheduler(Options *op, CommandList *c,
+                                   CommandScheduler *s)
 {
-    int fd = -1;
-    struct stat stat_buf;
-    char *file = MAP_FAILED;
-    int ret = FALSE;
-    int i, len, size = 0;
-
-    /* if no requiredString, do not check for the required string */
+    int i;
 
-    if (!info.requiredString) return ret;
+    memset(s, 0, sizeof(*s));
+    s->op = op;
+    s->c = c;
+    s->jobs = nvalloc(NV_MAX(c->num, 1) * sizeof(CommandJob));
+    s->queue = nvalloc(NV_MAX(c->num, 1) * sizeof(int));
 
-    ret = FALSE;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->queued, NULL);
+    pthread_cond_init(&s->completed, NULL);
 
-    if ((fd = open(filename, O_RDONLY)) == -1) {
-        ui_error(op, "Unable to open '%s' for reading (%s)",
-                 filename, strerror(errno));
-        goto cleanup;
+    if (op->concurrency_level <= 1) {
+        return;
     }
 
-    if (fstat(fd, &stat_buf) == -1) {
-        ui_error(op, "Unable to determine size of '%s' (%s)",
-                 filename, strerror(errno));
-        goto cleanup;
+    /* the CRC tables must be built before any worker can use them */
+
+    init_crc_engine();
+
+    s->threads = nvalloc(op->concurrency_level * sizeof(pthread_t));
+
+    for (i = 0; i < op->concurrency_level; i++) {
+        if (pthread_create(&s->threads[i], NULL, command_worker, s) != 0) {
+            break;
+        }
+        s->num_threads++;
     }
 
-    size = stat_buf.st_size;
+    s->lookahead = s->num_threads * COMMAND_LOOKAHEAD_PER_THREAD;
+}
 
-    if (!size) {
-        goto cleanup;
+
+/*
+ * dispatch_commands() - dispatch to the worker threads as many of the
+ * commands following command 'current' as allowed (see above).
+ */
+
+static void dispatch_commands(CommandScheduler *s, int current)
+{
+    int i;
+
+    if (s->num_threads == 0 || is_barrier_command(&s->c->cmds[current])) {
+        return;
     }
 
-    if ((file = mmap(0, size, PROT_READ,
-                     MAP_FILE | MAP_SHARED, fd, 0)) == MAP_FAILED) {
-        ui_error(op, "Unable to map file '%s' for reading (%s)",
-                 filename, strerror(errno));
-        goto cleanup;
+    /*
+     * every command between 'current' and 'next' has been examined, and
+     * has valid keys; otherwise, nothing is dispatched beyond it
+     */
+
+    if (s->next <= current) {
+        get_command_keys(s, current);
+        s->next = current + 1;
+    }
+
+    if (!command_keys_are_valid(&s->jobs[current])) {
+        return;
+    }
+
+    while (s->next < s->c->num && s->next - current <= s->lookahead) {
+        Command *cmd = &s->c->cmds[s->next];
+        CommandJob *job = &s->jobs[s->next];
+
+        if (is_barrier_command(cmd)) {
+            break;
+        }
+
+        get_command_keys(s, s->next);
+
+        if (!command_keys_are_valid(job)) {
+            break;
+        }
+
+        /*
+         * a command that conflicts with an earlier one is left to be
+         * executed in order, by the calling thread
+         */
+
+        for (i = current; i < s->next; i++) {
+            if (commands_conflict(&s->jobs[i], job)) {
+                break;
+            }
+        }
+
+        if (cmd->cmd == INSTALL_CMD && i == s->next) {
+            memset(&job->sum, 0, sizeof(job->sum));
+            job->sum.digest.type = s->op->backup_log_digest;
+
+            pthread_mutex_lock(&s->lock);
+            job->state = COMMAND_DISPATCHED;
+            s->queue[s->queue_tail++] = s->next;
+            pthread_cond_signal(&s->queued);
+            pthread_mutex_unlock(&s->lock);
+        }
+
+        s->next++;
+    }
+}
+
+
+/*
+ * wait_for_command() - wait for the dispatched command 'i' to complete,
+ * and report any error; returns the result of the command.
+ */
+
+static int wait_for_command(CommandScheduler *s, int i, FileChecksum *sum)
+{
+    CommandJob *job = &s->jobs[i];
+
+    pthread_mutex_lock(&s->lock);
+    while (job->state != COMMAND_COMPLETED) {
+        pthread_cond_wait(&s->completed, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (job->error_str) {
+        ui_error(s->op, "%s", job->error_str);
+        nvfree(job->error_str);
+        job->error_str = NULL;
+    }
+
+    *sum = job->sum;
+
+    return job->ret;
+}
+
+
+/*
+ * finish_command_scheduler() - stop the worker threads, and release the
+ * scheduler.  If execution stopped before the end of the command list,
+ * files that were nonetheless installed ahead of time are still logged,
+ * so that the backup log continues to describe everything that was
+ * installed.
+ */
+
+static void finish_command_scheduler(CommandScheduler *s, int current)
+{
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    s->shutdown = TRUE;
+    pthread_cond_broadcast(&s->queued);
+    pthread_mutex_unlock(&s->lock);
+
+    for (i = 0; i < s->num_threads; i++) {
+        pthread_join(s->threads[i], NULL);
+    }
+
+    for (i = current + 1; i < s->c->num; i++) {
+        CommandJob *job = &s->jobs[i];
+
+        if (job->state != COMMAND_COMPLETED || !job->ret) continue;
+
+        if (job->matches &&
+            !keep_installed_file(s->op, s->c->cmds[i].s1, TRUE, &job->sum)) {
+            continue;
+        }
+
+        log_install_file(s->op, s->c->cmds[i].s1, &job->sum);
+        append_to_rpm_file_list(s->rpm, &s->c->cmds[i]);
+    }
+
+    for (i = 0; i < s->c->num; i++) {
+        nvfree(s->jobs[i].target_path);
+        nvfree(s->jobs[i].error_str);
+    }
+
+    pthread_cond_destroy(&s->completed);
+    pthread_cond_destroy(&s->queued);
+    pthread_mutex_destroy(&s->lock);
+
+    nvfree(s->threads);
+    nvfree(s->queue);
+    nvfree(s->jobs);
+}
+
+
+
+/*
+ * execute_swapped_command_list() - execute the command list for
+ * --swap-install, in three passes, so that the destinations only change
+ * during the short middle pass:
+ *
+ *  1. every file and symbolic link to install is staged under a
+ *     temporary name (unless stage_package_files() already staged it),
+ *     and the staged files are flushed to disk, so that none is moved
+ *     into place before its data is on disk;
+ *
+ *  2. the files to back up are backed up, the conflicting files to
+ *     delete are deleted, and the staged files are moved into place,
+ *     files before symbolic links, so that no new link points at a file
+ *     that is not there yet.  A file that is backed up because it is
+ *     being replaced is first swapped with its replacement atomically,
+ *     where the filesystem supports it, and then backed up from its
+ *     temporary name; one that is deleted because it is being replaced
+ *     is simply replaced;
+ *
+ *  3. the installed files and links are logged, and the remaining
+ *     commands are run, in their original order.
+ *
+ * When reinstalling in place, the files and links that are kept are not
+ * staged, and are only logged again in the third pass.  If the command
+ * list is aborted, the files and links already moved into place are
+ * still logged, so that they are uninstalled.
+ */
+
+/*
+ * is_install_source() - whether 'path' is the file installed by one of
+ * the INSTALL_CMDs of 'c'; a DELETE_CMD for it removes a temporary file
+ * generated for the installation, rather than a conflicting file.
+ */
+
+static int is_install_source(const CommandList *c, const char *path)
+{
+    int i;
+
+    for (i = 0; i < c->num; i++) {
+        if (c->cmds[i].cmd == INSTALL_CMD &&
+            strcmp(c->cmds[i].s0, path) == 0) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+/*
+ * is_staged_destination() - whether a file or symbolic link has been
+ * staged to be moved to 'path'.
+ */
+
+static int is_staged_destination(const CommandList *c, const int *staged,
+                                 const char *path)
+{
+    int i;
+
+    for (i = 0; i < c->num; i++) {
+        const Command *cmd = &c->cmds[i];
+
+        if (staged[i] &&
+            ((cmd->cmd == INSTALL_CMD && strcmp(cmd->s1, path) == 0) ||
+             (cmd->cmd == SYMLINK_CMD && strcmp(cmd->s0, path) == 0))) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+/*
+ * log_swapped_command() - log the file or symbolic link installed by
+ * the command 'cmd'.
+ */
+
+static void log_swapped_command(Options *op, const Command *cmd,
+                                FileChecksum *sum, RpmFileList *rpm)
+{
+    if (cmd->cmd == INSTALL_CMD) {
+        log_install_file(op, cmd->s1, sum);
+    } else {
+        log_create_symlink(op, cmd->s0, cmd->s1);
+    }
+    append_to_rpm_file_list(rpm, cmd);
+}
+
+
+static int execute_swapped_command_list(Options *op, CommandList *c,
+                                        RpmFileList *rpm)
+{
+    FileChecksum *sums = nvalloc(NV_MAX(c->num, 1) * sizeof(FileChecksum));
+    int *staged = nvalloc(NV_MAX(c->num, 1) * sizeof(int));
+    int *kept = nvalloc(NV_MAX(c->num, 1) * sizeof(int));
+    int *committed = nvalloc(NV_MAX(c->num, 1) * sizeof(int));
+    int *deleted = nvalloc(NV_MAX(c->num, 1) * sizeof(int));
+    int i, ret, pass, success = FALSE;
+    char *old;
+
+    /* 1. stage */
+
+    for (i = 0; i < c->num; i++) {
+        Command *cmd = &c->cmds[i];
+        float percent = (float) i / (float) c->num;
+
+        if (cmd->cmd == INSTALL_CMD && delta_reinstall_active() &&
+            keep_installed_file(op, cmd->s1,
+                                installed_file_is_current(cmd->s0, cmd->s1,
+                                                          cmd->mode),
+                                &sums[i])) {
+            ui_expert(op, "Keeping unchanged: %s", cmd->s1);
+            kept[i] = TRUE;
+        } else if (cmd->cmd == SYMLINK_CMD && delta_reinstall_active() &&
+                   keep_installed_symlink(op, cmd->s0, cmd->s1)) {
+            kept[i] = TRUE;
+        } else if (cmd->cmd == INSTALL_CMD) {
+            ui_expert(op, "Staging: %s --> %s", cmd->s0, cmd->s1);
+            ui_status_update(op, percent, "Staging: %s", cmd->s1);
+            staged[i] = stage_install_file(op, cmd->s0, cmd->s1, cmd->mode);
+            if (!staged[i] &&
+                !continue_after_error(op, "Cannot install %s", cmd->s1)) {
+                goto done;
+            }
+        } else if (cmd->cmd == SYMLINK_CMD) {
+            ui_expert(op, "Staging symlink: %s -> %s", cmd->s0, cmd->s1);
+            ui_status_update(op, percent, "Staging: %s", cmd->s0);
+            staged[i] = stage_install_symlink(op, cmd->s1, cmd->s0);
+            if (!staged[i] &&
+                !continue_after_error(op, "Cannot create symlink %s (%s)",
+                                      cmd->s0, strerror(errno))) {
+                goto done;
+            }
+        }
+    }
+
+    if (!sync_installed_filesystems(op)) goto done;
+
+    /* 2. back up, and swap the staged files in */
+
+    ui_status_update(op, 1.0, "Replacing the installed files");
+
+    for (i = 0; i < c->num; i++) {
+        Command *cmd = &c->cmds[i];
+
+        if (cmd->cmd != BACKUP_CMD) continue;
+
+        ui_expert(op, "Backing up: %s", cmd->s0);
+
+        if ((old = exchange_staged_file(op, cmd->s0)) != NULL) {
+            ret = do_backup_from(op, cmd->s0, old);
+            nvfree(old);
+        } else {
+            ret = do_backup(op, cmd->s0);
+        }
+
+        if (!ret && !continue_after_error(op, "Cannot backup %s", cmd->s0)) {
+            goto done;
+        }
+    }
+
+    for (i = 0; i < c->num; i++) {
+        Command *cmd = &c->cmds[i];
+
+        if (cmd->cmd != DELETE_CMD || is_install_source(c, cmd->s0)) {
+            continue;
+        }
+
+        deleted[i] = TRUE;
+
+        /* renaming the staged file over it replaces it atomically */
+
+        if (is_staged_destination(c, staged, cmd->s0)) continue;
+
+        ui_expert(op, "Deleting: %s", cmd->s0);
+        if (unlink(cmd->s0) == -1 &&
+            !continue_after_error(op, "Cannot delete %s", cmd->s0)) {
+            goto done;
+        }
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < c->num; i++) {
+            Command *cmd = &c->cmds[i];
+
+            if (!staged[i] ||
+                cmd->cmd != (pass == 0 ? INSTALL_CMD : SYMLINK_CMD)) {
+                continue;
+            }
+
+            if (cmd->cmd == INSTALL_CMD) {
+                staged[i] = commit_staged_file(op, cmd->s1, &sums[i]);
+                committed[i] = staged[i];
+                if (!staged[i] &&
+                    !continue_after_error(op, "Cannot install %s", cmd->s1)) {
+                    goto done;
+                }
+            } else {
+                staged[i] = commit_staged_file(op, cmd->s0, NULL);
+                committed[i] = staged[i];
+                if (!staged[i] &&
+                    !continue_after_error(op, "Cannot create symlink %s",
+                                          cmd->s0)) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+    /* 3. log the installed files, and run the other commands */
+
+    for (i = 0; i < c->num; i++) {
+        Command *cmd = &c->cmds[i];
+        float percent = (float) i / (float) c->num;
+
+        switch (cmd->cmd) {
+        case INSTALL_CMD:
+            if (kept[i]) {
+                log_swapped_command(op, cmd, &sums[i], rpm);
+                break;
+            }
+            if (!committed[i]) break;
+
+            ui_status_update(op, percent, "Installing: %s", cmd->s1);
+
+            /* see execute_command_list() */
+            if (cmd->s2) {
+                if (!execute_run_command(op, percent, cmd->s2)) {
+                    goto done;
+                }
+                compute_file_checksum(op, cmd->s1, &sums[i]);
+            }
+
+            log_swapped_command(op, cmd, &sums[i], rpm);
+            committed[i] = FALSE;
+            break;
+
+        case SYMLINK_CMD:
+            if (!committed[i] && !kept[i]) break;
+
+            log_swapped_command(op, cmd, NULL, rpm);
+            committed[i] = FALSE;
+            break;
+
+        case RUN_CMD:
+            if (!execute_run_command(op, percent, cmd->s0)) {
+                goto done;
+            }
+            break;
+
+        case DELETE_CMD:
+            if (deleted[i]) break;
+
+            ui_expert(op, "Deleting: %s", cmd->s0);
+            if (unlink(cmd->s0) == -1 &&
+                !continue_after_error(op, "Cannot delete %s", cmd->s0)) {
+                goto done;
+            }
+            break;
+
+        default:
+            break;
+        }
     }
 
+    success = TRUE;
+
+ done:
+    /* log what is already in place, if the command list was aborted */
+
+    for (i = 0; i < c->num; i++) {
+        if (committed[i]) {
+            log_swapped_command(op, &c->cmds[i], &sums[i], rpm);
+        }
+    }
+
+    discard_staged_files();
+
+    nvfree(deleted);
+    nvfree(committed);
+    nvfree(kept);
+    nvfree(staged);
+    nvfree(sums);
+
+    return success;
+}
+
+
+
+/*
+ * execute_command_list() - execute the commands in the command list.
+ *
+ * If any failure occurs, ask the user if they would like to continue.
+ */
+
+int execute_command_list(Options *op, CommandList *c,
+                         const char *title, const char *msg)
+{
+    int i, ret, dispatched, matches, success = FALSE;
+    float percent;
+    FileChecksum sum;
+    CommandScheduler sched;
+    RpmFileList rpm;
+
+    ui_status_begin(op, title, "%s", msg);
+
     /*
-     * if the requiredString is not found within the mapping of file,
-     * ignore the conflicting file; when scanning for the string,
-     * ensure that the string is either at the end of the file, or
-     * followed by '\0'.
+     * keep the backup log, and the RPM file list if requested, open
+     * while the commands are executed
      */
 
-    ret = TRUE;
+    open_backup_log_journal(op);
+    open_rpm_file_list(op, &rpm);
+
+    /* the swapped command list does not use the worker threads */
+
+    if (op->swap_install) {
+        success = execute_swapped_command_list(op, c, &rpm);
+        goto close_files;
+    }
+
+    init_command_scheduler(op, c, &sched);
+    sched.rpm = &rpm;
+
+    for (i = 0; i < c->num; i++) {
+
+        percent = (float) i / (float) c->num;
+
+        dispatch_commands(&sched, i);
+
+        switch (c->cmds[i].cmd) {
+                
+        case INSTALL_CMD:
+            ui_expert(op, "Installing: %s --> %s",
+                      c->cmds[i].s0, c->cmds[i].s1);
+            ui_status_update(op, percent, "Installing: %s", c->cmds[i].s1);
+            
+            dispatched = (sched.jobs[i].state != COMMAND_NOT_DISPATCHED);
+
+            if (dispatched) {
+                ret = wait_for_command(&sched, i, &sum);
+                matches = sched.jobs[i].matches;
+            } else {
+                ret = FALSE;
+                matches = delta_reinstall_active() &&
+                          installed_file_is_current(c->cmds[i].s0,
+                                                    c->cmds[i].s1,
+                                                    c->cmds[i].mode);
+            }
+
+            /*
+             * when reinstalling in place, an unchanged file is only
+             * logged again
+             */
+            if (delta_reinstall_active() &&
+                keep_installed_file(op, c->cmds[i].s1, matches, &sum)) {
+                ui_expert(op, "Keeping unchanged: %s", c->cmds[i].s1);
+                log_install_file(op, c->cmds[i].s1, &sum);
+                append_to_rpm_file_list(&rpm, &c->cmds[i]);
+                break;
+            }
+
+            /*
+             * the checksums for the backup log are computed while the
+             * file is copied into place, so that each installed byte
+             * is only read once; a file that was found unchanged by a
+             * worker, but could not be kept after all, was not copied
+             */
+            if (!dispatched || matches) {
+                if (delta_reinstall_active()) {
+                    unlink_replaced_file(op, c->cmds[i].s1);
+                }
+                memset(&sum, 0, sizeof(sum));
+                sum.digest.type = op->backup_log_digest;
+                ret = install_file(op, c->cmds[i].s0, c->cmds[i].s1,
+                                   c->cmds[i].mode, &sum);
+            }
+            if (!ret) {
+                ret = continue_after_error(op, "Cannot install %s",
+                                           c->cmds[i].s1);
+                if (!ret) goto done;
+            } else {
+                /*
+                 * perform post-install step before logging the backup;
+                 * the post-install step may modify the installed file,
+                 * so its checksums must be computed again
+                 */
+                if (c->cmds[i].s2) {
+                    if (!execute_run_command(op, percent, c->cmds[i].s2)) {
+                        goto done;
+                    }
+                    compute_file_checksum(op, c->cmds[i].s1, &sum);
+                }
+
+                log_install_file(op, c->cmds[i].s1, &sum);
+                append_to_rpm_file_list(&rpm, &c->cmds[i]);
+            }
+            break;
+            
+        case RUN_CMD:
+            if (!execute_run_command(op, percent, c->cmds[i].s0)) {
+                goto done;
+            }
+            break;
+
+        case SYMLINK_CMD:
+            if (delta_reinstall_active() &&
+                keep_installed_symlink(op, c->cmds[i].s0, c->cmds[i].s1)) {
+                log_create_symlink(op, c->cmds[i].s0, c->cmds[i].s1);
+                append_to_rpm_file_list(&rpm, &c->cmds[i]);
+                break;
+            }
+
+            ui_expert(op, "Creating symlink: %s -> %s",
+                      c->cmds[i].s0, c->cmds[i].s1);
+            ui_status_update(op, percent, "Creating symlink: %s",
+                             c->cmds[i].s1);
+
+            ret = install_symlink(op, c->cmds[i].s1, c->cmds[i].s0);
+
+            if (!ret) {
+                ret = continue_after_error(op, "Cannot create symlink %s (%s)",
+                                           c->cmds[i].s0, strerror(errno));
+                if (!ret) goto done;
+            } else {
+                log_create_symlink(op, c->cmds[i].s0, c->cmds[i].s1);
+                append_to_rpm_file_list(&rpm, &c->cmds[i]);
+            }
+            break;
+
+        case BACKUP_CMD:
+            ui_expert(op, "Backing up: %s", c->cmds[i].s0);
+            ui_status_update(op, percent, "Backing up: %s", c->cmds[i].s0);
+
+            ret = do_backup(op, c->cmds[i].s0);
+            if (!ret) {
+                ret = continue_after_error(op, "Cannot backup %s",
+                                           c->cmds[i].s0);
+                if (!ret) goto done;
+            }
+            break;
+
+        case DELETE_CMD:
+            ui_expert(op, "Deleting: %s", c->cmds[i].s0);
+            ret = unlink(c->cmds[i].s0);
+            if (ret == -1) {
+                ret = continue_after_error(op, "Cannot delete %s",
+                                           c->cmds[i].s0);
+                if (!ret) goto done;
+            }
+            break;
+
+        default:
+            /* XXX should never get here */
+            goto done;
+            break;
+        }
+    }
+
+    success = TRUE;
+
+ done:
+
+    finish_command_scheduler(&sched, i);
+
+ close_files:
+
+    if (!close_backup_log_journal(op)) {
+        success = FALSE;
+    }
+
+    if (!close_rpm_file_list(&rpm)) {
+        success = FALSE;
+    }
+
+    /*
+     * with --staged-install (or --swap-install), flush everything
+     * installed (or renamed into place) to disk at once
+     */
+
+    if (op->staged_install && !sync_installed_filesystems(op)) {
+        success = FALSE;
+    }
+
+    if (success) {
+        ui_status_end(op, "done.");
+    }
+
+    return success;
+    
+} /* execute_command_list() */
+
+
+/*
+ ***************************************************************************
+ * local static routines
+ ***************************************************************************
+ */
+
+
+
+/*
+ * find_conflicting_kernel_modules() - search for conflicting kernel
+ * modules under the kernel module installation prefix.
+ */
+
+static void find_conflicting_kernel_modules(Options *op, FileList *l)
+{
+    int i = 0;
+    ConflictingFileInfo *files;
+    char *paths[3];
+    char *tmp = get_kernel_name(op);
+    char **filenames;
+
+    /* Don't descend into the "build" or "source" directories; these won't
+     * contain modules, and may be symlinks back to an actual source tree. */
+    static const NoRecursionDirectory skipdirs[] = {
+        { 1, "build" },
+        { 1, "source" },
+        { 0, NULL }
+    };
+
+    if (op->kernel_module_installation_path) {
+        paths[i++] = op->kernel_module_installation_path;
+    }
+
+    if (tmp) {
+        paths[i++] = nvstrcat("/lib/modules/", tmp, NULL);
+    }
+
+    paths[i] = NULL;
+
+    /* Build the list of conflicting kernel modules */
+
+    files = nvalloc((num_conflicting_kernel_modules + 1) * sizeof(files[0]));
+    filenames = nvalloc(num_conflicting_kernel_modules * sizeof(filenames[0]));
+
+    for (i = 0; i < num_conflicting_kernel_modules; i++) {
+        filenames[i] = nvstrcat(conflicting_kernel_modules[i], ".ko", NULL);
+        files[i].name = filenames[i];
+        files[i].len = strlen(filenames[i]);
+    }
+
+    /*
+     * Recursively search for the conflicting kernel modules
+     * relative to the prefixes.
+     */
+
+    find_conflicting_files(op, paths, files, l, skipdirs, FALSE);
+
+    /* free any paths we nvstrcat()'d above  */
+
+    for (i = 1; paths[i]; i++) {
+        nvfree(paths[i]);
+    }
+
+    /* free the kernel module names */
+
+    for (i = 0; i < num_conflicting_kernel_modules; i++) {
+        nvfree(filenames[i]);
+    }
+    nvfree(filenames);
+    nvfree(files);
+}
+
+
+
+/*
+ * find_existing_files() - given a Package description, search for any
+ * of the package files which already exist, and add them to the
+ * FileList.
+ */
+
+static void find_existing_files(Package *p, FileList *l,
+                                PackageEntryFileTypeList *file_type_list)
+{
+    int i;
+    struct stat stat_buf;
+
+    for (i = 0; i < p->num_entries; i++) {
+        if (file_type_list->types[p->entries[i].type]) {
+            if (lstat(p->entries[i].dst, &stat_buf) == 0) {
+                add_file_to_list(NULL, p->entries[i].dst, l);
+            }
+        }
+    }
+} /* find_existing_files() */
+
+
+
+/*
+ * ignore_conflicting_file() - ignore (i.e., do not put it on the list
+ * of files to backup) the conflicting file 'filename' if requiredString
+ * is non-NULL and we cannot find the string in 'filename', or if the
+ * file only conflicts on specific architectures, and the file's
+ * architecture does not match.
+ */
+
+static int ignore_conflicting_file(Options *op,
+                                   const char *filename,
+                                   const ConflictingFileInfo info)
+{
+    int fd = -1;
+    struct stat stat_buf;
+    char *file = MAP_FAILED;
+    int ret = FALSE;
+    int size = 0;
+
+    /* if no requiredString, do not check for the required string */
+
+    if (!info.requiredString) return ret;
+
+    ret = FALSE;
+
+    if ((fd = open(filename, O_RDONLY)) == -1) {
+        ui_error(op, "Unable to open '%s' for reading (%s)",
+                 filename, strerror(errno));
+        goto cleanup;
+    }
+
+    if (fstat(fd, &stat_buf) == -1) {
+        ui_error(op, "Unable to determine size of '%s' (%s)",
+                 filename, strerror(errno));
+        goto cleanup;
+    }
+
+    size = stat_buf.st_size;
+
+    if (!size) {
+        goto cleanup;
+    }
+
+    if ((file = mmap(0, size, PROT_READ,
+                     MAP_FILE | MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        ui_error(op, "Unable to map file '%s' for reading (%s)",
+                 filename, strerror(errno));
+        goto cleanup;
+    }
+
+    /*
+     * if the requiredString is not found within the mapping of file,
+     * ignore the conflicting file; when scanning for the string,
+     * ensure that the string is either at the end of the file, or
+     * followed by '\0'.
+     */
+
+    ret = !buffer_contains_string(file, size, info.requiredString);
+
+    /* fall through to cleanup */
+
+ cleanup:
+
+    if (file != MAP_FAILED) {
+        munmap(file, size);
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    return ret;
+
+} /* ignore_conflicting_file() */
+
+
+
+
+/*
+ * ConflictingFileMatcher: a prefix trie of the names in a
+ * ConflictingFileInfo list, each truncated to its 'len' (e.g. "libGL.so"
+ * for "libGL.so.1"), so that a file name can be classified in time
+ * proportional to its length, however many names the list holds.  The
+ * nodes' children are found through a single hash table of the edges,
+ * keyed by parent node and byte.
+ */
+
+typedef struct {
+    unsigned int parent;
+    unsigned int child;         /* 0 for an empty slot: the root is 0 */
+    unsigned char byte;
+} ConflictingFileTrieEdge;
+
+typedef struct {
+    ConflictingFileTrieEdge *edges;
+    size_t num_slots;           /* a power of two */
+    unsigned int num_nodes;
+    int *first_match;           /* per node: first entry ending there */
+    int *next_match;            /* per entry: next entry ending there */
+    int num_files;
+} ConflictingFileMatcher;
+
+
+static ConflictingFileTrieEdge *find_trie_edge(const ConflictingFileMatcher *m,
+                                               unsigned int parent,
+                                               unsigned char byte)
+{
+    size_t mask = m->num_slots - 1;
+    size_t i = ((parent * 257u + byte) * 0x9E3779B1u) & mask;
+
+    while (m->edges[i].child &&
+           (m->edges[i].parent != parent || m->edges[i].byte != byte)) {
+        i = (i + 1) & mask;
+    }
+
+    return &m->edges[i];
+}
+
+
+static ConflictingFileMatcher *
+new_conflicting_file_matcher(const ConflictingFileInfo *files)
+{
+    ConflictingFileMatcher *m = nvalloc(sizeof(ConflictingFileMatcher));
+    size_t k, total_len = 0;
+    int i, j, *last_match;
+
+    for (i = 0; files[i].name; i++) {
+        total_len += files[i].len;
+    }
+
+    m->num_files = i;
+    m->num_slots = 16;
+    while (m->num_slots < total_len * 2) {
+        m->num_slots *= 2;
+    }
+
+    m->edges = nvalloc(m->num_slots * sizeof(ConflictingFileTrieEdge));
+    m->first_match = nvalloc((total_len + 1) * sizeof(int));
+    m->next_match = nvalloc((m->num_files + 1) * sizeof(int));
+    last_match = nvalloc((total_len + 1) * sizeof(int));
+    m->num_nodes = 1;
+
+    for (k = 0; k <= total_len; k++) {
+        m->first_match[k] = -1;
+    }
+
+    for (i = 0; i < m->num_files; i++) {
+        unsigned int node = 0;
+
+        for (j = 0; j < files[i].len; j++) {
+            ConflictingFileTrieEdge *edge =
+                find_trie_edge(m, node, (unsigned char) files[i].name[j]);
+
+            if (!edge->child) {
+                edge->parent = node;
+                edge->byte = (unsigned char) files[i].name[j];
+                edge->child = m->num_nodes++;
+            }
+            node = edge->child;
+        }
+
+        /* keep the entries ending at each node in list order */
+
+        m->next_match[i] = -1;
+        if (m->first_match[node] < 0) {
+            m->first_match[node] = i;
+        } else {
+            m->next_match[last_match[node]] = i;
+        }
+        last_match[node] = i;
+    }
+
+    nvfree(last_match);
+
+    return m;
+}
+
+
+static void free_conflicting_file_matcher(ConflictingFileMatcher *m)
+{
+    if (!m) return;
+
+    nvfree(m->edges);
+    nvfree(m->first_match);
+    nvfree(m->next_match);
+    nvfree(m);
+}
+
+
+/*
+ * match_conflicting_file() - find the entries of the ConflictingFileInfo
+ * list that 'name' starts with (comparing up to each entry's 'len'), and
+ * store their indices in 'matches', which must have room for all of the
+ * entries.  Returns the number of matches; if 'matches' is NULL, only
+ * checks whether there is any match.
+ */
+
+static int match_conflicting_file(const ConflictingFileMatcher *m,
+                                  const char *name, int *matches)
+{
+    unsigned int node = 0;
+    int i, num_matches = 0;
+
+    while (1) {
+        for (i = m->first_match[node]; i >= 0; i = m->next_match[i]) {
+            if (!matches) return 1;
+            matches[num_matches++] = i;
+        }
+
+        if (*name == '\0') break;
+
+        node = find_trie_edge(m, node, (unsigned char) *name++)->child;
+        if (!node) break;
+    }
+
+    return num_matches;
+}
+
+
+
+/*
+ * State shared by find_conflicting_files() and its DirectoryWalk
+ * callbacks.
+ */
+
+typedef struct {
+    Options *op;
+    ConflictingFileMatcher *matcher;
+    const NoRecursionDirectory *skipdirs;
+    int show_progress;
+} ConflictingFileSearch;
+
+
+static int conflicting_file_search_descend(const char *name, int level,
+                                           void *data)
+{
+    const ConflictingFileSearch *search = data;
+    const NoRecursionDirectory *dir;
+
+    if (level > 0 && search->op->no_recursion) {
+        return FALSE;
+    }
+
+    if (search->skipdirs) {
+        for (dir = search->skipdirs; dir->name; dir++) {
+            if ((dir->level < 0 || dir->level >= level) &&
+                strcmp(name, dir->name) == 0) {
+                return FALSE;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+
+static int conflicting_file_search_match(const char *name, void *data)
+{
+    const ConflictingFileSearch *search = data;
+
+    return match_conflicting_file(search->matcher, name, NULL);
+}
+
+
+static void conflicting_file_search_progress(float fraction,
+                                             const char *path, void *data)
+{
+    const ConflictingFileSearch *search = data;
+
+    if (search->show_progress) {
+        ui_status_update(search->op, fraction, "Searching: %s", path);
+    }
+}
+
+
+static void add_searched_directory(const char *path)
+{
+    pthread_mutex_lock(&searched_directories.lock);
+
+    if (searched_directories.num == searched_directories.capacity) {
+        searched_directories.capacity =
+            NV_MAX(searched_directories.capacity * 2, 64);
+        searched_directories.paths =
+            nvrealloc(searched_directories.paths,
+                      searched_directories.capacity * sizeof(char *));
+    }
+
+    searched_directories.paths[searched_directories.num++] = nvstrdup(path);
+
+    pthread_mutex_unlock(&searched_directories.lock);
+}
+
+
+static void conflicting_file_search_visit(const char *path, void *data)
+{
+    add_searched_directory(path);
+}
+
+
+
+/*
+ * find_conflicting_files() - search for any conflicting files in the
+ * hierarchies under all of the given (NULL-terminated list of) prefixes.
+ * The prefixes are searched in parallel by find_files_in_trees(), which
+ * only reads each directory once, even if it can be reached through
+ * several paths (e.g. via symbolic links to directories, or from
+ * overlapping prefixes): files found through different paths would be
+ * the same files, which condense_file_list() would discard anyway.
+ * The candidates it finds are then checked, in order of their paths, on
+ * this thread.  If 'show_progress' is set, the status bar is updated as
+ * the search progresses.
+ */
+
+static void find_conflicting_files(Options *op,
+                                   char **paths,
+                                   ConflictingFileInfo *files,
+                                   FileList *l,
+                                   const NoRecursionDirectory *skipdirs,
+                                   int show_progress)
+{
+    ConflictingFileSearch search;
+    DirectoryWalk walk;
+    char **found;
+    int i, j, num_found, num_matches, *matches;
+
+    search.op = op;
+    search.matcher = new_conflicting_file_matcher(files);
+    search.skipdirs = skipdirs;
+    search.show_progress = show_progress;
+
+    walk.descend = conflicting_file_search_descend;
+    walk.match = conflicting_file_search_match;
+    walk.progress = conflicting_file_search_progress;
+    walk.visit = searched_directories.enabled ?
+                 conflicting_file_search_visit : NULL;
+    walk.data = &search;
+    walk.use_cache = TRUE;
+
+    num_found = find_files_in_trees(op, paths, &walk, &found);
+
+    matches = nvalloc((search.matcher->num_files + 1) * sizeof(int));
+
+    for (j = 0; j < num_found; j++) {
+        const char *name = strrchr(found[j], '/');
+
+        name = name ? name + 1 : found[j];
+
+        /* end compare at len e.g. so "libGL." matches "libGL.so.1" */
+
+        num_matches = match_conflicting_file(search.matcher, name, matches);
+
+        for (i = 0; i < num_matches; i++) {
+            if (!ignore_conflicting_file(op, found[j], files[matches[i]])) {
+                add_file_to_list(NULL, found[j], l);
+            }
+        }
+    }
+
+    nvfree(matches);
+    free_found_files(found, num_found);
+    free_conflicting_file_matcher(search.matcher);
+
+} /* find_conflicting_files() */
+
+void get_conflicting_file_info(const char *file, ConflictingFileInfo *cfi)
+{
+    char *c;
+
+    cfi->name = file;
+
+    /*
+     * match the names of DSOs with "libfoo.so*" by stopping any comparisons
+     * after ".so".
+     */
+
+    c = strstr(file, ".so.");
+    if (c) {
+        cfi->len = (c - file) + 3;
+    } else {
+        cfi->len = strlen(file);
+    }
+
+    /*
+     * XXX avoid conflicting with libglx.so if it doesn't include the string
+     * "glxModuleData" to avoid removing the wrong libglx.so (bug 489316)
+     */
+
+    if (strncmp(file, "libglx.so", cfi->len) == 0) {
+        cfi->requiredString = "glxModuleData";
+    } else {
+        cfi->requiredString = NULL;
+    }
+}
+
+ConflictingFileInfo *build_conflicting_file_list(Options *op, Package *p)
+{
+    ConflictingFileInfo *cfList = NULL;
+    int index = 0;
+    int i;
+
+    // Allocate enough space for the whole file list, plus two extra files and
+    // a NULL at the end.
+    cfList = nvalloc((p->num_entries + 3) * sizeof(ConflictingFileInfo));
+    /* let's just return an empty list!  */
+    return cfList;
+
+    for (i = 0; i < p->num_entries; i++) {
+        PackageEntry *entry = &p->entries[i];
+        if (entry->caps.is_shared_lib && entry->caps.is_conflicting) {
+            get_conflicting_file_info(entry->name, &cfList[index++]);
+        }
+    }
+
+    /* XXX always conflict with these files if OpenGL files will be installed
+     * libGLwrapper.so: this library has an SONAME of libGL.so.1 (bug 74761) */
+    if (!op->no_opengl_files) {
+        get_conflicting_file_info("libGLwrapper.so", &cfList[index++]);
+    }
+
+    /* terminate the conflicting files list */
+    cfList[index].name = NULL;
+
+    return cfList;
+}
+
+
+
+/*
+ * condense_file_list() - Take a FileList stucture and delete any
+ * duplicate entries in the list, and any files that are part of the
+ * package.  Files are identified by device and inode, and looked up in
+ * hash sets, so that this stays linear in the number of files.
+ */
+
+static void condense_file_list(Package *p, FileList *l)
+{
+    int n = 0, i;
+    InodeSet package_files, kept_files;
+    dev_t dev;
+    ino_t ino;
+
+    memset(&package_files, 0, sizeof(package_files));
+    memset(&kept_files, 0, sizeof(kept_files));
+
+    /*
+     * we don't want to remove files that are in the package we're
+     * trying to install; symlinks may have tricked us into looking
+     * for conflicting files inside our unpacked .run file.
+     */
+
+    if (l->num) {
+        for (i = 0; i < p->num_entries; i++) {
+            add_to_inode_set(&package_files, p->entries[i].device,
+                             p->entries[i].inode);
+        }
+    }
+
+    /*
+     * walk through our original (uncondensed) list of files and move
+     * unique files to the front of the list, which becomes the
+     * condensed list.
+     */
+
+    for (i = 0; i < l->num; i++) {
+        if (!get_file_identity(l->filename[i], &dev, &ino)) {
+            continue;
+        }
+
+        if (inode_set_contains(&package_files, dev, ino) ||
+            !add_to_inode_set(&kept_files, dev, ino)) {
+            continue;
+        }
+
+        l->filename[n++] = l->filename[i];
+    }
+
+    free_inode_set(&package_files);
+    free_inode_set(&kept_files);
+
+    l->num = n;
+
+} /* condense_file_list() */
+
+
+
+/*
+ * String table: the strings of a CommandList (and of the FileList used
+ * to build it) are copied into large blocks, rather than allocated one
+ * by one, and are interned: each distinct string is stored once, so
+ * that e.g. the path of a conflicting file, which appears both in the
+ * FileList and in the BACKUP_CMD for it, is only copied once.  The
+ * strings are never freed individually; free_string_table() releases
+ * them all at once.
+ */
+
+#define STRING_TABLE_BLOCK_SIZE (64 * 1024)
+
+typedef struct __string_table_block {
+    struct __string_table_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+} StringTableBlock;
+
+struct __string_table {
+    StringTableBlock *blocks;
+    char **slots;               /* open addressing; a power of two */
+    size_t num_slots;
+    size_t count;
+};
+
+
+static StringTable *new_string_table(void)
+{
+    StringTable *t = nvalloc(sizeof(StringTable));
+
+    t->num_slots = 256;
+    t->slots = nvalloc(t->num_slots * sizeof(char *));
+
+    return t;
+}
+
+
+static void free_string_table(StringTable *t)
+{
+    StringTableBlock *block, *next;
+
+    if (!t) return;
+
+    for (block = t->blocks; block; block = next) {
+        next = block->next;
+        nvfree(block);
+    }
+
+    nvfree(t->slots);
+    nvfree(t);
+}
+
+
+static size_t string_table_hash(const char *str)
+{
+    size_t h = 2166136261u;
+
+    while (*str) {
+        h = (h ^ (unsigned char) *str++) * 16777619u;
+    }
+
+    return h;
+}
+
+
+/*
+ * string_table_reserve() - return a pointer to 'len' bytes at the end of
+ * the current block, starting a new block if needed; the bytes are only
+ * kept if the caller then adds 'len' to the block's 'used' count.
+ */
+
+static char *string_table_reserve(StringTable *t, size_t len)
+{
+    StringTableBlock *block = t->blocks;
+
+    if (!block || block->size - block->used < len) {
+        size_t size = NV_MAX(len, STRING_TABLE_BLOCK_SIZE);
+
+        block = nvalloc(sizeof(StringTableBlock) + size);
+        block->size = size;
+        block->next = t->blocks;
+        t->blocks = block;
+    }
+
+    return block->data + block->used;
+}
+
+
+static char **string_table_find_slot(StringTable *t, const char *str,
+                                     size_t hash)
+{
+    size_t mask = t->num_slots - 1;
+    size_t i = hash & mask;
+
+    while (t->slots[i] && strcmp(t->slots[i], str) != 0) {
+        i = (i + 1) & mask;
+    }
+
+    return &t->slots[i];
+}
+
+
+/*
+ * intern_path() - return the interned copy of "<directory>/<filename>",
+ * or of just 'filename' if 'directory' is NULL.  Returns NULL if
+ * 'filename' is NULL.
+ */
+
+static char *intern_path(StringTable *t, const char *directory,
+                         const char *filename)
+{
+    size_t len, dirlen = 0;
+    char *str, **slot;
+
+    if (!filename) return NULL;
+
+    len = strlen(filename) + 1;
+    if (directory) {
+        dirlen = strlen(directory) + 1;
+        len += dirlen;
+    }
+
+    /* build the string in place; it is only kept if it is new */
+
+    str = string_table_reserve(t, len);
+    if (directory) {
+        memcpy(str, directory, dirlen - 1);
+        str[dirlen - 1] = '/';
+    }
+    memcpy(str + dirlen, filename, len - dirlen);
+
+    slot = string_table_find_slot(t, str, string_table_hash(str));
+    if (*slot) {
+        return *slot;
+    }
+
+    *slot = str;
+    t->blocks->used += len;
+    t->count++;
+
+    /* keep the load factor at or below 1/2 */
+
+    if (t->count * 2 > t->num_slots) {
+        char **old = t->slots;
+        size_t i, old_num_slots = t->num_slots;
+
+        t->num_slots *= 2;
+        t->slots = nvalloc(t->num_slots * sizeof(char *));
+
+        for (i = 0; i < old_num_slots; i++) {
+            if (old[i]) {
+                *string_table_find_slot(t, old[i],
+                                        string_table_hash(old[i])) = old[i];
+            }
+        }
+        nvfree(old);
+    }
+
+    return str;
+}
+
+
+
+/*
+ * add_command() - grow the commandlist and append the new command,
+ * parsing the variable argument list.  The command list grows
+ * geometrically, and the strings are interned in c->strings.
+ */
+
+static void add_command(CommandList *c, int cmd, ...)
+{
+    int n = c->num;
+    char *s;
+    va_list ap;
+    
+    if (n == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 64;
+        c->cmds = (Command *) nvrealloc(c->cmds,
+                                        sizeof(Command) * c->capacity);
+    }
+ 
+    c->cmds[n].cmd  = cmd;
+    c->cmds[n].s0   = NULL;
+    c->cmds[n].s1   = NULL;
+    c->cmds[n].s2   = NULL;
+    c->cmds[n].mode = 0x0;
+    
+    va_start(ap, cmd);
+
+    switch (cmd) {
+      case INSTALL_CMD:
+        s = va_arg(ap, char *);
+        c->cmds[n].s0 = intern_path(c->strings, NULL, s);
+        s = va_arg(ap, char *);
+        c->cmds[n].s1 = intern_path(c->strings, NULL, s);
+        s = va_arg(ap, char *);
+        c->cmds[n].s2 = intern_path(c->strings, NULL, s);
+        c->cmds[n].mode = va_arg(ap, mode_t);
+        break;
+      case BACKUP_CMD:
+        s = va_arg(ap, char *);
+        c->cmds[n].s0 = intern_path(c->strings, NULL, s);
+        break;
+      case RUN_CMD:
+        s = va_arg(ap, char *);
+        c->cmds[n].s0 = intern_path(c->strings, NULL, s);
+        break;
+      case SYMLINK_CMD:
+        s = va_arg(ap, char *);
+        c->cmds[n].s0 = intern_path(c->strings, NULL, s);
+        s = va_arg(ap, char *);
+        c->cmds[n].s1 = intern_path(c->strings, NULL, s);
+        break;
+      case DELETE_CMD:
+        s = va_arg(ap, char *);
+        c->cmds[n].s0 = intern_path(c->strings, NULL, s);
+        break;
+      default:
+        break;
+    }
+
+    va_end(ap);
+
+    c->num++;
+
+} /* add_command() */
+
+
+
+/*
+ * add_file_to_list() - concatenate the given directory and filename,
+ * appending to the FileList structure.  If the 'directory' parameter
+ * is NULL, then just append the filename to the FileList.  The list
+ * grows geometrically, and the filenames are interned in l->strings.
+ */
+
+static void add_file_to_list(const char *directory,
+                             const char *filename, FileList *l)
+{
+    int n = l->num;
+    
+    if (n == l->capacity) {
+        l->capacity = l->capacity ? l->capacity * 2 : 64;
+        l->filename = (char **) nvrealloc(l->filename,
+                                          sizeof(char *) * l->capacity);
+    }
+
+    l->filename[n] = intern_path(l->strings, directory, filename);
+    l->num++;
+
+} /* add_file_to_list() */
+
+
+static void open_rpm_file_list(Options *op, RpmFileList *r)
+{
+    struct stat stat_buf;
+    FILE *old;
+    mode_t mode, mask;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+    r->op = op;
+
+    if (!op->rpm_file_list) return;
+
+    r->tmpname = nvstrcat(op->rpm_file_list, ".XXXXXX", NULL);
+
+    fd = mkstemp(r->tmpname);
+    if (fd == -1 || !(r->file = fdopen(fd, "w"))) {
+        ui_error(op, "Unable to create RPM file list '%s' (%s).",
+                 op->rpm_file_list, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            unlink(r->tmpname);
+        }
+        nvfree(r->tmpname);
+        r->tmpname = NULL;
+        return;
+    }
+
+    setvbuf(r->file, NULL, _IOFBF, RPM_FILE_LIST_BUFFER_SIZE);
+
+    /* keep the mode of the existing list, or use the one fopen(3) would */
+
+    if (stat(op->rpm_file_list, &stat_buf) == 0) {
+        mode = stat_buf.st_mode & 07777;
+    } else {
+        mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+    fchmod(fd, mode);
+
+    old = fopen(op->rpm_file_list, "r");
+    if (old) {
+        char *line;
+        int eof = FALSE;
+
+        while (!eof) {
+            line = fget_next_line(old, &eof);
+
+            if (strncmp(line, "%dir ", 5) == 0) {
+                r->dirs = nvrealloc(r->dirs,
+                                    (r->num_dirs + 1) * sizeof(char *));
+                r->dirs[r->num_dirs++] = nvstrdup(line + 5);
+            } else if (!eof || line[0] != '\0') {
+                fprintf(r->file, "%s\n", line);
+            }
+            nvfree(line);
+        }
+        fclose(old);
+    }
+}
+
+
+static void append_to_rpm_file_list(RpmFileList *r, const Command *c)
+{
+    const char *config = "";
+
+    if (!r->file) return;
+
+    switch (c->cmd) {
+
+    case INSTALL_CMD:
+        if ((r->op->rpm_file_list_entries & RPM_FILE_LIST_CONFIG) &&
+            strncmp(c->s1, "/etc/", 5) == 0) {
+            config = "%config ";
+        }
+        fprintf(r->file, "%s%%attr (%04o, root, root) %s\n",
+                config, c->mode, c->s1);
+        break;
+
+    case SYMLINK_CMD:
+        if (r->op->rpm_file_list_entries & RPM_FILE_LIST_SYMLINKS) {
+            fprintf(r->file, "%s\n", c->s0);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/*
+ * close_rpm_file_list() - finish the RPM file list, and rename it into
+ * place.
+ */
+
+static int close_rpm_file_list(RpmFileList *r)
+{
+    Options *op = r->op;
+    int i, ret = FALSE;
+
+    if (!r->file) return TRUE;
+
+    if (op->rpm_file_list_entries & RPM_FILE_LIST_DIRS) {
+        int num_dirs;
+        char **dirs = get_logged_directories(op, &num_dirs);
+
+        if (num_dirs > 0) {
+            r->dirs = nvrealloc(r->dirs,
+                                (r->num_dirs + num_dirs) * sizeof(char *));
+            memcpy(r->dirs + r->num_dirs, dirs, num_dirs * sizeof(char *));
+            r->num_dirs += num_dirs;
+        }
+        nvfree(dirs);
+    }
+
+    if (r->num_dirs > 0) {
+        qsort(r->dirs, r->num_dirs, sizeof(char *), compare_paths);
+
+        for (i = 0; i < r->num_dirs; i++) {
+            if (i == 0 || strcmp(r->dirs[i], r->dirs[i - 1]) != 0) {
+                fprintf(r->file, "%%dir %s\n", r->dirs[i]);
+            }
+        }
+    }
+
+    if (ferror(r->file) | (fclose(r->file) != 0)) {
+        ui_error(op, "Error while writing RPM file list '%s' (%s).",
+                 r->tmpname, strerror(errno));
+        unlink(r->tmpname);
+        goto done;
+    }
+
+    if (rename(r->tmpname, op->rpm_file_list) == -1) {
+        ui_error(op, "Unable to rename '%s' to '%s' (%s).",
+                 r->tmpname, op->rpm_file_list, strerror(errno));
+        unlink(r->tmpname);
+        goto done;
+    }
+
+    ret = TRUE;
+
+ done:
+    for (i = 0; i < r->num_dirs; i++) {
+        nvfree(r->dirs[i]);
+    }
+    nvfree(r->dirs);
+    r->dirs = NULL;
+    r->num_dirs = 0;
+
+    r->file = NULL;
+    nvfree(r->tmpname);
+    r->tmpname = NULL;
+
+    return ret;
+}
+
+
+
+/*
+ * Install plans: export_install_plan() writes the command list built
+ * for an installation, with the destinations of the package's entries,
+ * to a file; import_install_plan() reads it back on another run (e.g. on
+ * another system installed from the same image), instead of searching
+ * for conflicting files again, provided that the plan is still valid:
+ * it must have been written for the same driver version, installation
+ * options, utilities and package entry destinations, and each directory
+ * searched for conflicting files, each directory that files are installed
+ * into, and each file to be backed up or deleted, must have the same
+ * type, size and modification time as when the plan was written.  Device
+ * and inode numbers, and status change times, are not compared, so that
+ * a plan remains valid on copies of the system it was written on.  The
+ * imported commands are filtered as build_command_list() filters its
+ * own: see check_imported_command().
+ *
+ * Syntax for the plan file, where <string> is either "-" (for NULL), or
+ * the string's length in bytes, a ':', and the string itself:
+ *
+ * 1. The first line is INSTALL_PLAN_HEADER.
+ *
+ * 2. "version <string>": the driver version.
+ *
+ * 3. "options <string>": the options that affect the command list.
+ *
+ * 4. "utilities <string>": the paths of the utilities that the command
+ *    list runs.
+ *
+ * 5. "entries <count>", followed by <count> lines
+ *    "E <type> <string: name> <string: dst>", one per package entry.
+ *
+ * 6. "fingerprints <count>", followed by <count> lines
+ *    "F <kind> <mtime sec> <mtime nsec> <size> <string: path>", where
+ *    <kind> is "d", "f" or "n" (for a directory, any other file, or a
+ *    path that does not exist).
+ *
+ * 7. "commands <count>", followed by <count> lines
+ *    "C <cmd> <octal mode> <entry> <string: s0> <string: s1> <string: s2>";
+ *    <entry> is the index of the package entry whose file is s0, or -1:
+ *    the file is taken from this run's package, as the files generated
+ *    when the package is unpacked have different names on each run.
+ *
+ * 8. "end".
+ */
+
+#define INSTALL_PLAN_HEADER "nvidia-installer install plan 2"
+#define INSTALL_PLAN_MAX_STRING (1024 * 1024)
+
+typedef struct {
+    char kind;
+    long long sec;
+    long nsec;
+    long long size;
+} InstallPlanFingerprint;
+
+
+static void get_install_plan_fingerprint(const char *path,
+                                         InstallPlanFingerprint *fp)
+{
+    struct stat stat_buf;
+
+    memset(fp, 0, sizeof(*fp));
+
+    if (stat(path, &stat_buf) == -1) {
+        fp->kind = 'n';
+        return;
+    }
+
+    fp->kind = S_ISDIR(stat_buf.st_mode) ? 'd' : 'f';
+    fp->sec = stat_buf.st_mtim.tv_sec;
+    fp->nsec = stat_buf.st_mtim.tv_nsec;
+    fp->size = stat_buf.st_size;
+}
+
+
+/*
+ * get_install_plan_options() - describe the options that affect the
+ * command list built by build_command_list().
+ */
+
+static char *get_install_plan_options(Options *op)
+{
+    return nvasprintf("kernel=%s backup=%d kernel-module-only=%d "
+                      "kernel-module=%d dkms=%d opengl-files=%d "
+                      "recursion=%d abi-note=%d selinux=%d chcon-type=%s "
+                      "depmod=%d",
+                      op->kernel_name ? op->kernel_name : "",
+                      !op->no_backup, op->kernel_module_only,
+                      !op->no_kernel_module, op->dkms, !op->no_opengl_files,
+                      !op->no_recursion, !op->no_abi_note,
+                      op->selinux_enabled,
+                      op->selinux_chcon_type ? op->selinux_chcon_type : "",
+                      !op->skip_depmod);
+}
+
+
+/*
+ * get_install_plan_utilities() - describe the paths of the utilities
+ * that build_command_list() adds commands to run.
+ */
+
+static char *get_install_plan_utilities(Options *op)
+{
+    return nvasprintf("execstack=%s chcon=%s objcopy=%s depmod=%s",
+                      op->utils[EXECSTACK] ? op->utils[EXECSTACK] : "",
+                      op->utils[CHCON] ? op->utils[CHCON] : "",
+                      op->utils[OBJCOPY] ? op->utils[OBJCOPY] : "",
+                      op->utils[DEPMOD] ? op->utils[DEPMOD] : "");
+}
 
-    len = strlen(info.requiredString);
 
-    for (i = 0; (i + len) <= size; i++) {
-        if ((strncmp(&file[i], info.requiredString, len) == 0) &&
-            (((i + len) == size) || (file[i+len] == '\0'))) {
-            ret = FALSE;
-            break;
-        }
-    }
+/*
+ * find_install_plan_entry() - return the index of the package entry
+ * whose file is 'file', or -1; the search starts at '*hint', since the
+ * commands for the entries are built in the order of the entries.
+ */
 
-    /* fall through to cleanup */
+static int find_install_plan_entry(const Package *p, const char *file,
+                                   int *hint)
+{
+    int i, n;
 
- cleanup:
+    if (!file || p->num_entries == 0) return -1;
 
-    if (file != MAP_FAILED) {
-        munmap(file, size);
+    for (n = 0; n < p->num_entries; n++) {
+        i = (*hint + n) % p->num_entries;
+        if (p->entries[i].file && strcmp(p->entries[i].file, file) == 0) {
+            *hint = i;
+            return i;
+        }
     }
 
-    if (fd != -1) {
-        close(fd);
-    }
+    return -1;
+}
 
-    return ret;
 
-} /* ignore_conflicting_file() */
+static char *get_parent_directory(const char *path)
+{
+    char *tmp = nvstrdup(path), *dir;
 
+    dir = nvstrdup(dirname(tmp));
+    nvfree(tmp);
 
+    return dir;
+}
 
 
 /*
- * find_conflicting_files() - search for any conflicting
- * files in all the specified paths within the hierarchy under
- * the given prefix.
+ * get_install_plan_paths() - build the sorted list of paths to
+ * fingerprint for the command list 'c': the directories searched for
+ * conflicting files, the directories that files are installed into, and
+ * the files to be backed up or deleted.
  */
 
-static void find_conflicting_files(Options *op,
-                                   char *path,
-                                   ConflictingFileInfo *files,
-                                   FileList *l,
-                                   const NoRecursionDirectory *skipdirs)
+static char **get_install_plan_paths(const Package *p, const CommandList *c,
+                                     int *num)
 {
-    int i;
-    char *paths[2];
-    FTS *fts;
-    FTSENT *ent;
-
-    paths[0] = path; /* search root */
-    paths[1] = NULL;
-
-    fts = fts_open(paths, FTS_LOGICAL | FTS_NOSTAT, NULL);
-    if (!fts) return;
-
-    while ((ent = fts_read(fts)) != NULL) {
-        switch (ent->fts_info) {
-        case FTS_F:
-        case FTS_SLNONE:
-            for (i = 0; files[i].name; i++) {
-                /* end compare at len e.g. so "libGL." matches "libGL.so.1" */
-                if (!strncmp(ent->fts_name, files[i].name, files[i].len) &&
-                    !ignore_conflicting_file(op, ent->fts_path,
-                                             files[i])) {
-                    add_file_to_list(NULL, ent->fts_path, l);
-                }
-            }
-            break;
+    char **paths;
+    int i, j, n, hint = 0;
 
-        case FTS_DP:
-        case FTS_D:
-            if (op->no_recursion) {
-                fts_set(fts, ent, FTS_SKIP);
-            } else if (skipdirs) {
-                const NoRecursionDirectory *dir;
-                for (dir = skipdirs; dir->name; dir++) {
-                    if ((dir->level < 0 || dir->level >= ent->fts_level) &&
-                        strcmp(ent->fts_name, dir->name) == 0) {
-                        fts_set(fts, ent, FTS_SKIP);
-                    }
-                }
+    pthread_mutex_lock(&searched_directories.lock);
+
+    paths = nvalloc((searched_directories.num + c->num + 1) *
+                    sizeof(char *));
+
+    for (n = 0; n < searched_directories.num; n++) {
+        paths[n] = nvstrdup(searched_directories.paths[n]);
+    }
+
+    pthread_mutex_unlock(&searched_directories.lock);
+
+    for (i = 0; i < c->num; i++) {
+        const Command *cmd = &c->cmds[i];
+
+        switch (cmd->cmd) {
+          case INSTALL_CMD:
+            paths[n++] = get_parent_directory(cmd->s1);
+            break;
+          case SYMLINK_CMD:
+            paths[n++] = get_parent_directory(cmd->s0);
+            break;
+          case BACKUP_CMD:
+            paths[n++] = nvstrdup(cmd->s0);
+            break;
+          case DELETE_CMD:
+            /* generated files are deleted after they are installed */
+            if (find_install_plan_entry(p, cmd->s0, &hint) < 0) {
+                paths[n++] = nvstrdup(cmd->s0);
             }
             break;
-
-        default:
-            /*
-             * we only care about regular files, symbolic links
-             * and directories; traversing the hierarchy logically
-             * to simplify handling of paths with symbolic links
-             * to directories, we only need to handle broken links
-             * and, if recursion was not disabled, directories.
-             */
+          default:
             break;
         }
     }
 
-    fts_close(fts);
+    qsort(paths, n, sizeof(char *), compare_paths);
 
-} /* find_conflicting_files() */
+    for (i = j = 0; i < n; i++) {
+        if (j > 0 && strcmp(paths[j - 1], paths[i]) == 0) {
+            nvfree(paths[i]);
+        } else {
+            paths[j++] = paths[i];
+        }
+    }
 
-void get_conflicting_file_info(const char *file, ConflictingFileInfo *cfi)
-{
-    char *c;
+    *num = j;
 
-    cfi->name = file;
+    return paths;
+}
 
-    /*
-     * match the names of DSOs with "libfoo.so*" by stopping any comparisons
-     * after ".so".
-     */
 
-    c = strstr(file, ".so.");
-    if (c) {
-        cfi->len = (c - file) + 3;
+static void write_install_plan_string(FILE *file, const char *str)
+{
+    if (str) {
+        fprintf(file, " %zu:%s", strlen(str), str);
     } else {
-        cfi->len = strlen(file);
+        fputs(" -", file);
     }
+}
 
-    /*
-     * XXX avoid conflicting with libglx.so if it doesn't include the string
-     * "glxModuleData" to avoid removing the wrong libglx.so (bug 489316)
-     */
 
-    if (strncmp(file, "libglx.so", cfi->len) == 0) {
-        cfi->requiredString = "glxModuleData";
-    } else {
-        cfi->requiredString = NULL;
-    }
-}
+/*
+ * export_install_plan() - write the command list 'c', built for the
+ * package 'p', to the install plan 'op->export_install_plan'.  The plan
+ * is written under a temporary name and renamed into place.
+ */
 
-ConflictingFileInfo *build_conflicting_file_list(Options *op, Package *p)
+int export_install_plan(Options *op, Package *p, CommandList *c)
 {
-    ConflictingFileInfo *cfList = NULL;
-    int index = 0;
-    int i;
+    InstallPlanFingerprint fp;
+    FILE *file = NULL;
+    char *tmpname, *options, *utilities, **paths;
+    int i, fd, num_paths, hint = 0, ret = FALSE;
+
+    tmpname = nvstrcat(op->export_install_plan, ".XXXXXX", NULL);
+    options = get_install_plan_options(op);
+    utilities = get_install_plan_utilities(op);
+    paths = get_install_plan_paths(p, c, &num_paths);
+
+    fd = mkstemp(tmpname);
+    if (fd == -1 || !(file = fdopen(fd, "w"))) {
+        ui_error(op, "Unable to create install plan '%s' (%s).",
+                 op->export_install_plan, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            unlink(tmpname);
+        }
+        goto done;
+    }
 
-    // Allocate enough space for the whole file list, plus two extra files and
-    // a NULL at the end.
-    cfList = nvalloc((p->num_entries + 3) * sizeof(ConflictingFileInfo));
-    /* let's just return an empty list!  */
-    return cfList;
+    fprintf(file, "%s\n", INSTALL_PLAN_HEADER);
+
+    fputs("version", file);
+    write_install_plan_string(file, p->version);
+    fputs("\noptions", file);
+    write_install_plan_string(file, options);
+    fputs("\nutilities", file);
+    write_install_plan_string(file, utilities);
 
+    fprintf(file, "\nentries %d\n", p->num_entries);
     for (i = 0; i < p->num_entries; i++) {
-        PackageEntry *entry = &p->entries[i];
-        if (entry->caps.is_shared_lib && entry->caps.is_conflicting) {
-            get_conflicting_file_info(entry->name, &cfList[index++]);
+        fprintf(file, "E %d", p->entries[i].type);
+        write_install_plan_string(file, p->entries[i].name);
+        write_install_plan_string(file, p->entries[i].dst);
+        fputc('\n', file);
+    }
+
+    fprintf(file, "fingerprints %d\n", num_paths);
+    for (i = 0; i < num_paths; i++) {
+        get_install_plan_fingerprint(paths[i], &fp);
+        fprintf(file, "F %c %lld %ld %lld", fp.kind, fp.sec, fp.nsec,
+                fp.size);
+        write_install_plan_string(file, paths[i]);
+        fputc('\n', file);
+    }
+
+    fprintf(file, "commands %d\n", c->num);
+    for (i = 0; i < c->num; i++) {
+        const Command *cmd = &c->cmds[i];
+        int entry = -1;
+
+        if (cmd->cmd == INSTALL_CMD || cmd->cmd == DELETE_CMD) {
+            entry = find_install_plan_entry(p, cmd->s0, &hint);
         }
+
+        fprintf(file, "C %d %o %d", cmd->cmd, (unsigned int) cmd->mode,
+                entry);
+        write_install_plan_string(file, cmd->s0);
+        write_install_plan_string(file, cmd->s1);
+        write_install_plan_string(file, cmd->s2);
+        fputc('\n', file);
     }
 
-    /* XXX always conflict with these files if OpenGL files will be installed
-     * libGLwrapper.so: this library has an SONAME of libGL.so.1 (bug 74761) */
-    if (!op->no_opengl_files) {
-        get_conflicting_file_info("libGLwrapper.so", &cfList[index++]);
+    fputs("end\n", file);
+
+    if (ferror(file) | (fclose(file) != 0)) {
+        ui_error(op, "Error while writing install plan '%s' (%s).",
+                 op->export_install_plan, strerror(errno));
+        unlink(tmpname);
+        goto done;
     }
 
-    /* terminate the conflicting files list */
-    cfList[index].name = NULL;
+    if (rename(tmpname, op->export_install_plan) == -1) {
+        ui_error(op, "Unable to rename '%s' to '%s' (%s).",
+                 tmpname, op->export_install_plan, strerror(errno));
+        unlink(tmpname);
+        goto done;
+    }
 
-    return cfList;
+    ui_log(op, "Wrote install plan '%s' (%d commands, %d fingerprints).",
+           op->export_install_plan, c->num, num_paths);
+
+    ret = TRUE;
+
+ done:
+    for (i = 0; i < num_paths; i++) {
+        nvfree(paths[i]);
+    }
+    nvfree(paths);
+    nvfree(utilities);
+    nvfree(options);
+    nvfree(tmpname);
+
+    return ret;
 }
 
 
+static int read_install_plan_keyword(FILE *file, const char *keyword)
+{
+    char word[16];
+
+    return fscanf(file, " %15s", word) == 1 && strcmp(word, keyword) == 0;
+}
+
 
 /*
- * condense_file_list() - Take a FileList stucture and delete any
- * duplicate entries in the list.  This is a pretty brain dead
- * brute-force algorithm.
+ * read_install_plan_string() - read a string written by
+ * write_install_plan_string(); '*str' is set to NULL for "-".
  */
 
-static void condense_file_list(Package *p, FileList *l)
+static int read_install_plan_string(FILE *file, char **str)
 {
-    char **s = NULL;
-    int n = 0, i, j, keep;
+    size_t len;
+    int ch;
 
-    struct stat stat_buf, *stat_bufs;
+    *str = NULL;
 
-    /* allocate enough space in our temporary 'stat' array */
+    if ((ch = getc(file)) != ' ') return FALSE;
 
-    if (l->num) {
-        stat_bufs  = nvalloc(sizeof(struct stat) * l->num);
-    } else {
-        stat_bufs  = NULL;
+    ch = getc(file);
+    if (ch == '-') return TRUE;
+    if (ch < '0' || ch > '9') return FALSE;
+    ungetc(ch, file);
+
+    if (fscanf(file, "%zu", &len) != 1 || getc(file) != ':' ||
+        len > INSTALL_PLAN_MAX_STRING) {
+        return FALSE;
     }
-    
-    /*
-     * walk through our original (uncondensed) list of files and move
-     * unique files to a new (condensed) list.  For each file in the
-     * original list, get the filesystem information for the file, and
-     * then compare that to the filesystem information for all the
-     * files in the new list.  If the file from the original list does
-     * not match any file in the new list, add it to the new list.
-     */
 
-    for (i = 0; i < l->num; i++) {
-        keep = TRUE;
+    *str = nvalloc(len + 1);
 
-        if (lstat(l->filename[i], &stat_buf) == -1)
-            continue;
+    if (fread(*str, 1, len, file) != len) {
+        nvfree(*str);
+        *str = NULL;
+        return FALSE;
+    }
 
-        /*
-         * check if this file is in the package we're trying to
-         * install; we don't want to remove files that are in the
-         * package; symlinks may have tricked us into looking for
-         * conflicting files inside our unpacked .run file.
-         */
+    return TRUE;
+}
 
-        for (j = 0; j < p->num_entries; j++) {
-            if ((p->entries[j].device == stat_buf.st_dev) &&
-                (p->entries[j].inode == stat_buf.st_ino)) {
-                keep = FALSE;
-                break;
-            }
-        }
 
-        for (j = 0; keep && (j < n); j++) {
+static int strings_match(const char *a, const char *b)
+{
+    if (!a || !b) return a == b;
 
-            /*
-             * determine if the two files are the same by comparing
-             * device and inode
-             */
+    return strcmp(a, b) == 0;
+}
 
-            if ((stat_buf.st_dev == stat_bufs[j].st_dev) &&
-                (stat_buf.st_ino == stat_bufs[j].st_ino)) {
-                keep = FALSE;
-                break;
-            }
-        }
 
-        if (keep) {
-            s = (char **) nvrealloc(s, sizeof(char *) * (n + 1));
-            s[n] = nvstrdup(l->filename[i]);
-            stat_bufs[n] = stat_buf;
-            n++;
-        }
+/*
+ * check_imported_command() - apply to a command read from an install
+ * plan the checks that build_command_list() applies to the conflicting
+ * files that it finds: with --kernel-module-only, none may be part of
+ * the existing installation, and when reinstalling in place, those that
+ * are part of the installation being reinstalled are left alone.
+ * Returns FALSE, with '*reason' set, if the plan cannot be used;
+ * otherwise, '*skip' is set if the command should be left out.
+ */
+
+static int check_imported_command(Options *op, int type, int entry,
+                                  char *s0, int *skip, char **reason)
+{
+    *skip = FALSE;
+
+    /* generated files are deleted by commands with an entry */
+
+    if ((type != BACKUP_CMD && type != DELETE_CMD) || entry >= 0) {
+        return TRUE;
     }
-    
-    if (stat_bufs) nvfree((void *)stat_bufs);
 
-    for (i = 0; i < l->num; i++) free(l->filename[i]);
-    free(l->filename);
+    if (!s0) {
+        *reason = nvstrdup("the plan is not in a known format");
+        return FALSE;
+    }
 
-    l->filename = s;
-    l->num = n;
+    if (op->kernel_module_only && find_installed_file(op, s0)) {
+        *reason = nvasprintf("'%s' is now part of the existing driver "
+                             "installation", s0);
+        return FALSE;
+    }
 
-} /* condense_file_list() */
+    if (delta_reinstall_active() && is_delta_reinstalled_file(s0)) {
+        *skip = TRUE;
+    }
 
+    return TRUE;
+}
 
 
 /*
- * add_command() - grow the commandlist and append the new command,
- * parsing the variable argument list.
+ * import_install_plan() - read the install plan 'op->install_plan' and
+ * return its command list, if it is valid for the package 'p' on this
+ * system.  Otherwise, warn and return NULL, so that the caller builds
+ * the command list with build_command_list().
  */
 
-static void add_command(CommandList *c, int cmd, ...)
+CommandList *import_install_plan(Options *op, Package *p)
 {
-    int n = c->num;
-    char *s;
-    va_list ap;
-    
-    c->cmds = (Command *) nvrealloc(c->cmds, sizeof(Command) * (n + 1));
- 
-    c->cmds[n].cmd  = cmd;
-    c->cmds[n].s0   = NULL;
-    c->cmds[n].s1   = NULL;
-    c->cmds[n].s2   = NULL;
-    c->cmds[n].mode = 0x0;
-    
-    va_start(ap, cmd);
+    InstallPlanFingerprint fp, cur;
+    CommandList *c = NULL;
+    FILE *file;
+    char *reason = NULL;
+    char line[sizeof(INSTALL_PLAN_HEADER) + 1], *options = NULL;
+    char *utilities = NULL;
+    char *s0 = NULL, *s1 = NULL, *s2 = NULL, **paths = NULL;
+    unsigned int mode;
+    int i, n, type, entry, skip, num_paths = 0;
+
+    file = fopen(op->install_plan, "r");
+    if (!file) {
+        ui_warn(op, "Unable to open install plan '%s' (%s); searching for "
+                "conflicting files instead.", op->install_plan,
+                strerror(errno));
+        return NULL;
+    }
 
-    switch (cmd) {
-      case INSTALL_CMD:
-        s = va_arg(ap, char *);
-        c->cmds[n].s0 = nvstrdup(s);
-        s = va_arg(ap, char *);
-        c->cmds[n].s1 = nvstrdup(s);
-        s = va_arg(ap, char *);
-        c->cmds[n].s2 = nvstrdup(s);
-        c->cmds[n].mode = va_arg(ap, mode_t);
-        break;
-      case BACKUP_CMD:
-        s = va_arg(ap, char *);
-        c->cmds[n].s0 = nvstrdup(s);
-        break;
-      case RUN_CMD:
-        s = va_arg(ap, char *);
-        c->cmds[n].s0 = nvstrdup(s);
-        break;
-      case SYMLINK_CMD:
-        s = va_arg(ap, char *);
-        c->cmds[n].s0 = nvstrdup(s);
-        s = va_arg(ap, char *);
-        c->cmds[n].s1 = nvstrdup(s);
-        break;
-      case DELETE_CMD:
-        s = va_arg(ap, char *);
-        c->cmds[n].s0 = nvstrdup(s);
-        break;
-      default:
-        break;
+    c = nvalloc(sizeof(CommandList));
+    c->strings = new_string_table();
+
+    if (!fgets(line, sizeof(line), file) ||
+        strcmp(line, INSTALL_PLAN_HEADER "\n") != 0) {
+        goto mismatch;
     }
 
-    va_end(ap);
+    /* the driver version and options */
 
-    c->num++;
+    if (!read_install_plan_keyword(file, "version") ||
+        !read_install_plan_string(file, &s0) ||
+        !read_install_plan_keyword(file, "options") ||
+        !read_install_plan_string(file, &s1) ||
+        !read_install_plan_keyword(file, "utilities") ||
+        !read_install_plan_string(file, &s2)) {
+        goto mismatch;
+    }
 
-} /* add_command() */
+    options = get_install_plan_options(op);
+    utilities = get_install_plan_utilities(op);
 
+    if (!strings_match(s0, p->version)) {
+        reason = nvstrdup("it was written for a different driver version");
+        goto mismatch;
+    }
+    if (!strings_match(s1, options)) {
+        reason = nvstrdup("it was written with different installation options");
+        goto mismatch;
+    }
+    if (!strings_match(s2, utilities)) {
+        reason = nvstrdup("it was written for different utilities");
+        goto mismatch;
+    }
+    if (op->kernel_module_only && dkms_module_installed(op, p->version)) {
+        reason = nvasprintf("a DKMS kernel module with version %s is now "
+                            "installed", p->version);
+        goto mismatch;
+    }
 
+    /* the package entries */
 
-/*
- * add_file_to_list() - concatenate the given directory and filename,
- * appending to the FileList structure.  If the 'directory' parameter
- * is NULL, then just append the filename to the FileList.
- */
+    if (!read_install_plan_keyword(file, "entries") ||
+        fscanf(file, "%d", &n) != 1) {
+        goto mismatch;
+    }
 
-static void add_file_to_list(const char *directory,
-                             const char *filename, FileList *l)
-{
-    int len, n = l->num;
-    
-    l->filename = (char **) nvrealloc(l->filename, sizeof(char *) * (n + 1));
+    if (n != p->num_entries) {
+        reason = nvstrdup("it was written for a different set of files");
+        goto mismatch;
+    }
 
-    if (directory) {
-        len = strlen(filename) + strlen(directory) + 2;
-        l->filename[n] = (char *) nvalloc(len);
-        snprintf(l->filename[n], len, "%s/%s", directory, filename);
-    } else {
-        l->filename[n] = nvstrdup(filename);
+    for (i = 0; i < n; i++) {
+        nvfree(s0);
+        nvfree(s1);
+        if (!read_install_plan_keyword(file, "E") ||
+            fscanf(file, "%d", &type) != 1 ||
+            !read_install_plan_string(file, &s0) ||
+            !read_install_plan_string(file, &s1)) {
+            goto mismatch;
+        }
+        if (type != p->entries[i].type ||
+            !strings_match(s0, p->entries[i].name) ||
+            !strings_match(s1, p->entries[i].dst)) {
+            reason = nvstrdup("it was written for a different set of files");
+            goto mismatch;
+        }
     }
-    l->num++;
 
-} /* add_file_to_list() */
+    /* the fingerprints */
 
+    if (!read_install_plan_keyword(file, "fingerprints") ||
+        fscanf(file, "%d", &num_paths) != 1 || num_paths < 0) {
+        num_paths = 0;
+        goto mismatch;
+    }
 
-static void append_to_rpm_file_list(Options *op, Command *c)
-{
-    FILE *file;
+    paths = nvalloc((num_paths + 1) * sizeof(char *));
 
-    if (!op->rpm_file_list) return;
+    for (i = 0; i < num_paths; i++) {
+        if (!read_install_plan_keyword(file, "F") ||
+            fscanf(file, " %c %lld %ld %lld", &fp.kind, &fp.sec, &fp.nsec,
+                   &fp.size) != 4 ||
+            !read_install_plan_string(file, &paths[i]) || !paths[i]) {
+            goto mismatch;
+        }
+
+        get_install_plan_fingerprint(paths[i], &cur);
+
+        if (fp.kind != cur.kind || fp.sec != cur.sec ||
+            fp.nsec != cur.nsec || fp.size != cur.size) {
+            reason = nvasprintf("'%s' has changed", paths[i]);
+            goto mismatch;
+        }
+    }
+
+    /* the commands */
+
+    if (!read_install_plan_keyword(file, "commands") ||
+        fscanf(file, "%d", &n) != 1) {
+        goto mismatch;
+    }
+
+    for (i = 0; i < n; i++) {
+        nvfree(s0);
+        nvfree(s1);
+        nvfree(s2);
+        s0 = s1 = s2 = NULL;
+
+        if (!read_install_plan_keyword(file, "C") ||
+            fscanf(file, "%d %o %d", &type, &mode, &entry) != 3 ||
+            type < INSTALL_CMD || type > DELETE_CMD ||
+            entry < -1 || entry >= p->num_entries ||
+            !read_install_plan_string(file, &s0) ||
+            !read_install_plan_string(file, &s1) ||
+            !read_install_plan_string(file, &s2)) {
+            goto mismatch;
+        }
+
+        if (!check_imported_command(op, type, entry, s0, &skip, &reason)) {
+            goto mismatch;
+        }
+        if (skip) continue;
+
+        /* each command's arguments are consumed according to its type */
+
+        add_command(c, type,
+                    entry >= 0 ? p->entries[entry].file : s0,
+                    s1, s2, (mode_t) mode);
+    }
+
+    if (!read_install_plan_keyword(file, "end")) goto mismatch;
+
+    fclose(file);
+
+    /* an install plan exported from this one fingerprints the same paths */
+
+    for (i = 0; i < num_paths; i++) {
+        if (op->export_install_plan) {
+            add_searched_directory(paths[i]);
+        }
+        nvfree(paths[i]);
+    }
+    nvfree(paths);
+    nvfree(utilities);
+    nvfree(options);
+    nvfree(s0);
+    nvfree(s1);
+    nvfree(s2);
+
+    ui_log(op, "Using install plan '%s' (%d commands).", op->install_plan,
+           c->num);
+
+    return c;
+
+ mismatch:
+    ui_warn(op, "Not using install plan '%s': %s.  Searching for "
+            "conflicting files instead.", op->install_plan,
+            reason ? reason : "the plan is not in a known format");
+    nvfree(reason);
 
-    file = fopen(op->rpm_file_list, "a");
-    fprintf(file, "%%attr (%04o, root, root) %s\n", c->mode, c->s1);
     fclose(file);
+
+    for (i = 0; i < num_paths; i++) {
+        nvfree(paths[i]);
+    }
+    nvfree(paths);
+    nvfree(utilities);
+    nvfree(options);
+    nvfree(s0);
+    nvfree(s1);
+    nvfree(s2);
+    free_command_list(op, c);
+
+    return NULL;
 }
@@ -26,8 +26,14 @@
  * operations to perform to do an install.  The semantics of the s0,
  * s1, and mode fields vary, depending upon the value of the cmd field
  * (see the constants below).
+ *
+ * The strings of all the commands in a CommandList are interned in the
+ * list's StringTable, and are released together with the list by
+ * free_command_list().
  */
 
+typedef struct __string_table StringTable;
+
 typedef struct {
     int cmd;
     char *s0;
@@ -38,17 +44,22 @@ typedef struct {
 
 typedef struct {
     int num;
+    int capacity;
     Command *cmds;
+    StringTable *strings;
 } CommandList;
 
 
 /*
- * structure for storing a list of filenames.
+ * structure for storing a list of filenames; the filenames are interned
+ * in the given StringTable, which is not owned by the FileList.
  */
 
 typedef struct {
     int num;
+    int capacity;
     char **filename;
+    StringTable *strings;
 } FileList;
 
 
@@ -79,5 +90,7 @@ typedef struct {
 CommandList *build_command_list(Options*, Package *);
 void free_command_list(Options*, CommandList*);
 int execute_command_list(Options*, CommandList*, const char*, const char*);
+int export_install_plan(Options*, Package*, CommandList*);
+CommandList *import_install_plan(Options*, Package*);
 
 #endif /* __NVIDIA_INSTALLER_COMMAND_LIST_H__ */
@@ -39,11 +39,15 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "nvidia-installer.h"
 #include "user-interface.h"
 #include "misc.h"
 #include "crc.h"
+#include "digest.h"
 
 #define BIT(x) (1 << (x))
 #define CRC_GEN_MASK (BIT(26) | BIT(23) | BIT(22) | BIT(16) | BIT(12) | \
@@ -51,6 +55,33 @@
                       BIT(4)  | BIT(2)  | BIT(1)  | BIT(0))
 
 
+/*
+ * The checksum is computed by one of several engines, all of which
+ * produce bit-identical results (they must: checksums are stored in the
+ * backup log and compared against by later installer runs).  The
+ * engines differ only in how much of the message they consume per
+ * step:
+ *
+ *  - the classic bytewise table lookup (one byte per step);
+ *  - "slicing-by-8" and "slicing-by-16", which use 8 or 16 tables so
+ *    that 8 or 16 bytes can be consumed per step with independent
+ *    lookups;
+ *  - carry-less multiplication folding (PCLMULQDQ on x86_64, PMULL on
+ *    aarch64), which folds 64 bytes per step; see "Fast CRC Computation
+ *    for Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009).
+ *
+ * The engine is selected once, at runtime, based on the capabilities of
+ * the CPU we are running on.
+ */
+
+typedef uint32 (*CrcUpdateFunc)(uint32 crc, const uint8 *buf, size_t len);
+
+#define CRC_NUM_SLICES 16
+
+static uint32 crctab[CRC_NUM_SLICES][256];
+static CrcUpdateFunc crc_update_func = NULL;
+
+
 static uint32 crc_init(uint32 crc)
 {
     int i;
@@ -69,34 +100,1052 @@ static uint32 crc_init(uint32 crc)
 
 
 
+/*
+ * crc_update_bytewise() - the original one-byte-at-a-time algorithm;
+ * crctab[0] is the table used by every other engine as well.
+ */
+
+static uint32 crc_update_bytewise(uint32 cword, const uint8 *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        cword = crctab[0][buf[i] ^ (cword >> 24)] ^ (cword << 8);
+    }
+
+    return cword;
+}
+
+
+
+/*
+ * crc_update_sliced() - slicing-by-16, then slicing-by-8, then bytewise
+ * for whatever is left.  crctab[k][b] is the contribution of byte 'b'
+ * followed by 'k' zero bytes; since the CRC register is only 4 bytes
+ * wide, it is entirely consumed by the first 4 bytes of each slice and
+ * the remaining lookups are independent of each other.
+ */
+
+static uint32 crc_update_sliced(uint32 cword, const uint8 *buf, size_t len)
+{
+    while (len >= 16) {
+        cword = crctab[15][buf[0]  ^ (cword >> 24)] ^
+                crctab[14][buf[1]  ^ ((cword >> 16) & 0xff)] ^
+                crctab[13][buf[2]  ^ ((cword >> 8) & 0xff)] ^
+                crctab[12][buf[3]  ^ (cword & 0xff)] ^
+                crctab[11][buf[4]]  ^ crctab[10][buf[5]]  ^
+                crctab[9][buf[6]]   ^ crctab[8][buf[7]]   ^
+                crctab[7][buf[8]]   ^ crctab[6][buf[9]]   ^
+                crctab[5][buf[10]]  ^ crctab[4][buf[11]]  ^
+                crctab[3][buf[12]]  ^ crctab[2][buf[13]]  ^
+                crctab[1][buf[14]]  ^ crctab[0][buf[15]];
+        buf += 16;
+        len -= 16;
+    }
+
+    if (len >= 8) {
+        cword = crctab[7][buf[0] ^ (cword >> 24)] ^
+                crctab[6][buf[1] ^ ((cword >> 16) & 0xff)] ^
+                crctab[5][buf[2] ^ ((cword >> 8) & 0xff)] ^
+                crctab[4][buf[3] ^ (cword & 0xff)] ^
+                crctab[3][buf[4]] ^ crctab[2][buf[5]] ^
+                crctab[1][buf[6]] ^ crctab[0][buf[7]];
+        buf += 8;
+        len -= 8;
+    }
+
+    return crc_update_bytewise(cword, buf, len);
+}
+
+
+
+/*
+ * xn_mod_p() - compute x^n mod P, where P is the generator polynomial;
+ * used to derive the folding constants for the carry-less
+ * multiplication engines.
+ */
+
+static uint32 xn_mod_p(int n)
+{
+    uint32 r = 1;
+
+    while (n-- > 0) {
+        r = (r & 0x80000000) ? ((r << 1) ^ CRC_GEN_MASK) : (r << 1);
+    }
+
+    return r;
+}
+
+
+/*
+ * Folding constants: a 128-bit accumulator A = H * x^64 + L is advanced
+ * by 'd' bits with H * (x^(d+64) mod P) + L * (x^d mod P), which is
+ * congruent to A * x^d modulo P and still fits in 128 bits.
+ */
+
+static uint64_t fold128_hi, fold128_lo, fold512_hi, fold512_lo;
+
+static void init_fold_constants(void)
+{
+    fold128_hi = xn_mod_p(128 + 64);
+    fold128_lo = xn_mod_p(128);
+    fold512_hi = xn_mod_p(512 + 64);
+    fold512_lo = xn_mod_p(512);
+}
+
+
+/*
+ * The folding engines treat each 16 byte block as a big endian 128-bit
+ * polynomial, fold the message down into a single 128-bit remainder,
+ * and then hand that remainder (and any trailing bytes) to the table
+ * driven engine, which reduces it modulo P.  Feeding the CRC register
+ * into the first 4 bytes of the message is equivalent to starting the
+ * table driven engine with that register value.
+ */
+
+#define CRC_FOLD_MIN_LEN 64
+
+#if defined(NV_X86_64)
+
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+
+#define CRC_TARGET_CLMUL __attribute__((target("pclmul,ssse3")))
+
+CRC_TARGET_CLMUL
+static inline __m128i clmul_load(const uint8 *buf, __m128i bswap)
+{
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) buf), bswap);
+}
+
+CRC_TARGET_CLMUL
+static inline __m128i clmul_fold(__m128i a, __m128i k, __m128i next)
+{
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x11),
+                                       _mm_clmulepi64_si128(a, k, 0x00)),
+                         next);
+}
+
+CRC_TARGET_CLMUL
+static uint32 crc_update_clmul(uint32 cword, const uint8 *buf, size_t len)
+{
+    const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                        7, 6, 5, 4, 3, 2, 1, 0);
+    const __m128i k128 = _mm_set_epi64x(fold128_hi, fold128_lo);
+    const __m128i k512 = _mm_set_epi64x(fold512_hi, fold512_lo);
+    __m128i a0, a1, a2, a3;
+    uint8 rem[16];
+
+    if (len < CRC_FOLD_MIN_LEN) {
+        return crc_update_sliced(cword, buf, len);
+    }
+
+    a0 = _mm_xor_si128(clmul_load(buf, bswap),
+                       _mm_set_epi32((int) cword, 0, 0, 0));
+    a1 = clmul_load(buf + 16, bswap);
+    a2 = clmul_load(buf + 32, bswap);
+    a3 = clmul_load(buf + 48, bswap);
+    buf += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        a0 = clmul_fold(a0, k512, clmul_load(buf, bswap));
+        a1 = clmul_fold(a1, k512, clmul_load(buf + 16, bswap));
+        a2 = clmul_fold(a2, k512, clmul_load(buf + 32, bswap));
+        a3 = clmul_fold(a3, k512, clmul_load(buf + 48, bswap));
+        buf += 64;
+        len -= 64;
+    }
+
+    a0 = clmul_fold(a0, k128, a1);
+    a0 = clmul_fold(a0, k128, a2);
+    a0 = clmul_fold(a0, k128, a3);
+
+    while (len >= 16) {
+        a0 = clmul_fold(a0, k128, clmul_load(buf, bswap));
+        buf += 16;
+        len -= 16;
+    }
+
+    _mm_storeu_si128((__m128i *) rem, _mm_shuffle_epi8(a0, bswap));
+
+    cword = crc_update_sliced(0, rem, sizeof(rem));
+
+    return crc_update_sliced(cword, buf, len);
+}
+
+static int cpu_has_clmul(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") &&
+           __builtin_cpu_supports("ssse3");
+}
+
+#elif defined(NV_AARCH64) && defined(__ARM_FEATURE_CRYPTO)
+
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_PMULL
+#define HWCAP_PMULL (1 << 4)
+#endif
+
+static inline uint64x2_t clmul_load(const uint8 *buf)
+{
+    uint8x16_t v = vrev64q_u8(vld1q_u8(buf));
+    return vreinterpretq_u64_u8(vextq_u8(v, v, 8));
+}
+
+static inline uint64x2_t clmul_fold(uint64x2_t a, poly64_t k_hi,
+                                    poly64_t k_lo, uint64x2_t next)
+{
+    uint64x2_t hi = vreinterpretq_u64_p128(
+        vmull_p64((poly64_t) vgetq_lane_u64(a, 1), k_hi));
+    uint64x2_t lo = vreinterpretq_u64_p128(
+        vmull_p64((poly64_t) vgetq_lane_u64(a, 0), k_lo));
+
+    return veorq_u64(veorq_u64(hi, lo), next);
+}
+
+static uint32 crc_update_clmul(uint32 cword, const uint8 *buf, size_t len)
+{
+    const poly64_t k128_hi = fold128_hi, k128_lo = fold128_lo;
+    const poly64_t k512_hi = fold512_hi, k512_lo = fold512_lo;
+    uint64x2_t a0, a1, a2, a3;
+    uint8x16_t v;
+    uint8 rem[16];
+
+    if (len < CRC_FOLD_MIN_LEN) {
+        return crc_update_sliced(cword, buf, len);
+    }
+
+    a0 = veorq_u64(clmul_load(buf),
+                   vcombine_u64(vcreate_u64(0),
+                                vcreate_u64((uint64_t) cword << 32)));
+    a1 = clmul_load(buf + 16);
+    a2 = clmul_load(buf + 32);
+    a3 = clmul_load(buf + 48);
+    buf += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        a0 = clmul_fold(a0, k512_hi, k512_lo, clmul_load(buf));
+        a1 = clmul_fold(a1, k512_hi, k512_lo, clmul_load(buf + 16));
+        a2 = clmul_fold(a2, k512_hi, k512_lo, clmul_load(buf + 32));
+        a3 = clmul_fold(a3, k512_hi, k512_lo, clmul_load(buf + 48));
+        buf += 64;
+        len -= 64;
+    }
+
+    a0 = clmul_fold(a0, k128_hi, k128_lo, a1);
+    a0 = clmul_fold(a0, k128_hi, k128_lo, a2);
+    a0 = clmul_fold(a0, k128_hi, k128_lo, a3);
+
+    while (len >= 16) {
+        a0 = clmul_fold(a0, k128_hi, k128_lo, clmul_load(buf));
+        buf += 16;
+        len -= 16;
+    }
+
+    v = vrev64q_u8(vreinterpretq_u8_u64(a0));
+    vst1q_u8(rem, vextq_u8(v, v, 8));
+
+    cword = crc_update_sliced(0, rem, sizeof(rem));
+
+    return crc_update_sliced(cword, buf, len);
+}
+
+static int cpu_has_clmul(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+
+#else
+
+#define crc_update_clmul NULL
+
+static int cpu_has_clmul(void)
+{
+    return FALSE;
+}
+
+#endif
+
+
+
+/*
+ * init_crc_engine() - build the lookup tables and select the fastest
+ * engine supported by this CPU.  This must be called before any CRC is
+ * computed from more than one thread.
+ */
+
+void init_crc_engine(void)
+{
+    int i, k;
+
+    if (crc_update_func) {
+        return;
+    }
+
+    for (i = 0; i < 256; i++) {
+        crctab[0][i] = crc_init(i << 24);
+    }
+
+    for (k = 1; k < CRC_NUM_SLICES; k++) {
+        for (i = 0; i < 256; i++) {
+            uint32 prev = crctab[k - 1][i];
+            crctab[k][i] = (prev << 8) ^ crctab[0][prev >> 24];
+        }
+    }
+
+    init_fold_constants();
+
+    if (cpu_has_clmul()) {
+        crc_update_func = crc_update_clmul;
+    } else {
+        crc_update_func = crc_update_sliced;
+    }
+
+} /* init_crc_engine() */
+
+
+
+/*
+ * update_crc_from_buffer() - continue a CRC computation over 'len' more
+ * bytes; 'cword' is the value returned by the previous call, or
+ * CRC_INITIAL_VALUE when starting a new computation.
+ */
+
+uint32 update_crc_from_buffer(uint32 cword, const uint8 *buf, size_t len)
+{
+    init_crc_engine();
+
+    return crc_update_func(cword, buf, len);
+}
+
+
+
 uint32 compute_crc_from_buffer(const uint8 *buf, int len)
 {
-    uint32 cword = ~0;
-    static uint32 *crctab = NULL;
+    return update_crc_from_buffer(CRC_INITIAL_VALUE, buf, len);
+}
+
+
+
+/*
+ * gf2_multmod() - multiply the polynomials 'a' and 'b' modulo P.
+ */
+
+static uint32 gf2_multmod(uint32 a, uint32 b)
+{
+    uint32 prod = 0;
     int i;
 
-    if (!crctab) {
-        crctab = (uint32 *) nvalloc(sizeof(uint32) * 256);
-        for (i=0; i < 256; i++) {
-            crctab[i] = crc_init(i << 24);
+    for (i = 31; i >= 0; i--) {
+        prod = (prod & 0x80000000) ? ((prod << 1) ^ CRC_GEN_MASK) : (prod << 1);
+        if (a & (1U << i)) {
+            prod ^= b;
         }
     }
 
-    for (i = 0; i < len; i++) {
-        cword = crctab[buf[i] ^ (cword >> 24)] ^ (cword << 8);
+    return prod;
+}
+
+
+
+/*
+ * combine_crc() - given the CRC of a message A (computed starting from
+ * any register value), and the CRC of a message B of 'len2' bytes
+ * (computed starting from 0), return the CRC of A followed by B.  The
+ * CRC is linear, so this is just crc1 * x^(8 * len2) + crc2 mod P.
+ */
+
+uint32 combine_crc(uint32 crc1, uint32 crc2, uint64_t len2)
+{
+    uint32 xpow = 1, sq = xn_mod_p(8);
+
+    while (len2) {
+        if (len2 & 1) {
+            xpow = gf2_multmod(xpow, sq);
+        }
+        sq = gf2_multmod(sq, sq);
+        len2 >>= 1;
     }
 
-    return cword;
+    return gf2_multmod(crc1, xpow) ^ crc2;
 }
 
 
 
-uint32 compute_crc(Options *op, const char *filename)
+/*
+ * Large files are not mapped in their entirety: they are read in
+ * bounded chunks with pread(2), and each chunk is handed to a callback
+ * by a pool of worker threads.  compute_crc() uses this to checksum
+ * each chunk on its own and then merge the per-chunk CRCs with
+ * combine_crc(); other digests that can be computed piecewise use the
+ * same pool through process_file_chunks().  This bounds the memory used
+ * to CRC_CHUNK_SIZE * concurrency, and lets the checksum of a large file
+ * proceed at memory bandwidth across several cores.
+ */
+
+#define CRC_CHUNKED_MIN_SIZE (2 * CRC_CHUNK_SIZE)
+
+static int crc_concurrency_level = 1;
+
+typedef struct {
+    int fd;
+    off_t size;
+    size_t num_chunks;
+    FileChunkFunc func;
+    void *data;
+
+    pthread_mutex_t lock;
+    size_t next_chunk;
+    int error;
+} FileChunkJob;
+
+
+/*
+ * set_crc_concurrency_level() - set the maximum number of threads used
+ * to checksum a single large file.
+ */
+
+void set_crc_concurrency_level(int level)
+{
+    crc_concurrency_level = NV_MAX(level, 1);
+}
+
+
+static int read_chunk(int fd, uint8 *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t ret = pread(fd, buf, len, offset);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (ret == 0) {
+            /* the file was truncated while we were reading it */
+            return EIO;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+
+    return 0;
+}
+
+
+static void *file_chunk_worker(void *arg)
+{
+    FileChunkJob *job = arg;
+    uint8 *buf = malloc(CRC_CHUNK_SIZE);
+
+    if (!buf) {
+        pthread_mutex_lock(&job->lock);
+        if (!job->error) job->error = ENOMEM;
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+
+    while (1) {
+        size_t chunk;
+        off_t offset;
+        size_t len;
+        int err;
+
+        pthread_mutex_lock(&job->lock);
+        chunk = job->next_chunk++;
+        err = job->error;
+        pthread_mutex_unlock(&job->lock);
+
+        if (err || chunk >= job->num_chunks) break;
+
+        offset = (off_t) chunk * CRC_CHUNK_SIZE;
+        len = NV_MIN(job->size - offset, CRC_CHUNK_SIZE);
+
+        err = read_chunk(job->fd, buf, len, offset);
+        if (err) {
+            pthread_mutex_lock(&job->lock);
+            if (!job->error) job->error = err;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+
+        job->func(buf, len, chunk, job->data);
+    }
+
+    free(buf);
+
+    return NULL;
+}
+
+
+/*
+ * process_file_chunks() - call 'func' on each CRC_CHUNK_SIZE chunk of
+ * the 'size' bytes of the file open on 'fd' (the last chunk may be
+ * shorter), from up to the configured number of threads.  Chunks are
+ * processed in no particular order; 'func' is passed the chunk index so
+ * that it can store its result for the caller to merge.  Returns FALSE
+ * and sets errno on failure.
+ */
+
+int process_file_chunks(int fd, off_t size, FileChunkFunc func, void *data)
+{
+    FileChunkJob job;
+    pthread_t *threads;
+    int i, num_threads, num_started = 0;
+
+    memset(&job, 0, sizeof(job));
+    job.fd = fd;
+    job.size = size;
+    job.num_chunks = (size + CRC_CHUNK_SIZE - 1) / CRC_CHUNK_SIZE;
+    job.func = func;
+    job.data = data;
+    pthread_mutex_init(&job.lock, NULL);
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    /* the calling thread is one of the workers */
+
+    num_threads = (int) NV_MIN((size_t) crc_concurrency_level,
+                                job.num_chunks) - 1;
+    threads = nvalloc(NV_MAX(num_threads, 1) * sizeof(pthread_t));
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, file_chunk_worker, &job) != 0) {
+            break;
+        }
+        num_started++;
+    }
+
+    file_chunk_worker(&job);
+
+    for (i = 0; i < num_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    nvfree(threads);
+    pthread_mutex_destroy(&job.lock);
+
+    if (job.error) {
+        errno = job.error;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static void crc_chunk_func(const uint8 *buf, size_t len, size_t chunk,
+                           void *data)
+{
+    uint32 *chunk_crcs = data;
+
+    chunk_crcs[chunk] = update_crc_from_buffer(0, buf, len);
+}
+
+
+/*
+ * compute_crc_chunked() - checksum the 'size' bytes of the file open on
+ * 'fd', as described above.  Returns FALSE and sets errno on failure.
+ */
+
+static int compute_crc_chunked(int fd, off_t size, uint32 *crc)
+{
+    size_t num_chunks = (size + CRC_CHUNK_SIZE - 1) / CRC_CHUNK_SIZE;
+    uint32 *chunk_crcs = nvalloc(num_chunks * sizeof(uint32));
+    uint32 cword = CRC_INITIAL_VALUE;
+    size_t chunk;
+
+    /* the tables must be built before any worker can use them */
+
+    init_crc_engine();
+
+    if (!process_file_chunks(fd, size, crc_chunk_func, chunk_crcs)) {
+        nvfree(chunk_crcs);
+        return FALSE;
+    }
+
+    for (chunk = 0; chunk < num_chunks; chunk++) {
+        off_t offset = (off_t) chunk * CRC_CHUNK_SIZE;
+        cword = combine_crc(cword, chunk_crcs[chunk],
+                            NV_MIN(size - offset, CRC_CHUNK_SIZE));
+    }
+
+    nvfree(chunk_crcs);
+
+    *crc = cword;
+
+    return TRUE;
+}
+
+
+
+/*
+ * Checksum cache: compute_crc() and try_compute_digest() consult an
+ * in-memory table of previously computed checksums, keyed by the identity
+ * of the file
+ * (device, inode, size, modification and status change times).  A file
+ * whose identity has not changed is not read again.  The table can be
+ * loaded from and saved to disk with load_crc_cache() and
+ * save_crc_cache(), so that repeated runs (e.g. periodic `--sanity`
+ * checks) only need to stat(2) the installed files.
+ *
+ * Syntax for the cache file:
+ *
+ * 1. The first line is CRC_CACHE_HEADER.
+ *
+ * 2. Each following line is one entry:
+ *
+ *    <dev> <ino> <size> <mtime sec> <mtime nsec> <ctime sec> <ctime nsec> <crc> [<digest>]
+ *
+ *    where <crc> is '-' if only the digest is known, and <digest> is
+ *    the DigestType number, a ':' and the DIGEST_MAX_LEN bytes of the
+ *    digest in hexadecimal.  (digest.c's digest_to_string() is not used,
+ *    as mkprecompiled also uses this file.)  The entries of version 1 of
+ *    the cache, which only hold a CRC, are read as they are.
+ */
+
+#define CRC_CACHE_HEADER "nvidia-installer checksum cache 2"
+#define CRC_CACHE_HEADER_V1 "nvidia-installer checksum cache 1"
+#define CRC_CACHE_RACY_SECONDS 2
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    uint32 crc;
+    int has_crc;
+    Digest digest;      /* DIGEST_NONE if not known */
+    int used;
+} CrcCacheEntry;
+
+static struct {
+    CrcCacheEntry *entries;
+    size_t capacity; /* always a power of two, or 0 */
+    size_t count;
+    int enabled;
+    int dirty;
+    pthread_mutex_t lock;
+} crc_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static size_t crc_cache_hash(dev_t dev, ino_t ino)
+{
+    uint64_t h = ((uint64_t) dev * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) ino;
+
+    h *= 0xBF58476D1CE4E5B9ULL;
+
+    return (size_t) (h ^ (h >> 31));
+}
+
+
+static CrcCacheEntry *crc_cache_find_slot(dev_t dev, ino_t ino)
+{
+    size_t mask = crc_cache.capacity - 1;
+    size_t i = crc_cache_hash(dev, ino) & mask;
+
+    while (crc_cache.entries[i].used &&
+           (crc_cache.entries[i].dev != dev ||
+            crc_cache.entries[i].ino != ino)) {
+        i = (i + 1) & mask;
+    }
+
+    return &crc_cache.entries[i];
+}
+
+
+static void crc_cache_insert(const CrcCacheEntry *entry)
+{
+    CrcCacheEntry *slot;
+
+    /* keep the load factor at or below 1/2 */
+
+    if ((crc_cache.count + 1) * 2 > crc_cache.capacity) {
+        CrcCacheEntry *old = crc_cache.entries;
+        size_t i, old_capacity = crc_cache.capacity;
+
+        crc_cache.capacity = old_capacity ? old_capacity * 2 : 256;
+        crc_cache.entries = nvalloc(crc_cache.capacity * sizeof(CrcCacheEntry));
+        crc_cache.count = 0;
+
+        for (i = 0; i < old_capacity; i++) {
+            if (old[i].used) {
+                *crc_cache_find_slot(old[i].dev, old[i].ino) = old[i];
+                crc_cache.count++;
+            }
+        }
+        nvfree(old);
+    }
+
+    slot = crc_cache_find_slot(entry->dev, entry->ino);
+    if (!slot->used) {
+        crc_cache.count++;
+    }
+    *slot = *entry;
+    slot->used = TRUE;
+}
+
+
+static int timespec_equal(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+
+/*
+ * find_crc_cache_entry() - return the entry of the file described by
+ * 'stat_buf', if the file has not changed since it was cached, or NULL.
+ * Must be called with crc_cache.lock held.
+ */
+
+static CrcCacheEntry *find_crc_cache_entry(const struct stat *stat_buf)
+{
+    CrcCacheEntry *e;
+
+    if (!crc_cache.enabled || !crc_cache.count) {
+        return NULL;
+    }
+
+    e = crc_cache_find_slot(stat_buf->st_dev, stat_buf->st_ino);
+
+    if (e->used &&
+        e->size == stat_buf->st_size &&
+        timespec_equal(&e->mtime, &stat_buf->st_mtim) &&
+        timespec_equal(&e->ctime, &stat_buf->st_ctim)) {
+        return e;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * lookup_crc_cache() - if the cache holds a checksum for the file
+ * described by 'stat_buf', and the file has not changed since, return
+ * TRUE and the checksum in 'crc'.
+ */
+
+static int lookup_crc_cache(const struct stat *stat_buf, uint32 *crc)
+{
+    const CrcCacheEntry *e;
+    int found = FALSE;
+
+    pthread_mutex_lock(&crc_cache.lock);
+
+    if ((e = find_crc_cache_entry(stat_buf)) != NULL && e->has_crc) {
+        *crc = e->crc;
+        found = TRUE;
+    }
+
+    pthread_mutex_unlock(&crc_cache.lock);
+
+    return found;
+}
+
+
+/*
+ * update_crc_cache() - record the CRC 'crc' and/or the digest 'digest'
+ * of the file described by 'stat_buf', keeping the other checksum if it
+ * is already cached for the file.  Files whose status changed within the
+ * last CRC_CACHE_RACY_SECONDS seconds are not cached: on filesystems
+ * with coarse timestamps, a write racing with our read could otherwise
+ * leave the file's identity unchanged while its contents differ from the
+ * cached checksum.
+ */
+
+static void update_crc_cache(const struct stat *stat_buf, const uint32 *crc,
+                             const Digest *digest)
+{
+    CrcCacheEntry entry, *e;
+
+    if (!crc_cache.enabled ||
+        stat_buf->st_ctim.tv_sec >= time(NULL) - CRC_CACHE_RACY_SECONDS) {
+        return;
+    }
+
+    pthread_mutex_lock(&crc_cache.lock);
+
+    if ((e = find_crc_cache_entry(stat_buf)) != NULL) {
+        entry = *e;
+    } else {
+        memset(&entry, 0, sizeof(entry));
+        entry.dev = stat_buf->st_dev;
+        entry.ino = stat_buf->st_ino;
+        entry.size = stat_buf->st_size;
+        entry.mtime = stat_buf->st_mtim;
+        entry.ctime = stat_buf->st_ctim;
+    }
+
+    if (crc) {
+        entry.crc = *crc;
+        entry.has_crc = TRUE;
+    }
+    if (digest) {
+        entry.digest = *digest;
+    }
+
+    crc_cache_insert(&entry);
+    crc_cache.dirty = TRUE;
+
+    pthread_mutex_unlock(&crc_cache.lock);
+}
+
+
+static void store_crc_cache(const struct stat *stat_buf, uint32 crc)
+{
+    update_crc_cache(stat_buf, &crc, NULL);
+}
+
+
+/*
+ * lookup_cached_digest() - if the checksum cache holds a digest of type
+ * 'type' for the file described by 'stat_buf', and the file has not
+ * changed since, return TRUE and the digest in 'digest'.
+ */
+
+int lookup_cached_digest(const struct stat *stat_buf, DigestType type,
+                         Digest *digest)
+{
+    const CrcCacheEntry *e;
+    int found = FALSE;
+
+    pthread_mutex_lock(&crc_cache.lock);
+
+    if ((e = find_crc_cache_entry(stat_buf)) != NULL &&
+        e->digest.type == type) {
+        *digest = e->digest;
+        found = TRUE;
+    }
+
+    pthread_mutex_unlock(&crc_cache.lock);
+
+    return found;
+}
+
+
+/*
+ * store_cached_digest() - record the digest of the file described by
+ * 'stat_buf' in the checksum cache, alongside its CRC.
+ */
+
+void store_cached_digest(const struct stat *stat_buf, const Digest *digest)
 {
-    uint32 cword = ~0;
+    update_crc_cache(stat_buf, NULL, digest);
+}
+
+
+/*
+ * parse_cached_digest() - parse a digest as saved by save_crc_cache().
+ */
+
+static int parse_cached_digest(const char *str, Digest *digest)
+{
+    unsigned int byte;
+    int type, n, i;
+
+    if (sscanf(str, "%d:%n", &type, &n) != 1 || type == DIGEST_NONE ||
+        strlen(str + n) != 2 * DIGEST_MAX_LEN) {
+        return FALSE;
+    }
+
+    digest->type = type;
+
+    for (i = 0; i < DIGEST_MAX_LEN; i++) {
+        if (sscanf(str + n + 2 * i, "%2x", &byte) != 1) {
+            return FALSE;
+        }
+        digest->bytes[i] = byte;
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * load_crc_cache() - enable the checksum cache, and populate it from
+ * 'filename' if that file exists.  A missing or unparseable cache file
+ * simply leaves the cache empty.
+ */
+
+void load_crc_cache(Options *op, const char *filename)
+{
+    FILE *file;
+    char line[512];
+
+    pthread_mutex_lock(&crc_cache.lock);
+
+    if (crc_cache.enabled) {
+        goto done;
+    }
+
+    crc_cache.enabled = TRUE;
+
+    file = fopen(filename, "r");
+    if (!file) {
+        goto done;
+    }
+
+    if (!fgets(line, sizeof(line), file) ||
+        (strncmp(line, CRC_CACHE_HEADER, strlen(CRC_CACHE_HEADER)) != 0 &&
+         strncmp(line, CRC_CACHE_HEADER_V1,
+                 strlen(CRC_CACHE_HEADER_V1)) != 0)) {
+        ui_log(op, "Ignoring checksum cache '%s' with unknown format.",
+               filename);
+        fclose(file);
+        goto done;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        CrcCacheEntry entry;
+        unsigned long long dev, ino, size, msec, mnsec, csec, cnsec;
+        char crc[16], digest[128];
+        int n;
+
+        n = sscanf(line, "%llu %llu %llu %llu %llu %llu %llu %15s %127s",
+                   &dev, &ino, &size, &msec, &mnsec, &csec, &cnsec,
+                   crc, digest);
+        if (n < 8) {
+            continue;
+        }
+
+        memset(&entry, 0, sizeof(entry));
+
+        if (strcmp(crc, "-") != 0) {
+            entry.crc = strtoul(crc, NULL, 10);
+            entry.has_crc = TRUE;
+        }
+        if (n == 9 && !parse_cached_digest(digest, &entry.digest)) {
+            continue;
+        }
+        if (!entry.has_crc && entry.digest.type == DIGEST_NONE) {
+            continue;
+        }
+
+        entry.dev = dev;
+        entry.ino = ino;
+        entry.size = size;
+        entry.mtime.tv_sec = msec;
+        entry.mtime.tv_nsec = mnsec;
+        entry.ctime.tv_sec = csec;
+        entry.ctime.tv_nsec = cnsec;
+
+        crc_cache_insert(&entry);
+    }
+
+    fclose(file);
+
+ done:
+    pthread_mutex_unlock(&crc_cache.lock);
+}
+
+
+/*
+ * save_crc_cache() - write the checksum cache to 'filename', if it has
+ * changed since it was loaded.  The file is written under a temporary
+ * name and renamed into place, so readers never see a partial cache.
+ */
+
+int save_crc_cache(Options *op, const char *filename)
+{
+    FILE *file = NULL;
+    char *tmpname;
+    int fd, ret = FALSE;
+    size_t i;
+
+    pthread_mutex_lock(&crc_cache.lock);
+
+    if (!crc_cache.enabled || !crc_cache.dirty) {
+        pthread_mutex_unlock(&crc_cache.lock);
+        return TRUE;
+    }
+
+    tmpname = nvstrcat(filename, ".tmp", NULL);
+
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1 || !(file = fdopen(fd, "w"))) {
+        ui_log(op, "Unable to write checksum cache '%s' (%s).",
+               tmpname, strerror(errno));
+        if (fd != -1) close(fd);
+        goto done;
+    }
+
+    fprintf(file, "%s\n", CRC_CACHE_HEADER);
+
+    for (i = 0; i < crc_cache.capacity; i++) {
+        const CrcCacheEntry *e = &crc_cache.entries[i];
+        int j;
+
+        if (!e->used) continue;
+
+        fprintf(file, "%llu %llu %llu %llu %ld %llu %ld",
+                (unsigned long long) e->dev,
+                (unsigned long long) e->ino,
+                (unsigned long long) e->size,
+                (unsigned long long) e->mtime.tv_sec, e->mtime.tv_nsec,
+                (unsigned long long) e->ctime.tv_sec, e->ctime.tv_nsec);
+
+        if (e->has_crc) {
+            fprintf(file, " %" PRIu32, e->crc);
+        } else {
+            fprintf(file, " -");
+        }
+
+        if (e->digest.type != DIGEST_NONE) {
+            fprintf(file, " %d:", e->digest.type);
+            for (j = 0; j < DIGEST_MAX_LEN; j++) {
+                fprintf(file, "%02x", e->digest.bytes[j]);
+            }
+        }
+
+        fprintf(file, "\n");
+    }
+
+    if (fclose(file) != 0) {
+        ui_log(op, "Error while closing checksum cache '%s' (%s).",
+               tmpname, strerror(errno));
+        unlink(tmpname);
+        goto done;
+    }
+
+    if (rename(tmpname, filename) == -1) {
+        ui_log(op, "Unable to rename '%s' to '%s' (%s).",
+               tmpname, filename, strerror(errno));
+        unlink(tmpname);
+        goto done;
+    }
+
+    crc_cache.dirty = FALSE;
+    ret = TRUE;
+
+ done:
+    pthread_mutex_unlock(&crc_cache.lock);
+    nvfree(tmpname);
+
+    return ret;
+}
+
+
+
+/*
+ * try_compute_crc() - compute the CRC of the specified file, without
+ * reporting failures: returns FALSE, with errno set, if the file could
+ * not be read.  Safe to call from several threads at once, provided
+ * that init_crc_engine() has been called first.
+ */
+
+int try_compute_crc(const char *filename, uint32 *crc)
+{
+    uint32 cword = CRC_INITIAL_VALUE;
     uint8 *buf = MAP_FAILED;
     int success = FALSE;
-    int fd;
+    int fd, err = 0;
     struct stat stat_buf;
     size_t len = 0;
 
@@ -108,28 +1157,57 @@ uint32 compute_crc(Options *op, const char *filename)
         success = TRUE;
         goto done;
     }
-    len = stat_buf.st_size;
 
-    buf = mmap(0, len, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
-    if (buf == MAP_FAILED) goto done;
+    if (lookup_crc_cache(&stat_buf, &cword)) {
+        success = TRUE;
+        goto done;
+    }
 
-    cword = compute_crc_from_buffer(buf, len);
+    if (stat_buf.st_size >= CRC_CHUNKED_MIN_SIZE) {
+        success = compute_crc_chunked(fd, stat_buf.st_size, &cword);
+    } else {
+        len = stat_buf.st_size;
 
-    success = TRUE;
+        buf = mmap(0, len, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+        if (buf == MAP_FAILED) goto done;
 
- done:
-    if (!success) {
-        ui_warn(op, "Unable to compute CRC for file '%s' (%s).",
-                filename, strerror(errno));
+        cword = update_crc_from_buffer(CRC_INITIAL_VALUE, buf, len);
+
+        success = TRUE;
     }
 
+    if (success) {
+        store_crc_cache(&stat_buf, cword);
+    }
+
+ done:
+    err = errno;
+
     if (buf != MAP_FAILED) {
         munmap(buf, len);
     }
     if (fd >= 0) {
         close(fd);
     }
-    
+
+    *crc = cword;
+    errno = err;
+
+    return success;
+
+} /* try_compute_crc() */
+
+
+
+uint32 compute_crc(Options *op, const char *filename)
+{
+    uint32 cword;
+
+    if (!try_compute_crc(filename, &cword)) {
+        ui_warn(op, "Unable to compute CRC for file '%s' (%s).",
+                filename, strerror(errno));
+    }
+
     return cword;
-        
+
 } /* compute_crc() */
@@ -21,7 +21,21 @@
 #ifndef __NVIDIA_INSTALLER_CRC_H__
 #define __NVIDIA_INSTALLER_CRC_H__
 
+#define CRC_INITIAL_VALUE ((uint32) ~0)
+#define CRC_CHUNK_SIZE (4 * 1024 * 1024)
+
+typedef void (*FileChunkFunc)(const uint8 *buf, size_t len, size_t chunk,
+                              void *data);
+
+void init_crc_engine(void);
+uint32 update_crc_from_buffer(uint32 crc, const uint8 *buf, size_t len);
 uint32 compute_crc_from_buffer(const uint8 *buf, int len);
+uint32 combine_crc(uint32 crc1, uint32 crc2, uint64_t len2);
+void set_crc_concurrency_level(int level);
+int process_file_chunks(int fd, off_t size, FileChunkFunc func, void *data);
+int try_compute_crc(const char *filename, uint32 *crc);
 uint32 compute_crc(Options *op, const char *filename);
+void load_crc_cache(Options *op, const char *filename);
+int save_crc_cache(Options *op, const char *filename);
 
 #endif /* __NVIDIA_INSTALLER_CRC_H__ */
@@ -0,0 +1,955 @@
+/*
+ * nvidia-installer: A tool for installing NVIDIA software packages on
+ * Unix and Linux systems.
+ *
+ * Copyright (C) 2003 NVIDIA Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ *
+ * digest.c - file digests that may be recorded in the backup log in
+ * addition to the legacy CRC (see crc.c):
+ *
+ *  - XXH64, a fast non-cryptographic 64-bit hash, for detecting
+ *    accidental modification of installed files at little more than the
+ *    cost of reading them;
+ *
+ *  - BLAKE3 (256-bit output, unkeyed hash mode), a cryptographic hash
+ *    for detecting deliberate modification.  BLAKE3 hashes its input as
+ *    a binary tree of 1 KiB chunks, so independent subtrees of a large
+ *    file are hashed in parallel by the chunk workers in crc.c.
+ *
+ * Both are implemented here in portable C; the byte order of the
+ * host does not affect the results.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "nvidia-installer.h"
+#include "user-interface.h"
+#include "misc.h"
+#include "crc.h"
+#include "digest.h"
+
+
+static const struct {
+    DigestType type;
+    const char *name;
+    int len;
+} digest_types[] = {
+    { DIGEST_NONE,   "crc32",  0 },
+    { DIGEST_XXH64,  "xxh64",  8 },
+    { DIGEST_BLAKE3, "blake3", 32 },
+};
+
+
+/*
+ * parse_digest_type() - look up a digest by the name used for it on the
+ * command line and in the backup log.  Returns FALSE if the name is not
+ * recognized.
+ */
+
+int parse_digest_type(const char *name, DigestType *type)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_LEN(digest_types); i++) {
+        if (strcmp(name, digest_types[i].name) == 0) {
+            *type = digest_types[i].type;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+const char *digest_type_name(DigestType type)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_LEN(digest_types); i++) {
+        if (digest_types[i].type == type) {
+            return digest_types[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+
+int digest_length(DigestType type)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_LEN(digest_types); i++) {
+        if (digest_types[i].type == type) {
+            return digest_types[i].len;
+        }
+    }
+
+    return 0;
+}
+
+
+static inline uint32 load_le32(const uint8 *p)
+{
+    return (uint32) p[0] | ((uint32) p[1] << 8) |
+           ((uint32) p[2] << 16) | ((uint32) p[3] << 24);
+}
+
+static inline uint64_t load_le64(const uint8 *p)
+{
+    return (uint64_t) load_le32(p) | ((uint64_t) load_le32(p + 4) << 32);
+}
+
+
+
+/*
+ * XXH64, as specified at https://github.com/Cyan4973/xxHash (seed 0).
+ * The digest is stored in the canonical (big-endian) byte order.
+ */
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    uint64_t total_len;
+    uint64_t v[4];
+    uint8 mem[32];
+    size_t mem_len;
+} Xxh64State;
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void xxh64_init(Xxh64State *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    s->v[1] = XXH_PRIME64_2;
+    s->v[2] = 0;
+    s->v[3] = -XXH_PRIME64_1;
+}
+
+static void xxh64_stripe(Xxh64State *s, const uint8 *p)
+{
+    s->v[0] = xxh64_round(s->v[0], load_le64(p));
+    s->v[1] = xxh64_round(s->v[1], load_le64(p + 8));
+    s->v[2] = xxh64_round(s->v[2], load_le64(p + 16));
+    s->v[3] = xxh64_round(s->v[3], load_le64(p + 24));
+}
+
+static void xxh64_update(Xxh64State *s, const uint8 *p, size_t len)
+{
+    s->total_len += len;
+
+    if (s->mem_len + len < 32) {
+        memcpy(s->mem + s->mem_len, p, len);
+        s->mem_len += len;
+        return;
+    }
+
+    if (s->mem_len) {
+        size_t fill = 32 - s->mem_len;
+        memcpy(s->mem + s->mem_len, p, fill);
+        xxh64_stripe(s, s->mem);
+        p += fill;
+        len -= fill;
+        s->mem_len = 0;
+    }
+
+    while (len >= 32) {
+        xxh64_stripe(s, p);
+        p += 32;
+        len -= 32;
+    }
+
+    memcpy(s->mem, p, len);
+    s->mem_len = len;
+}
+
+static void xxh64_final(const Xxh64State *s, uint8 *out)
+{
+    const uint8 *p = s->mem;
+    size_t len = s->mem_len;
+    uint64_t h;
+    int i;
+
+    if (s->total_len >= 32) {
+        h = rotl64(s->v[0], 1) + rotl64(s->v[1], 7) +
+            rotl64(s->v[2], 12) + rotl64(s->v[3], 18);
+        for (i = 0; i < 4; i++) {
+            h = xxh64_merge_round(h, s->v[i]);
+        }
+    } else {
+        h = s->v[2] + XXH_PRIME64_5;
+    }
+
+    h += s->total_len;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= xxh64_round(0, load_le64(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+
+    if (len >= 4) {
+        h ^= (uint64_t) load_le32(p) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+
+    for (; len > 0; p++, len--) {
+        h ^= *p * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    for (i = 0; i < 8; i++) {
+        out[i] = h >> (56 - 8 * i);
+    }
+}
+
+
+
+/*
+ * BLAKE3, as specified at https://github.com/BLAKE3-team/BLAKE3-specs.
+ * This follows the structure of the reference implementation: the input
+ * is split into 1 KiB chunks, each chunk is compressed into a chaining
+ * value, and chaining values are merged pairwise into parent nodes as
+ * soon as a complete subtree is available, using a stack whose depth is
+ * logarithmic in the input length.
+ */
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+#define BLAKE3_CHUNK_START (1 << 0)
+#define BLAKE3_CHUNK_END   (1 << 1)
+#define BLAKE3_PARENT      (1 << 2)
+#define BLAKE3_ROOT        (1 << 3)
+
+static const uint32 blake3_iv[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const uint8 blake3_msg_permutation[16] = {
+    2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8,
+};
+
+typedef struct {
+    uint32 cv[8];
+    uint32 block[16];
+    uint64_t counter;
+    uint32 block_len;
+    uint32 flags;
+} Blake3Output;
+
+typedef struct {
+    uint32 cv[8];
+    uint64_t chunk_counter;
+    uint8 block[BLAKE3_BLOCK_LEN];
+    uint32 block_len;
+    uint32 blocks_compressed;
+} Blake3ChunkState;
+
+typedef struct {
+    Blake3ChunkState chunk;
+    uint32 cv_stack[BLAKE3_MAX_DEPTH][8];
+    int cv_stack_len;
+} Blake3Hasher;
+
+static inline uint32 rotr32(uint32 x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+static inline void blake3_g(uint32 *s, int a, int b, int c, int d,
+                            uint32 mx, uint32 my)
+{
+    s[a] = s[a] + s[b] + mx;
+    s[d] = rotr32(s[d] ^ s[a], 16);
+    s[c] = s[c] + s[d];
+    s[b] = rotr32(s[b] ^ s[c], 12);
+    s[a] = s[a] + s[b] + my;
+    s[d] = rotr32(s[d] ^ s[a], 8);
+    s[c] = s[c] + s[d];
+    s[b] = rotr32(s[b] ^ s[c], 7);
+}
+
+static void blake3_compress(const uint32 cv[8], const uint32 block[16],
+                            uint64_t counter, uint32 block_len, uint32 flags,
+                            uint32 out[16])
+{
+    uint32 s[16], m[16], t[16];
+    int round, i;
+
+    memcpy(s, cv, 8 * sizeof(uint32));
+    memcpy(s + 8, blake3_iv, 4 * sizeof(uint32));
+    s[12] = (uint32) counter;
+    s[13] = (uint32) (counter >> 32);
+    s[14] = block_len;
+    s[15] = flags;
+
+    memcpy(m, block, sizeof(m));
+
+    for (round = 0; round < 7; round++) {
+        blake3_g(s, 0, 4,  8, 12, m[0],  m[1]);
+        blake3_g(s, 1, 5,  9, 13, m[2],  m[3]);
+        blake3_g(s, 2, 6, 10, 14, m[4],  m[5]);
+        blake3_g(s, 3, 7, 11, 15, m[6],  m[7]);
+        blake3_g(s, 0, 5, 10, 15, m[8],  m[9]);
+        blake3_g(s, 1, 6, 11, 12, m[10], m[11]);
+        blake3_g(s, 2, 7,  8, 13, m[12], m[13]);
+        blake3_g(s, 3, 4,  9, 14, m[14], m[15]);
+
+        for (i = 0; i < 16; i++) {
+            t[i] = m[blake3_msg_permutation[i]];
+        }
+        memcpy(m, t, sizeof(m));
+    }
+
+    for (i = 0; i < 8; i++) {
+        out[i] = s[i] ^ s[i + 8];
+        out[i + 8] = s[i + 8] ^ cv[i];
+    }
+}
+
+static void blake3_block_words(const uint8 *block, uint32 words[16])
+{
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        words[i] = load_le32(block + 4 * i);
+    }
+}
+
+static void blake3_output_cv(const Blake3Output *o, uint32 cv[8])
+{
+    uint32 out[16];
+
+    blake3_compress(o->cv, o->block, o->counter, o->block_len, o->flags, out);
+    memcpy(cv, out, 8 * sizeof(uint32));
+}
+
+static void blake3_output_root(const Blake3Output *o, uint8 *digest)
+{
+    uint32 out[16];
+    int i;
+
+    blake3_compress(o->cv, o->block, 0, o->block_len,
+                    o->flags | BLAKE3_ROOT, out);
+
+    for (i = 0; i < 32; i++) {
+        digest[i] = out[i / 4] >> (8 * (i % 4));
+    }
+}
+
+static void blake3_parent_output(const uint32 left[8], const uint32 right[8],
+                                 Blake3Output *o)
+{
+    memcpy(o->cv, blake3_iv, sizeof(o->cv));
+    memcpy(o->block, left, 8 * sizeof(uint32));
+    memcpy(o->block + 8, right, 8 * sizeof(uint32));
+    o->counter = 0;
+    o->block_len = BLAKE3_BLOCK_LEN;
+    o->flags = BLAKE3_PARENT;
+}
+
+static void blake3_chunk_init(Blake3ChunkState *c, uint64_t chunk_counter)
+{
+    memset(c, 0, sizeof(*c));
+    memcpy(c->cv, blake3_iv, sizeof(c->cv));
+    c->chunk_counter = chunk_counter;
+}
+
+static size_t blake3_chunk_len(const Blake3ChunkState *c)
+{
+    return BLAKE3_BLOCK_LEN * c->blocks_compressed + c->block_len;
+}
+
+static uint32 blake3_chunk_start_flag(const Blake3ChunkState *c)
+{
+    return c->blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0;
+}
+
+static void blake3_chunk_update(Blake3ChunkState *c, const uint8 *p,
+                                size_t len)
+{
+    while (len > 0) {
+        size_t take;
+
+        if (c->block_len == BLAKE3_BLOCK_LEN) {
+            uint32 words[16], out[16];
+
+            blake3_block_words(c->block, words);
+            blake3_compress(c->cv, words, c->chunk_counter, BLAKE3_BLOCK_LEN,
+                            blake3_chunk_start_flag(c), out);
+            memcpy(c->cv, out, sizeof(c->cv));
+            c->blocks_compressed++;
+            memset(c->block, 0, sizeof(c->block));
+            c->block_len = 0;
+        }
+
+        take = NV_MIN(BLAKE3_BLOCK_LEN - c->block_len, len);
+        memcpy(c->block + c->block_len, p, take);
+        c->block_len += take;
+        p += take;
+        len -= take;
+    }
+}
+
+static void blake3_chunk_output(const Blake3ChunkState *c, Blake3Output *o)
+{
+    memcpy(o->cv, c->cv, sizeof(o->cv));
+    blake3_block_words(c->block, o->block);
+    o->counter = c->chunk_counter;
+    o->block_len = c->block_len;
+    o->flags = blake3_chunk_start_flag(c) | BLAKE3_CHUNK_END;
+}
+
+/*
+ * blake3_push_cv() - push the chaining value of a completed subtree,
+ * first merging it with every completed sibling on the stack.  'total'
+ * is the number of subtrees completed so far, at the level of 'cv': its
+ * trailing zero bits count the merges that are now possible.
+ */
+
+static void blake3_push_cv(uint32 stack[][8], int *stack_len,
+                           const uint32 cv[8], uint64_t total)
+{
+    uint32 new_cv[8];
+
+    memcpy(new_cv, cv, sizeof(new_cv));
+
+    while ((total & 1) == 0) {
+        Blake3Output parent;
+
+        blake3_parent_output(stack[--(*stack_len)], new_cv, &parent);
+        blake3_output_cv(&parent, new_cv);
+        total >>= 1;
+    }
+
+    memcpy(stack[(*stack_len)++], new_cv, sizeof(new_cv));
+}
+
+/*
+ * blake3_hasher_init() - start hashing a subtree whose first chunk is
+ * 'chunk_counter'.  This is 0 when hashing a whole message; when hashing
+ * one of several subtrees of a message in parallel, it must be a
+ * multiple of the (power of two) number of chunks per subtree.
+ */
+
+static void blake3_hasher_init(Blake3Hasher *h, uint64_t chunk_counter)
+{
+    blake3_chunk_init(&h->chunk, chunk_counter);
+    h->cv_stack_len = 0;
+}
+
+static void blake3_hasher_update(Blake3Hasher *h, const uint8 *p, size_t len)
+{
+    while (len > 0) {
+        size_t take;
+
+        /* only finish a chunk once we know more input follows it */
+
+        if (blake3_chunk_len(&h->chunk) == BLAKE3_CHUNK_LEN) {
+            Blake3Output o;
+            uint32 cv[8];
+            uint64_t total = h->chunk.chunk_counter + 1;
+
+            blake3_chunk_output(&h->chunk, &o);
+            blake3_output_cv(&o, cv);
+            blake3_push_cv(h->cv_stack, &h->cv_stack_len, cv, total);
+            blake3_chunk_init(&h->chunk, total);
+        }
+
+        take = NV_MIN(BLAKE3_CHUNK_LEN - blake3_chunk_len(&h->chunk), len);
+        blake3_chunk_update(&h->chunk, p, take);
+        p += take;
+        len -= take;
+    }
+}
+
+/*
+ * blake3_hasher_output() - the (not yet finalized) output node of the
+ * subtree hashed so far: the root node if the subtree is the whole
+ * message, otherwise the node to be merged into the enclosing tree.
+ */
+
+static void blake3_hasher_output(const Blake3Hasher *h, Blake3Output *o)
+{
+    int i;
+
+    blake3_chunk_output(&h->chunk, o);
+
+    for (i = h->cv_stack_len - 1; i >= 0; i--) {
+        uint32 cv[8];
+
+        blake3_output_cv(o, cv);
+        blake3_parent_output(h->cv_stack[i], cv, o);
+    }
+}
+
+
+/*
+ * Large files are hashed as a sequence of CRC_CHUNK_SIZE subtrees (a
+ * power of two number of BLAKE3 chunks), each hashed independently by
+ * process_file_chunks(); the subtree outputs are then merged in order
+ * exactly as blake3_hasher_update() would have merged them.
+ */
+
+#define BLAKE3_SUBTREE_CHUNKS (CRC_CHUNK_SIZE / BLAKE3_CHUNK_LEN)
+#define DIGEST_CHUNKED_MIN_SIZE (2 * CRC_CHUNK_SIZE)
+
+static void blake3_subtree_func(const uint8 *buf, size_t len, size_t chunk,
+                                void *data)
+{
+    Blake3Output *outputs = data;
+    Blake3Hasher *h = nvalloc(sizeof(Blake3Hasher));
+
+    blake3_hasher_init(h, (uint64_t) chunk * BLAKE3_SUBTREE_CHUNKS);
+    blake3_hasher_update(h, buf, len);
+    blake3_hasher_output(h, &outputs[chunk]);
+
+    nvfree(h);
+}
+
+static int blake3_file_parallel(int fd, off_t size, uint8 *digest)
+{
+    size_t num_subtrees = (size + CRC_CHUNK_SIZE - 1) / CRC_CHUNK_SIZE;
+    Blake3Output *outputs = nvalloc(num_subtrees * sizeof(Blake3Output));
+    uint32 stack[BLAKE3_MAX_DEPTH][8];
+    int stack_len = 0, i;
+    Blake3Output o;
+    size_t n;
+
+    if (!process_file_chunks(fd, size, blake3_subtree_func, outputs)) {
+        nvfree(outputs);
+        return FALSE;
+    }
+
+    for (n = 0; n + 1 < num_subtrees; n++) {
+        uint32 cv[8];
+
+        blake3_output_cv(&outputs[n], cv);
+        blake3_push_cv(stack, &stack_len, cv, n + 1);
+    }
+
+    o = outputs[num_subtrees - 1];
+
+    for (i = stack_len - 1; i >= 0; i--) {
+        uint32 cv[8];
+
+        blake3_output_cv(&o, cv);
+        blake3_parent_output(stack[i], cv, &o);
+    }
+
+    blake3_output_root(&o, digest);
+
+    nvfree(outputs);
+
+    return TRUE;
+}
+
+
+
+struct __digest_context {
+    DigestType type;
+    union {
+        Xxh64State xxh64;
+        Blake3Hasher blake3;
+    } u;
+};
+
+
+/*
+ * digest_new() - allocate a context for computing a digest of the given
+ * type incrementally, with digest_update() and digest_final().
+ */
+
+DigestContext *digest_new(DigestType type)
+{
+    DigestContext *ctx = nvalloc(sizeof(DigestContext));
+
+    ctx->type = type;
+
+    switch (type) {
+    case DIGEST_XXH64:
+        xxh64_init(&ctx->u.xxh64);
+        break;
+    case DIGEST_BLAKE3:
+        blake3_hasher_init(&ctx->u.blake3, 0);
+        break;
+    default:
+        break;
+    }
+
+    return ctx;
+}
+
+
+void digest_update(DigestContext *ctx, const uint8 *buf, size_t len)
+{
+    switch (ctx->type) {
+    case DIGEST_XXH64:
+        xxh64_update(&ctx->u.xxh64, buf, len);
+        break;
+    case DIGEST_BLAKE3:
+        blake3_hasher_update(&ctx->u.blake3, buf, len);
+        break;
+    default:
+        break;
+    }
+}
+
+
+/*
+ * digest_final() - store the digest of everything passed to
+ * digest_update() in 'digest', and free the context.
+ */
+
+void digest_final(DigestContext *ctx, Digest *digest)
+{
+    Blake3Output o;
+
+    memset(digest, 0, sizeof(*digest));
+    digest->type = ctx->type;
+
+    switch (ctx->type) {
+    case DIGEST_XXH64:
+        xxh64_final(&ctx->u.xxh64, digest->bytes);
+        break;
+    case DIGEST_BLAKE3:
+        blake3_hasher_output(&ctx->u.blake3, &o);
+        blake3_output_root(&o, digest->bytes);
+        break;
+    default:
+        break;
+    }
+
+    nvfree(ctx);
+}
+
+
+
+/*
+ * try_compute_digest() - compute the digest of the given type of the
+ * specified file, without reporting failures: returns FALSE, with errno
+ * set, if the file could not be read.  Safe to call from several
+ * threads at once.
+ */
+
+int try_compute_digest(const char *filename, DigestType type, Digest *digest)
+{
+    DigestContext *ctx = NULL;
+    uint8 *buf = MAP_FAILED;
+    int success = FALSE;
+    int fd, err = 0;
+    struct stat stat_buf;
+    size_t len = 0;
+
+    memset(digest, 0, sizeof(*digest));
+    digest->type = type;
+
+    if (type == DIGEST_NONE) {
+        return TRUE;
+    }
+
+    if ((fd = open(filename, O_RDONLY)) == -1) goto done;
+    if (fstat(fd, &stat_buf) == -1) goto done;
+
+    if (lookup_cached_digest(&stat_buf, type, digest)) {
+        success = TRUE;
+        goto done;
+    }
+
+    if (type == DIGEST_BLAKE3 && stat_buf.st_size >= DIGEST_CHUNKED_MIN_SIZE) {
+        success = blake3_file_parallel(fd, stat_buf.st_size, digest->bytes);
+        goto store;
+    }
+
+    ctx = digest_new(type);
+
+    if (stat_buf.st_size > 0) {
+        len = stat_buf.st_size;
+
+        buf = mmap(0, len, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+        if (buf == MAP_FAILED) goto done;
+
+#if defined(MADV_SEQUENTIAL)
+        madvise(buf, len, MADV_SEQUENTIAL);
+#endif
+
+        digest_update(ctx, buf, len);
+    }
+
+    digest_final(ctx, digest);
+    ctx = NULL;
+
+    success = TRUE;
+
+ store:
+    if (success) {
+        store_cached_digest(&stat_buf, digest);
+    }
+
+ done:
+    err = errno;
+
+    if (ctx) {
+        nvfree(ctx);
+    }
+    if (buf != MAP_FAILED) {
+        munmap(buf, len);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    errno = err;
+
+    return success;
+
+} /* try_compute_digest() */
+
+
+
+/*
+ * compute_digest() - compute the digest of the given type of the
+ * specified file.  Returns FALSE (after printing a warning) if the file
+ * could not be read.
+ */
+
+int compute_digest(Options *op, const char *filename, DigestType type,
+                   Digest *digest)
+{
+    if (!try_compute_digest(filename, type, digest)) {
+        ui_warn(op, "Unable to compute %s digest for file '%s' (%s).",
+                digest_type_name(type), filename, strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+
+} /* compute_digest() */
+
+
+
+/*
+ * compute_file_checksum() - compute the checksums to be recorded in the
+ * backup log for the specified file: always the CRC, and the digest of
+ * type 'sum->digest.type' if that is not DIGEST_NONE.
+ */
+
+void compute_file_checksum(Options *op, const char *filename,
+                           FileChecksum *sum)
+{
+    sum->crc = compute_crc(op, filename);
+
+    if (sum->digest.type != DIGEST_NONE) {
+        compute_digest(op, filename, sum->digest.type, &sum->digest);
+    }
+}
+
+
+
+/*
+ * verify_file_checksum() - check the specified file against its
+ * recorded checksums: the digest if one was recorded, otherwise the CRC.
+ * Returns TRUE if they match.  Otherwise, returns FALSE, and sets
+ * 'actual' and 'expected' to printable forms of the computed and the
+ * recorded checksum, which the caller should free.
+ */
+
+int verify_file_checksum(Options *op, const char *filename, uint32 crc,
+                         const Digest *digest, char **actual, char **expected)
+{
+    if (digest && digest->type != DIGEST_NONE) {
+        Digest actual_digest;
+
+        if (compute_digest(op, filename, digest->type, &actual_digest) &&
+            digests_equal(&actual_digest, digest)) {
+            return TRUE;
+        }
+
+        *actual = digest_to_string(&actual_digest);
+        *expected = digest_to_string(digest);
+    } else {
+        uint32 actual_crc = compute_crc(op, filename);
+
+        if (actual_crc == crc) {
+            return TRUE;
+        }
+
+        *actual = nvasprintf("%u", actual_crc);
+        *expected = nvasprintf("%u", crc);
+    }
+
+    return FALSE;
+}
+
+
+
+/*
+ * file_checksum_matches() - as verify_file_checksum(), but without
+ * reporting anything: returns TRUE only if the file could be read and
+ * matches its recorded checksums.  Safe to call from several threads
+ * at once, provided that init_crc_engine() has been called first.
+ */
+
+int file_checksum_matches(const char *filename, uint32 crc,
+                          const Digest *digest)
+{
+    if (digest && digest->type != DIGEST_NONE) {
+        Digest actual_digest;
+
+        return try_compute_digest(filename, digest->type, &actual_digest) &&
+               digests_equal(&actual_digest, digest);
+    } else {
+        uint32 actual_crc;
+
+        return try_compute_crc(filename, &actual_crc) && actual_crc == crc;
+    }
+}
+
+
+
+/*
+ * digest_to_string() - format a digest as "<name>:<hex bytes>", as it is
+ * recorded in the backup log; the caller should free the returned
+ * string.  Returns NULL for DIGEST_NONE.
+ */
+
+char *digest_to_string(const Digest *digest)
+{
+    const char *name = digest_type_name(digest->type);
+    int len = digest_length(digest->type);
+    char *str, *hex;
+    int i;
+
+    if (len == 0 || !name) {
+        return NULL;
+    }
+
+    str = nvalloc(strlen(name) + 1 + 2 * len + 1);
+    sprintf(str, "%s:", name);
+    hex = str + strlen(str);
+
+    for (i = 0; i < len; i++) {
+        sprintf(hex + 2 * i, "%02x", digest->bytes[i]);
+    }
+
+    return str;
+}
+
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+/*
+ * parse_digest_string() - parse a digest formatted by digest_to_string().
+ * Returns FALSE if the string is not a well formed digest of a known
+ * type; 'digest' is then left as a DIGEST_NONE digest.
+ */
+
+int parse_digest_string(const char *str, Digest *digest)
+{
+    const char *colon = strchr(str, ':');
+    DigestType type;
+    char name[16];
+    int len, i;
+
+    memset(digest, 0, sizeof(*digest));
+
+    if (!colon || colon - str >= sizeof(name)) {
+        return FALSE;
+    }
+
+    memcpy(name, str, colon - str);
+    name[colon - str] = '\0';
+
+    if (!parse_digest_type(name, &type) || type == DIGEST_NONE) {
+        return FALSE;
+    }
+
+    len = digest_length(type);
+    str = colon + 1;
+
+    if (strlen(str) != 2 * len) {
+        return FALSE;
+    }
+
+    for (i = 0; i < len; i++) {
+        int hi = hex_value(str[2 * i]);
+        int lo = hex_value(str[2 * i + 1]);
+
+        if (hi < 0 || lo < 0) {
+            memset(digest, 0, sizeof(*digest));
+            return FALSE;
+        }
+        digest->bytes[i] = (hi << 4) | lo;
+    }
+
+    /* only a fully validated digest is given a type */
+
+    digest->type = type;
+
+    return TRUE;
+}
+
+
+int digests_equal(const Digest *a, const Digest *b)
+{
+    return a->type == b->type &&
+           memcmp(a->bytes, b->bytes, digest_length(a->type)) == 0;
+}
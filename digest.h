@@ -0,0 +1,86 @@
+/*
+ * nvidia-installer: A tool for installing NVIDIA software packages on
+ * Unix and Linux systems.
+ *
+ * Copyright (C) 2003 NVIDIA Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef __NVIDIA_INSTALLER_DIGEST_H__
+#define __NVIDIA_INSTALLER_DIGEST_H__
+
+#include <sys/stat.h>
+
+#include "nvidia-installer.h"
+
+/*
+ * Digests that may be recorded in the backup log in addition to the
+ * legacy CRC.  DIGEST_NONE means that only the CRC is recorded.
+ */
+
+typedef enum {
+    DIGEST_NONE = 0,
+    DIGEST_XXH64,
+    DIGEST_BLAKE3,
+} DigestType;
+
+#define DIGEST_MAX_LEN 32
+
+typedef struct {
+    DigestType type;
+    uint8 bytes[DIGEST_MAX_LEN];
+} Digest;
+
+/*
+ * The checksums recorded for a file: the CRC is always computed; the
+ * digest only if 'digest.type' is not DIGEST_NONE.
+ */
+
+typedef struct {
+    uint32 crc;
+    Digest digest;
+} FileChecksum;
+
+typedef struct __digest_context DigestContext;
+
+int parse_digest_type(const char *name, DigestType *type);
+const char *digest_type_name(DigestType type);
+int digest_length(DigestType type);
+
+DigestContext *digest_new(DigestType type);
+void digest_update(DigestContext *ctx, const uint8 *buf, size_t len);
+void digest_final(DigestContext *ctx, Digest *digest);
+
+int try_compute_digest(const char *filename, DigestType type,
+                       Digest *digest);
+int compute_digest(Options *op, const char *filename, DigestType type,
+                   Digest *digest);
+void compute_file_checksum(Options *op, const char *filename,
+                           FileChecksum *sum);
+int verify_file_checksum(Options *op, const char *filename, uint32 crc,
+                         const Digest *digest, char **actual, char **expected);
+int file_checksum_matches(const char *filename, uint32 crc,
+                          const Digest *digest);
+
+/* the digests are cached with the CRCs; see crc.c */
+
+int lookup_cached_digest(const struct stat *stat_buf, DigestType type,
+                         Digest *digest);
+void store_cached_digest(const struct stat *stat_buf, const Digest *digest);
+
+char *digest_to_string(const Digest *digest);
+int parse_digest_string(const char *str, Digest *digest);
+int digests_equal(const Digest *a, const Digest *b);
+
+#endif /* __NVIDIA_INSTALLER_DIGEST_H__ */
@@ -29,6 +29,7 @@
 SRC := backup.c
 SRC += command-list.c
 SRC += crc.c
+SRC += digest.c
 SRC += files.c
 SRC += install-from-cwd.c
 SRC += kernel.c
@@ -47,6 +48,7 @@ DIST_FILES := $(SRC)
 DIST_FILES += backup.h
 DIST_FILES += command-list.h
 DIST_FILES += crc.h
+DIST_FILES += digest.h
 DIST_FILES += files.h
 DIST_FILES += kernel.h
 DIST_FILES += misc.h
@@ -36,6 +36,16 @@
 #include <utime.h>
 #include <time.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/sysmacros.h>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
 
 #include "nvidia-installer.h"
 #include "user-interface.h"
@@ -43,6 +53,9 @@
 #include "misc.h"
 #include "precompiled.h"
 #include "backup.h"
+#include "crc.h"
+#include "digest.h"
+#include "manifest.h"
 
 
 static char *get_xdg_data_dir(void);
@@ -208,73 +221,305 @@ int touch_directory(Options *op, const char *victim)
 
 
 /*
- * copy_file() - copy the file specified by srcfile to dstfile, using
- * mmap and memcpy.  The destination file is created with the
- * permissions specified by mode.  Roughly based on code presented by
- * Richard Stevens, in Advanced Programming in the Unix Environment,
- * 12.9.
+ * copy_file() - copy the file specified by srcfile to dstfile.  The
+ * destination file is created with the permissions specified by mode.
+ * The data is copied by the fastest means that these files support;
+ * see try_copy_file_with_checksum().
  */
 
 int copy_file(Options *op, const char *srcfile,
               const char *dstfile, mode_t mode)
 {
-    int src_fd = -1, dst_fd = -1;
+    return copy_file_with_checksum(op, srcfile, dstfile, mode, NULL);
+}
+
+
+
+/*
+ * copy_file_with_checksum() - same as copy_file(), but if sum is
+ * non-NULL, also compute the checksums of the copied data (as
+ * compute_file_checksum() would for dstfile): the CRC, and the digest of
+ * type sum->digest.type.
+ */
+
+int copy_file_with_checksum(Options *op, const char *srcfile,
+                            const char *dstfile, mode_t mode,
+                            FileChecksum *sum)
+{
+    char *error_str = NULL;
+    int success;
+
+    success = try_copy_file_with_checksum(srcfile, dstfile, mode, sum,
+                                          &error_str);
+
+    if (error_str) {
+        ui_error(op, "%s", error_str);
+        nvfree(error_str);
+    }
+
+    return success;
+}
+
+
+
+/*
+ * copy_tier_unsupported() - whether the error 'err' from one of the
+ * kernel copy mechanisms means that it cannot copy between these two
+ * files (e.g. because they are on different filesystems, or because the
+ * filesystem does not implement it), rather than that the copy failed.
+ */
+
+static int copy_tier_unsupported(int err)
+{
+    switch (err) {
+      case EXDEV:
+      case EOPNOTSUPP:
+#if defined(ENOTSUP) && ENOTSUP != EOPNOTSUPP
+      case ENOTSUP:
+#endif
+      case ENOSYS:
+      case EINVAL:
+      case ENOTTY:
+      case EBADF:
+        return TRUE;
+      default:
+        return FALSE;
+    }
+}
+
+
+/*
+ * reset_copy_destination() - discard whatever a kernel copy mechanism
+ * that gave up part way through wrote to dst_fd, before trying the next.
+ */
+
+static int reset_copy_destination(int src_fd, int dst_fd)
+{
+    return ftruncate(dst_fd, 0) == 0 &&
+           lseek(dst_fd, 0, SEEK_SET) == 0 &&
+           lseek(src_fd, 0, SEEK_SET) == 0;
+}
+
+
+/*
+ * clone_file_data() - share the extents of src_fd with dst_fd (a reflink,
+ * on filesystems that support it), so that no data is copied at all.
+ * Returns TRUE on success.
+ */
+
+static int clone_file_data(int src_fd, int dst_fd)
+{
+#if defined(FICLONE)
+    return ioctl(dst_fd, FICLONE, src_fd) == 0;
+#else
+    errno = EOPNOTSUPP;
+    return FALSE;
+#endif
+}
+
+
+/*
+ * copy_file_data_in_kernel() - copy the 'size' bytes of src_fd to
+ * dst_fd without passing the data through user space: by reflink, then
+ * with copy_file_range(2) (which also lets the filesystem keep holes,
+ * or copy on the server side for network filesystems), then with
+ * sendfile(2).  Each of these is only tried if the previous one is not
+ * supported for these files, or stopped short of 'size' bytes (as some
+ * filesystems' copy_file_range(2) does, instead of failing); anything
+ * written by the previous one is discarded first.  Returns TRUE, with
+ * '*copied' set to whether the data was copied; returns FALSE, with
+ * errno set, if the copy failed.
+ */
+
+static int copy_file_data_in_kernel(int src_fd, int dst_fd, off_t size,
+                                    int *copied)
+{
+    off_t offset;
+    ssize_t ret;
+
+    *copied = FALSE;
+
+    if (clone_file_data(src_fd, dst_fd)) {
+        *copied = TRUE;
+        return TRUE;
+    }
+    if (!copy_tier_unsupported(errno)) return FALSE;
+
+#if defined(__NR_copy_file_range)
+    for (offset = 0; offset < size; offset += ret) {
+        ret = syscall(__NR_copy_file_range, src_fd, NULL, dst_fd, NULL,
+                      (size_t) (size - offset), 0);
+        if (ret == -1 && errno == EINTR) {
+            ret = 0;
+            continue;
+        }
+        if (ret <= 0) break;
+    }
+
+    if (offset >= size) {
+        *copied = TRUE;
+        return TRUE;
+    }
+    if ((ret == -1 && !copy_tier_unsupported(errno)) ||
+        !reset_copy_destination(src_fd, dst_fd)) {
+        return FALSE;
+    }
+#endif
+
+    for (offset = 0; offset < size; ) {
+        ret = sendfile(dst_fd, src_fd, &offset, (size_t) (size - offset));
+        if (ret == -1 && errno == EINTR) continue;
+        if (ret <= 0) break;
+    }
+
+    if (offset >= size) {
+        *copied = TRUE;
+        return TRUE;
+    }
+    if ((ret == -1 && !copy_tier_unsupported(errno)) ||
+        !reset_copy_destination(src_fd, dst_fd)) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * copy_file_data() - copy src_fd to dst_fd through a buffer, and, if sum
+ * is non-NULL, compute the CRC (and, if digest is non-NULL, the digest)
+ * of the data as it passes through, while each block is still in the
+ * CPU cache.  If dst_fd is -1, the data is only checksummed.  Returns
+ * FALSE, with errno set, on failure.
+ */
+
+#define COPY_BUFFER_SIZE (256 * 1024)
+
+static int copy_file_data(int src_fd, int dst_fd, FileChecksum *sum,
+                          DigestContext *digest)
+{
+    uint32 cword = CRC_INITIAL_VALUE;
+    uint8 *buf = nvalloc(COPY_BUFFER_SIZE);
     int success = FALSE;
+    ssize_t len, ret, written;
+
+    while ((len = read(src_fd, buf, COPY_BUFFER_SIZE)) != 0) {
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            goto done;
+        }
+
+        if (sum) {
+            cword = update_crc_from_buffer(cword, buf, len);
+            if (digest) {
+                digest_update(digest, buf, len);
+            }
+        }
+
+        for (written = 0; dst_fd != -1 && written < len; written += ret) {
+            ret = write(dst_fd, buf + written, len - written);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    ret = 0;
+                    continue;
+                }
+                goto done;
+            }
+        }
+    }
+
+    if (sum) sum->crc = cword;
+
+    success = TRUE;
+
+ done:
+    nvfree(buf);
+
+    return success;
+}
+
+
+/*
+ * try_copy_file_with_checksum() - the implementation of
+ * copy_file_with_checksum(), which does not report failures itself: on
+ * failure, '*error_str' is set to a newly allocated error message, for
+ * the caller to report and free.  Safe to call from several threads at
+ * once, provided that init_crc_engine() has been called first.
+ *
+ * Without a checksum, the data is copied by copy_file_data_in_kernel()
+ * if possible.  With a checksum, the data must be read anyway, so it is
+ * copied (and checksummed) through a buffer in a single pass, rather
+ * than copied in the kernel and then read back; only a reflink, which
+ * copies nothing, is tried first, and the destination then read to
+ * checksum it.
+ */
+
+int try_copy_file_with_checksum(const char *srcfile, const char *dstfile,
+                                mode_t mode, FileChecksum *sum,
+                                char **error_str)
+{
+    int src_fd = -1, dst_fd = -1;
+    int success = FALSE, copied = FALSE;
+    DigestContext *digest = NULL;
     struct stat stat_buf;
-    char *src, *dst;
     
     if ((src_fd = open(srcfile, O_RDONLY)) == -1) {
-        ui_error (op, "Unable to open '%s' for copying (%s)",
-                  srcfile, strerror (errno));
+        *error_str = nvasprintf("Unable to open '%s' for copying (%s)",
+                                srcfile, strerror(errno));
         goto done;
     }
-    if ((dst_fd = open(dstfile, O_RDWR | O_CREAT | O_TRUNC, mode)) == -1) {
-        ui_error (op, "Unable to create '%s' for copying (%s)",
-                  dstfile, strerror (errno));
+    if ((dst_fd = open(dstfile, (sum ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC,
+                       mode)) == -1) {
+        *error_str = nvasprintf("Unable to create '%s' for copying (%s)",
+                                dstfile, strerror(errno));
         goto done;
     }
     if (fstat(src_fd, &stat_buf) == -1) {
-        ui_error (op, "Unable to determine size of '%s' (%s)",
-                  srcfile, strerror (errno));
+        *error_str = nvasprintf("Unable to determine size of '%s' (%s)",
+                                srcfile, strerror(errno));
         goto done;
     }
+    if (sum && sum->digest.type != DIGEST_NONE) {
+        digest = digest_new(sum->digest.type);
+    }
     if (stat_buf.st_size == 0) {
+        /* compute_crc() defines the checksum of an empty file as 0 */
+        if (sum) sum->crc = 0;
         success = TRUE;
         goto done;
     }
-    if (lseek(dst_fd, stat_buf.st_size - 1, SEEK_SET) == -1) {
-        ui_error (op, "Unable to set file size for '%s' (%s)",
-                  dstfile, strerror (errno));
-        goto done;
-    }
-    if (write(dst_fd, "", 1) != 1) {
-        ui_error (op, "Unable to write file size for '%s' (%s)",
-                  dstfile, strerror (errno));
-        goto done;
-    }
-    if ((src = mmap(0, stat_buf.st_size, PROT_READ,
-                    MAP_FILE | MAP_SHARED, src_fd, 0)) == (void *) -1) {
-        ui_error (op, "Unable to map source file '%s' for copying (%s)",
-                  srcfile, strerror (errno));
+
+    if (sum) {
+        copied = clone_file_data(src_fd, dst_fd);
+        if (!copied && !copy_tier_unsupported(errno)) {
+            *error_str = nvasprintf("Unable to copy '%s' to '%s' (%s)",
+                                    srcfile, dstfile, strerror(errno));
+            goto done;
+        }
+    } else if (!copy_file_data_in_kernel(src_fd, dst_fd, stat_buf.st_size,
+                                         &copied)) {
+        *error_str = nvasprintf("Unable to copy '%s' to '%s' (%s)",
+                                srcfile, dstfile, strerror(errno));
         goto done;
     }
-    if ((dst = mmap(0, stat_buf.st_size, PROT_READ | PROT_WRITE,
-                    MAP_FILE | MAP_SHARED, dst_fd, 0)) == (void *) -1) {
-        ui_error (op, "Unable to map destination file '%s' for copying (%s)",
-                  dstfile, strerror (errno));
+
+    if (copied && !sum) {
+        success = TRUE;
         goto done;
     }
-    
-    memcpy (dst, src, stat_buf.st_size);
-    
-    if (munmap (src, stat_buf.st_size) == -1) {
-        ui_error (op, "Unable to unmap source file '%s' after copying (%s)",
-                 srcfile, strerror (errno));
+
+    /* checksum a reflinked file from the destination, which shares its data */
+
+    if (copied && lseek(dst_fd, 0, SEEK_SET) != 0) {
+        *error_str = nvasprintf("Unable to read back '%s' (%s)",
+                                dstfile, strerror(errno));
         goto done;
     }
-    if (munmap (dst, stat_buf.st_size) == -1) {
-        ui_error (op, "Unable to unmap destination file '%s' after "
-                 "copying (%s)", dstfile, strerror (errno));
+
+    if (!copy_file_data(copied ? dst_fd : src_fd, copied ? -1 : dst_fd,
+                        sum, digest)) {
+        *error_str = nvasprintf("Unable to copy '%s' to '%s' (%s)",
+                                srcfile, dstfile, strerror(errno));
         goto done;
     }
 
@@ -297,6 +542,9 @@ int copy_file(Options *op, const char *srcfile,
     if (dst_fd != -1) {
         close (dst_fd);
     }
+    if (digest) {
+        digest_final(digest, &sum->digest);
+    }
 
     return success;
 }
@@ -304,2956 +552,4714 @@ int copy_file(Options *op, const char *srcfile,
 
 
 /*
- * write_temp_file() - write the given data to a temporary file,
- * setting the file's permissions to those specified in perm.  On
- * success the name of the temporary file is returned; on error NULL
- * is returned.
+ * Staged installation (--staged-install): each file is copied to a
+ * temporary name in its destination directory, and then renamed into
+ * place, so that if the installer is interrupted, the destination names
+ * either the previous file or the complete new one.  Rather than fsync()
+ * each file, the filesystems installed into are noted, and
+ * sync_installed_filesystems() flushes each of them once, with
+ * syncfs(2), when the installation is complete.  Until then, a file may
+ * be renamed into place before its data reaches the disk, so a system
+ * crash may still leave it incomplete; only --swap-install, which
+ * flushes the staged files before renaming any of them, avoids that.
  */
 
-char *write_temp_file(Options *op, const int len,
-                      const unsigned char *data, mode_t perm)
+static struct {
+    pthread_mutex_t lock;
+    dev_t *devs;
+    int *fds;           /* a directory on each filesystem, for syncfs(2) */
+    int num;
+} installed_filesystems = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static void note_installed_filesystem(const char *path)
 {
-    unsigned char *dst = (void *) -1;
-    char *tmpfile = NULL;
-    int fd = -1;
-    int ret = FALSE;
+    struct stat stat_buf;
+    char *dirc = nvstrdup(path), *dir = dirname(dirc);
+    int i, fd;
 
-    /* create a temporary file */
+    if (stat(dir, &stat_buf) == -1) goto done;
 
-    tmpfile = nvstrcat(op->tmpdir, "/nv-tmp-XXXXXX", NULL);
-    
-    fd = mkstemp(tmpfile);
-    if (fd == -1) {
-        ui_warn(op, "Unable to create temporary file (%s).",
-                strerror(errno));
-        goto done;
+    pthread_mutex_lock(&installed_filesystems.lock);
+
+    for (i = 0; i < installed_filesystems.num; i++) {
+        if (installed_filesystems.devs[i] == stat_buf.st_dev) break;
     }
 
-    /* If a length of zero or a NULL data pointer was provided, skip writing
-     * to the file and just set the desired permissions. */
+    if (i == installed_filesystems.num &&
+        (fd = open(dir, O_RDONLY | O_DIRECTORY)) != -1) {
+        installed_filesystems.devs =
+            nvrealloc(installed_filesystems.devs, (i + 1) * sizeof(dev_t));
+        installed_filesystems.fds =
+            nvrealloc(installed_filesystems.fds, (i + 1) * sizeof(int));
+        installed_filesystems.devs[i] = stat_buf.st_dev;
+        installed_filesystems.fds[i] = fd;
+        installed_filesystems.num++;
+    }
 
-    if (len && data) {
+    pthread_mutex_unlock(&installed_filesystems.lock);
 
-        /* set the temporary file's size */
+ done:
+    nvfree(dirc);
+}
 
-        if (lseek(fd, len - 1, SEEK_SET) == -1) {
-            ui_warn(op, "Unable to set file size for temporary file (%s).",
-                    strerror(errno));
-            goto done;
-        }
-        if (write(fd, "", 1) != 1) {
-            ui_warn(op, "Unable to write file size for temporary file (%s).",
-                    strerror(errno));
-            goto done;
-        }
 
-        /* mmap the temporary file */
+/*
+ * get_staging_name() - return a new, unused name in the directory of
+ * 'dstfile' under which to stage it ("<dir>/.<name>.nv-XXXXXX"); the
+ * leading '.' keeps it from matching any conflicting file name.  The
+ * file is created empty, and private to the caller.  Returns NULL, with
+ * errno set, on failure.
+ */
 
-        if ((dst = mmap(0, len, PROT_READ | PROT_WRITE,
-                    MAP_FILE | MAP_SHARED, fd, 0)) == (void *) -1) {
-        ui_warn(op, "Unable to map temporary file (%s).", strerror(errno));
-        goto done;
+static char *get_staging_name(const char *dstfile)
+{
+    char *dirc = nvstrdup(dstfile), *basec = nvstrdup(dstfile);
+    char *tmpname;
+    int fd;
 
-        }
-    
-        /* copy the data out to the file */
+    tmpname = nvstrcat(dirname(dirc), "/.", basename(basec), ".nv-XXXXXX",
+                       NULL);
+    nvfree(dirc);
+    nvfree(basec);
 
-        memcpy(dst, data, len);
+    if ((fd = mkstemp(tmpname)) == -1) {
+        nvfree(tmpname);
+        return NULL;
     }
 
-    /* set the desired permissions on the file */
-    
-    if (fchmod(fd, perm) == -1) {
-        ui_warn(op, "Unable to set permissions %04o on temporary "
-                "file (%s)", perm, strerror(errno));
-        goto done;
-    }
-    
-    ret = TRUE;
+    close(fd);
 
- done:
-    
-    /* unmap the temporary file */
-    
-    if (dst != (void *) -1) {
-        if (munmap(dst, len) == -1) {
-            ui_warn(op, "Unable to unmap temporary file (%s).",
-                    strerror(errno));
-        }
+    return tmpname;
+}
+
+
+/*
+ * stage_file() - copy srcfile to a new temporary name beside dstfile,
+ * which is returned in '*tmpname'; see try_copy_file_with_checksum().
+ */
+
+static int stage_file(const char *srcfile, const char *dstfile,
+                      mode_t mode, FileChecksum *sum, char **tmpname,
+                      char **error_str)
+{
+    if ((*tmpname = get_staging_name(dstfile)) == NULL) {
+        *error_str = nvasprintf("Unable to create a temporary file to "
+                                "install '%s' (%s)", dstfile,
+                                strerror(errno));
+        return FALSE;
     }
-    
-    /* close the temporary file */
 
-    if (fd != -1) close(fd);
-    
-    if (ret) {
-        return tmpfile;
-    } else {
-        nvfree(tmpfile);
-        return NULL;
+    if (!try_copy_file_with_checksum(srcfile, *tmpname, mode, sum,
+                                     error_str)) {
+        unlink(*tmpname);
+        nvfree(*tmpname);
+        *tmpname = NULL;
+        return FALSE;
     }
-    
-} /* write_temp_file() */
+
+    return TRUE;
+}
 
 
 /*
- * check_libGLX_indirect_target() - Helper function for
- * check_libGLX_indirect_links.
- *
- * Checks to see if the installer should install (or overwrite) a
- * libGLX_indirect.so.0 symlink.
- *
- * (path) should be the path to where the symlink would be installed.
+ * try_stage_file_with_checksum() - same as try_copy_file_with_checksum(),
+ * but the file is staged under a temporary name and then renamed to
+ * 'dstfile'.  The file is not flushed to disk first; see
+ * sync_installed_filesystems().
  */
-static int check_libGLX_indirect_target(Options *op, const char *path)
+
+int try_stage_file_with_checksum(const char *srcfile, const char *dstfile,
+                                 mode_t mode, FileChecksum *sum,
+                                 char **error_str)
 {
-    char *target = NULL;
-    char *base = NULL;
-    char *ext = NULL;
-    struct stat stat_buf;
-    int ret;
+    char *tmpname;
 
-    if (lstat(path, &stat_buf) != 0) {
-        // If the file doesn't exist, then we should create it.
-        return TRUE;
+    if (!stage_file(srcfile, dstfile, mode, sum, &tmpname, error_str)) {
+        return FALSE;
     }
 
-    if (!S_ISLNK(stat_buf.st_mode)) {
-        // The file is not a symlink. Leave it alone.
+    if (renameat(AT_FDCWD, tmpname, AT_FDCWD, dstfile) == -1) {
+        *error_str = nvasprintf("Unable to rename '%s' to '%s' (%s)",
+                                tmpname, dstfile, strerror(errno));
+        unlink(tmpname);
+        nvfree(tmpname);
         return FALSE;
     }
 
-    if (stat(path, &stat_buf) != 0) {
-        // If we can't resolve the link, then overwrite it.
-        return TRUE;
-    }
+    nvfree(tmpname);
+    note_installed_filesystem(dstfile);
 
-    // Resolve the symlink.
-    target = get_resolved_symlink_target(op, path);
-    while (target != NULL) {
-        // Follow any more symlinks. The fact that the stat call above
-        // succeeded means that the link is valid.
-        char *nextTarget = NULL;
-        if (lstat(target, &stat_buf) != 0) {
-            free(target);
-            target = NULL;
-            break;
-        }
+    return TRUE;
+}
 
-        if (!S_ISLNK(stat_buf.st_mode)) {
-            break;
-        }
 
-        nextTarget = get_resolved_symlink_target(op, target);
-        free(target);
-        target = nextTarget;
-    }
-    if (target == NULL) {
-        // This should never happen.
-        ui_error(op, "Unable to resolve symbolic link \"%s\"\n", path);
+/*
+ * stage_symlink() - create a symbolic link 'dstfile' pointing at
+ * 'linkname' under a temporary name, and rename it into place.
+ */
+
+static int stage_symlink(const char *linkname, const char *dstfile)
+{
+    char *tmpname = get_staging_name(dstfile);
+    int saved_errno;
+
+    if (!tmpname) return FALSE;
+
+    /* replace the placeholder created by get_staging_name() */
+
+    if (unlink(tmpname) == -1 || symlink(linkname, tmpname) == -1 ||
+        renameat(AT_FDCWD, tmpname, AT_FDCWD, dstfile) == -1) {
+        saved_errno = errno;
+        unlink(tmpname);
+        nvfree(tmpname);
+        errno = saved_errno;
         return FALSE;
     }
 
-    // Find the basename of the link target.
-    base = basename(target);
-    // Strip off the extension.
-    ext = strchr(base, '.');
-    if (ext != NULL) {
-        *ext = '\0';
+    nvfree(tmpname);
+    note_installed_filesystem(dstfile);
+
+    return TRUE;
+}
+
+
+/*
+ * sync_installed_filesystems() - flush each filesystem that files were
+ * staged or installed into to disk, and forget them.  Returns FALSE if
+ * any could not be flushed.
+ */
+
+int sync_installed_filesystems(Options *op)
+{
+    int i, ret = TRUE;
+
+    pthread_mutex_lock(&installed_filesystems.lock);
+
+    for (i = 0; i < installed_filesystems.num; i++) {
+#if defined(__NR_syncfs)
+        if (syscall(__NR_syncfs, installed_filesystems.fds[i]) == -1) {
+            ui_error(op, "Unable to flush installed files to disk (%s).",
+                     strerror(errno));
+            ret = FALSE;
+        }
+#else
+        if (i == 0) sync();
+#endif
+        close(installed_filesystems.fds[i]);
     }
 
-    // Finally, see if the resulting name is "libGLX_indirect". If it is, then
-    // we'll assume that the existing file is a dedicated indirect rendering
-    // library. Otherwise, we'll assume that it's a link to another vendor
-    // library.
-    if (strcmp(base, "libGLX_indirect") == 0) {
-        ret = FALSE;
-    } else {
-        ret = TRUE;
+    if (installed_filesystems.num > 0) {
+        ui_log(op, "Flushed installed files on %d filesystem%s to disk.",
+               installed_filesystems.num,
+               installed_filesystems.num == 1 ? "" : "s");
     }
-    free(target);
+
+    nvfree(installed_filesystems.devs);
+    nvfree(installed_filesystems.fds);
+    installed_filesystems.devs = NULL;
+    installed_filesystems.fds = NULL;
+    installed_filesystems.num = 0;
+
+    pthread_mutex_unlock(&installed_filesystems.lock);
+
     return ret;
 }
 
+
+
 /*
- * check_libGLX_indirect_links() - Finds the entries for the
- * "libGLX_indirect.so.0" symlinks, and figures out whether to install them.
+ * Swap installation (--swap-install): every file and symbolic link to
+ * install is staged, as for --staged-install, before any destination is
+ * changed; the staged files are then moved into place together, with
+ * exchange_staged_file() and commit_staged_file(), so that the
+ * previous files are only missing for as long as that takes.  Package
+ * files can be staged even before the previous driver is uninstalled,
+ * by stage_package_files().  The staged files are only used from the
+ * calling thread.
  */
-static void check_libGLX_indirect_links(Options *op, Package *p)
+
+typedef struct {
+    char *dst;
+    char *src;          /* the target, for a symbolic link */
+    char *tmpname;
+    int is_symlink;
+    int committed;
+    mode_t mode;
+    FileChecksum sum;
+} StagedFile;
+
+static struct {
+    StagedFile *files;
+    int num;
+} staged_files;
+
+
+static StagedFile *find_staged_file(const char *dstfile)
 {
     int i;
 
-    if (op->install_libglx_indirect == NV_OPTIONAL_BOOL_TRUE) {
-        // The user specified that we should install the symlink.
-        return;
-    }
-
-    // Find the entries for libGLX_indirect.so.0, and decide whether or not to
-    // keep them.
-    for (i = 0; i < p->num_entries; i++) {
-        if (p->entries[i].dst != NULL && p->entries[i].type == FILE_TYPE_OPENGL_SYMLINK) {
-            if (strcmp(p->entries[i].name, "libGLX_indirect.so.0") == 0) {
-                int overwrite = FALSE;
-                if (op->install_libglx_indirect == NV_OPTIONAL_BOOL_DEFAULT) {
-                    if (check_libGLX_indirect_target(op, p->entries[i].dst)) {
-                        overwrite = TRUE;
-                    }
-                }
-                if (!overwrite) {
-                    invalidate_package_entry(&(p->entries[i]));
-                }
-            }
+    for (i = staged_files.num - 1; i >= 0; i--) {
+        if (strcmp(staged_files.files[i].dst, dstfile) == 0) {
+            return &staged_files.files[i];
         }
     }
+
+    return NULL;
+}
+
+
+static StagedFile *add_staged_file(const char *dstfile, const char *src,
+                                   char *tmpname, int is_symlink)
+{
+    StagedFile *f;
+
+    staged_files.files = nvrealloc(staged_files.files,
+                                   (staged_files.num + 1) *
+                                   sizeof(StagedFile));
+    f = &staged_files.files[staged_files.num++];
+
+    memset(f, 0, sizeof(*f));
+    f->dst = nvstrdup(dstfile);
+    f->src = nvstrdup(src);
+    f->tmpname = tmpname;
+    f->is_symlink = is_symlink;
+
+    note_installed_filesystem(dstfile);
+
+    return f;
 }
 
+
 /*
- * set_destinations() - given the Options and Package structures,
- * assign the destination field in each Package entry, building from
- * the OpenGL and XFree86 prefixes, the path relative to the prefix,
- * and the filename.  This assumes that the prefixes have already been
- * assigned in the Options struct.
+ * stage_package_files() - stage the files of the package that will be
+ * installed, where their destination directories already exist.  This
+ * is only an optimization: files that cannot be staged now are staged
+ * by stage_install_file() when the command list is executed.
  */
 
-int set_destinations(Options *op, Package *p)
+void stage_package_files(Options *op, Package *p)
 {
-    char *name;
-    char *dir, *path;
-    const char *prefix;
-    char *xdg_data_dir;
-    int i;
-    if (!op->kernel_module_src_dir) {
-        op->kernel_module_src_dir = nvstrcat("nvidia-", p->version, NULL);
-    }
+    PackageEntryFileTypeList installable_files;
+    int i, num_staged = 0;
+
+    get_installable_file_type_list(op, &installable_files);
+
+    ui_status_begin(op, "Staging the new driver files:", "Staging");
 
     for (i = 0; i < p->num_entries; i++) {
-        /* If a file type's destination was overridden, use the override */
-        if (op->file_type_destination_overrides[p->entries[i].type] != NULL) {
-            p->entries[i].dst = nvstrcat(
-                op->file_type_destination_overrides[p->entries[i].type], "/",
-                p->entries[i].name, NULL);
-            collapse_multiple_slashes(p->entries[i].dst);
+        PackageEntry *pe = &p->entries[i];
+        FileChecksum sum;
+        StagedFile *f;
+        char *tmpname, *error_str = NULL;
 
+        if (!pe->dst || pe->caps.is_symlink ||
+            !installable_files.types[pe->type] || find_staged_file(pe->dst)) {
             continue;
         }
 
-        switch (p->entries[i].type) {
+        ui_status_update(op, (float) i / (float) p->num_entries,
+                         "Staging: %s", pe->dst);
 
-        case FILE_TYPE_KERNEL_MODULE_SRC:
-        case FILE_TYPE_DKMS_CONF:
-            if (op->no_kernel_module_source) {
-                /* Don't install kernel module source files if requested. */
-                p->entries[i].dst = NULL;
-                continue;
-            }
-            prefix = op->kernel_module_src_prefix;
-            dir = op->kernel_module_src_dir;
-            path = p->entries[i].path;
-            break;
+        memset(&sum, 0, sizeof(sum));
+        sum.digest.type = op->backup_log_digest;
 
-        case FILE_TYPE_OPENGL_LIB:
-        case FILE_TYPE_OPENGL_SYMLINK:
-        case FILE_TYPE_GLVND_LIB:
-        case FILE_TYPE_GLVND_SYMLINK:
-        case FILE_TYPE_GLX_CLIENT_LIB:
-        case FILE_TYPE_GLX_CLIENT_SYMLINK:
-        case FILE_TYPE_EGL_CLIENT_LIB:
-        case FILE_TYPE_EGL_CLIENT_SYMLINK:
-            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
-                prefix = op->compat32_prefix;
-                dir = op->compat32_libdir;
-            } else {
-                prefix = op->opengl_prefix;
-                dir = op->opengl_libdir;
-            }
-            path = "";
-            break;
+        if (!stage_file(pe->file, pe->dst, pe->mode, &sum, &tmpname,
+                        &error_str)) {
+            ui_log(op, "%s; it will be installed later.", error_str);
+            nvfree(error_str);
+            continue;
+        }
 
-        case FILE_TYPE_VDPAU_LIB:
-        case FILE_TYPE_VDPAU_SYMLINK:
-            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
-                prefix = op->compat32_prefix;
-                dir = op->compat32_libdir;
-            } else {
-                prefix = op->opengl_prefix;
-                dir = op->opengl_libdir;
-            }
-            path = p->entries[i].path;
-            break;
+        f = add_staged_file(pe->dst, pe->file, tmpname, FALSE);
+        f->mode = pe->mode;
+        f->sum = sum;
+        num_staged++;
+    }
 
-        case FILE_TYPE_CUDA_LIB:
-        case FILE_TYPE_CUDA_SYMLINK:
-        case FILE_TYPE_OPENCL_LIB:
-        case FILE_TYPE_OPENCL_WRAPPER_LIB:
-        case FILE_TYPE_OPENCL_LIB_SYMLINK:
-        case FILE_TYPE_OPENCL_WRAPPER_SYMLINK:
-            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
-                prefix = op->compat32_prefix;
-                dir = op->compat32_libdir;
-            } else {
-                prefix = op->opengl_prefix;
-                dir = op->opengl_libdir;
-            }
-            path = p->entries[i].path;
-            break;
+    ui_status_end(op, "done.");
 
-        case FILE_TYPE_CUDA_ICD:
-            prefix = DEFAULT_CUDA_ICD_PREFIX;
-            dir = DEFAULT_CUDA_ICD_DIR;
-            path = "";
-            break;            
-            
-        case FILE_TYPE_XMODULE_SHARED_LIB:
-        case FILE_TYPE_GLX_MODULE_SHARED_LIB:
-        case FILE_TYPE_GLX_MODULE_SYMLINK:
-            prefix = op->x_module_path;
-            dir = "";
-            path = p->entries[i].path;
-            break;
+    ui_log(op, "Staged %d files for installation.", num_staged);
+}
 
-        case FILE_TYPE_TLS_LIB:
-            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
-                prefix = op->compat32_prefix;
-                dir = op->compat32_libdir;
-            } else {
-                prefix = op->opengl_prefix;
-                dir = op->opengl_libdir;
-            }
-            path = p->entries[i].path;
-            break;
 
-        case FILE_TYPE_UTILITY_LIB:
-        case FILE_TYPE_UTILITY_LIB_SYMLINK:
-            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
-                prefix = op->compat32_prefix;
-                dir = op->compat32_libdir;
-            } else {
-                prefix = op->utility_prefix;
-                dir = op->utility_libdir;
-            }
-            path = "";
-            break;
+/*
+ * stage_install_file() - stage srcfile for installation as dstfile,
+ * creating dstfile's directory if needed, unless stage_package_files()
+ * already did.  Returns FALSE, after reporting the error, on failure.
+ */
 
-        case FILE_TYPE_NVCUVID_LIB:
-        case FILE_TYPE_NVCUVID_LIB_SYMLINK:
-            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
-                prefix = op->compat32_prefix;
-                dir = op->compat32_libdir;
-            } else {
-                prefix = op->opengl_prefix;
-                dir = op->opengl_libdir;
-            }
-            path = "";
-            break;
+int stage_install_file(Options *op, const char *srcfile,
+                       const char *dstfile, mode_t mode)
+{
+    StagedFile *f = find_staged_file(dstfile);
+    FileChecksum sum;
+    char *dirc, *tmpname, *error_str = NULL;
+    int ret;
 
-        case FILE_TYPE_ENCODEAPI_LIB:
-        case FILE_TYPE_ENCODEAPI_LIB_SYMLINK:
-            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
-                prefix = op->compat32_prefix;
-                dir = op->compat32_libdir;
-            } else {
-                prefix = op->opengl_prefix;
-                dir = op->opengl_libdir;
-            }
-            path = "";
-            break;
+    if (f && !f->committed && !f->is_symlink && f->mode == mode &&
+        strcmp(f->src, srcfile) == 0) {
+        return TRUE;
+    }
 
-        case FILE_TYPE_VGX_LIB:
-        case FILE_TYPE_VGX_LIB_SYMLINK:
-            prefix = op->opengl_prefix;
-            dir = op->opengl_libdir;
-            path = "";
-            break;
+    dirc = nvstrdup(dstfile);
+    ret = mkdir_with_log(op, dirname(dirc), 0755);
+    nvfree(dirc);
 
-        case FILE_TYPE_GRID_LIB:
-        case FILE_TYPE_GRID_LIB_SYMLINK:
-        case FILE_TYPE_FLEXERA_LIB:
-        case FILE_TYPE_FLEXERA_LIB_SYMLINK:
-            prefix = op->opengl_prefix;
-            dir = op->opengl_libdir;
-            path = p->entries[i].path;
-            break;
+    if (!ret) return FALSE;
 
-        case FILE_TYPE_INSTALLER_BINARY:
-            prefix = op->utility_prefix;
-            dir = op->utility_bindir;
-            path = "";
-            break;
-            
-        case FILE_TYPE_DOCUMENTATION:
-            prefix = op->documentation_prefix;
-            dir = op->documentation_docdir;
-            path = p->entries[i].path;
-            break;
-
-        case FILE_TYPE_MANPAGE:
-        case FILE_TYPE_NVIDIA_MODPROBE_MANPAGE:
-            prefix = op->documentation_prefix;
-            dir = op->documentation_mandir;
-            path = p->entries[i].path;
-            break;
-
-        case FILE_TYPE_APPLICATION_PROFILE:
-            prefix = op->application_profile_path;
-            dir = path = "";
-            break;
-
-        case FILE_TYPE_UTILITY_BINARY:
-        case FILE_TYPE_UTILITY_BIN_SYMLINK:
-            prefix = op->utility_prefix;
-            dir = op->utility_bindir;
-            path = "";
-            break;
+    memset(&sum, 0, sizeof(sum));
+    sum.digest.type = op->backup_log_digest;
 
-        case FILE_TYPE_DOT_DESKTOP:
-            xdg_data_dir = get_xdg_data_dir();
-            if (xdg_data_dir) {
-                prefix = xdg_data_dir;
-                dir = nvstrdup("applications");
-            } else {
-                prefix = op->utility_prefix;
-                dir = op->dot_desktopdir;
-            }
-            path = "";
-            break;
+    if (!stage_file(srcfile, dstfile, mode, &sum, &tmpname, &error_str)) {
+        ui_error(op, "%s", error_str);
+        nvfree(error_str);
+        return FALSE;
+    }
 
-        case FILE_TYPE_KERNEL_MODULE:
-            
-            /*
-             * the kernel module dst field has already been
-             * initialized in add_kernel_module_to_package()
-             */
-            
-            continue;
+    f = add_staged_file(dstfile, srcfile, tmpname, FALSE);
+    f->mode = mode;
+    f->sum = sum;
 
-        case FILE_TYPE_MODULE_SIGNING_KEY:
-            prefix = op->module_signing_key_path;
-            dir = path = "";
-            break;
+    return TRUE;
+}
 
-        case FILE_TYPE_EXPLICIT_PATH:
-        case FILE_TYPE_NVIDIA_MODPROBE:
-            prefix = p->entries[i].path;
-            dir = path = "";
-            break;
 
-        case FILE_TYPE_NVIFR_LIB:
-        case FILE_TYPE_NVIFR_LIB_SYMLINK:
-            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
-                prefix = op->compat32_prefix;
-                dir = op->compat32_libdir;
-            } else {
-                prefix = op->opengl_prefix;
-                dir = op->opengl_libdir;
-            }
-            path = "";
-            break;
+/*
+ * stage_install_symlink() - stage a symbolic link 'dstfile' pointing at
+ * 'linkname', creating its directory if needed.  Returns FALSE, with
+ * errno set, on failure.
+ */
 
-        case FILE_TYPE_XORG_OUTPUTCLASS_CONFIG:
-            prefix = op->x_sysconfig_path;
-            dir = path = "";
-            break;
+int stage_install_symlink(Options *op, const char *linkname,
+                          const char *dstfile)
+{
+    char *dirc, *tmpname;
+    int ret, saved_errno;
 
-        case FILE_TYPE_VULKAN_ICD_JSON:
-            /*
-             * Defined by the Vulkan Linux ICD loader specification.
-             */
-            prefix = "/etc/vulkan/";
-            path = p->entries[i].path;
-            dir = "";
-            break;
+    dirc = nvstrdup(dstfile);
+    ret = mkdir_with_log(op, dirname(dirc), 0755);
+    nvfree(dirc);
 
-        case FILE_TYPE_GLVND_EGL_ICD_JSON:
-            // We'll set this path later in check_libglvnd_files. We have to
-            // wait until we figure out whether we're going to install our own
-            // build of the libglvnd libraries, which will determine where the
-            // JSON file goes.
-            p->entries[i].dst = NULL;
-            continue;
+    if (!ret) return FALSE;
 
-        case FILE_TYPE_EGL_EXTERNAL_PLATFORM_JSON:
-            prefix = op->external_platform_json_path;
-            dir = path = "";
-            break;
+    if ((tmpname = get_staging_name(dstfile)) == NULL) return FALSE;
 
-        case FILE_TYPE_ALLOCATOR_JSON:
-            /*
-             * Defined in the prototype allocator driver loader module code.
-             */
-            prefix = "/etc/allocator/";
-            dir = path = "";
-            break;
+    /* replace the placeholder created by get_staging_name() */
 
-        case FILE_TYPE_INTERNAL_UTILITY_BINARY:
-        case FILE_TYPE_INTERNAL_UTILITY_LIB:
-        case FILE_TYPE_INTERNAL_UTILITY_DATA:
-            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
-                // TODO: Avoid the chroot stuff below for this?
-                prefix = "/usr/lib/nvidia/32";
-            } else {
-                prefix = "/usr/lib/nvidia";
-            }
-            dir = path = "";
-            break;
+    if (unlink(tmpname) == -1 || symlink(linkname, tmpname) == -1) {
+        saved_errno = errno;
+        unlink(tmpname);
+        nvfree(tmpname);
+        errno = saved_errno;
+        return FALSE;
+    }
 
-        default:
-            
-            /* 
-             * silently ignore anything that doesn't match; libraries
-             * of the wrong TLS class may fall in here, for example.
-             */
-            
-            p->entries[i].dst = NULL;
-            continue;
-        }
+    add_staged_file(dstfile, linkname, tmpname, TRUE);
 
-        if ((prefix == NULL) || (dir == NULL) || (path == NULL)) {
-            p->entries[i].dst = NULL;
-            continue;
-        }
-        
-        name = p->entries[i].name;
+    return TRUE;
+}
 
-        p->entries[i].dst = nvstrcat(prefix, "/", dir, "/", path, "/", name, NULL);
-        collapse_multiple_slashes(p->entries[i].dst);
 
-#if defined(NV_X86_64)
-        if ((p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) &&
-            (op->compat32_chroot != NULL)) {
+/*
+ * exchange_staged_file() - atomically swap the file (or symbolic link)
+ * staged for 'dstfile' with the existing 'dstfile', using renameat2(2)'s
+ * RENAME_EXCHANGE.  On success, returns the temporary name that now
+ * holds the previous file, for the caller to back it up from there and
+ * free.  Returns NULL if nothing is staged for 'dstfile', if 'dstfile'
+ * does not exist, or if the filesystem cannot exchange files; the
+ * caller should then back 'dstfile' up, and commit_staged_file().
+ */
 
-            /*
-             * prepend an additional prefix; this is currently only
-             * used for Debian GNU/Linux on Linux/x86-64, but may see
-             * more use in the future.
-             */
+char *exchange_staged_file(Options *op, const char *dstfile)
+{
+#if defined(__NR_renameat2) && defined(RENAME_EXCHANGE)
+    StagedFile *f = find_staged_file(dstfile);
 
-            char *dst = p->entries[i].dst;
-            p->entries[i].dst = nvstrcat(op->compat32_chroot, dst, NULL);
+    if (!f || f->committed) return NULL;
 
-            nvfree(dst);
-        }
-#endif /* NV_X86_64 */
+    if (syscall(__NR_renameat2, AT_FDCWD, f->tmpname, AT_FDCWD, dstfile,
+                RENAME_EXCHANGE) == -1) {
+        return NULL;
     }
 
-    return TRUE;
-
-} /* set_destinations() */
+    f->committed = TRUE;
+    note_installed_filesystem(dstfile);
 
+    return nvstrdup(f->tmpname);
+#else
+    return NULL;
+#endif
+}
 
 
 /*
- * get_prefixes() - if in expert mode, ask the user for the OpenGL and
- * XFree86 installation prefix.  The default prefixes are already set
- * in parse_commandline().
+ * commit_staged_file() - move the file (or symbolic link) staged for
+ * 'dstfile' into place, if exchange_staged_file() has not already done
+ * so.  For a file, its checksums, computed as it was staged, are
+ * returned in 'sum'.  Returns FALSE, after reporting the error, on
+ * failure.
  */
 
-int get_prefixes (Options *op)
+int commit_staged_file(Options *op, const char *dstfile, FileChecksum *sum)
 {
-    char *ret;
- 
-    if (op->expert) {
-        ret = ui_get_input(op, op->x_prefix,
-                           "X installation prefix (only under "
-                           "rare circumstances should this be changed "
-                           "from the default)");
-        if (ret && ret[0]) {
-            op->x_prefix = ret; 
-            if (!confirm_path(op, op->x_prefix)) return FALSE;
-        }
-    }
-
-    remove_trailing_slashes(op->x_prefix);
-    ui_expert(op, "X installation prefix is: '%s'", op->x_prefix);
-    
-    /*
-     * assign the X module and library paths; this must be done
-     * after the default prefixes/paths are assigned.
-     */
+    StagedFile *f = find_staged_file(dstfile);
 
-    if (op->x_files_packaged) {
-        get_x_library_and_module_paths(op);
+    if (!f) {
+        ui_error(op, "No file has been staged for '%s'.", dstfile);
+        return FALSE;
     }
 
-    if (op->expert) {
-        ret = ui_get_input(op, op->x_library_path,
-                           "X library installation path (only under "
-                           "rare circumstances should this be changed "
-                           "from the default)");
-        if (ret && ret[0]) {
-            op->x_library_path = ret; 
-            if (!confirm_path(op, op->x_library_path)) return FALSE;
+    if (!f->committed) {
+        if (renameat(AT_FDCWD, f->tmpname, AT_FDCWD, dstfile) == -1) {
+            ui_error(op, "Unable to rename '%s' to '%s' (%s).",
+                     f->tmpname, dstfile, strerror(errno));
+            return FALSE;
         }
-    }
-
-    remove_trailing_slashes(op->x_library_path);
-    ui_expert(op, "X library installation path is: '%s'", op->x_library_path);
 
-    if (op->expert) {
-        ret = ui_get_input(op, op->x_module_path,
-                           "X module installation path (only under "
-                           "rare circumstances should this be changed "
-                           "from the default)");
-        if (ret && ret[0]) {
-            op->x_module_path = ret; 
-            if (!confirm_path(op, op->x_module_path)) return FALSE;
-        }
+        f->committed = TRUE;
+        note_installed_filesystem(dstfile);
     }
 
-    remove_trailing_slashes(op->x_module_path);
-    ui_expert(op, "X module installation path is: '%s'", op->x_module_path);
-        
-    if (op->expert) {
-        ret = ui_get_input(op, op->opengl_prefix,
-                           "OpenGL installation prefix (only under "
-                           "rare circumstances should this be changed "
-                           "from the default)");
-        if (ret && ret[0]) {
-            op->opengl_prefix = ret;
-            if (!confirm_path(op, op->opengl_prefix)) return FALSE;
-        }
-    }
+    if (sum) *sum = f->sum;
 
-    remove_trailing_slashes(op->opengl_prefix);
-    ui_expert(op, "OpenGL installation prefix is: '%s'", op->opengl_prefix);
+    return TRUE;
+}
 
 
-    if (op->expert) {
-        ret = ui_get_input(op, op->documentation_prefix,
-                           "Documentation installation prefix (only under "
-                           "rare circumstances should this be changed "
-                           "from the default)");
-        if (ret && ret[0]) {
-            op->documentation_prefix = ret;
-            if (!confirm_path(op, op->documentation_prefix)) return FALSE;
-        }
-    }
+/*
+ * discard_staged_files() - remove any staged files that were not moved
+ * into place, e.g. because the installation was aborted, and forget
+ * all staged files.
+ */
 
-    remove_trailing_slashes(op->documentation_prefix);
-    ui_expert(op, "Documentation installation prefix is: '%s'", op->documentation_prefix);
+void discard_staged_files(void)
+{
+    int i;
 
+    for (i = 0; i < staged_files.num; i++) {
+        StagedFile *f = &staged_files.files[i];
 
-    if (op->expert) {
-        ret = ui_get_input(op, op->utility_prefix,
-                           "Utility installation prefix (only under "
-                           "rare circumstances should this be changed "
-                           "from the default)");
-        if (ret && ret[0]) {
-            op->utility_prefix = ret;
-            if (!confirm_path(op, op->utility_prefix)) return FALSE;
+        if (!f->committed) {
+            unlink(f->tmpname);
         }
+
+        nvfree(f->dst);
+        nvfree(f->src);
+        nvfree(f->tmpname);
     }
 
-    remove_trailing_slashes(op->utility_prefix);
-    ui_expert(op, "Utility installation prefix is: '%s'", op->utility_prefix);
+    nvfree(staged_files.files);
+    staged_files.files = NULL;
+    staged_files.num = 0;
+}
 
-    if (op->expert) {
-        op->no_kernel_module_source =
-            !ui_yes_no(op, !op->no_kernel_module_source,
-                      "Do you want to install kernel module sources?");
+
+
+/*
+ * write_temp_file() - write the given data to a temporary file,
+ * setting the file's permissions to those specified in perm.  On
+ * success the name of the temporary file is returned; on error NULL
+ * is returned.
+ */
+
+char *write_temp_file(Options *op, const int len,
+                      const unsigned char *data, mode_t perm)
+{
+    unsigned char *dst = (void *) -1;
+    char *tmpfile = NULL;
+    int fd = -1;
+    int ret = FALSE;
+
+    /* create a temporary file */
+
+    tmpfile = nvstrcat(op->tmpdir, "/nv-tmp-XXXXXX", NULL);
+    
+    fd = mkstemp(tmpfile);
+    if (fd == -1) {
+        ui_warn(op, "Unable to create temporary file (%s).",
+                strerror(errno));
+        goto done;
     }
 
-    if (!op->no_kernel_module_source) {
-        if (op->expert) {
-            ret = ui_get_input(op, op->kernel_module_src_prefix,
-                               "Kernel module source installation prefix");
-            if (ret && ret[0]) {
-                op->kernel_module_src_prefix = ret;
-                if (!confirm_path(op, op->kernel_module_src_prefix))
-                    return FALSE;
-            }
+    /* If a length of zero or a NULL data pointer was provided, skip writing
+     * to the file and just set the desired permissions. */
+
+    if (len && data) {
+
+        /* set the temporary file's size */
+
+        if (lseek(fd, len - 1, SEEK_SET) == -1) {
+            ui_warn(op, "Unable to set file size for temporary file (%s).",
+                    strerror(errno));
+            goto done;
         }
-    
-        remove_trailing_slashes(op->kernel_module_src_prefix);
-        ui_expert(op, "Kernel module source installation prefix is: '%s'",
-                  op->kernel_module_src_prefix);
-    
-        if (op->expert) {
-            ret = ui_get_input(op, op->kernel_module_src_dir,
-                               "Kernel module source installation directory");
-            if (ret && ret[0]) {
-                op->kernel_module_src_dir = ret;
-                if (!confirm_path(op, op->kernel_module_src_dir)) return FALSE;
-            }
+        if (write(fd, "", 1) != 1) {
+            ui_warn(op, "Unable to write file size for temporary file (%s).",
+                    strerror(errno));
+            goto done;
         }
-    
-        remove_trailing_slashes(op->kernel_module_src_dir);
-        ui_expert(op, "Kernel module source installation directory is: '%s'",
-                  op->kernel_module_src_dir);
-    }
 
-#if defined(NV_X86_64)
-    if (op->expert) {
-        ret = ui_get_input(op, op->compat32_chroot,
-                           "Compat32 installation chroot (only under "
-                           "rare circumstances should this be "
-                           "changed from the default)");
-        if (ret && ret[0]) {
-            op->compat32_chroot = ret;
-            if (!confirm_path(op, op->compat32_chroot)) return FALSE;
+        /* mmap the temporary file */
+
+        if ((dst = mmap(0, len, PROT_READ | PROT_WRITE,
+                    MAP_FILE | MAP_SHARED, fd, 0)) == (void *) -1) {
+        ui_warn(op, "Unable to map temporary file (%s).", strerror(errno));
+        goto done;
+
         }
+    
+        /* copy the data out to the file */
+
+        memcpy(dst, data, len);
     }
 
-    remove_trailing_slashes(op->compat32_chroot);
-    ui_expert(op, "Compat32 installation chroot is: '%s'",
-              op->compat32_chroot);
+    /* set the desired permissions on the file */
+    
+    if (fchmod(fd, perm) == -1) {
+        ui_warn(op, "Unable to set permissions %04o on temporary "
+                "file (%s)", perm, strerror(errno));
+        goto done;
+    }
+    
+    ret = TRUE;
 
-    if (op->expert) {
-        ret = ui_get_input(op, op->compat32_prefix,
-                           "Compat32 installation prefix (only under "
-                           "rare circumstances should this be "
-                           "changed from the default)");
-        if (ret && ret[0]) {
-            op->compat32_prefix = ret;
-            if (!confirm_path(op, op->compat32_prefix)) return FALSE;
+ done:
+    
+    /* unmap the temporary file */
+    
+    if (dst != (void *) -1) {
+        if (munmap(dst, len) == -1) {
+            ui_warn(op, "Unable to unmap temporary file (%s).",
+                    strerror(errno));
         }
     }
+    
+    /* close the temporary file */
 
-    remove_trailing_slashes(op->compat32_prefix);
-    ui_expert(op, "Compat32 installation prefix is: '%s'",
-              op->compat32_prefix);
-#endif /* NV_X86_64 */
-
-    return TRUE;
+    if (fd != -1) close(fd);
     
-} /* get_prefixes() */
+    if (ret) {
+        return tmpfile;
+    } else {
+        nvfree(tmpfile);
+        return NULL;
+    }
+    
+} /* write_temp_file() */
 
 
 /*
- * add_kernel_module_helper() - append a kernel module (contained in
- * p->kernel_module_build_directory/subdir) to the package list.
+ * check_libGLX_indirect_target() - Helper function for
+ * check_libGLX_indirect_links.
+ *
+ * Checks to see if the installer should install (or overwrite) a
+ * libGLX_indirect.so.0 symlink.
+ *
+ * (path) should be the path to where the symlink would be installed.
  */
-
-static void add_kernel_module_helper(Options *op, Package *p,
-                                     const char *filename)
+static int check_libGLX_indirect_target(Options *op, const char *path)
 {
-    char *file, *name, *dst;
-
-    file = nvstrcat(p->kernel_module_build_directory, "/", filename, NULL);
+    char *target = NULL;
+    char *base = NULL;
+    char *ext = NULL;
+    struct stat stat_buf;
+    int ret;
 
-    name = strrchr(file, '/');
+    if (lstat(path, &stat_buf) != 0) {
+        // If the file doesn't exist, then we should create it.
+        return TRUE;
+    }
 
-    if (name && name[0]) {
-        name++;
+    if (!S_ISLNK(stat_buf.st_mode)) {
+        // The file is not a symlink. Leave it alone.
+        return FALSE;
     }
 
-    if (!name || !name[0]) {
-        name = file;
+    if (stat(path, &stat_buf) != 0) {
+        // If we can't resolve the link, then overwrite it.
+        return TRUE;
     }
 
-    dst = nvstrcat(op->kernel_module_installation_path, "/", filename, NULL);
+    // Resolve the symlink.
+    target = get_resolved_symlink_target(op, path);
+    while (target != NULL) {
+        // Follow any more symlinks. The fact that the stat call above
+        // succeeded means that the link is valid.
+        char *nextTarget = NULL;
+        if (lstat(target, &stat_buf) != 0) {
+            free(target);
+            target = NULL;
+            break;
+        }
 
-    add_package_entry(p,
-                      file,
-                      NULL, /* path */
-                      name,
-                      NULL, /* target */
-                      dst,
-                      FILE_TYPE_KERNEL_MODULE,
-                      FILE_COMPAT_ARCH_NONE,
-                      0644);
-}
+        if (!S_ISLNK(stat_buf.st_mode)) {
+            break;
+        }
 
-/*
- * add_kernel_modules_to_package() - add any to-be-installed kernel modules
- * to the package list for installation.
- */
+        nextTarget = get_resolved_symlink_target(op, target);
+        free(target);
+        target = nextTarget;
+    }
+    if (target == NULL) {
+        // This should never happen.
+        ui_error(op, "Unable to resolve symbolic link \"%s\"\n", path);
+        return FALSE;
+    }
 
-void add_kernel_modules_to_package(Options *op, Package *p)
-{
-    int i;
+    // Find the basename of the link target.
+    base = basename(target);
+    // Strip off the extension.
+    ext = strchr(base, '.');
+    if (ext != NULL) {
+        *ext = '\0';
+    }
 
-    for (i = 0; i < p->num_kernel_modules; i++) {
-        add_kernel_module_helper(op, p, p->kernel_modules[i].module_filename);
+    // Finally, see if the resulting name is "libGLX_indirect". If it is, then
+    // we'll assume that the existing file is a dedicated indirect rendering
+    // library. Otherwise, we'll assume that it's a link to another vendor
+    // library.
+    if (strcmp(base, "libGLX_indirect") == 0) {
+        ret = FALSE;
+    } else {
+        ret = TRUE;
     }
+    free(target);
+    return ret;
 }
 
-
-
 /*
- * Invalidate each package entry that is not type
- * FILE_TYPE_KERNEL_MODULE{,_SRC} or FILE_TYPE_DKMS_CONF.
+ * check_libGLX_indirect_links() - Finds the entries for the
+ * "libGLX_indirect.so.0" symlinks, and figures out whether to install them.
  */
-
-void remove_non_kernel_module_files_from_package(Options *op, Package *p)
+static void check_libGLX_indirect_links(Options *op, Package *p)
 {
     int i;
 
-    for (i = 0; i < p->num_entries; i++) {
-        if ((p->entries[i].type != FILE_TYPE_KERNEL_MODULE) &&
-            (p->entries[i].type != FILE_TYPE_KERNEL_MODULE_SRC) &&
-            (p->entries[i].type != FILE_TYPE_DKMS_CONF)) {
-            invalidate_package_entry(&(p->entries[i]));
-        }
+    if (op->install_libglx_indirect == NV_OPTIONAL_BOOL_TRUE) {
+        // The user specified that we should install the symlink.
+        return;
     }
-}
-
 
-/*
- * Invalidate each package entry that is an OpenGL file
- */
-void remove_opengl_files_from_package(Options *op, Package *p)
+    // Find the entries for libGLX_indirect.so.0, and decide whether or not to
+    // keep them.
+    for (i = 0; i < p->num_entries; i++) {
+        if (p->entries[i].dst != NULL && p->entries[i].type == FILE_TYPE_OPENGL_SYMLINK) {
+            if (strcmp(p->entries[i].name, "libGLX_indirect.so.0") == 0) {
+                int overwrite = FALSE;
+                if (op->install_libglx_indirect == NV_OPTIONAL_BOOL_DEFAULT) {
+                    if (check_libGLX_indirect_target(op, p->entries[i].dst)) {
+                        overwrite = TRUE;
+                    }
+                }
+                if (!overwrite) {
+                    invalidate_package_entry(&(p->entries[i]));
+                }
+            }
+        }
+    }
+}
+
+/*
+ * set_destinations() - given the Options and Package structures,
+ * assign the destination field in each Package entry, building from
+ * the OpenGL and XFree86 prefixes, the path relative to the prefix,
+ * and the filename.  This assumes that the prefixes have already been
+ * assigned in the Options struct.
+ */
+
+int set_destinations(Options *op, Package *p)
 {
+    char *name;
+    char *dir, *path;
+    const char *prefix;
+    char *xdg_data_dir;
     int i;
+    if (!op->kernel_module_src_dir) {
+        op->kernel_module_src_dir = nvstrcat("nvidia-", p->version, NULL);
+    }
+
+    for (i = 0; i < p->num_entries; i++) {
+        /* If a file type's destination was overridden, use the override */
+        if (op->file_type_destination_overrides[p->entries[i].type] != NULL) {
+            p->entries[i].dst = nvstrcat(
+                op->file_type_destination_overrides[p->entries[i].type], "/",
+                p->entries[i].name, NULL);
+            collapse_multiple_slashes(p->entries[i].dst);
+
+            continue;
+        }
+
+        switch (p->entries[i].type) {
+
+        case FILE_TYPE_KERNEL_MODULE_SRC:
+        case FILE_TYPE_DKMS_CONF:
+            if (op->no_kernel_module_source) {
+                /* Don't install kernel module source files if requested. */
+                p->entries[i].dst = NULL;
+                continue;
+            }
+            prefix = op->kernel_module_src_prefix;
+            dir = op->kernel_module_src_dir;
+            path = p->entries[i].path;
+            break;
+
+        case FILE_TYPE_OPENGL_LIB:
+        case FILE_TYPE_OPENGL_SYMLINK:
+        case FILE_TYPE_GLVND_LIB:
+        case FILE_TYPE_GLVND_SYMLINK:
+        case FILE_TYPE_GLX_CLIENT_LIB:
+        case FILE_TYPE_GLX_CLIENT_SYMLINK:
+        case FILE_TYPE_EGL_CLIENT_LIB:
+        case FILE_TYPE_EGL_CLIENT_SYMLINK:
+            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
+                prefix = op->compat32_prefix;
+                dir = op->compat32_libdir;
+            } else {
+                prefix = op->opengl_prefix;
+                dir = op->opengl_libdir;
+            }
+            path = "";
+            break;
+
+        case FILE_TYPE_VDPAU_LIB:
+        case FILE_TYPE_VDPAU_SYMLINK:
+            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
+                prefix = op->compat32_prefix;
+                dir = op->compat32_libdir;
+            } else {
+                prefix = op->opengl_prefix;
+                dir = op->opengl_libdir;
+            }
+            path = p->entries[i].path;
+            break;
+
+        case FILE_TYPE_CUDA_LIB:
+        case FILE_TYPE_CUDA_SYMLINK:
+        case FILE_TYPE_OPENCL_LIB:
+        case FILE_TYPE_OPENCL_WRAPPER_LIB:
+        case FILE_TYPE_OPENCL_LIB_SYMLINK:
+        case FILE_TYPE_OPENCL_WRAPPER_SYMLINK:
+            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
+                prefix = op->compat32_prefix;
+                dir = op->compat32_libdir;
+            } else {
+                prefix = op->opengl_prefix;
+                dir = op->opengl_libdir;
+            }
+            path = p->entries[i].path;
+            break;
+
+        case FILE_TYPE_CUDA_ICD:
+            prefix = DEFAULT_CUDA_ICD_PREFIX;
+            dir = DEFAULT_CUDA_ICD_DIR;
+            path = "";
+            break;            
+            
+        case FILE_TYPE_XMODULE_SHARED_LIB:
+        case FILE_TYPE_GLX_MODULE_SHARED_LIB:
+        case FILE_TYPE_GLX_MODULE_SYMLINK:
+            prefix = op->x_module_path;
+            dir = "";
+            path = p->entries[i].path;
+            break;
+
+        case FILE_TYPE_TLS_LIB:
+            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
+                prefix = op->compat32_prefix;
+                dir = op->compat32_libdir;
+            } else {
+                prefix = op->opengl_prefix;
+                dir = op->opengl_libdir;
+            }
+            path = p->entries[i].path;
+            break;
+
+        case FILE_TYPE_UTILITY_LIB:
+        case FILE_TYPE_UTILITY_LIB_SYMLINK:
+            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
+                prefix = op->compat32_prefix;
+                dir = op->compat32_libdir;
+            } else {
+                prefix = op->utility_prefix;
+                dir = op->utility_libdir;
+            }
+            path = "";
+            break;
+
+        case FILE_TYPE_NVCUVID_LIB:
+        case FILE_TYPE_NVCUVID_LIB_SYMLINK:
+            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
+                prefix = op->compat32_prefix;
+                dir = op->compat32_libdir;
+            } else {
+                prefix = op->opengl_prefix;
+                dir = op->opengl_libdir;
+            }
+            path = "";
+            break;
+
+        case FILE_TYPE_ENCODEAPI_LIB:
+        case FILE_TYPE_ENCODEAPI_LIB_SYMLINK:
+            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
+                prefix = op->compat32_prefix;
+                dir = op->compat32_libdir;
+            } else {
+                prefix = op->opengl_prefix;
+                dir = op->opengl_libdir;
+            }
+            path = "";
+            break;
+
+        case FILE_TYPE_VGX_LIB:
+        case FILE_TYPE_VGX_LIB_SYMLINK:
+            prefix = op->opengl_prefix;
+            dir = op->opengl_libdir;
+            path = "";
+            break;
+
+        case FILE_TYPE_GRID_LIB:
+        case FILE_TYPE_GRID_LIB_SYMLINK:
+        case FILE_TYPE_FLEXERA_LIB:
+        case FILE_TYPE_FLEXERA_LIB_SYMLINK:
+            prefix = op->opengl_prefix;
+            dir = op->opengl_libdir;
+            path = p->entries[i].path;
+            break;
+
+        case FILE_TYPE_INSTALLER_BINARY:
+            prefix = op->utility_prefix;
+            dir = op->utility_bindir;
+            path = "";
+            break;
+            
+        case FILE_TYPE_DOCUMENTATION:
+            prefix = op->documentation_prefix;
+            dir = op->documentation_docdir;
+            path = p->entries[i].path;
+            break;
+
+        case FILE_TYPE_MANPAGE:
+        case FILE_TYPE_NVIDIA_MODPROBE_MANPAGE:
+            prefix = op->documentation_prefix;
+            dir = op->documentation_mandir;
+            path = p->entries[i].path;
+            break;
+
+        case FILE_TYPE_APPLICATION_PROFILE:
+            prefix = op->application_profile_path;
+            dir = path = "";
+            break;
+
+        case FILE_TYPE_UTILITY_BINARY:
+        case FILE_TYPE_UTILITY_BIN_SYMLINK:
+            prefix = op->utility_prefix;
+            dir = op->utility_bindir;
+            path = "";
+            break;
+
+        case FILE_TYPE_DOT_DESKTOP:
+            xdg_data_dir = get_xdg_data_dir();
+            if (xdg_data_dir) {
+                prefix = xdg_data_dir;
+                dir = nvstrdup("applications");
+            } else {
+                prefix = op->utility_prefix;
+                dir = op->dot_desktopdir;
+            }
+            path = "";
+            break;
+
+        case FILE_TYPE_KERNEL_MODULE:
+            
+            /*
+             * the kernel module dst field has already been
+             * initialized in add_kernel_module_to_package()
+             */
+            
+            continue;
+
+        case FILE_TYPE_MODULE_SIGNING_KEY:
+            prefix = op->module_signing_key_path;
+            dir = path = "";
+            break;
+
+        case FILE_TYPE_EXPLICIT_PATH:
+        case FILE_TYPE_NVIDIA_MODPROBE:
+            prefix = p->entries[i].path;
+            dir = path = "";
+            break;
+
+        case FILE_TYPE_NVIFR_LIB:
+        case FILE_TYPE_NVIFR_LIB_SYMLINK:
+            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
+                prefix = op->compat32_prefix;
+                dir = op->compat32_libdir;
+            } else {
+                prefix = op->opengl_prefix;
+                dir = op->opengl_libdir;
+            }
+            path = "";
+            break;
+
+        case FILE_TYPE_XORG_OUTPUTCLASS_CONFIG:
+            prefix = op->x_sysconfig_path;
+            dir = path = "";
+            break;
+
+        case FILE_TYPE_VULKAN_ICD_JSON:
+            /*
+             * Defined by the Vulkan Linux ICD loader specification.
+             */
+            prefix = "/etc/vulkan/";
+            path = p->entries[i].path;
+            dir = "";
+            break;
+
+        case FILE_TYPE_GLVND_EGL_ICD_JSON:
+            // We'll set this path later in check_libglvnd_files. We have to
+            // wait until we figure out whether we're going to install our own
+            // build of the libglvnd libraries, which will determine where the
+            // JSON file goes.
+            p->entries[i].dst = NULL;
+            continue;
+
+        case FILE_TYPE_EGL_EXTERNAL_PLATFORM_JSON:
+            prefix = op->external_platform_json_path;
+            dir = path = "";
+            break;
+
+        case FILE_TYPE_ALLOCATOR_JSON:
+            /*
+             * Defined in the prototype allocator driver loader module code.
+             */
+            prefix = "/etc/allocator/";
+            dir = path = "";
+            break;
+
+        case FILE_TYPE_INTERNAL_UTILITY_BINARY:
+        case FILE_TYPE_INTERNAL_UTILITY_LIB:
+        case FILE_TYPE_INTERNAL_UTILITY_DATA:
+            if (p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) {
+                // TODO: Avoid the chroot stuff below for this?
+                prefix = "/usr/lib/nvidia/32";
+            } else {
+                prefix = "/usr/lib/nvidia";
+            }
+            dir = path = "";
+            break;
+
+        default:
+            
+            /* 
+             * silently ignore anything that doesn't match; libraries
+             * of the wrong TLS class may fall in here, for example.
+             */
+            
+            p->entries[i].dst = NULL;
+            continue;
+        }
+
+        if ((prefix == NULL) || (dir == NULL) || (path == NULL)) {
+            p->entries[i].dst = NULL;
+            continue;
+        }
+        
+        name = p->entries[i].name;
+
+        p->entries[i].dst = nvstrcat(prefix, "/", dir, "/", path, "/", name, NULL);
+        collapse_multiple_slashes(p->entries[i].dst);
+
+#if defined(NV_X86_64)
+        if ((p->entries[i].compat_arch == FILE_COMPAT_ARCH_COMPAT32) &&
+            (op->compat32_chroot != NULL)) {
+
+            /*
+             * prepend an additional prefix; this is currently only
+             * used for Debian GNU/Linux on Linux/x86-64, but may see
+             * more use in the future.
+             */
+
+            char *dst = p->entries[i].dst;
+            p->entries[i].dst = nvstrcat(op->compat32_chroot, dst, NULL);
+
+            nvfree(dst);
+        }
+#endif /* NV_X86_64 */
+    }
+
+    return TRUE;
+
+} /* set_destinations() */
+
+
+
+/*
+ * get_prefixes() - if in expert mode, ask the user for the OpenGL and
+ * XFree86 installation prefix.  The default prefixes are already set
+ * in parse_commandline().
+ */
+
+int get_prefixes (Options *op)
+{
+    char *ret;
+ 
+    if (op->expert) {
+        ret = ui_get_input(op, op->x_prefix,
+                           "X installation prefix (only under "
+                           "rare circumstances should this be changed "
+                           "from the default)");
+        if (ret && ret[0]) {
+            op->x_prefix = ret; 
+            if (!confirm_path(op, op->x_prefix)) return FALSE;
+        }
+    }
+
+    remove_trailing_slashes(op->x_prefix);
+    ui_expert(op, "X installation prefix is: '%s'", op->x_prefix);
+    
+    /*
+     * assign the X module and library paths; this must be done
+     * after the default prefixes/paths are assigned.
+     */
+
+    if (op->x_files_packaged) {
+        get_x_library_and_module_paths(op);
+    }
+
+    if (op->expert) {
+        ret = ui_get_input(op, op->x_library_path,
+                           "X library installation path (only under "
+                           "rare circumstances should this be changed "
+                           "from the default)");
+        if (ret && ret[0]) {
+            op->x_library_path = ret; 
+            if (!confirm_path(op, op->x_library_path)) return FALSE;
+        }
+    }
+
+    remove_trailing_slashes(op->x_library_path);
+    ui_expert(op, "X library installation path is: '%s'", op->x_library_path);
+
+    if (op->expert) {
+        ret = ui_get_input(op, op->x_module_path,
+                           "X module installation path (only under "
+                           "rare circumstances should this be changed "
+                           "from the default)");
+        if (ret && ret[0]) {
+            op->x_module_path = ret; 
+            if (!confirm_path(op, op->x_module_path)) return FALSE;
+        }
+    }
+
+    remove_trailing_slashes(op->x_module_path);
+    ui_expert(op, "X module installation path is: '%s'", op->x_module_path);
+        
+    if (op->expert) {
+        ret = ui_get_input(op, op->opengl_prefix,
+                           "OpenGL installation prefix (only under "
+                           "rare circumstances should this be changed "
+                           "from the default)");
+        if (ret && ret[0]) {
+            op->opengl_prefix = ret;
+            if (!confirm_path(op, op->opengl_prefix)) return FALSE;
+        }
+    }
+
+    remove_trailing_slashes(op->opengl_prefix);
+    ui_expert(op, "OpenGL installation prefix is: '%s'", op->opengl_prefix);
+
+
+    if (op->expert) {
+        ret = ui_get_input(op, op->documentation_prefix,
+                           "Documentation installation prefix (only under "
+                           "rare circumstances should this be changed "
+                           "from the default)");
+        if (ret && ret[0]) {
+            op->documentation_prefix = ret;
+            if (!confirm_path(op, op->documentation_prefix)) return FALSE;
+        }
+    }
+
+    remove_trailing_slashes(op->documentation_prefix);
+    ui_expert(op, "Documentation installation prefix is: '%s'", op->documentation_prefix);
+
+
+    if (op->expert) {
+        ret = ui_get_input(op, op->utility_prefix,
+                           "Utility installation prefix (only under "
+                           "rare circumstances should this be changed "
+                           "from the default)");
+        if (ret && ret[0]) {
+            op->utility_prefix = ret;
+            if (!confirm_path(op, op->utility_prefix)) return FALSE;
+        }
+    }
+
+    remove_trailing_slashes(op->utility_prefix);
+    ui_expert(op, "Utility installation prefix is: '%s'", op->utility_prefix);
+
+    if (op->expert) {
+        op->no_kernel_module_source =
+            !ui_yes_no(op, !op->no_kernel_module_source,
+                      "Do you want to install kernel module sources?");
+    }
+
+    if (!op->no_kernel_module_source) {
+        if (op->expert) {
+            ret = ui_get_input(op, op->kernel_module_src_prefix,
+                               "Kernel module source installation prefix");
+            if (ret && ret[0]) {
+                op->kernel_module_src_prefix = ret;
+                if (!confirm_path(op, op->kernel_module_src_prefix))
+                    return FALSE;
+            }
+        }
+    
+        remove_trailing_slashes(op->kernel_module_src_prefix);
+        ui_expert(op, "Kernel module source installation prefix is: '%s'",
+                  op->kernel_module_src_prefix);
+    
+        if (op->expert) {
+            ret = ui_get_input(op, op->kernel_module_src_dir,
+                               "Kernel module source installation directory");
+            if (ret && ret[0]) {
+                op->kernel_module_src_dir = ret;
+                if (!confirm_path(op, op->kernel_module_src_dir)) return FALSE;
+            }
+        }
+    
+        remove_trailing_slashes(op->kernel_module_src_dir);
+        ui_expert(op, "Kernel module source installation directory is: '%s'",
+                  op->kernel_module_src_dir);
+    }
+
+#if defined(NV_X86_64)
+    if (op->expert) {
+        ret = ui_get_input(op, op->compat32_chroot,
+                           "Compat32 installation chroot (only under "
+                           "rare circumstances should this be "
+                           "changed from the default)");
+        if (ret && ret[0]) {
+            op->compat32_chroot = ret;
+            if (!confirm_path(op, op->compat32_chroot)) return FALSE;
+        }
+    }
+
+    remove_trailing_slashes(op->compat32_chroot);
+    ui_expert(op, "Compat32 installation chroot is: '%s'",
+              op->compat32_chroot);
+
+    if (op->expert) {
+        ret = ui_get_input(op, op->compat32_prefix,
+                           "Compat32 installation prefix (only under "
+                           "rare circumstances should this be "
+                           "changed from the default)");
+        if (ret && ret[0]) {
+            op->compat32_prefix = ret;
+            if (!confirm_path(op, op->compat32_prefix)) return FALSE;
+        }
+    }
+
+    remove_trailing_slashes(op->compat32_prefix);
+    ui_expert(op, "Compat32 installation prefix is: '%s'",
+              op->compat32_prefix);
+#endif /* NV_X86_64 */
+
+    return TRUE;
+    
+} /* get_prefixes() */
+
+
+/*
+ * add_kernel_module_helper() - append a kernel module (contained in
+ * p->kernel_module_build_directory/subdir) to the package list.
+ */
+
+static void add_kernel_module_helper(Options *op, Package *p,
+                                     const char *filename)
+{
+    char *file, *name, *dst;
+
+    file = nvstrcat(p->kernel_module_build_directory, "/", filename, NULL);
+
+    name = strrchr(file, '/');
+
+    if (name && name[0]) {
+        name++;
+    }
+
+    if (!name || !name[0]) {
+        name = file;
+    }
+
+    dst = nvstrcat(op->kernel_module_installation_path, "/", filename, NULL);
+
+    add_package_entry(p,
+                      file,
+                      NULL, /* path */
+                      name,
+                      NULL, /* target */
+                      dst,
+                      FILE_TYPE_KERNEL_MODULE,
+                      FILE_COMPAT_ARCH_NONE,
+                      0644);
+}
+
+/*
+ * add_kernel_modules_to_package() - add any to-be-installed kernel modules
+ * to the package list for installation.
+ */
+
+void add_kernel_modules_to_package(Options *op, Package *p)
+{
+    int i;
+
+    for (i = 0; i < p->num_kernel_modules; i++) {
+        add_kernel_module_helper(op, p, p->kernel_modules[i].module_filename);
+    }
+}
+
+
+
+/*
+ * Invalidate each package entry that is not type
+ * FILE_TYPE_KERNEL_MODULE{,_SRC} or FILE_TYPE_DKMS_CONF.
+ */
+
+void remove_non_kernel_module_files_from_package(Options *op, Package *p)
+{
+    int i;
+
+    for (i = 0; i < p->num_entries; i++) {
+        if ((p->entries[i].type != FILE_TYPE_KERNEL_MODULE) &&
+            (p->entries[i].type != FILE_TYPE_KERNEL_MODULE_SRC) &&
+            (p->entries[i].type != FILE_TYPE_DKMS_CONF)) {
+            invalidate_package_entry(&(p->entries[i]));
+        }
+    }
+}
+
+
+/*
+ * Invalidate each package entry that is an OpenGL file
+ */
+void remove_opengl_files_from_package(Options *op, Package *p)
+{
+    int i;
+
+    for (i = 0; i < p->num_entries; i++) {
+        if (p->entries[i].caps.is_opengl) {
+            invalidate_package_entry(&(p->entries[i]));
+        }
+    }
+}
+
+
+
+/*
+ * mode_string_to_mode() - convert the string s 
+ */
+
+int mode_string_to_mode(Options *op, char *s, mode_t *mode)
+{
+    char *endptr;
+    long int ret;
+    
+    ret = strtol(s, &endptr, 8);
+
+    if ((ret == LONG_MIN) || (ret == LONG_MAX) || (*endptr != '\0')) {
+        ui_error(op, "Error parsing permission string '%s' (%s)",
+                 s, strerror (errno));
+        return FALSE;
+    }
+
+    *mode = (mode_t) ret;
+
+    return TRUE;
+    
+} /* mode_string_to_mode() */
+
+
+
+/*
+ * mode_to_permission_string() - given a mode bitmask, allocate and
+ * write a permission string.
+ */
+
+char *mode_to_permission_string(mode_t mode)
+{
+    char *s = (char *) nvalloc(10);
+    memset (s, '-', 9);
+    
+    if (mode & (1 << 8)) s[0] = 'r';
+    if (mode & (1 << 7)) s[1] = 'w';
+    if (mode & (1 << 6)) s[2] = 'x';
+    
+    if (mode & (1 << 5)) s[3] = 'r';
+    if (mode & (1 << 4)) s[4] = 'w';
+    if (mode & (1 << 3)) s[5] = 'x';
+    
+    if (mode & (1 << 2)) s[6] = 'r';
+    if (mode & (1 << 1)) s[7] = 'w';
+    if (mode & (1 << 0)) s[8] = 'x';
+    
+    s[9] = '\0';
+    return s;
+
+} /* mode_to_permission_string() */
+
+
+
+/*
+ * confirm_path() - check that the path exists; if not, ask the user
+ * if it's OK to create it and then do mkdir().
+ *
+ * XXX for a while, I had thought that it would be better for this
+ * function to only ask the user if it was OK to create the directory;
+ * there are just too many reasons why mkdir might fail, though, so
+ * it's better to do mkdir() so that we can fail at this point in the
+ * installation.
+ */
+
+int confirm_path(Options *op, const char *path)
+{
+    const char *choices[2] = {
+        "Create directory",
+        "Abort installation"
+    };
+
+    /* return TRUE if the path already exists and is a directory */
+
+    if (directory_exists(path)) return TRUE;
+    
+    if (ui_multiple_choice(op, choices, 2, 0, "The directory '%s' does not "
+                           "exist; would you like to create it, or would you "
+                           "prefer to abort installation?", path) == 0) {
+        if (mkdir_with_log(op, path, 0755)) {
+            return TRUE;
+        } else {
+            return FALSE;
+        }
+    }
+    
+    ui_message(op, "Not creating directory '%s'; aborting installation.",
+               path);
+    
+    return FALSE;
+
+} /* confirm_path() */
+
+
+
+/*
+ * mkdir_recursive() - create the path specified, also creating parent
+ * directories as needed; this is equivalent to `mkdir -p`. Log created
+ * directories if the "log" parameter is set.
+ */
+
+int mkdir_recursive(Options *op, const char *path, const mode_t mode, int log)
+{
+    char *error_str = NULL;
+    char *log_str   = NULL;
+    int success = FALSE;
+
+    success = nv_mkdir_recursive(path, mode, &error_str, log ? &log_str : NULL);
+
+    if (log_str) {
+        log_mkdir(op, log_str);
+        free(log_str);
+    }
+
+    if (error_str) {
+        ui_error(op, "%s", error_str);
+        free(error_str);
+    }
+
+    return success;
+}
+
+
+
+/*
+ * mkdir_with_log() - Wrap mkdir_recursive() to create the path specified
+ * with any needed parent directories.
+ */
+
+int mkdir_with_log(Options *op, const char *path, const mode_t mode)
+{
+    return mkdir_recursive(op, path, mode, TRUE);
+}
+
+
+
+/*
+ * get_symlink_target() - get the target of the symbolic link
+ * 'filename'.  On success, a newly malloced string containing the
+ * target is returned.  On error, an error message is printed and NULL
+ * is returned.
+ */
+
+char *get_symlink_target(Options *op, const char *filename)
+{
+    struct stat stat_buf;
+    int ret, len = 0;
+    char *buf = NULL;
+
+    if (lstat(filename, &stat_buf) == -1) {
+        ui_error(op, "Unable to get file properties for '%s' (%s).",
+                 filename, strerror(errno));
+        return NULL;
+    }
+    
+    if (!S_ISLNK(stat_buf.st_mode)) {
+        ui_error(op, "File '%s' is not a symbolic link.", filename);
+        return NULL;
+    }
+    
+    /*
+     * grow the buffer to be passed into readlink(2), until the buffer
+     * is big enough to hold the whole target.
+     */
+
+    do {
+        len += NV_LINE_LEN;
+        if (buf) free(buf);
+        buf = nvalloc(len);
+        ret = readlink(filename, buf, len - 1);
+        if (ret == -1) {
+            ui_error(op, "Failure while reading target of symbolic "
+                     "link %s (%s).", filename, strerror(errno));
+            free(buf);
+            return NULL;
+        }
+    } while (ret >= (len - 1));
+
+    buf[ret] = '\0';
+    
+    return buf;
+
+} /* get_symlink_target() */
+
+
+
+/*
+ * get_resolved_symlink_target() - same as get_symlink_target, except that
+ * relative links get resolved to an absolute path.
+ */
+char * get_resolved_symlink_target(Options *op, const char *filename)
+{
+    char *target = get_symlink_target(op, filename);
+    if (target[0] != '/') {
+        /* target is relative; canonicalize */
+        char *filename_copy, *target_dir, *full_target_path;
+
+        /* dirname(3) may modify the string passed into it; make a copy */
+        filename_copy = nvstrdup(filename);
+        target_dir = dirname(filename_copy);
+
+        full_target_path = nvstrcat(target_dir, "/", target, NULL);
+
+        nvfree(filename_copy);
+        nvfree(target);
+
+        target = nvalloc(PATH_MAX);
+        target = realpath(full_target_path, target);
+
+        nvfree(full_target_path);
+    }
+
+    return target;
+
+} /* get_resolved_symlink_target() */
+
+
+
+/*
+ * install_file() - install srcfile as dstfile; this is done by
+ * extracting the directory portion of dstfile, and then calling
+ * copy_file() (or, with --staged-install, staging the file under a
+ * temporary name and renaming it into place).  If sum is non-NULL, the
+ * checksums of the installed file are computed and returned in sum.
+ */ 
+
+int install_file(Options *op, const char *srcfile,
+                 const char *dstfile, mode_t mode, FileChecksum *sum)
+{   
+    int retval; 
+    char *dirc, *dname;
+
+    dirc = nvstrdup(dstfile);
+    dname = dirname(dirc);
+    
+    if (!mkdir_with_log(op, dname, 0755)) {
+        free(dirc);
+        return FALSE;
+    }
+
+    if (op->staged_install) {
+        char *error_str = NULL;
+
+        retval = try_stage_file_with_checksum(srcfile, dstfile, mode, sum,
+                                              &error_str);
+        if (error_str) {
+            ui_error(op, "%s", error_str);
+            nvfree(error_str);
+        }
+    } else {
+        retval = copy_file_with_checksum(op, srcfile, dstfile, mode, sum);
+    }
+    free(dirc);
+
+    return retval;
+
+} /* install_file() */
+
+
+/*
+ * install_symlink() - install dstfile as a symlink to linkname; this
+ * is done by extracting the directory portion of dstfile, creating
+ * that directory if it does not exist, and then calling symlink().
+ */ 
+
+int install_symlink(Options *op, const char *linkname, const char *dstfile)
+{   
+    char *dirc, *dname;
+
+    dirc = nvstrdup(dstfile);
+    dname = dirname(dirc);
+    
+    if (!mkdir_with_log(op, dname, 0755)) {
+        free(dirc);
+        return FALSE;
+    }
+
+    if (op->staged_install ? !stage_symlink(linkname, dstfile) :
+                             symlink(linkname, dstfile) != 0) {
+        free(dirc);
+        return FALSE;
+    }
+
+    free(dirc);
+    return TRUE;
+
+} /* install_symlink() */
+
+
+
+size_t get_file_size(Options *op, const char *filename)
+{
+    struct stat stat_buf;
+    
+    if (stat(filename, &stat_buf) == -1) {
+        ui_error(op, "Unable to determine file size of '%s' (%s).",
+                 filename, strerror(errno));
+        return 0;
+    }
+
+    return stat_buf.st_size;
+
+} /* get_file_size() */
+
+
+
+size_t fget_file_size(Options *op, const int fd)
+{
+    struct stat stat_buf;
+    
+    if (fstat(fd, &stat_buf) == -1) {
+        ui_error(op, "Unable to determine file size of file "
+                 "descriptor %d (%s).", fd, strerror(errno));
+        return 0;
+    }
+
+    return stat_buf.st_size;
+
+} /* fget_file_size() */
+
+
+
+char *get_tmpdir(Options *op)
+{
+    char *tmpdirs[] = { NULL, "/tmp", ".", NULL };
+    int i;
+
+    tmpdirs[0] = getenv("TMPDIR");
+    tmpdirs[3] = getenv("HOME");
+    
+    for (i = 0; i < 4; i++) {
+        if (tmpdirs[i] && directory_exists(tmpdirs[i])) {
+            return (tmpdirs[i]);
+        }
+    }
+    
+    return NULL;
+
+} /* get_tmpdir() */
+
+
+
+/*
+ * make_tmpdir() - create a temporary directory; XXX we should really
+ * use mkdtemp, but it is not available on all systems.
+ */
+
+char *make_tmpdir(Options *op)
+{
+    char tmp[32], *tmpdir;
+    
+    snprintf(tmp, 32, "%d", getpid());
+    
+    tmpdir = nvstrcat(op->tmpdir, "/nvidia-", tmp, NULL);
+    
+    if (directory_exists(tmpdir)) {
+        remove_directory(op, tmpdir);
+    }
+    
+    if (!mkdir_recursive(op, tmpdir, 0655, FALSE)) {
+        return NULL;
+    }
+    
+    return tmpdir;
+    
+} /* make_tmpdir() */
+
+
+
+/*
+ * nvrename() - replacement for rename(2), because rename(2) can't
+ * cross filesystem boundaries.  Within a filesystem, just rename(2) the
+ * file: this moves only metadata, and keeps the file's inode, and so
+ * its timestamps and mode.  Otherwise, get the src file attributes, copy
+ * the src file to the dst file (by reflink or in the kernel where
+ * possible), stamp the dst file with the src file's timestamps, and
+ * delete the src file.  Returns FALSE on error, TRUE on success.
+ */
+
+int nvrename(Options *op, const char *src, const char *dst)
+{
+    struct stat stat_buf;
+    struct timespec times[2];
+
+    if (rename(src, dst) == 0) return TRUE;
+
+    if (stat(src, &stat_buf) == -1) {
+        ui_error(op, "Unable to determine file attributes of file "
+                 "%s (%s).", src, strerror(errno));
+        return FALSE;
+    }
+        
+    if (!copy_file(op, src, dst, stat_buf.st_mode)) {
+        return FALSE;
+    }
+
+    times[0] = stat_buf.st_atim; /* access time */
+    times[1] = stat_buf.st_mtim; /* modification time */
+
+    if (utimensat(AT_FDCWD, dst, times, 0) == -1) {
+        ui_warn(op, "Unable to transfer timestamp from '%s' to '%s' (%s).",
+                   src, dst, strerror(errno));
+    }
+    
+    if (unlink(src) == -1) {
+        ui_error(op, "Unable to delete '%s' (%s).", src, strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+    
+} /* nvrename() */
+
+
+
+/*
+ * check_for_existing_rpms() - check if any of the previous NVIDIA
+ * rpms are installed on the system.  If we find any, ask the user if
+ * we may remove them.
+ */
+
+int check_for_existing_rpms(Options *op)
+{
+    /* list of rpms to remove; should be in dependency order */
+
+    const char *rpms[2] = { "NVIDIA_GLX", "NVIDIA_kernel" };
+
+    char *data, *cmd;
+    int i, ret;
+
+    if (op->no_rpms) {
+        ui_log(op, "Skipping check for conflicting rpms.");
+        return TRUE;
+    }
+
+    for (i = 0; i < 2; i++) {
+        
+        cmd = nvstrcat("env LD_KERNEL_ASSUME=2.2.5 rpm --query ",
+                       rpms[i], NULL);
+        ret = run_command(op, cmd, NULL, FALSE, 0, TRUE);
+        nvfree(cmd);
+
+        if (ret == 0) {
+            if (ui_multiple_choice(op, CONTINUE_ABORT_CHOICES,
+                                   NUM_CONTINUE_ABORT_CHOICES,
+                                   CONTINUE_CHOICE, /* Default choice */
+                                   "An %s rpm appears to already be installed "
+                                   "on your system.  As part of installing the "
+                                   "new driver, this %s rpm will be "
+                                   "uninstalled. Are you sure you want to "
+                                   "continue?",
+                                   rpms[i], rpms[i]) == ABORT_CHOICE) {
+                ui_log(op, "Installation aborted.");
+                return FALSE;
+            }
+            
+            cmd = nvstrcat("rpm --erase --nodeps ", rpms[i], NULL);
+            ret = run_command(op, cmd, &data, op->expert, 0, TRUE);
+            nvfree(cmd);
+            
+            if (ret == 0) {
+                ui_log(op, "Removed %s.", rpms[i]);
+            } else {
+                ui_warn(op, "Unable to erase %s rpm: %s", rpms[i], data);
+            }
+            
+            nvfree(data);
+        }
+    }
+
+    return TRUE;
+    
+} /* check_for_existing_rpms() */
+
+
+
+/*
+ * copy_directory_contents() - recursively copy the contents of directory src to
+ * directory dst.  Special files are ignored.
+ */
+
+int copy_directory_contents(Options *op, const char *src, const char *dst)
+{
+    DIR *dir;
+    struct dirent *ent;
+    int status = FALSE;
+
+    if ((dir = opendir(src)) == NULL) {
+        ui_error(op, "Unable to open directory '%s' (%s).",
+                 src, strerror(errno));
+        return FALSE;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        struct stat stat_buf;
+        char *srcfile, *dstfile;
+        int ret;
+
+        if (((strcmp(ent->d_name, ".")) == 0) ||
+            ((strcmp(ent->d_name, "..")) == 0)) continue;
+
+        srcfile = nvstrcat(src, "/", ent->d_name, NULL);
+        dstfile = nvstrcat(dst, "/", ent->d_name, NULL);
+
+        ret = (stat(srcfile, &stat_buf) != -1);
+
+        if (ret) {
+            /* recurse into subdirectories */
+            if (S_ISDIR(stat_buf.st_mode)) {
+                ret = mkdir_recursive(op, dstfile, stat_buf.st_mode, FALSE) &&
+                      copy_directory_contents(op, srcfile, dstfile);
+            } else if (S_ISREG(stat_buf.st_mode)) {
+                ret = copy_file(op, srcfile, dstfile, stat_buf.st_mode);
+            }
+        }
+
+        nvfree(srcfile);
+        nvfree(dstfile);
+
+        if (!ret) {
+            goto done;
+        }
+    }
+
+    status = TRUE;
+
+  done:
+
+    if (closedir(dir) != 0) {
+        ui_error(op, "Failure while closing directory '%s' (%s).",
+                 src, strerror(errno));
+
+        return FALSE;
+    }
+
+    return status;
+
+}
+
+
+
+/*
+ * pack_precompiled_files() - Create a new precompiled files package for the
+ * given PrecompiledFileInfo array and save it to disk.
+ */
+
+int pack_precompiled_files(Options *op, Package *p, int num_files,
+                           PrecompiledFileInfo *files)
+{
+    char time_str[256], *proc_version_string;
+    char *outfile, *descr;
+    time_t t;
+    struct utsname buf;
+    int ret;
+    PrecompiledInfo *info;
+
+    ui_log(op, "Packaging precompiled kernel interface.");
+
+    /* make sure the precompiled_kernel_interface_directory exists */
+
+    if (!mkdir_recursive(op, p->precompiled_kernel_interface_directory, 0755,
+                         FALSE)) {
+        ui_error(op, "Failed to create the directory '%s'!",
+                 p->precompiled_kernel_interface_directory);
+        return FALSE;
+    }
+    
+    /* use the time in the output string... should be fairly unique */
+
+    t = time(NULL);
+    snprintf(time_str, 256, "%lu", t);
+
+    /* use the uname string as the description */
+
+    if (uname(&buf) != 0) {
+        ui_error(op, "Failed to retrieve uname identifiers from the kernel!");
+        return FALSE;
+    }
+    descr = nvstrcat(buf.sysname, " ",
+                     buf.release, " ",
+                     buf.version, " ",
+                     buf.machine, NULL);
+    
+    /* read the proc version string */
+
+    proc_version_string = read_proc_version(op, op->proc_mount_point);
+
+    /* build the PrecompiledInfo struct */
+
+    info = nvalloc(sizeof(PrecompiledInfo));
+
+    outfile = nvstrcat(p->precompiled_kernel_interface_directory, "/",
+                       PRECOMPILED_PACKAGE_FILENAME, "-", p->version,
+                       ".", time_str, NULL);
+
+    info->version = nvstrdup(p->version);
+    info->proc_version_string = proc_version_string;
+    info->description = descr;
+    info->num_files = num_files;
+    info->files = files;
+
+    ret = precompiled_pack(info, outfile);
+
+    nvfree(outfile);
+    free_precompiled(info);
+
+    if (ret) {
+        return TRUE;
+    }
+    else {
+        /* XXX precompiled_pack() never fails */
+        ui_error(op, "Unable to package precompiled kernel interface.");
+        return FALSE;
+    }
+}
+
+
+
+/*
+ * nv_strreplace() - we can't assume that the user has sed installed
+ * on their system, so use this function to preform simple string
+ * search and replacement.  Returns a newly allocated string that is a
+ * duplicate of src, with all instances of 'orig' replaced with
+ * 'replace'.
+ */
+
+char *nv_strreplace(char *src, char *orig, char *replace)
+{
+    char *prev_s, *end_s, *s;
+    char *d, *dst;
+    int len, dst_len, orig_len, replace_len;
+    int done = 0;
+
+    prev_s = s = src;
+    end_s = src + strlen(src) + 1;
+    
+    dst = NULL;
+    dst_len = 0;
+
+    orig_len = strlen(orig);
+    replace_len = strlen(replace);
 
-    for (i = 0; i < p->num_entries; i++) {
-        if (p->entries[i].caps.is_opengl) {
-            invalidate_package_entry(&(p->entries[i]));
+    do {
+        /* find the next instances of orig in src */
+
+        s = strstr(prev_s, orig);
+        
+        /*
+         * if no match, then flag that we are done once we finish
+         * copying the src into dst
+         */
+
+        if (!s) {
+            s = end_s;
+            done = 1;
         }
-    }
-}
+        
+        /* copy the characters between prev_s and s into dst */
+        
+        len = s - prev_s;
+        dst = realloc(dst, dst_len + len + 1);
+        d = dst + dst_len;
+        strncpy(d, prev_s, len);
+        d[len] = '\0';
+        dst_len += len;
+        
+        /* if we are not done, then append the replace string */
+
+        if (!done) {
+            dst = realloc(dst, dst_len + replace_len + 1);
+            d = dst + dst_len;
+            strncpy(d, replace, replace_len);
+            d[replace_len] = '\0';
+            dst_len += replace_len;
+        }
+
+        /* skip past the orig string */
+
+        if (!done) prev_s = s + orig_len;
+
+    } while (!done);
+    
+    return dst;
+
+} /* nv_strreplace() */
 
 
 
 /*
- * mode_string_to_mode() - convert the string s 
+ * process_template_file() - copy the specified template file to
+ * a temporary file, replacing specified tokens with specified
+ * replacement strings.  Return the temporary file's path to the
+ * caller or NULL, if an error occurs.
  */
 
-int mode_string_to_mode(Options *op, char *s, mode_t *mode)
+char *process_template_file(Options *op, PackageEntry *pe,
+                            char **tokens, char **replacements)
 {
-    char *endptr;
-    long int ret;
+    int failed, src_fd, dst_fd, len;
+    struct stat stat_buf;
+    char *src, *dst, *tmp, *tmp0, *tmpfile = NULL;
+    char *token, *replacement;
+
+    failed = FALSE;
+    src_fd = dst_fd = -1;
+    tmp = tmp0 = src = dst = tmpfile = NULL;
+    len = 0;
     
-    ret = strtol(s, &endptr, 8);
+    /* open the file */
 
-    if ((ret == LONG_MIN) || (ret == LONG_MAX) || (*endptr != '\0')) {
-        ui_error(op, "Error parsing permission string '%s' (%s)",
-                 s, strerror (errno));
-        return FALSE;
+    if ((src_fd = open(pe->file, O_RDONLY)) == -1) {
+        ui_error(op, "Unable to open '%s' for copying (%s)",
+                 pe->file, strerror(errno));
+        return NULL;
     }
 
-    *mode = (mode_t) ret;
+    /* get the size of the file */
 
-    return TRUE;
-    
-} /* mode_string_to_mode() */
+    if (fstat(src_fd, &stat_buf) == -1) {
+        ui_error(op, "Unable to determine size of '%s' (%s)",
+                 pe->file, strerror(errno));
+        failed = TRUE; goto done;
+    }
 
+    /* mmap the file */
 
+    if ((src = mmap(0, stat_buf.st_size, PROT_READ,
+                    MAP_FILE|MAP_SHARED, src_fd, 0)) == MAP_FAILED) {
+        ui_error (op, "Unable to map source file '%s' for "
+                  "copying (%s)", pe->file, strerror(errno));
+        src = NULL;
+        failed = TRUE; goto done;
+    }
 
-/*
- * mode_to_permission_string() - given a mode bitmask, allocate and
- * write a permission string.
- */
+    if (!src) {
+        ui_log(op, "%s is empty; skipping.", pe->file);
+        failed = TRUE; goto done;
+    }
 
-char *mode_to_permission_string(mode_t mode)
-{
-    char *s = (char *) nvalloc(10);
-    memset (s, '-', 9);
-    
-    if (mode & (1 << 8)) s[0] = 'r';
-    if (mode & (1 << 7)) s[1] = 'w';
-    if (mode & (1 << 6)) s[2] = 'x';
-    
-    if (mode & (1 << 5)) s[3] = 'r';
-    if (mode & (1 << 4)) s[4] = 'w';
-    if (mode & (1 << 3)) s[5] = 'x';
+    /*
+     * allocate a string to hold the contents of the mmap'ed file,
+     * plus explicit NULL termination
+     */
+
+    tmp = nvalloc(stat_buf.st_size + 1);
+    memcpy(tmp, src, stat_buf.st_size);
+    tmp[stat_buf.st_size] = '\0';
+
+    /* setup to walk the tokens and replacements arrays */
     
-    if (mode & (1 << 2)) s[6] = 'r';
-    if (mode & (1 << 1)) s[7] = 'w';
-    if (mode & (1 << 0)) s[8] = 'x';
+    token = *tokens;
+    replacement = *replacements;
+
+    while (token != NULL && replacement != NULL) {
+        /*
+         * Replace any occurances of 'token' with 'replacement' in
+         * the source string and free the source
+         */
+        tmp0 = nv_strreplace(tmp, token, replacement);
+        nvfree(tmp);
+        tmp = tmp0;
+        token = *(++tokens);
+        replacement = *(++replacements);
+    }
+
+    /* create a temporary file to store the processed template file */
     
-    s[9] = '\0';
-    return s;
+    tmpfile = nvstrcat(op->tmpdir, "/template-XXXXXX", NULL);
+    if ((dst_fd = mkstemp(tmpfile)) == -1) {
+        ui_error(op, "Unable to create temporary file (%s)",
+                 strerror(errno));
+        failed = TRUE; goto done;
+    }
 
-} /* mode_to_permission_string() */
+    /* set the size of the new file */
 
+    len = strlen(tmp);
 
+    if (lseek(dst_fd, len - 1, SEEK_SET) == -1) {
+        ui_error(op, "Unable to set file size for '%s' (%s)",
+                  tmpfile, strerror(errno));
+        failed = TRUE; goto done;
+    }
+    if (write(dst_fd, "", 1) != 1) {
+        ui_error(op, "Unable to write file size for '%s' (%s)",
+                 tmpfile, strerror(errno));
+        failed = TRUE; goto done;
+    }
 
-/*
- * confirm_path() - check that the path exists; if not, ask the user
- * if it's OK to create it and then do mkdir().
- *
- * XXX for a while, I had thought that it would be better for this
- * function to only ask the user if it was OK to create the directory;
- * there are just too many reasons why mkdir might fail, though, so
- * it's better to do mkdir() so that we can fail at this point in the
- * installation.
- */
+    /* mmap the new file */
 
-int confirm_path(Options *op, const char *path)
-{
-    const char *choices[2] = {
-        "Create directory",
-        "Abort installation"
-    };
+    if ((dst = mmap(0, len, PROT_READ | PROT_WRITE,
+                    MAP_FILE|MAP_SHARED, dst_fd, 0)) == MAP_FAILED) {
+        ui_error(op, "Unable to map destination file '%s' for "
+                 "copying (%s)", tmpfile, strerror(errno));
+        dst = NULL;
+        failed = TRUE; goto done;
+    }
 
-    /* return TRUE if the path already exists and is a directory */
+    /* write the processed data out to the temporary file */
 
-    if (directory_exists(path)) return TRUE;
-    
-    if (ui_multiple_choice(op, choices, 2, 0, "The directory '%s' does not "
-                           "exist; would you like to create it, or would you "
-                           "prefer to abort installation?", path) == 0) {
-        if (mkdir_with_log(op, path, 0755)) {
-            return TRUE;
-        } else {
-            return FALSE;
+    memcpy(dst, tmp, len);
+
+done:
+
+    if (src) {
+        if (munmap(src, stat_buf.st_size) == -1) {
+            ui_error(op, "Unable to unmap source file '%s' after "
+                     "copying (%s)", pe->file,
+                     strerror(errno));
         }
     }
     
-    ui_message(op, "Not creating directory '%s'; aborting installation.",
-               path);
-    
-    return FALSE;
+    if (dst) {
+        if (munmap(dst, len) == -1) {
+            ui_error (op, "Unable to unmap destination file '%s' "
+                      "after copying (%s)", tmpfile, strerror(errno));
+        }
+    }
 
-} /* confirm_path() */
+    if (src_fd != -1) close(src_fd);
+    if (dst_fd != -1) {
+        close(dst_fd);
+        /* in case an error occurred, delete the temporary file */
+        if (failed) unlink(tmpfile);
+    }
+
+    if (failed) {
+        nvfree(tmpfile); tmpfile = NULL;
+    }
+
+    nvfree(tmp);
+
+    return tmpfile;
+
+} /* process_template_files() */
 
 
 
 /*
- * mkdir_recursive() - create the path specified, also creating parent
- * directories as needed; this is equivalent to `mkdir -p`. Log created
- * directories if the "log" parameter is set.
+ * process_dot_desktop_files() - for any .desktop files in the
+ * package, copy them to a temporary file, replacing __UTILS_PATH__
+ * and __PIXMAP_PATH__ as appropriate.  Then, add the new file to
+ * the package list.
  */
 
-int mkdir_recursive(Options *op, const char *path, const mode_t mode, int log)
+void process_dot_desktop_files(Options *op, Package *p)
 {
-    char *error_str = NULL;
-    char *log_str   = NULL;
-    int success = FALSE;
-
-    success = nv_mkdir_recursive(path, mode, &error_str, log ? &log_str : NULL);
-
-    if (log_str) {
-        log_mkdir(op, log_str);
-        free(log_str);
-    }
+    int i;
+    char *tmpfile;
 
-    if (error_str) {
-        ui_error(op, "%s", error_str);
-        free(error_str);
-    }
+    char *tokens[3] = { "__UTILS_PATH__", "__PIXMAP_PATH__", NULL };
+    char *replacements[3] = { NULL, NULL, NULL };
 
-    return success;
-}
+    int package_num_entries = p->num_entries;
 
+    replacements[0] = nvstrcat(op->utility_prefix,
+                               "/", op->utility_bindir, NULL);
 
+    remove_trailing_slashes(replacements[0]);
+    collapse_multiple_slashes(replacements[0]);
 
-/*
- * mkdir_with_log() - Wrap mkdir_recursive() to create the path specified
- * with any needed parent directories.
- */
+    for (i = 0; i < package_num_entries; i++) {
+        if ((p->entries[i].type == FILE_TYPE_DOT_DESKTOP)) {
+    
+            /* invalidate the template file */
 
-int mkdir_with_log(Options *op, const char *path, const mode_t mode)
-{
-    return mkdir_recursive(op, path, mode, TRUE);
-}
+            invalidate_package_entry(&(p->entries[i]));
 
+            nvfree(replacements[1]);
 
+            replacements[1] = nvstrcat(op->documentation_prefix,
+                                       "/", op->documentation_docdir,
+                                       "/", p->entries[i].path,
+                                       NULL);
 
-/*
- * get_symlink_target() - get the target of the symbolic link
- * 'filename'.  On success, a newly malloced string containing the
- * target is returned.  On error, an error message is printed and NULL
- * is returned.
- */
+            remove_trailing_slashes(replacements[1]);
+            collapse_multiple_slashes(replacements[1]);
 
-char *get_symlink_target(Options *op, const char *filename)
-{
-    struct stat stat_buf;
-    int ret, len = 0;
-    char *buf = NULL;
+            tmpfile = process_template_file(op, &p->entries[i], tokens,
+                                            replacements);
+            if (tmpfile != NULL) {
+                /* add this new file to the package */
 
-    if (lstat(filename, &stat_buf) == -1) {
-        ui_error(op, "Unable to get file properties for '%s' (%s).",
-                 filename, strerror(errno));
-        return NULL;
-    }
-    
-    if (!S_ISLNK(stat_buf.st_mode)) {
-        ui_error(op, "File '%s' is not a symbolic link.", filename);
-        return NULL;
-    }
-    
-    /*
-     * grow the buffer to be passed into readlink(2), until the buffer
-     * is big enough to hold the whole target.
-     */
+                /*
+                 * XXX 'name' is the basename (non-directory part) of
+                 * the file to be installed; normally, 'name' just
+                 * points into 'file', but in this case 'file' is
+                 * mkstemp(3)-generated, so doesn't have the same
+                 * basename; instead, we just strdup the name from the
+                 * template package entry; yes, 'name' will get leaked
+                 */
 
-    do {
-        len += NV_LINE_LEN;
-        if (buf) free(buf);
-        buf = nvalloc(len);
-        ret = readlink(filename, buf, len - 1);
-        if (ret == -1) {
-            ui_error(op, "Failure while reading target of symbolic "
-                     "link %s (%s).", filename, strerror(errno));
-            free(buf);
-            return NULL;
+                add_package_entry(p,
+                                  tmpfile,
+                                  nvstrdup(p->entries[i].path),
+                                  nvstrdup(p->entries[i].name),
+                                  NULL, /* target */
+                                  NULL, /* dst */
+                                  FILE_TYPE_DOT_DESKTOP,
+                                  p->entries[i].compat_arch,
+                                  p->entries[i].mode);
+            }
         }
-    } while (ret >= (len - 1));
+    }
 
-    buf[ret] = '\0';
-    
-    return buf;
+    nvfree(replacements[0]);
+    nvfree(replacements[1]);
 
-} /* get_symlink_target() */
+} /* process_dot_desktop_files() */
 
 
 
 /*
- * get_resolved_symlink_target() - same as get_symlink_target, except that
- * relative links get resolved to an absolute path.
+ * process_dkms_conf() - copy dkms.conf to a temporary file and perform
+ * some substitutions. Then, add the new file to the package list.
  */
-char * get_resolved_symlink_target(Options *op, const char *filename)
+
+void process_dkms_conf(Options *op, Package *p)
 {
-    char *target = get_symlink_target(op, filename);
-    if (target[0] != '/') {
-        /* target is relative; canonicalize */
-        char *filename_copy, *target_dir, *full_target_path;
+    int i;
+    char *tmpfile;
 
-        /* dirname(3) may modify the string passed into it; make a copy */
-        filename_copy = nvstrdup(filename);
-        target_dir = dirname(filename_copy);
+    char *tokens[] = { "__VERSION_STRING", "__DKMS_MODULES", "__JOBS",
+                             "__EXCLUDE_MODULES", "will be generated",
+                             "__IGNORE_CC_MISMATCH", NULL };
+    char *replacements[] = { p->version, NULL, NULL,
+                                   p->excluded_kernel_modules,
+                                   "was generated", NULL, NULL };
 
-        full_target_path = nvstrcat(target_dir, "/", target, NULL);
+    int package_num_entries = p->num_entries;
 
-        nvfree(filename_copy);
-        nvfree(target);
+    replacements[1] = nvstrdup("");
+    replacements[2] = nvasprintf("%d", op->concurrency_level);
+    replacements[5] = op->ignore_cc_version_check ? "1" : "";
 
-        target = nvalloc(PATH_MAX);
-        target = realpath(full_target_path, target);
+    /* Build the list of kernel modules to be installed */
+    for (i = 0; i < p->num_kernel_modules; i++) {
+        char *old_modules = replacements[1];
+        char *index = nvasprintf("%d", i);
 
-        nvfree(full_target_path);
-    }
+        replacements[1] = nvstrcat(old_modules,
+                                   "BUILT_MODULE_NAME[", index, "]=\"",
+                                   p->kernel_modules[i].module_name, "\"\n",
+                                   "DEST_MODULE_LOCATION[", index, "]=",
+                                   "\"/kernel/drivers/video\"\n", NULL);
 
-    return target;
+        nvfree(index);
+        nvfree(old_modules);
+    }
 
-} /* get_resolved_symlink_target() */
+    for (i = 0; i < package_num_entries; i++) {
+        if ((p->entries[i].type == FILE_TYPE_DKMS_CONF)) {
 
+            /* invalidate the template file */
 
+            invalidate_package_entry(&(p->entries[i]));
 
-/*
- * install_file() - install srcfile as dstfile; this is done by
- * extracting the directory portion of dstfile, and then calling
- * copy_file().
- */ 
+            tmpfile = process_template_file(op, &p->entries[i], tokens,
+                                            replacements);
+            if (tmpfile != NULL) {
+                /* add this new file to the package */
 
-int install_file(Options *op, const char *srcfile,
-                 const char *dstfile, mode_t mode)
-{   
-    int retval; 
-    char *dirc, *dname;
+                /*
+                 * XXX 'name' is the basename (non-directory part) of
+                 * the file to be installed; normally, 'name' just
+                 * points into 'file', but in this case 'file' is
+                 * mkstemp(3)-generated, so doesn't have the same
+                 * basename; instead, we just strdup the name from the
+                 * template package entry; yes, 'name' will get leaked
+                 */
 
-    dirc = nvstrdup(dstfile);
-    dname = dirname(dirc);
-    
-    if (!mkdir_with_log(op, dname, 0755)) {
-        free(dirc);
-        return FALSE;
+                add_package_entry(p,
+                                  tmpfile,
+                                  nvstrdup(p->entries[i].path),
+                                  nvstrdup(p->entries[i].name),
+                                  NULL, /* target */
+                                  NULL, /* dst */
+                                  FILE_TYPE_DKMS_CONF,
+                                  p->entries[i].compat_arch,
+                                  p->entries[i].mode);
+            }
+        }
     }
 
-    retval = copy_file(op, srcfile, dstfile, mode);
-    free(dirc);
-
-    return retval;
-
-} /* install_file() */
+    nvfree(replacements[2]);
+    nvfree(replacements[1]);
 
+}
 
 /*
- * install_symlink() - install dstfile as a symlink to linkname; this
- * is done by extracting the directory portion of dstfile, creating
- * that directory if it does not exist, and then calling symlink().
- */ 
-
-int install_symlink(Options *op, const char *linkname, const char *dstfile)
-{   
-    char *dirc, *dname;
-
-    dirc = nvstrdup(dstfile);
-    dname = dirname(dirc);
+ * set_security_context() - set the security context of the file to 'type'
+ * Returns TRUE on success or if SELinux is disabled, FALSE otherwise
+ */
+int set_security_context(Options *op, const char *filename, const char *type)
+{
+    char *cmd = NULL;
+    int ret = FALSE;
     
-    if (!mkdir_with_log(op, dname, 0755)) {
-        free(dirc);
-        return FALSE;
-    }
-
-    if (symlink(linkname, dstfile)) {
-        free(dirc);
-        return FALSE;
-    }
+    if (op->selinux_enabled == FALSE) {
+        return TRUE;
+    } 
+    
+    cmd = nvstrcat(op->utils[CHCON], " -t ", type, " ", filename, NULL);
+    
+    ret = run_command(op, cmd, NULL, FALSE, 0, TRUE);
+    
+    ret = ((ret == 0) ? TRUE : FALSE);
+    nvfree(cmd);
+    
+    return ret;
+}
 
-    free(dirc);
-    return TRUE;
 
-} /* install_symlink() */
+static char * const native_libdirs[] = {
+#if defined(NV_X86_64)
+    DEFAULT_AMD64_TRIPLET_LIBDIR,
+#elif defined(NV_X86)
+    DEFAULT_IA32_TRIPLET_LIBDIR,
+#elif defined(NV_ARMV7)
+#if defined(NV_GNUEABIHF)
+    DEFAULT_ARMV7HF_TRIPLET_LIBDIR,
+#else
+    DEFAULT_ARMV7_TRIPLET_LIBDIR,
+#endif /* GNUEABIHF */
+#elif defined(NV_AARCH64)
+    DEFAULT_AARCH64_TRIPLET_LIBDIR,
+#elif defined(NV_PPC64LE)
+    DEFAULT_PPC64LE_TRIPLET_LIBDIR,
+#else
+#error Unknown architecture! Please update utils.mk to add support for this \
+TARGET_ARCH, and make sure that an architecture-specific NV_$ARCH macro gets \
+defined, and that NV_ARCH_BITS gets defined to the correct word size in bits.
+#endif
 
+#if NV_ARCH_BITS == 32
+    DEFAULT_32BIT_LIBDIR,
+#elif NV_ARCH_BITS == 64
+    DEFAULT_64BIT_LIBDIR,
+#endif
 
+    DEFAULT_LIBDIR,
+    NULL
+};
 
-size_t get_file_size(Options *op, const char *filename)
-{
-    struct stat stat_buf;
-    
-    if (stat(filename, &stat_buf) == -1) {
-        ui_error(op, "Unable to determine file size of '%s' (%s).",
-                 filename, strerror(errno));
-        return 0;
-    }
 
-    return stat_buf.st_size;
+#if defined(NV_X86_64)
+static char * const compat_libdirs[] = {
+    DEFAULT_IA32_TRIPLET_LIBDIR,
+    DEFAULT_32BIT_LIBDIR,
+    DEFAULT_LIBDIR,
+    NULL
+};
+#endif
 
-} /* get_file_size() */
 
 
+/*
+ * get_ldconfig_cache() - retrieve the ldconfig(8) cache, or NULL on error
+ */
 
-size_t fget_file_size(Options *op, const int fd)
+static char *get_ldconfig_cache(Options *op)
 {
-    struct stat stat_buf;
-    
-    if (fstat(fd, &stat_buf) == -1) {
-        ui_error(op, "Unable to determine file size of file "
-                 "descriptor %d (%s).", fd, strerror(errno));
-        return 0;
-    }
+    char *data, *cmd;
+    int ret;
 
-    return stat_buf.st_size;
+    cmd = nvstrcat(op->utils[LDCONFIG], " -p", NULL);
+    ret = run_command(op, cmd, &data, FALSE, 0, FALSE);
+    nvfree(cmd);
 
-} /* fget_file_size() */
+    if (ret != 0) {
+        nvfree(data);
+        return NULL;
+    }
 
+    return data;
+}
 
 
-char *get_tmpdir(Options *op)
+/*
+ * find_libdir() - search in 'prefix' (optionally under 'chroot'/'prefix')
+ * for directories in 'list', either in the ldconfig(8) cache or on the
+ * filesystem. return the first directory found, or NULL if none found.
+ */
+
+static char *find_libdir(char * const * list, const char *prefix,
+                         const char *ldconfig_cache, const char *chroot)
 {
-    char *tmpdirs[] = { NULL, "/tmp", ".", NULL };
     int i;
+    char *path = NULL;
 
-    tmpdirs[0] = getenv("TMPDIR");
-    tmpdirs[3] = getenv("HOME");
-    
-    for (i = 0; i < 4; i++) {
-        if (tmpdirs[i] && directory_exists(tmpdirs[i])) {
-            return (tmpdirs[i]);
+    for (i = 0; list[i]; i++) {
+        nvfree(path);
+
+        path = nvstrcat(chroot ? chroot : "",
+                        "/", prefix, "/", list[i], "/", NULL);
+        collapse_multiple_slashes(path);
+
+        if (ldconfig_cache) {
+            if (strstr(ldconfig_cache, path)) {
+                break;
+            }
+        } else {
+            if (directory_exists(path)) {
+                break;
+            }
         }
     }
-    
-    return NULL;
-
-} /* get_tmpdir() */
 
+    nvfree(path);
+    return list[i];
+}
 
 
 /*
- * make_tmpdir() - create a temporary directory; XXX we should really
- * use mkdtemp, but it is not available on all systems.
+ * find_libdir_and_fall_back() - search for the first available directory from
+ * 'list' under 'prefix' that appears in the 'ldconfig_cache'. If no directory
+ * is found in 'ldconfig_cache', test for directory existence; if no directory
+ * from 'list' exists under 'prefix', default to DEFAULT_LIBDIR and print a
+ * warning message.
  */
-
-char *make_tmpdir(Options *op)
+static char * find_libdir_and_fall_back(Options *op, char * const * list,
+                                        const char *prefix,
+                                        const char *ldconfig_cache,
+                                        const char *name)
 {
-    char tmp[32], *tmpdir;
-    
-    snprintf(tmp, 32, "%d", getpid());
-    
-    tmpdir = nvstrcat(op->tmpdir, "/nvidia-", tmp, NULL);
-    
-    if (directory_exists(tmpdir)) {
-        remove_directory(op, tmpdir);
+    char *libdir = find_libdir(list, prefix, ldconfig_cache, NULL);
+    if (!libdir) {
+        libdir = find_libdir(list, prefix, NULL, NULL);
     }
-    
-    if (!mkdir_recursive(op, tmpdir, 0655, FALSE)) {
-        return NULL;
+    if (!libdir) {
+        libdir = DEFAULT_LIBDIR;
+        ui_warn(op, "Unable to determine the default %s path. The path %s/%s "
+                    "will be used, but this path was not detected in the "
+                    "ldconfig(8) cache, and no directory exists at this path, "
+                    "so it is likely that libraries installed there will not "
+                    "be found by the loader.", name, prefix, libdir);
     }
-    
-    return tmpdir;
-    
-} /* make_tmpdir() */
 
+    return libdir;
+}
 
 
 /*
- * nvrename() - replacement for rename(2), because rename(2) can't
- * cross filesystem boundaries.  Get the src file attributes, copy the
- * src file to the dst file, stamp the dst file with the src file's
- * timestamp, and delete the src file.  Returns FALSE on error, TRUE
- * on success.
+ * get_default_prefixes_and_paths() - assign the default prefixes and
+ * paths depending on the architecture, distribution and the X.Org
+ * version installed on the system.
  */
 
-int nvrename(Options *op, const char *src, const char *dst)
+void get_default_prefixes_and_paths(Options *op)
 {
-    struct stat stat_buf;
-    struct utimbuf utime_buf;
+    char *default_libdir, *ldconfig_cache;
 
-    if (stat(src, &stat_buf) == -1) {
-        ui_error(op, "Unable to determine file attributes of file "
-                 "%s (%s).", src, strerror(errno));
-        return FALSE;
-    }
-        
-    if (!copy_file(op, src, dst, stat_buf.st_mode)) return FALSE;
+    if (!op->opengl_prefix)
+        op->opengl_prefix = DEFAULT_OPENGL_PREFIX;
 
-    utime_buf.actime = stat_buf.st_atime; /* access time */
-    utime_buf.modtime = stat_buf.st_mtime; /* modification time */
+    ldconfig_cache = get_ldconfig_cache(op);
 
-    if (utime(dst, &utime_buf) == -1) {
-        ui_warn(op, "Unable to transfer timestamp from '%s' to '%s' (%s).",
-                   src, dst, strerror(errno));
+    default_libdir = find_libdir_and_fall_back(op, native_libdirs,
+                                               op->opengl_prefix,
+                                               ldconfig_cache, "library");
+
+
+    if (!op->opengl_libdir)
+        op->opengl_libdir = default_libdir;
+
+    if (!op->x_prefix) {
+        if (op->modular_xorg) {
+            op->x_prefix = XORG7_DEFAULT_X_PREFIX;
+        } else {
+            op->x_prefix = DEFAULT_X_PREFIX;
+        }
     }
-    
-    if (unlink(src) == -1) {
-        ui_error(op, "Unable to delete '%s' (%s).", src, strerror(errno));
-        return FALSE;
+    if (!op->x_libdir) {
+        /* XXX if we just inherit default_libdir from above, we could end up
+         * with e.g. /usr/lib/x86_64-linux-gnu/xorg/modules as the module path.
+         * In practice, we haven't seen the tuplet-based paths used for X
+         * module paths, so skip the first (tuplet-based) entry from
+         * native_libdirs when getting a default value for x_libdir. This is
+         * only used when we have to guess the paths when the query fails. */
+        op->x_libdir = find_libdir_and_fall_back(op, &native_libdirs[1],
+                                                 op->x_prefix, ldconfig_cache,
+                                                 "X library");
     }
 
-    return TRUE;
-    
-} /* nvrename() */
+    nvfree(ldconfig_cache);
+
+    if (!op->x_moddir) {
+        if (op->modular_xorg) {
+            op->x_moddir = XORG7_DEFAULT_X_MODULEDIR ;
+        } else {
+            op->x_moddir = DEFAULT_X_MODULEDIR;
+        }
+    }
 
+#if defined(NV_X86_64)
+    if (!op->compat32_prefix)
+        op->compat32_prefix = DEFAULT_OPENGL_PREFIX;
+#endif
 
+    if (!op->utility_prefix)
+        op->utility_prefix = DEFAULT_UTILITY_PREFIX;
+    if (!op->utility_libdir)
+        op->utility_libdir = default_libdir;
+    if (!op->utility_bindir)
+        op->utility_bindir = DEFAULT_BINDIR;
 
-/*
- * check_for_existing_rpms() - check if any of the previous NVIDIA
- * rpms are installed on the system.  If we find any, ask the user if
- * we may remove them.
- */
+    if (!op->dot_desktopdir)
+        op->dot_desktopdir = DEFAULT_DOT_DESKTOPDIR;
 
-int check_for_existing_rpms(Options *op)
-{
-    /* list of rpms to remove; should be in dependency order */
+    if (!op->documentation_prefix)
+        op->documentation_prefix = DEFAULT_DOCUMENTATION_PREFIX;
+    if (!op->documentation_docdir)
+        op->documentation_docdir = DEFAULT_DOCDIR;
+    if (!op->documentation_mandir)
+        op->documentation_mandir = DEFAULT_MANDIR;
 
-    const char *rpms[2] = { "NVIDIA_GLX", "NVIDIA_kernel" };
+    if (!op->application_profile_path)
+        op->application_profile_path = DEFAULT_APPLICATION_PROFILE_PATH;
 
-    char *data, *cmd;
-    int i, ret;
+    if (!op->kernel_module_src_prefix)
+        op->kernel_module_src_prefix = DEFAULT_KERNEL_MODULE_SRC_PREFIX;
 
-    if (op->no_rpms) {
-        ui_log(op, "Skipping check for conflicting rpms.");
-        return TRUE;
-    }
+    if (!op->module_signing_key_path)
+        op->module_signing_key_path = DEFAULT_MODULE_SIGNING_KEY_PATH;
+    /* kernel_module_src_dir's default value is set in set_destinations() */
+
+} /* get_default_prefixes_and_paths() */
+
+
+#if defined NV_X86_64
+/*
+ * compat32_conflict() - given a value for the compatibility library directory,
+ * determines whether a conflict exists between the proposed compatibility
+ * library path and the existing OpenGL library path. e.g. if the native path
+ * is /usr/lib/x86_64-linux-gnu, then /usr/lib is probably not a good path for
+ * compat32 libs. On the other hand, /usr/lib/i386-linux-gnu might be a valid
+ * compat32 directory for a system where /usr/lib is the native library
+ * directory, so the comparison is one-directional.
+ *
+ * XXX this assumes that the native directory would never be a subdirectory of
+ *     the compat directory, which might not actually be true.
+ */
+static int compat32_conflict(Options *op, const char *compat_libdir)
+{
+    char *native_path, *compat_path;
+    int ret, is_subdir;
+
+    native_path = nvstrcat(op->opengl_prefix, "/", op->opengl_libdir, NULL);
+    compat_path = nvstrcat(op->compat32_chroot ? op->compat32_chroot : "",
+                           "/", op->compat32_prefix, "/", compat_libdir, NULL);
 
-    for (i = 0; i < 2; i++) {
-        
-        cmd = nvstrcat("env LD_KERNEL_ASSUME=2.2.5 rpm --query ",
-                       rpms[i], NULL);
-        ret = run_command(op, cmd, NULL, FALSE, 0, TRUE);
-        nvfree(cmd);
+    ret = is_subdirectory(compat_path, native_path, &is_subdir);
 
-        if (ret == 0) {
-            if (ui_multiple_choice(op, CONTINUE_ABORT_CHOICES,
-                                   NUM_CONTINUE_ABORT_CHOICES,
-                                   CONTINUE_CHOICE, /* Default choice */
-                                   "An %s rpm appears to already be installed "
-                                   "on your system.  As part of installing the "
-                                   "new driver, this %s rpm will be "
-                                   "uninstalled. Are you sure you want to "
-                                   "continue?",
-                                   rpms[i], rpms[i]) == ABORT_CHOICE) {
-                ui_log(op, "Installation aborted.");
-                return FALSE;
-            }
-            
-            cmd = nvstrcat("rpm --erase --nodeps ", rpms[i], NULL);
-            ret = run_command(op, cmd, &data, op->expert, 0, TRUE);
-            nvfree(cmd);
-            
-            if (ret == 0) {
-                ui_log(op, "Removed %s.", rpms[i]);
-            } else {
-                ui_warn(op, "Unable to erase %s rpm: %s", rpms[i], data);
-            }
-            
-            nvfree(data);
-        }
+    if (!ret) {
+        ui_error(op, "Failed to determine whether '%s' is a subdirectory of "
+                 "'%s'; '%s' will not be considered as a candidate location "
+                 "for installing 32-bit compatibility libraries.",
+                 native_path, compat_path, compat_path);
+        is_subdir = TRUE;
     }
 
-    return TRUE;
-    
-} /* check_for_existing_rpms() */
+    nvfree(native_path);
+    nvfree(compat_path);
 
+    return is_subdir;
+}
+#endif
 
 
 /*
- * copy_directory_contents() - recursively copy the contents of directory src to
- * directory dst.  Special files are ignored.
+ * get_compat32_path() - detect the appropriate path for installing the 32-bit
+ * compatibility files. This function must be called after parse_manifest(),
+ * and before set_destinations().
  */
-
-int copy_directory_contents(Options *op, const char *src, const char *dst)
+void get_compat32_path(Options *op)
 {
-    DIR *dir;
-    struct dirent *ent;
-    int status = FALSE;
-
-    if ((dir = opendir(src)) == NULL) {
-        ui_error(op, "Unable to open directory '%s' (%s).",
-                 src, strerror(errno));
-        return FALSE;
-    }
+#if defined(NV_X86_64)
+    char *ldconfig_cache = get_ldconfig_cache(op);
 
-    while ((ent = readdir(dir)) != NULL) {
-        struct stat stat_buf;
-        char *srcfile, *dstfile;
-        int ret;
+    if (!op->compat32_prefix)
+        op->compat32_prefix = DEFAULT_OPENGL_PREFIX;
 
-        if (((strcmp(ent->d_name, ".")) == 0) ||
-            ((strcmp(ent->d_name, "..")) == 0)) continue;
+    if(!op->compat32_libdir) {
+        char *compat_libdir;
 
-        srcfile = nvstrcat(src, "/", ent->d_name, NULL);
-        dstfile = nvstrcat(dst, "/", ent->d_name, NULL);
 
-        ret = (stat(srcfile, &stat_buf) != -1);
+        /* First, search the ldconfig(8) cache and filesystem normally */
+        compat_libdir = find_libdir(compat_libdirs, op->compat32_prefix,
+                                    ldconfig_cache, op->compat32_chroot);
 
-        if (ret) {
-            /* recurse into subdirectories */
-            if (S_ISDIR(stat_buf.st_mode)) {
-                ret = mkdir_recursive(op, dstfile, stat_buf.st_mode, FALSE) &&
-                      copy_directory_contents(op, srcfile, dstfile);
-            } else if (S_ISREG(stat_buf.st_mode)) {
-                ret = copy_file(op, srcfile, dstfile, stat_buf.st_mode);
-            }
+        if (!compat_libdir || compat32_conflict(op, compat_libdir)) {
+            compat_libdir = find_libdir(compat_libdirs, op->compat32_prefix,
+                                        NULL, op->compat32_chroot);
         }
 
-        nvfree(srcfile);
-        nvfree(dstfile);
+        /*
+         * If we still didn't find a suitable directory, and the user did not
+         * specify an explicit chroot, try the old Debian 32-bit chroot.
+         */
+        if ((!compat_libdir || compat32_conflict(op, compat_libdir)) &&
+            !op->compat32_chroot) {
+            op->compat32_chroot = DEBIAN_DEFAULT_COMPAT32_CHROOT;
 
-        if (!ret) {
-            goto done;
-        }
-    }
+            compat_libdir = find_libdir(compat_libdirs, op->compat32_prefix,
+                                        ldconfig_cache, op->compat32_chroot);
 
-    status = TRUE;
+            if (!compat_libdir || compat32_conflict(op, compat_libdir)) {
+                compat_libdir = find_libdir(compat_libdirs, op->compat32_prefix,
+                                            NULL, op->compat32_chroot);
+            }
 
-  done:
+            /*
+             * If we still didn't find a suitable path in the old Debian chroot,
+             * reset the chroot path and the detected directory.
+             */
+            if (!compat_libdir || compat32_conflict(op, compat_libdir)) {
+                op->compat32_chroot = NULL;
+                compat_libdir = NULL;
+            }
+        }
 
-    if (closedir(dir) != 0) {
-        ui_error(op, "Failure while closing directory '%s' (%s).",
-                 src, strerror(errno));
+        /* If we still failed to find a directory, don't install 32-bit files */
+        if (op->install_compat32_libs != NV_OPTIONAL_BOOL_FALSE &&
+            (!compat_libdir || compat32_conflict(op, compat_libdir))) {
+            ui_warn(op, "Unable to find a suitable destination to install "
+                    "32-bit compatibility libraries. Your system may not "
+                    "be set up for 32-bit compatibility. 32-bit "
+                    "compatibility files will not be installed; if you "
+                    "wish to install them, re-run the installation and set "
+                    "a valid directory with the --compat32-libdir option.");
+            op->install_compat32_libs = NV_OPTIONAL_BOOL_FALSE;
+        }
 
-        return FALSE;
+        if (op->install_compat32_libs != NV_OPTIONAL_BOOL_FALSE) {
+            op->compat32_libdir = compat_libdir;
+        }
     }
 
-    return status;
+    nvfree(ldconfig_cache);
+#endif
+}
+
+/*
+ * get_xdg_data_dir() - determine if the XDG_DATA_DIRS environment
+ * variable is set; if set and not empty, return the first path
+ * in the list, else return NULL.
+ */
 
+static char *get_xdg_data_dir(void)
+{
+    /*
+     * If XDG_DATA_DIRS is set, then derive the installation path
+     * from the first entry; complies with:
+     *   http://www.freedesktop.org/Standards/basedir-spec
+     */
+    char *xdg_data_dir = getenv("XDG_DATA_DIRS");
+    if ((xdg_data_dir != NULL) && strlen(xdg_data_dir))
+        return nvstrdup(strtok(xdg_data_dir, ":"));
+    return NULL;
 }
 
 
 
 /*
- * pack_precompiled_files() - Create a new precompiled files package for the
- * given PrecompiledFileInfo array and save it to disk.
+ * extract_x_path() - take a comma-separated list of directories, and
+ * extract the next available directory in the list.  Assign the
+ * 'next' pointer so that it points to where we should continue during
+ * the next call of extract_x_path().
+ *
+ * On success, return a pointer to the next directory in the string,
+ * and update the 'next' pointer.  When we have exhausted the list,
+ * NULL is returned.
+ *
+ * Note that this will destructively replace commas with NULL
+ * terminators in the string.
  */
 
-int pack_precompiled_files(Options *op, Package *p, int num_files,
-                           PrecompiledFileInfo *files)
+static char *extract_x_path(char *str, char **next)
 {
-    char time_str[256], *proc_version_string;
-    char *outfile, *descr;
-    time_t t;
-    struct utsname buf;
-    int ret;
-    PrecompiledInfo *info;
+    char *start;
+    
+    /*
+     * choose where to start in the string: either we start at the
+     * beginning, or we start immediately after where we found a comma
+     * last time
+     */
 
-    ui_log(op, "Packaging precompiled kernel interface.");
+    start = str;
+    
+    if (*next) start = *next;
+    
+    /* skip past any commas at the start */
 
-    /* make sure the precompiled_kernel_interface_directory exists */
+    while (*start == ',') start++;
+    
+    /* if we hit the end of the string, return now */
 
-    if (!mkdir_recursive(op, p->precompiled_kernel_interface_directory, 0755,
-                         FALSE)) {
-        ui_error(op, "Failed to create the directory '%s'!",
-                 p->precompiled_kernel_interface_directory);
-        return FALSE;
+    if (*start == '\0') return NULL;
+    
+    /*
+     * find the next comma in the string; if we find one, change it to
+     * a NULL terminator (and move 'next' to the character immediately
+     * after the comma); if we don't find a comma, move the 'next'
+     * pointer to the end of the string, so that we terminate on the
+     * next call to extract_x_path()
+     */
+
+    *next = strchr(start, ',');
+
+    if (*next) {
+        **next = '\0';
+        (*next)++;
+    } else {
+        *next = strchr(start, '\0');
     }
     
-    /* use the time in the output string... should be fairly unique */
+    return start;
+    
+} /* extract_x_path() */
 
-    t = time(NULL);
-    snprintf(time_str, 256, "%lu", t);
 
-    /* use the uname string as the description */
+enum XPathType {
+    XPathLibrary,
+    XPathModule,
+    XPathSysConfig
+};
 
-    if (uname(&buf) != 0) {
-        ui_error(op, "Failed to retrieve uname identifiers from the kernel!");
+/*
+ * get_x_paths_helper() - helper function for determining the X
+ * library, module, and system xorg.conf.d paths; returns 'TRUE' if we had to
+ * guess at the path
+ */
+
+static int get_x_paths_helper(Options *op,
+                              enum XPathType pathType,
+                              char *xserver_cmd,
+                              char *pkg_config_cmd,
+                              char *name,
+                              char **path,
+                              int require_existing_directory)
+{
+    char *dirs, *cmd, *dir, *next;
+    int ret, guessed = 0;
+
+    /*
+     * if the path was already specified (i.e.: by a command
+     * line option), then we are done with this iteration
+     */
+    
+    if (*path != NULL) {
         return FALSE;
     }
-    descr = nvstrcat(buf.sysname, " ",
-                     buf.release, " ",
-                     buf.version, " ",
-                     buf.machine, NULL);
     
-    /* read the proc version string */
-
-    proc_version_string = read_proc_version(op, op->proc_mount_point);
+    /*
+     * attempt to determine the path through the various query mechanisms
+     */
 
-    /* build the PrecompiledInfo struct */
+    /*
+     * first, try the X server commandline option; this is the
+     * recommended query mechanism as of X.Org 7.2
+     */
+    if (op->utils[XSERVER] && xserver_cmd) {
 
-    info = nvalloc(sizeof(PrecompiledInfo));
+        dirs = NULL;
+        cmd = nvstrcat(op->utils[XSERVER], " ", xserver_cmd, NULL);
+        ret = run_command(op, cmd, &dirs, FALSE, 0, TRUE);
+        nvfree(cmd);
 
-    outfile = nvstrcat(p->precompiled_kernel_interface_directory, "/",
-                       PRECOMPILED_PACKAGE_FILENAME, "-", p->version,
-                       ".", time_str, NULL);
+        if ((ret == 0) && dirs) {
+            
+            next = NULL;
 
-    info->version = nvstrdup(p->version);
-    info->proc_version_string = proc_version_string;
-    info->description = descr;
-    info->num_files = num_files;
-    info->files = files;
+            dir = extract_x_path(dirs, &next);
+            
+            while (dir) {
+                
+                if (!require_existing_directory || directory_exists(dir)) {
 
-    ret = precompiled_pack(info, outfile);
+                    ui_expert(op, "X %s path '%s' determined from `%s %s`",
+                              name, dir, op->utils[XSERVER], xserver_cmd);
+                    
+                    *path = nvstrdup(dir);
+                    
+                    nvfree(dirs);
+                    
+                    return FALSE;
+                    
+                } else {
+                    ui_warn(op, "You appear to be using a modular X.Org "
+                            "release, but the X %s installation "
+                            "path, '%s', reported by `%s %s` does not exist.  "
+                            "Please check your X.Org installation.",
+                            name, dir, op->utils[XSERVER], xserver_cmd);
+                }
 
-    nvfree(outfile);
-    free_precompiled(info);
+                dir = extract_x_path(dirs, &next);
+            }
+        }
 
-    if (ret) {
-        return TRUE;
-    }
-    else {
-        /* XXX precompiled_pack() never fails */
-        ui_error(op, "Unable to package precompiled kernel interface.");
-        return FALSE;
+        nvfree(dirs);
     }
-}
 
+    /*
+     * then, try the pkg-config command; this was the the
+     * pseudo-recommended query mechanism between X.Org 7.0 and
+     * X.Org 7.2
+     */
+    if (op->utils[PKG_CONFIG]) {
 
+        dirs = NULL;
+        cmd = nvstrcat(op->utils[PKG_CONFIG], " ",
+                pkg_config_cmd, NULL);
+        ret = run_command(op, cmd, &dirs, FALSE, 0, TRUE);
+        nvfree(cmd);
 
-/*
- * nv_strreplace() - we can't assume that the user has sed installed
- * on their system, so use this function to preform simple string
- * search and replacement.  Returns a newly allocated string that is a
- * duplicate of src, with all instances of 'orig' replaced with
- * 'replace'.
- */
+        if ((ret == 0) && dirs) {
 
-char *nv_strreplace(char *src, char *orig, char *replace)
-{
-    char *prev_s, *end_s, *s;
-    char *d, *dst;
-    int len, dst_len, orig_len, replace_len;
-    int done = 0;
+            next = NULL;
+            
+            dir = extract_x_path(dirs, &next);
+ 
+            while (dir) {
+                
+                if (!require_existing_directory || directory_exists(dir)) {
 
-    prev_s = s = src;
-    end_s = src + strlen(src) + 1;
-    
-    dst = NULL;
-    dst_len = 0;
+                    ui_expert(op, "X %s path '%s' determined from `%s %s`",
+                              name, dir, op->utils[PKG_CONFIG],
+                              pkg_config_cmd);
 
-    orig_len = strlen(orig);
-    replace_len = strlen(replace);
+                    *path = nvstrdup(dir);
+                    
+                    nvfree(dirs);
+                    
+                    return FALSE;
+                
+                } else {
+                    ui_warn(op, "You appear to be using a modular X.Org "
+                            "release, but the X %s installation "
+                            "path, '%s', reported by `%s %s` does not exist.  "
+                            "Please check your X.Org installation.",
+                            name, dir, op->utils[PKG_CONFIG], pkg_config_cmd);
+                }
 
-    do {
-        /* find the next instances of orig in src */
+                dir = extract_x_path(dirs, &next);
+            }
+        }
 
-        s = strstr(prev_s, orig);
-        
-        /*
-         * if no match, then flag that we are done once we finish
-         * copying the src into dst
-         */
+        nvfree(dirs);
+    }
 
-        if (!s) {
-            s = end_s;
-            done = 1;
-        }
-        
-        /* copy the characters between prev_s and s into dst */
-        
-        len = s - prev_s;
-        dst = realloc(dst, dst_len + len + 1);
-        d = dst + dst_len;
-        strncpy(d, prev_s, len);
-        d[len] = '\0';
-        dst_len += len;
-        
-        /* if we are not done, then append the replace string */
+    /*
+     * neither of the above mechanisms yielded a usable path; fall
+     * through to constructing the path by hand.  If this is a modular X server,
+     * record that we have to guess the path so that we can print a warning when
+     * we are done.  For non-modular X, the default of /usr/X11R6/lib is
+     * standard.
+     */
 
-        if (!done) {
-            dst = realloc(dst, dst_len + replace_len + 1);
-            d = dst + dst_len;
-            strncpy(d, replace, replace_len);
-            d[replace_len] = '\0';
-            dst_len += replace_len;
-        }
+    if (op->modular_xorg)
+        guessed = TRUE;
 
-        /* skip past the orig string */
 
-        if (!done) prev_s = s + orig_len;
+    /* build the path */
 
-    } while (!done);
-    
-    return dst;
+    switch (pathType) {
+        case XPathLibrary:
+            *path = nvstrcat(op->x_prefix, "/", op->x_libdir, NULL);
+            break;
 
-} /* nv_strreplace() */
+        case XPathModule:
+            *path = nvstrcat(op->x_library_path, "/", op->x_moddir, NULL);
+            break;
 
+        case XPathSysConfig:
+            *path = nvstrcat(DEFAULT_X_DATAROOT_PATH, "/", DEFAULT_CONFDIR, NULL);
+            break;
+    }
+    
+    remove_trailing_slashes(*path);
+    collapse_multiple_slashes(*path);
+    
+    return guessed;
+}
 
 
 /*
- * process_template_file() - copy the specified template file to
- * a temporary file, replacing specified tokens with specified
- * replacement strings.  Return the temporary file's path to the
- * caller or NULL, if an error occurs.
+ * get_x_library_and_module_paths() - assign op->x_library_path and
+ * op->x_module_path; this cannot fail.
  */
 
-char *process_template_file(Options *op, PackageEntry *pe,
-                            char **tokens, char **replacements)
+static void get_x_library_and_module_paths(Options *op)
 {
-    int failed, src_fd, dst_fd, len;
-    struct stat stat_buf;
-    char *src, *dst, *tmp, *tmp0, *tmpfile = NULL;
-    char *token, *replacement;
-
-    failed = FALSE;
-    src_fd = dst_fd = -1;
-    tmp = tmp0 = src = dst = tmpfile = NULL;
-    len = 0;
+    int guessed = FALSE;
     
-    /* open the file */
-
-    if ((src_fd = open(pe->file, O_RDONLY)) == -1) {
-        ui_error(op, "Unable to open '%s' for copying (%s)",
-                 pe->file, strerror(errno));
-        return NULL;
-    }
-
-    /* get the size of the file */
-
-    if (fstat(src_fd, &stat_buf) == -1) {
-        ui_error(op, "Unable to determine size of '%s' (%s)",
-                 pe->file, strerror(errno));
-        failed = TRUE; goto done;
-    }
-
-    /* mmap the file */
-
-    if ((src = mmap(0, stat_buf.st_size, PROT_READ,
-                    MAP_FILE|MAP_SHARED, src_fd, 0)) == MAP_FAILED) {
-        ui_error (op, "Unable to map source file '%s' for "
-                  "copying (%s)", pe->file, strerror(errno));
-        src = NULL;
-        failed = TRUE; goto done;
-    }
+    /*
+     * get the library path, and then get the module path; note that
+     * the module path depends on already having the library path
+     */
+    
+    guessed |= get_x_paths_helper(op,
+                                  XPathLibrary,
+                                  "-showDefaultLibPath",
+                                  "--variable=libdir xorg-server",
+                                  "library",
+                                  &op->x_library_path,
+                                  TRUE);
+    
+    guessed |= get_x_paths_helper(op,
+                                  XPathModule,
+                                  "-showDefaultModulePath",
+                                  "--variable=moduledir xorg-server",
+                                  "module",
+                                  &op->x_module_path,
+                                  TRUE);
 
-    if (!src) {
-        ui_log(op, "%s is empty; skipping.", pe->file);
-        failed = TRUE; goto done;
-    }
+    /*
+     * Get the sysconfig path (typically /usr/share/X11/xorg.conf.d).  This is
+     * only needed if the nvidia.conf OutputClass config snippet is going to be
+     * installed.  Don't complain if we had to guess the path; the server will
+     * still work without it if xorg.conf is set up.
+     */
+    get_x_paths_helper(op,
+                       XPathSysConfig,
+                       NULL,
+                       "--variable=sysconfigdir xorg-server",
+                       "sysconfig",
+                       &op->x_sysconfig_path,
+                       FALSE);
 
     /*
-     * allocate a string to hold the contents of the mmap'ed file,
-     * plus explicit NULL termination
+     * done assigning op->x_library_path and op->x_module_path; if we
+     * had to guess at either of the paths, print a warning
      */
+    
+    if (guessed) {
+        ui_warn(op, "nvidia-installer was forced to guess the X library "
+                "path '%s' and X module path '%s'; these paths were not "
+                "queryable from the system.  If X fails to find the "
+                "NVIDIA X driver module, please install the `pkg-config` "
+                "utility and the X.Org SDK/development package for your "
+                "distribution and reinstall the driver.",
+                op->x_library_path, op->x_module_path);
+    }
+    
+} /* get_x_library_and_module_paths() */
 
-    tmp = nvalloc(stat_buf.st_size + 1);
-    memcpy(tmp, src, stat_buf.st_size);
-    tmp[stat_buf.st_size] = '\0';
 
-    /* setup to walk the tokens and replacements arrays */
-    
-    token = *tokens;
-    replacement = *replacements;
 
-    while (token != NULL && replacement != NULL) {
-        /*
-         * Replace any occurances of 'token' with 'replacement' in
-         * the source string and free the source
-         */
-        tmp0 = nv_strreplace(tmp, token, replacement);
-        nvfree(tmp);
-        tmp = tmp0;
-        token = *(++tokens);
-        replacement = *(++replacements);
-    }
+/*
+ * get_filename() - Prompt the user for the path to a file. If no file exists
+ * at the given path, keep reprompting until a valid path to a regular file or
+ * symbolic link is given. This is just a thin wrapper around ui_get_input().
+ */
+char *get_filename(Options *op, const char *def, const char *msg)
+{
+    char *oldfile = nvstrdup(def);
 
-    /* create a temporary file to store the processed template file */
-    
-    tmpfile = nvstrcat(op->tmpdir, "/template-XXXXXX", NULL);
-    if ((dst_fd = mkstemp(tmpfile)) == -1) {
-        ui_error(op, "Unable to create temporary file (%s)",
-                 strerror(errno));
-        failed = TRUE; goto done;
+    /* XXX This function should never be called if op->no_questions is set,
+     * but just in case that happens by accident, do something besides looping
+     * infinitely if def is a filename that doesn't exist. */
+    if (op->no_questions) {
+        return oldfile;
     }
 
-    /* set the size of the new file */
+    while (TRUE) {
+        struct stat stat_buf;
+        char *file = ui_get_input(op, oldfile, "%s", msg);
 
-    len = strlen(tmp);
+        nvfree(oldfile);
 
-    if (lseek(dst_fd, len - 1, SEEK_SET) == -1) {
-        ui_error(op, "Unable to set file size for '%s' (%s)",
-                  tmpfile, strerror(errno));
-        failed = TRUE; goto done;
-    }
-    if (write(dst_fd, "", 1) != 1) {
-        ui_error(op, "Unable to write file size for '%s' (%s)",
-                 tmpfile, strerror(errno));
-        failed = TRUE; goto done;
-    }
+        if (file && stat(file, &stat_buf) != -1 &&
+           (S_ISREG(stat_buf.st_mode) || S_ISLNK(stat_buf.st_mode))) {
+            return file;
+        }
 
-    /* mmap the new file */
+        ui_message(op, "File \"%s\" does not exist, or is not a regular "
+                   "file. Please enter another filename.", file ?
+                   file : "(null)");
 
-    if ((dst = mmap(0, len, PROT_READ | PROT_WRITE,
-                    MAP_FILE|MAP_SHARED, dst_fd, 0)) == MAP_FAILED) {
-        ui_error(op, "Unable to map destination file '%s' for "
-                 "copying (%s)", tmpfile, strerror(errno));
-        dst = NULL;
-        failed = TRUE; goto done;
+        oldfile = file;
     }
+}
 
-    /* write the processed data out to the temporary file */
 
-    memcpy(dst, tmp, len);
 
-done:
+/*
+ * secure_delete() - Securely delete a file, using `shred -u`. If `shred` isn't
+ * found, fall back to just unlinking, but print a warning message.
+ */
+int secure_delete(Options *op, const char *file)
+{
+    char *cmd;
 
-    if (src) {
-        if (munmap(src, stat_buf.st_size) == -1) {
-            ui_error(op, "Unable to unmap source file '%s' after "
-                     "copying (%s)", pe->file,
-                     strerror(errno));
-        }
-    }
-    
-    if (dst) {
-        if (munmap(dst, len) == -1) {
-            ui_error (op, "Unable to unmap destination file '%s' "
-                      "after copying (%s)", tmpfile, strerror(errno));
-        }
-    }
+    cmd = find_system_util("shred");
 
-    if (src_fd != -1) close(src_fd);
-    if (dst_fd != -1) {
-        close(dst_fd);
-        /* in case an error occurred, delete the temporary file */
-        if (failed) unlink(tmpfile);
-    }
+    if (cmd) {
+        int ret;
+        char *cmdline = nvstrcat(cmd, " -u \"", file, "\"", NULL);
 
-    if (failed) {
-        nvfree(tmpfile); tmpfile = NULL;
-    }
+        ret = run_command(op, cmdline, NULL, FALSE, 0, TRUE);
+        log_printf(op, NULL, "%s: %s", cmdline, ret == 0 ? "" : "failed!");
 
-    nvfree(tmp);
+        nvfree(cmd);
+        nvfree(cmdline);
 
-    return tmpfile;
+        return ret == 0;
+    } else {
+        ui_warn(op, "`shred` was not found on the system. The file %s will "
+                "be deleted, but not securely. It may be possible to recover "
+                "the file after deletion.", file);
+        unlink(file);
+        return FALSE;
+    }
+} /* secure_delete() */
 
-} /* process_template_files() */
 
+/* invalidate_package_entry() - clear a package entry */
+
+void invalidate_package_entry(PackageEntry *entry)
+{
+    entry->type = FILE_TYPE_NONE;
+    /*
+     * XXX don't try to free the destination string for
+     * these invalidated package entries; this prevents
+     * a crash on some Slackware 10.0 installations that
+     * we've been unable to reproduce/root cause.
+     */
+    entry->dst = NULL;
+    memset(&(entry->caps), 0, sizeof(entry->caps));
+}
 
 
 /*
- * process_dot_desktop_files() - for any .desktop files in the
- * package, copy them to a temporary file, replacing __UTILS_PATH__
- * and __PIXMAP_PATH__ as appropriate.  Then, add the new file to
- * the package list.
+ * is_subdirectory() - test whether subdir is a subdir of dir
+ * returns TRUE on successful test, or FALSE on error
+ * sets *is_subdir based on the result of a successful test
+ *
+ * The testing is performed two ways: first, walk from subdir up to "/"
+ * and check at each step along the way if subdir's device and inode
+ * match dir's. If a match is not found this way, simply compare dir
+ * and subdir as normalized strings, up to the length of subdir, since
+ * the first method will fail if subdir is a symlink located inside dir
+ * whose target is outside of dir.
  */
 
-void process_dot_desktop_files(Options *op, Package *p)
+int is_subdirectory(const char *dir, const char *subdir, int *is_subdir)
 {
-    int i;
-    char *tmpfile;
-
-    char *tokens[3] = { "__UTILS_PATH__", "__PIXMAP_PATH__", NULL };
-    char *replacements[3] = { NULL, NULL, NULL };
+    struct stat root_st, dir_st;
 
-    int package_num_entries = p->num_entries;
+    if (stat("/", &root_st) != 0 || stat(dir, &dir_st) != 0) {
+        return FALSE;
+    } else {
+        struct stat testdir_st;
+        char *testdir = nvstrdup(subdir);
 
-    replacements[0] = nvstrcat(op->utility_prefix,
-                               "/", op->utility_bindir, NULL);
+        *is_subdir = FALSE;
 
-    remove_trailing_slashes(replacements[0]);
-    collapse_multiple_slashes(replacements[0]);
+        do {
+            char *oldtestdir;
 
-    for (i = 0; i < package_num_entries; i++) {
-        if ((p->entries[i].type == FILE_TYPE_DOT_DESKTOP)) {
-    
-            /* invalidate the template file */
+            if (stat(testdir, &testdir_st) != 0) {
+                nvfree(testdir);
+                return FALSE;
+            }
 
-            invalidate_package_entry(&(p->entries[i]));
+            if (testdir_st.st_dev == dir_st.st_dev &&
+                testdir_st.st_ino == dir_st.st_ino) {
+                *is_subdir = TRUE;
+                break;
+            }
 
-            nvfree(replacements[1]);
+            oldtestdir = testdir;
+            testdir = nvstrcat(oldtestdir, "/..", NULL);
+            nvfree(oldtestdir);
+        } while (testdir_st.st_dev != root_st.st_dev ||
+                 testdir_st.st_ino != root_st.st_ino);
 
-            replacements[1] = nvstrcat(op->documentation_prefix,
-                                       "/", op->documentation_docdir,
-                                       "/", p->entries[i].path,
-                                       NULL);
+        nvfree(testdir);
+    }
 
-            remove_trailing_slashes(replacements[1]);
-            collapse_multiple_slashes(replacements[1]);
+    if (!*is_subdir) {
+        char *dir_with_slash, *subdir_with_slash;
 
-            tmpfile = process_template_file(op, &p->entries[i], tokens,
-                                            replacements);
-            if (tmpfile != NULL) {
-                /* add this new file to the package */
+        dir_with_slash = nvstrcat(dir, "/", NULL);
+        collapse_multiple_slashes(dir_with_slash);
+        subdir_with_slash = nvstrcat(subdir, "/", NULL);
+        collapse_multiple_slashes(subdir_with_slash);
 
-                /*
-                 * XXX 'name' is the basename (non-directory part) of
-                 * the file to be installed; normally, 'name' just
-                 * points into 'file', but in this case 'file' is
-                 * mkstemp(3)-generated, so doesn't have the same
-                 * basename; instead, we just strdup the name from the
-                 * template package entry; yes, 'name' will get leaked
-                 */
+        *is_subdir = (strncmp(dir_with_slash, subdir_with_slash,
+                              strlen(dir_with_slash)) == 0);
 
-                add_package_entry(p,
-                                  tmpfile,
-                                  nvstrdup(p->entries[i].path),
-                                  nvstrdup(p->entries[i].name),
-                                  NULL, /* target */
-                                  NULL, /* dst */
-                                  FILE_TYPE_DOT_DESKTOP,
-                                  p->entries[i].compat_arch,
-                                  p->entries[i].mode);
-            }
-        }
+        nvfree(dir_with_slash);
+        nvfree(subdir_with_slash);
     }
 
-    nvfree(replacements[0]);
-    nvfree(replacements[1]);
+    return TRUE;
+}
 
-} /* process_dot_desktop_files() */
+/*
+ * directory_equals() - if a is a subdirectory of b, and b is a subdirectory
+ * of a, then a and b are the same directory. Uses is_subdirectory() to do the
+ * subdirectory check, since the inode-based comparison will be resilient
+ * against symbolic links in either direction.
+ */
+static int directory_equals(const char *a, const char *b)
+{
+    int a_b, b_a;
 
+    if (is_subdirectory(a, b, &a_b) && is_subdirectory(b, a, &b_a)) {
+        return a_b && b_a;
+    }
 
+    return FALSE;
+}
 
 /*
- * process_dkms_conf() - copy dkms.conf to a temporary file and perform
- * some substitutions. Then, add the new file to the package list.
+ * get_opengl_libdir() - get the path where OpenGL libraries will be installed.
  */
+static char *get_opengl_libdir(const Options *op)
+{
+    return nvstrcat(op->opengl_prefix, "/", op->opengl_libdir, "/", NULL);
+}
 
-void process_dkms_conf(Options *op, Package *p)
+/*
+ * get_compat32_libdir() - get the path where 32-bit compatibility libraries
+ * will be installed, where applicable, or NULL when not applicable.
+ */
+static char *get_compat32_libdir(const Options *op)
 {
-    int i;
-    char *tmpfile;
+#if defined NV_X86_64
+    return nvstrcat(op->compat32_chroot ? op->compat32_chroot : "", "/",
+                    op->compat32_prefix, "/", op->compat32_libdir, "/", NULL);
+#else
+    return NULL;
+#endif
+}
 
-    char *tokens[] = { "__VERSION_STRING", "__DKMS_MODULES", "__JOBS",
-                             "__EXCLUDE_MODULES", "will be generated",
-                             "__IGNORE_CC_MISMATCH", NULL };
-    char *replacements[] = { p->version, NULL, NULL,
-                                   p->excluded_kernel_modules,
-                                   "was generated", NULL, NULL };
+/*
+ * add_libgl_abi_symlink() - check to see if either native or compatibility
+ * OpenGL libraries are destined to be installed to /usr/lib. If not, then
+ * create a symlink /usr/lib/libGL.so.1 that points to the native libGL.so.1,
+ * for compliance with the OpenGL ABI. Note: this function must be called
+ * after set_destinations() to avoid the hardcoded "/usr/lib" destination from
+ * being overwritten.
+ */
+void add_libgl_abi_symlink(Options *op, Package *p)
+{
+    static const char *usrlib = "/usr/lib/";
+    char *libgl = nvstrdup("libGL.so.1");
+    char *opengl_path = get_opengl_libdir(op);
+    char *opengl32_path = get_compat32_libdir(op);
 
-    int package_num_entries = p->num_entries;
+    if (!directory_equals(usrlib, opengl_path)
+#if defined (NV_X86_64)
+        && !directory_equals(usrlib, opengl32_path)
+#endif
+       ) {
+        char *target = nvstrcat(opengl_path, "libGL.so.1", NULL);
+        add_package_entry(p,
+                          libgl,
+                          NULL,
+                          libgl,
+                          target,
+                          nvstrcat(usrlib, libgl, NULL),
+                          FILE_TYPE_OPENGL_SYMLINK,
+                          FILE_COMPAT_ARCH_NATIVE,
+                          0000);
+    } else {
+        nvfree(libgl);
+    }
 
-    replacements[1] = nvstrdup("");
-    replacements[2] = nvasprintf("%d", op->concurrency_level);
-    replacements[5] = op->ignore_cc_version_check ? "1" : "";
+    nvfree(opengl_path);
+    nvfree(opengl32_path);
+}
 
-    /* Build the list of kernel modules to be installed */
-    for (i = 0; i < p->num_kernel_modules; i++) {
-        char *old_modules = replacements[1];
-        char *index = nvasprintf("%d", i);
+typedef enum {
+    LIBGLVND_CHECK_RESULT_INSTALLED = 0,
+    LIBGLVND_CHECK_RESULT_NOT_INSTALLED = 1,
+    LIBGLVND_CHECK_RESULT_PARTIAL = 2,
+    LIBGLVND_CHECK_RESULT_ERROR = 3,
+} LibglvndInstallCheckResult;
 
-        replacements[1] = nvstrcat(old_modules,
-                                   "BUILT_MODULE_NAME[", index, "]=\"",
-                                   p->kernel_modules[i].module_name, "\"\n",
-                                   "DEST_MODULE_LOCATION[", index, "]=",
-                                   "\"/kernel/drivers/video\"\n", NULL);
+/*
+ * run_libglvnd_script() - Finds and runs the libglvnd install checker script.
+ *
+ * This runs a helper script which determines whether the libglvnd libraries
+ * are installed, missing, or partially installed.
+ *
+ * If the helper script is not included in the package, then it will just
+ * return LIBGLVND_CHECK_RESULT_NOT_INSTALLED.
+ */
+static LibglvndInstallCheckResult run_libglvnd_script(Options *op, Package *p,
+                                                      char **missing_libs)
+{
+    const char *scriptPath = "./libglvnd_install_checker/check-libglvnd-install.sh";
+    char *cmdline = NULL, *output = NULL;
+    int status;
+    LibglvndInstallCheckResult result = LIBGLVND_CHECK_RESULT_ERROR;
 
-        nvfree(index);
-        nvfree(old_modules);
+    if (missing_libs) {
+        *missing_libs = "";
     }
 
-    for (i = 0; i < package_num_entries; i++) {
-        if ((p->entries[i].type == FILE_TYPE_DKMS_CONF)) {
+    log_printf(op, NULL, "Looking for install checker script at %s", scriptPath);
+    if (access(scriptPath, R_OK) != 0) {
+        // We don't have the install check script, so assume that it's not
+        // installed.
+        log_printf(op, NULL, "No libglvnd install checker script, assuming not installed.");
+        result = LIBGLVND_CHECK_RESULT_NOT_INSTALLED;
+        goto done;
+    }
 
-            /* invalidate the template file */
+    cmdline = nvasprintf("/bin/sh %s", scriptPath);
+    status = run_command(op, cmdline, &output, TRUE, 0, FALSE);
+    if (WIFEXITED(status)) {
+        result = WEXITSTATUS(status);
+    } else {
+        result = LIBGLVND_CHECK_RESULT_ERROR;
+    }
 
-            invalidate_package_entry(&(p->entries[i]));
+    // If the installation is partial, pass the list of missing libraries
+    // reported by the script back to the caller.
+    if (result == LIBGLVND_CHECK_RESULT_PARTIAL && missing_libs) {
+        char *line, *end, *buf;
+        int len = strlen(output);
+        static const char *missing_label = "Missing libglvnd libraries: ";
 
-            tmpfile = process_template_file(op, &p->entries[i], tokens,
-                                            replacements);
-            if (tmpfile != NULL) {
-                /* add this new file to the package */
+        for (buf = output;
+             (line = get_next_line(buf, &end, output, len));
+             buf = end) {
+            int found = FALSE;
 
-                /*
-                 * XXX 'name' is the basename (non-directory part) of
-                 * the file to be installed; normally, 'name' just
-                 * points into 'file', but in this case 'file' is
-                 * mkstemp(3)-generated, so doesn't have the same
-                 * basename; instead, we just strdup the name from the
-                 * template package entry; yes, 'name' will get leaked
-                 */
+            if (strncmp(line, missing_label, strlen(missing_label)) == 0) {
+                *missing_libs = nvstrdup(line + strlen(missing_label));
+                found = TRUE;
+            }
 
-                add_package_entry(p,
-                                  tmpfile,
-                                  nvstrdup(p->entries[i].path),
-                                  nvstrdup(p->entries[i].name),
-                                  NULL, /* target */
-                                  NULL, /* dst */
-                                  FILE_TYPE_DKMS_CONF,
-                                  p->entries[i].compat_arch,
-                                  p->entries[i].mode);
+            free(line);
+
+            if (found) {
+                break;
             }
         }
     }
 
-    nvfree(replacements[2]);
-    nvfree(replacements[1]);
-
+done:
+    nvfree(output);
+    nvfree(cmdline);
+    return result;
 }
 
 /*
- * set_security_context() - set the security context of the file to 'type'
- * Returns TRUE on success or if SELinux is disabled, FALSE otherwise
+ * set_libglvnd_egl_json_path() - Tries to figure out what path to install the
+ * JSON file to for a libglvnd EGL vendor library.
+ *
+ * This is only needed to work with an existing copy of the libglvnd libraries.
+ * If we're installing our own build, then we already know what path libEGL
+ * expects.
  */
-int set_security_context(Options *op, const char *filename, const char *type)
+static void set_libglvnd_egl_json_path(Options *op)
 {
-    char *cmd = NULL;
-    int ret = FALSE;
-    
-    if (op->selinux_enabled == FALSE) {
-        return TRUE;
-    } 
-    
-    cmd = nvstrcat(op->utils[CHCON], " -t ", type, " ", filename, NULL);
-    
-    ret = run_command(op, cmd, NULL, FALSE, 0, TRUE);
-    
-    ret = ((ret == 0) ? TRUE : FALSE);
-    nvfree(cmd);
-    
-    return ret;
-}
-
-
-static char * const native_libdirs[] = {
-#if defined(NV_X86_64)
-    DEFAULT_AMD64_TRIPLET_LIBDIR,
-#elif defined(NV_X86)
-    DEFAULT_IA32_TRIPLET_LIBDIR,
-#elif defined(NV_ARMV7)
-#if defined(NV_GNUEABIHF)
-    DEFAULT_ARMV7HF_TRIPLET_LIBDIR,
-#else
-    DEFAULT_ARMV7_TRIPLET_LIBDIR,
-#endif /* GNUEABIHF */
-#elif defined(NV_AARCH64)
-    DEFAULT_AARCH64_TRIPLET_LIBDIR,
-#elif defined(NV_PPC64LE)
-    DEFAULT_PPC64LE_TRIPLET_LIBDIR,
-#else
-#error Unknown architecture! Please update utils.mk to add support for this \
-TARGET_ARCH, and make sure that an architecture-specific NV_$ARCH macro gets \
-defined, and that NV_ARCH_BITS gets defined to the correct word size in bits.
-#endif
-
-#if NV_ARCH_BITS == 32
-    DEFAULT_32BIT_LIBDIR,
-#elif NV_ARCH_BITS == 64
-    DEFAULT_64BIT_LIBDIR,
-#endif
+    if (op->libglvnd_json_path == NULL) {
+        if (op->utils[PKG_CONFIG]) {
+            char *path = NULL;
+            char *cmd = nvstrcat(op->utils[PKG_CONFIG], " --variable=datadir libglvnd", NULL);
+            int ret = run_command(op, cmd, &path, FALSE, 0, TRUE);
+            nvfree(cmd);
 
-    DEFAULT_LIBDIR,
-    NULL
-};
+            if (ret == 0) {
+                op->libglvnd_json_path = nvstrcat(path, "/glvnd/egl_vendor.d", NULL);
+                collapse_multiple_slashes(op->libglvnd_json_path);
+            }
+            nvfree(path);
+        }
+    }
 
+    if (op->libglvnd_json_path == NULL) {
+        ui_warn(op, "Unable to determine the path to install the "
+                "libglvnd EGL vendor library config files. Check that "
+                "you have pkg-config and the libglvnd development "
+                "libraries installed, or specify a path with "
+                "--glvnd-egl-config-path.");
+        op->libglvnd_json_path = nvstrdup(DEFAULT_GLVND_EGL_JSON_PATH);
+    }
+}
 
-#if defined(NV_X86_64)
-static char * const compat_libdirs[] = {
-    DEFAULT_IA32_TRIPLET_LIBDIR,
-    DEFAULT_32BIT_LIBDIR,
-    DEFAULT_LIBDIR,
-    NULL
-};
-#endif
+/*
+ * Reports whether the given library is an optional part of libglvnd.
+ */
+static int library_is_optional(const char *library)
+{
+    const char * const optional_libs[] = {
+        "libOpenGL.so", // libOpenGL.so is not needed for classic GLX/EGL ABIs
+    };
+    int i;
 
+    for (i = 0; i < ARRAY_LEN(optional_libs); i++) {
+        // Do a partial name match to allow versioned and unversioned SONAMEs
+        if (strncmp(library, optional_libs[i], strlen(optional_libs[i])) == 0) {
+            return TRUE;
+        }
+    }
 
+    return FALSE;
+}
 
 /*
- * get_ldconfig_cache() - retrieve the ldconfig(8) cache, or NULL on error
+ * Reports whether the given space-delimited list of libraries includes a
+ * mandatory part of the libglvnd stack.
  */
-
-static char *get_ldconfig_cache(Options *op)
+static int list_includes_essential_library(const char *libraries)
 {
-    char *data, *cmd;
-    int ret;
-
-    cmd = nvstrcat(op->utils[LDCONFIG], " -p", NULL);
-    ret = run_command(op, cmd, &data, FALSE, 0, FALSE);
-    nvfree(cmd);
+    int essential_library_found = FALSE;
+    char *libs = nvstrdup(libraries);
+    char *lib;
 
-    if (ret != 0) {
-        nvfree(data);
-        return NULL;
+    for (lib = strtok(libs, " "); lib; lib = strtok(NULL, " ")) {
+        if (!library_is_optional(lib)) {
+            essential_library_found = TRUE;
+            break;
+        }
     }
 
-    return data;
+    nvfree(libs);
+    return essential_library_found;
 }
 
-
 /*
- * find_libdir() - search in 'prefix' (optionally under 'chroot'/'prefix')
- * for directories in 'list', either in the ldconfig(8) cache or on the
- * filesystem. return the first directory found, or NULL if none found.
+ * check_libglvnd_files() - Checks whether or not the installer should install
+ * the libglvnd libraries.
+ *
+ * If the libglvnd libraries are already installed, then we'll leave them
+ * alone. If they're not already installed, then we'll install our own copies.
+ *
+ * Note that we only check for the native libraries, and use that result for
+ * both the native and 32-bit compatibility libraries. The reason for that is
+ * that the conflicting file list can't distinguish between 32-bit and 64-bit
+ * files that have the same filename, so it won't correctly handle installing
+ * one but not the other.
  */
-
-static char *find_libdir(char * const * list, const char *prefix,
-                         const char *ldconfig_cache, const char *chroot)
+int check_libglvnd_files(Options *op, Package *p)
 {
+    int shouldInstall = op->install_libglvnd_libraries;
+    int foundAnyFiles = FALSE;
+    int foundJSONFile = FALSE;
     int i;
-    char *path = NULL;
 
-    for (i = 0; list[i]; i++) {
-        nvfree(path);
+    // Start by checking for any libGLX_indirect.so.0 links.
+    check_libGLX_indirect_links(op, p);
 
-        path = nvstrcat(chroot ? chroot : "",
-                        "/", prefix, "/", list[i], "/", NULL);
-        collapse_multiple_slashes(path);
+    // Then, check to see if there are any libglvnd files in the package.
+    for (i = 0; i < p->num_entries; i++) {
+        if (p->entries[i].type == FILE_TYPE_GLVND_LIB ||
+            p->entries[i].type == FILE_TYPE_GLVND_SYMLINK) {
+            foundAnyFiles = TRUE;
+        }
 
-        if (ldconfig_cache) {
-            if (strstr(ldconfig_cache, path)) {
-                break;
+        if (p->entries[i].type == FILE_TYPE_GLVND_EGL_ICD_JSON) {
+            foundAnyFiles = TRUE;
+            foundJSONFile = TRUE;
+        }
+    }
+    if (!foundAnyFiles) {
+        return TRUE;
+    }
+
+    if (shouldInstall == NV_OPTIONAL_BOOL_DEFAULT) {
+        char *missing_libs;
+
+        // Try to figure out whether libglvnd is already installed. We'll defer
+        // to a separate program to do that.
+
+        LibglvndInstallCheckResult result = run_libglvnd_script(op, p, &missing_libs);
+        if (result == LIBGLVND_CHECK_RESULT_INSTALLED) {
+            // The libraries are already installed, so leave them alone.
+            shouldInstall = NV_OPTIONAL_BOOL_FALSE;
+        } else if (result == LIBGLVND_CHECK_RESULT_NOT_INSTALLED) {
+            // The libraries are not installed, so install our own copies.
+            shouldInstall = NV_OPTIONAL_BOOL_TRUE;
+        } else if (result == LIBGLVND_CHECK_RESULT_PARTIAL) {
+            // The libraries are partially installed. Ask the user what to do.
+            static int partialAction = -1;
+            if (partialAction < 0) {
+                static const char *ANSWERS[] = {
+                    "Don't install libglvnd files",
+                    "Install and overwrite existing files",
+                    "Abort installation."
+                };
+
+                int default_choice;
+                const char *optional_only;
+
+                // If GLVND was partially installed, but none of the missing
+                // libraries are essential, default to allowing the installation
+                // to continue without installing libglvnd by. If any of the
+                // missing libraries in a partial libglvnd installation are
+                // essential, default to aborting the installation.
+                if (list_includes_essential_library(missing_libs)) {
+                    default_choice = 2; // Abort installation
+                    optional_only = "";
+                } else {
+                    default_choice = 0; // Don't install
+                    optional_only = "All of the essential libglvnd libraries "
+                                    "are present, but one or more optional "
+                                    "components are missing. ";
+                }
+
+                partialAction = ui_multiple_choice(op, ANSWERS, 3, default_choice,
+                        "An incomplete installation of libglvnd was found. %s"
+                        "Do you want to install a full copy of libglvnd? "
+                        "This will overwrite any existing libglvnd libraries.",
+                        optional_only);
             }
-        } else {
-            if (directory_exists(path)) {
-                break;
+            if (partialAction == 0) {
+                // Don't install
+                shouldInstall = NV_OPTIONAL_BOOL_FALSE;
+            } else if (partialAction == 1) {
+                // Install and overwrite
+                shouldInstall = NV_OPTIONAL_BOOL_TRUE;
+            } else {
+                // Abort.
+                return FALSE;
             }
+        } else {
+            // Some error occurred.
+            return FALSE;
         }
     }
 
-    nvfree(path);
-    return list[i];
+    // Sanity check: We should have set shouldInstall to true or false by now.
+    if (shouldInstall != NV_OPTIONAL_BOOL_FALSE && shouldInstall != NV_OPTIONAL_BOOL_TRUE) {
+        ui_error(op, "Internal error: Could not determine whether to install libglvnd");
+        return FALSE;
+    }
+
+    if (shouldInstall != NV_OPTIONAL_BOOL_TRUE) {
+        log_printf(op, NULL, "Will not install libglvnd libraries.");
+        for (i = 0; i < p->num_entries; i++) {
+            if (p->entries[i].type == FILE_TYPE_GLVND_LIB ||
+                p->entries[i].type == FILE_TYPE_GLVND_SYMLINK ||
+                p->entries[i].type == FILE_TYPE_GLX_CLIENT_LIB ||
+                p->entries[i].type == FILE_TYPE_GLX_CLIENT_SYMLINK ||
+                p->entries[i].type == FILE_TYPE_EGL_CLIENT_LIB ||
+                p->entries[i].type == FILE_TYPE_EGL_CLIENT_SYMLINK) {
+                ui_log(op, "Skipping GLVND file: \"%s\"", p->entries[i].file);
+                invalidate_package_entry(&(p->entries[i]));
+            }
+        }
+
+        if (foundJSONFile) {
+            set_libglvnd_egl_json_path(op);
+        }
+    } else {
+        log_printf(op, NULL, "Will install libglvnd libraries.");
+
+        if (foundJSONFile && op->libglvnd_json_path == NULL) {
+            op->libglvnd_json_path = nvstrdup(DEFAULT_GLVND_EGL_JSON_PATH);
+        }
+    }
+    if (foundJSONFile) {
+        log_printf(op, NULL,
+                "Will install libEGL vendor library config file to %s",
+                op->libglvnd_json_path);
+        for (i = 0; i < p->num_entries; i++) {
+            if (p->entries[i].type == FILE_TYPE_GLVND_EGL_ICD_JSON) {
+                p->entries[i].dst = nvstrcat(op->libglvnd_json_path, "/", p->entries[i].name, NULL);
+                collapse_multiple_slashes(p->entries[i].dst);
+            }
+        }
+    }
+    return TRUE;
 }
 
 
+
 /*
- * find_libdir_and_fall_back() - search for the first available directory from
- * 'list' under 'prefix' that appears in the 'ldconfig_cache'. If no directory
- * is found in 'ldconfig_cache', test for directory existence; if no directory
- * from 'list' exists under 'prefix', default to DEFAULT_LIBDIR and print a
- * warning message.
+ * InodeSet: a set of files, identified by device and inode number; see
+ * files.h.
  */
-static char * find_libdir_and_fall_back(Options *op, char * const * list,
-                                        const char *prefix,
-                                        const char *ldconfig_cache,
-                                        const char *name)
+
+static InodeSetEntry *find_inode_set_slot(const InodeSet *set, dev_t dev,
+                                          ino_t ino)
 {
-    char *libdir = find_libdir(list, prefix, ldconfig_cache, NULL);
-    if (!libdir) {
-        libdir = find_libdir(list, prefix, NULL, NULL);
-    }
-    if (!libdir) {
-        libdir = DEFAULT_LIBDIR;
-        ui_warn(op, "Unable to determine the default %s path. The path %s/%s "
-                    "will be used, but this path was not detected in the "
-                    "ldconfig(8) cache, and no directory exists at this path, "
-                    "so it is likely that libraries installed there will not "
-                    "be found by the loader.", name, prefix, libdir);
+    size_t mask = set->num_slots - 1;
+    uint64_t h = ((uint64_t) dev * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) ino;
+    size_t i;
+
+    h *= 0xBF58476D1CE4E5B9ULL;
+    i = (size_t) (h ^ (h >> 31)) & mask;
+
+    while (set->slots[i].used &&
+           (set->slots[i].dev != dev || set->slots[i].ino != ino)) {
+        i = (i + 1) & mask;
     }
 
-    return libdir;
+    return &set->slots[i];
 }
 
 
-/*
- * get_default_prefixes_and_paths() - assign the default prefixes and
- * paths depending on the architecture, distribution and the X.Org
- * version installed on the system.
+/*
+ * add_to_inode_set() - add the file to the set; returns FALSE if it was
+ * already in the set.
  */
 
-void get_default_prefixes_and_paths(Options *op)
+int add_to_inode_set(InodeSet *set, dev_t dev, ino_t ino)
 {
-    char *default_libdir, *ldconfig_cache;
-
-    if (!op->opengl_prefix)
-        op->opengl_prefix = DEFAULT_OPENGL_PREFIX;
-
-    ldconfig_cache = get_ldconfig_cache(op);
+    InodeSetEntry *slot;
 
-    default_libdir = find_libdir_and_fall_back(op, native_libdirs,
-                                               op->opengl_prefix,
-                                               ldconfig_cache, "library");
+    /* keep the load factor at or below 1/2 */
 
+    if ((set->count + 1) * 2 > set->num_slots) {
+        InodeSetEntry *old = set->slots;
+        size_t i, old_num_slots = set->num_slots;
 
-    if (!op->opengl_libdir)
-        op->opengl_libdir = default_libdir;
+        set->num_slots = old_num_slots ? old_num_slots * 2 : 1024;
+        set->slots = nvalloc(set->num_slots * sizeof(InodeSetEntry));
 
-    if (!op->x_prefix) {
-        if (op->modular_xorg) {
-            op->x_prefix = XORG7_DEFAULT_X_PREFIX;
-        } else {
-            op->x_prefix = DEFAULT_X_PREFIX;
+        for (i = 0; i < old_num_slots; i++) {
+            if (old[i].used) {
+                *find_inode_set_slot(set, old[i].dev, old[i].ino) = old[i];
+            }
         }
+        nvfree(old);
     }
-    if (!op->x_libdir) {
-        /* XXX if we just inherit default_libdir from above, we could end up
-         * with e.g. /usr/lib/x86_64-linux-gnu/xorg/modules as the module path.
-         * In practice, we haven't seen the tuplet-based paths used for X
-         * module paths, so skip the first (tuplet-based) entry from
-         * native_libdirs when getting a default value for x_libdir. This is
-         * only used when we have to guess the paths when the query fails. */
-        op->x_libdir = find_libdir_and_fall_back(op, &native_libdirs[1],
-                                                 op->x_prefix, ldconfig_cache,
-                                                 "X library");
-    }
-
-    nvfree(ldconfig_cache);
 
-    if (!op->x_moddir) {
-        if (op->modular_xorg) {
-            op->x_moddir = XORG7_DEFAULT_X_MODULEDIR ;
-        } else {
-            op->x_moddir = DEFAULT_X_MODULEDIR;
-        }
+    slot = find_inode_set_slot(set, dev, ino);
+    if (slot->used) {
+        return FALSE;
     }
 
-#if defined(NV_X86_64)
-    if (!op->compat32_prefix)
-        op->compat32_prefix = DEFAULT_OPENGL_PREFIX;
-#endif
+    slot->dev = dev;
+    slot->ino = ino;
+    slot->used = TRUE;
+    set->count++;
 
-    if (!op->utility_prefix)
-        op->utility_prefix = DEFAULT_UTILITY_PREFIX;
-    if (!op->utility_libdir)
-        op->utility_libdir = default_libdir;
-    if (!op->utility_bindir)
-        op->utility_bindir = DEFAULT_BINDIR;
+    return TRUE;
+}
 
-    if (!op->dot_desktopdir)
-        op->dot_desktopdir = DEFAULT_DOT_DESKTOPDIR;
 
-    if (!op->documentation_prefix)
-        op->documentation_prefix = DEFAULT_DOCUMENTATION_PREFIX;
-    if (!op->documentation_docdir)
-        op->documentation_docdir = DEFAULT_DOCDIR;
-    if (!op->documentation_mandir)
-        op->documentation_mandir = DEFAULT_MANDIR;
+int inode_set_contains(const InodeSet *set, dev_t dev, ino_t ino)
+{
+    if (set->count == 0) {
+        return FALSE;
+    }
 
-    if (!op->application_profile_path)
-        op->application_profile_path = DEFAULT_APPLICATION_PROFILE_PATH;
+    return find_inode_set_slot(set, dev, ino)->used;
+}
 
-    if (!op->kernel_module_src_prefix)
-        op->kernel_module_src_prefix = DEFAULT_KERNEL_MODULE_SRC_PREFIX;
 
-    if (!op->module_signing_key_path)
-        op->module_signing_key_path = DEFAULT_MODULE_SIGNING_KEY_PATH;
-    /* kernel_module_src_dir's default value is set in set_destinations() */
+void free_inode_set(InodeSet *set)
+{
+    nvfree(set->slots);
+    memset(set, 0, sizeof(*set));
+}
 
-} /* get_default_prefixes_and_paths() */
 
 
-#if defined NV_X86_64
 /*
- * compat32_conflict() - given a value for the compatibility library directory,
- * determines whether a conflict exists between the proposed compatibility
- * library path and the existing OpenGL library path. e.g. if the native path
- * is /usr/lib/x86_64-linux-gnu, then /usr/lib is probably not a good path for
- * compat32 libs. On the other hand, /usr/lib/i386-linux-gnu might be a valid
- * compat32 directory for a system where /usr/lib is the native library
- * directory, so the comparison is one-directional.
- *
- * XXX this assumes that the native directory would never be a subdirectory of
- *     the compat directory, which might not actually be true.
+ * get_file_identity() - get the device and inode number of 'path',
+ * without following symbolic links, as lstat(2) would.  Where statx(2)
+ * is available, only the inode number is requested, and the kernel is
+ * told not to synchronize with the server on network filesystems, which
+ * may need fewer metadata lookups than a full lstat(2).
  */
-static int compat32_conflict(Options *op, const char *compat_libdir)
+
+int get_file_identity(const char *path, dev_t *dev, ino_t *ino)
 {
-    char *native_path, *compat_path;
-    int ret, is_subdir;
+    struct stat stat_buf;
 
-    native_path = nvstrcat(op->opengl_prefix, "/", op->opengl_libdir, NULL);
-    compat_path = nvstrcat(op->compat32_chroot ? op->compat32_chroot : "",
-                           "/", op->compat32_prefix, "/", compat_libdir, NULL);
+#if defined(STATX_INO) && defined(AT_STATX_DONT_SYNC)
+    static int no_statx = FALSE;
+    struct statx stx;
 
-    ret = is_subdirectory(compat_path, native_path, &is_subdir);
+    if (!no_statx) {
+        if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                  STATX_INO, &stx) == 0) {
+            *dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            *ino = stx.stx_ino;
+            return TRUE;
+        }
+        if (errno != ENOSYS) {
+            return FALSE;
+        }
+        no_statx = TRUE;
+    }
+#endif
 
-    if (!ret) {
-        ui_error(op, "Failed to determine whether '%s' is a subdirectory of "
-                 "'%s'; '%s' will not be considered as a candidate location "
-                 "for installing 32-bit compatibility libraries.",
-                 native_path, compat_path, compat_path);
-        is_subdir = TRUE;
+    if (lstat(path, &stat_buf) != 0) {
+        return FALSE;
     }
 
-    nvfree(native_path);
-    nvfree(compat_path);
+    *dev = stat_buf.st_dev;
+    *ino = stat_buf.st_ino;
 
-    return is_subdir;
+    return TRUE;
 }
-#endif
+
 
 
 /*
- * get_compat32_path() - detect the appropriate path for installing the 32-bit
- * compatibility files. This function must be called after parse_manifest(),
- * and before set_destinations().
+ * Directory scan cache: find_files_in_trees() can record, for each
+ * directory it reads, the directory's identity (device, inode,
+ * modification and status change times) and its entries, in an
+ * in-memory table which is loaded from and saved to disk with
+ * load_scan_cache() and save_scan_cache().  A later search then only
+ * reads the directories whose identity has changed; the entries of the
+ * others are replayed from the cache.  Adding, removing or renaming an
+ * entry updates the directory's modification time; changes to the
+ * directory's subdirectories are covered by their own records.  Only
+ * regular files, directories and symbolic links are recorded, and the
+ * targets of symbolic links are always examined again.
+ *
+ * Directories modified within SCAN_CACHE_RACY_SECONDS of the start of
+ * the search are not recorded: with coarse timestamps, a later change
+ * could leave their times unchanged.
+ *
+ * Syntax for the cache file:
+ *
+ * 1. The first line is SCAN_CACHE_HEADER.
+ *
+ * 2. Each directory is a line
+ *
+ *    <dev> <ino> <mtime sec> <mtime nsec> <ctime sec> <ctime nsec> <count>
+ *
+ *    followed by <count> lines, one per entry: "f", "d" or "l" (for a
+ *    regular file, a directory or a symbolic link), a space, and the
+ *    entry's name.
  */
-void get_compat32_path(Options *op)
+
+#define SCAN_CACHE_HEADER "nvidia-installer directory scan cache 1"
+#define SCAN_CACHE_RACY_SECONDS 2
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    char *entries;              /* <type char><name>'\0', ... */
+    size_t entries_len;
+    int used;
+    int seen;                   /* used by this run; kept when saving */
+} ScanCacheEntry;
+
+static struct {
+    pthread_mutex_t lock;
+    int enabled;
+    int dirty;
+    time_t start_time;
+    ScanCacheEntry *entries;
+    size_t capacity; /* always a power of two, or 0 */
+    size_t count;
+} scan_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static ScanCacheEntry *scan_cache_find_slot(dev_t dev, ino_t ino)
 {
-#if defined(NV_X86_64)
-    char *ldconfig_cache = get_ldconfig_cache(op);
+    size_t mask = scan_cache.capacity - 1;
+    uint64_t h = ((uint64_t) dev * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) ino;
+    size_t i;
 
-    if (!op->compat32_prefix)
-        op->compat32_prefix = DEFAULT_OPENGL_PREFIX;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    i = (size_t) (h ^ (h >> 31)) & mask;
 
-    if(!op->compat32_libdir) {
-        char *compat_libdir;
+    while (scan_cache.entries[i].used &&
+           (scan_cache.entries[i].dev != dev ||
+            scan_cache.entries[i].ino != ino)) {
+        i = (i + 1) & mask;
+    }
 
+    return &scan_cache.entries[i];
+}
 
-        /* First, search the ldconfig(8) cache and filesystem normally */
-        compat_libdir = find_libdir(compat_libdirs, op->compat32_prefix,
-                                    ldconfig_cache, op->compat32_chroot);
 
-        if (!compat_libdir || compat32_conflict(op, compat_libdir)) {
-            compat_libdir = find_libdir(compat_libdirs, op->compat32_prefix,
-                                        NULL, op->compat32_chroot);
-        }
+/*
+ * scan_cache_insert() - insert or replace an entry; takes ownership of
+ * its entries.  Must be called with scan_cache.lock held.
+ */
 
-        /*
-         * If we still didn't find a suitable directory, and the user did not
-         * specify an explicit chroot, try the old Debian 32-bit chroot.
-         */
-        if ((!compat_libdir || compat32_conflict(op, compat_libdir)) &&
-            !op->compat32_chroot) {
-            op->compat32_chroot = DEBIAN_DEFAULT_COMPAT32_CHROOT;
+static void scan_cache_insert(const ScanCacheEntry *entry)
+{
+    ScanCacheEntry *slot;
 
-            compat_libdir = find_libdir(compat_libdirs, op->compat32_prefix,
-                                        ldconfig_cache, op->compat32_chroot);
+    /* keep the load factor at or below 1/2 */
 
-            if (!compat_libdir || compat32_conflict(op, compat_libdir)) {
-                compat_libdir = find_libdir(compat_libdirs, op->compat32_prefix,
-                                            NULL, op->compat32_chroot);
-            }
+    if ((scan_cache.count + 1) * 2 > scan_cache.capacity) {
+        ScanCacheEntry *old = scan_cache.entries;
+        size_t i, old_capacity = scan_cache.capacity;
 
-            /*
-             * If we still didn't find a suitable path in the old Debian chroot,
-             * reset the chroot path and the detected directory.
-             */
-            if (!compat_libdir || compat32_conflict(op, compat_libdir)) {
-                op->compat32_chroot = NULL;
-                compat_libdir = NULL;
+        scan_cache.capacity = old_capacity ? old_capacity * 2 : 1024;
+        scan_cache.entries = nvalloc(scan_cache.capacity *
+                                     sizeof(ScanCacheEntry));
+
+        for (i = 0; i < old_capacity; i++) {
+            if (old[i].used) {
+                *scan_cache_find_slot(old[i].dev, old[i].ino) = old[i];
             }
         }
+        nvfree(old);
+    }
 
-        /* If we still failed to find a directory, don't install 32-bit files */
-        if (op->install_compat32_libs != NV_OPTIONAL_BOOL_FALSE &&
-            (!compat_libdir || compat32_conflict(op, compat_libdir))) {
-            ui_warn(op, "Unable to find a suitable destination to install "
-                    "32-bit compatibility libraries. Your system may not "
-                    "be set up for 32-bit compatibility. 32-bit "
-                    "compatibility files will not be installed; if you "
-                    "wish to install them, re-run the installation and set "
-                    "a valid directory with the --compat32-libdir option.");
-            op->install_compat32_libs = NV_OPTIONAL_BOOL_FALSE;
-        }
+    slot = scan_cache_find_slot(entry->dev, entry->ino);
 
-        if (op->install_compat32_libs != NV_OPTIONAL_BOOL_FALSE) {
-            op->compat32_libdir = compat_libdir;
-        }
+    if (slot->used) {
+        nvfree(slot->entries);
+    } else {
+        scan_cache.count++;
     }
 
-    nvfree(ldconfig_cache);
-#endif
+    *slot = *entry;
+    slot->used = TRUE;
+}
+
+
+static int same_timespec(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
 }
 
+
 /*
- * get_xdg_data_dir() - determine if the XDG_DATA_DIRS environment
- * variable is set; if set and not empty, return the first path
- * in the list, else return NULL.
+ * get_cached_directory_entries() - if the scan cache holds the entries
+ * of the directory with the given status, and the directory has not
+ * changed since, return them.  They remain valid until the directory is
+ * recorded again.
  */
 
-static char *get_xdg_data_dir(void)
+static int get_cached_directory_entries(const struct stat *stat_buf,
+                                        const char **entries, size_t *len)
 {
-    /*
-     * If XDG_DATA_DIRS is set, then derive the installation path
-     * from the first entry; complies with:
-     *   http://www.freedesktop.org/Standards/basedir-spec
-     */
-    char *xdg_data_dir = getenv("XDG_DATA_DIRS");
-    if ((xdg_data_dir != NULL) && strlen(xdg_data_dir))
-        return nvstrdup(strtok(xdg_data_dir, ":"));
-    return NULL;
-}
+    ScanCacheEntry *slot;
+    int found = FALSE;
+
+    pthread_mutex_lock(&scan_cache.lock);
+
+    if (scan_cache.count == 0) {
+        goto done;
+    }
+
+    slot = scan_cache_find_slot(stat_buf->st_dev, stat_buf->st_ino);
+
+    if (slot->used &&
+        same_timespec(&slot->mtime, &stat_buf->st_mtim) &&
+        same_timespec(&slot->ctime, &stat_buf->st_ctim)) {
+        slot->seen = TRUE;
+        *entries = slot->entries;
+        *len = slot->entries_len;
+        found = TRUE;
+    }
+
+ done:
+    pthread_mutex_unlock(&scan_cache.lock);
 
+    return found;
+}
 
 
 /*
- * extract_x_path() - take a comma-separated list of directories, and
- * extract the next available directory in the list.  Assign the
- * 'next' pointer so that it points to where we should continue during
- * the next call of extract_x_path().
- *
- * On success, return a pointer to the next directory in the string,
- * and update the 'next' pointer.  When we have exhausted the list,
- * NULL is returned.
- *
- * Note that this will destructively replace commas with NULL
- * terminators in the string.
+ * record_directory_entries() - record the entries of the directory with
+ * the given status in the scan cache; takes ownership of 'entries'.
  */
 
-static char *extract_x_path(char *str, char **next)
+static void record_directory_entries(const struct stat *stat_buf,
+                                     char *entries, size_t len)
 {
-    char *start;
-    
-    /*
-     * choose where to start in the string: either we start at the
-     * beginning, or we start immediately after where we found a comma
-     * last time
-     */
+    ScanCacheEntry entry;
 
-    start = str;
-    
-    if (*next) start = *next;
-    
-    /* skip past any commas at the start */
+    pthread_mutex_lock(&scan_cache.lock);
 
-    while (*start == ',') start++;
-    
-    /* if we hit the end of the string, return now */
+    if (stat_buf->st_mtim.tv_sec >=
+            scan_cache.start_time - SCAN_CACHE_RACY_SECONDS ||
+        stat_buf->st_ctim.tv_sec >=
+            scan_cache.start_time - SCAN_CACHE_RACY_SECONDS) {
+        pthread_mutex_unlock(&scan_cache.lock);
+        nvfree(entries);
+        return;
+    }
 
-    if (*start == '\0') return NULL;
-    
-    /*
-     * find the next comma in the string; if we find one, change it to
-     * a NULL terminator (and move 'next' to the character immediately
-     * after the comma); if we don't find a comma, move the 'next'
-     * pointer to the end of the string, so that we terminate on the
-     * next call to extract_x_path()
-     */
+    memset(&entry, 0, sizeof(entry));
+    entry.dev = stat_buf->st_dev;
+    entry.ino = stat_buf->st_ino;
+    entry.mtime = stat_buf->st_mtim;
+    entry.ctime = stat_buf->st_ctim;
+    entry.entries = entries;
+    entry.entries_len = len;
+    entry.seen = TRUE;
 
-    *next = strchr(start, ',');
+    scan_cache_insert(&entry);
+    scan_cache.dirty = TRUE;
 
-    if (*next) {
-        **next = '\0';
-        (*next)++;
+    pthread_mutex_unlock(&scan_cache.lock);
+}
+
+
+/*
+ * parse_scan_cache_mode() - look up a ScanCacheMode by the name used for
+ * it on the command line.
+ */
+
+int parse_scan_cache_mode(const char *name, int *mode)
+{
+    if (strcmp(name, "use") == 0) {
+        *mode = SCAN_CACHE_USE;
+    } else if (strcmp(name, "rebuild") == 0) {
+        *mode = SCAN_CACHE_REBUILD;
+    } else if (strcmp(name, "off") == 0) {
+        *mode = SCAN_CACHE_OFF;
     } else {
-        *next = strchr(start, '\0');
+        return FALSE;
     }
-    
-    return start;
-    
-} /* extract_x_path() */
 
+    return TRUE;
+}
 
-enum XPathType {
-    XPathLibrary,
-    XPathModule,
-    XPathSysConfig
-};
 
 /*
- * get_x_paths_helper() - helper function for determining the X
- * library, module, and system xorg.conf.d paths; returns 'TRUE' if we had to
- * guess at the path
+ * load_scan_cache() - enable the directory scan cache, unless
+ * 'op->scan_cache' is SCAN_CACHE_OFF, and populate it from 'filename' if
+ * that file exists and 'op->scan_cache' is not SCAN_CACHE_REBUILD.  A
+ * missing or unparseable cache file simply leaves the cache empty; a
+ * truncated one only loses its last directory.
  */
 
-static int get_x_paths_helper(Options *op,
-                              enum XPathType pathType,
-                              char *xserver_cmd,
-                              char *pkg_config_cmd,
-                              char *name,
-                              char **path,
-                              int require_existing_directory)
+void load_scan_cache(Options *op, const char *filename)
 {
-    char *dirs, *cmd, *dir, *next;
-    int ret, guessed = 0;
+    FILE *file;
+    char line[NAME_MAX + 64];
+    unsigned long long dev, ino, msec, mnsec, csec, cnsec, count, i;
 
-    /*
-     * if the path was already specified (i.e.: by a command
-     * line option), then we are done with this iteration
-     */
-    
-    if (*path != NULL) {
-        return FALSE;
+    if (op->scan_cache == SCAN_CACHE_OFF) {
+        return;
     }
-    
-    /*
-     * attempt to determine the path through the various query mechanisms
-     */
 
-    /*
-     * first, try the X server commandline option; this is the
-     * recommended query mechanism as of X.Org 7.2
-     */
-    if (op->utils[XSERVER] && xserver_cmd) {
+    pthread_mutex_lock(&scan_cache.lock);
 
-        dirs = NULL;
-        cmd = nvstrcat(op->utils[XSERVER], " ", xserver_cmd, NULL);
-        ret = run_command(op, cmd, &dirs, FALSE, 0, TRUE);
-        nvfree(cmd);
+    if (scan_cache.enabled) {
+        goto done;
+    }
 
-        if ((ret == 0) && dirs) {
-            
-            next = NULL;
+    scan_cache.enabled = TRUE;
+    scan_cache.start_time = time(NULL);
 
-            dir = extract_x_path(dirs, &next);
-            
-            while (dir) {
-                
-                if (!require_existing_directory || directory_exists(dir)) {
+    if (op->scan_cache == SCAN_CACHE_REBUILD) {
+        ui_log(op, "Rebuilding the directory scan cache.");
+        scan_cache.dirty = TRUE;
+        goto done;
+    }
 
-                    ui_expert(op, "X %s path '%s' determined from `%s %s`",
-                              name, dir, op->utils[XSERVER], xserver_cmd);
-                    
-                    *path = nvstrdup(dir);
-                    
-                    nvfree(dirs);
-                    
-                    return FALSE;
-                    
-                } else {
-                    ui_warn(op, "You appear to be using a modular X.Org "
-                            "release, but the X %s installation "
-                            "path, '%s', reported by `%s %s` does not exist.  "
-                            "Please check your X.Org installation.",
-                            name, dir, op->utils[XSERVER], xserver_cmd);
-                }
+    file = fopen(filename, "r");
+    if (!file) {
+        goto done;
+    }
 
-                dir = extract_x_path(dirs, &next);
+    if (!fgets(line, sizeof(line), file) ||
+        strncmp(line, SCAN_CACHE_HEADER, strlen(SCAN_CACHE_HEADER)) != 0) {
+        ui_log(op, "Ignoring directory scan cache '%s' with unknown format.",
+               filename);
+        fclose(file);
+        goto done;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        ScanCacheEntry entry;
+        size_t capacity = 0;
+
+        if (sscanf(line, "%llu %llu %llu %llu %llu %llu %llu",
+                   &dev, &ino, &msec, &mnsec, &csec, &cnsec, &count) != 7) {
+            break;
+        }
+
+        memset(&entry, 0, sizeof(entry));
+        entry.dev = dev;
+        entry.ino = ino;
+        entry.mtime.tv_sec = msec;
+        entry.mtime.tv_nsec = mnsec;
+        entry.ctime.tv_sec = csec;
+        entry.ctime.tv_nsec = cnsec;
+
+        for (i = 0; i < count; i++) {
+            size_t len;
+
+            if (!fgets(line, sizeof(line), file) ||
+                (len = strlen(line)) < 4 || line[len - 1] != '\n' ||
+                !strchr("fdl", line[0]) || line[1] != ' ') {
+                break;
+            }
+
+            /* store "<type><name>\0": dropping the ' ', and the '\n' */
+
+            line[len - 1] = '\0';
+            len -= 1;
+
+            if (entry.entries_len + len > capacity) {
+                capacity = NV_MAX(capacity * 2, entry.entries_len + len);
+                entry.entries = nvrealloc(entry.entries, capacity);
             }
+
+            entry.entries[entry.entries_len] = line[0];
+            memcpy(entry.entries + entry.entries_len + 1, line + 2, len - 1);
+            entry.entries_len += len;
         }
 
-        nvfree(dirs);
+        if (i < count) {
+            nvfree(entry.entries);
+            break;
+        }
+
+        scan_cache_insert(&entry);
     }
 
-    /*
-     * then, try the pkg-config command; this was the the
-     * pseudo-recommended query mechanism between X.Org 7.0 and
-     * X.Org 7.2
-     */
-    if (op->utils[PKG_CONFIG]) {
+    fclose(file);
 
-        dirs = NULL;
-        cmd = nvstrcat(op->utils[PKG_CONFIG], " ",
-                pkg_config_cmd, NULL);
-        ret = run_command(op, cmd, &dirs, FALSE, 0, TRUE);
-        nvfree(cmd);
+ done:
+    pthread_mutex_unlock(&scan_cache.lock);
+}
 
-        if ((ret == 0) && dirs) {
 
-            next = NULL;
-            
-            dir = extract_x_path(dirs, &next);
- 
-            while (dir) {
-                
-                if (!require_existing_directory || directory_exists(dir)) {
+/*
+ * save_scan_cache() - write the directory scan cache to 'filename', if
+ * it has changed since it was loaded; only the directories found by
+ * this run's searches are kept.  The file is written under a temporary
+ * name and renamed into place, so readers never see a partial cache.
+ */
 
-                    ui_expert(op, "X %s path '%s' determined from `%s %s`",
-                              name, dir, op->utils[PKG_CONFIG],
-                              pkg_config_cmd);
+int save_scan_cache(Options *op, const char *filename)
+{
+    FILE *file = NULL;
+    char *tmpname;
+    int fd, ret = FALSE;
+    size_t i, num_seen = 0;
 
-                    *path = nvstrdup(dir);
-                    
-                    nvfree(dirs);
-                    
-                    return FALSE;
-                
-                } else {
-                    ui_warn(op, "You appear to be using a modular X.Org "
-                            "release, but the X %s installation "
-                            "path, '%s', reported by `%s %s` does not exist.  "
-                            "Please check your X.Org installation.",
-                            name, dir, op->utils[PKG_CONFIG], pkg_config_cmd);
-                }
+    pthread_mutex_lock(&scan_cache.lock);
 
-                dir = extract_x_path(dirs, &next);
-            }
+    for (i = 0; i < scan_cache.capacity; i++) {
+        if (scan_cache.entries[i].used && scan_cache.entries[i].seen) {
+            num_seen++;
         }
+    }
 
-        nvfree(dirs);
+    if (!scan_cache.enabled ||
+        (!scan_cache.dirty && num_seen == scan_cache.count)) {
+        pthread_mutex_unlock(&scan_cache.lock);
+        return TRUE;
     }
 
-    /*
-     * neither of the above mechanisms yielded a usable path; fall
-     * through to constructing the path by hand.  If this is a modular X server,
-     * record that we have to guess the path so that we can print a warning when
-     * we are done.  For non-modular X, the default of /usr/X11R6/lib is
-     * standard.
-     */
+    tmpname = nvstrcat(filename, ".tmp", NULL);
 
-    if (op->modular_xorg)
-        guessed = TRUE;
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1 || !(file = fdopen(fd, "w"))) {
+        ui_log(op, "Unable to write directory scan cache '%s' (%s).",
+               tmpname, strerror(errno));
+        if (fd != -1) close(fd);
+        goto done;
+    }
 
+    fprintf(file, "%s\n", SCAN_CACHE_HEADER);
 
-    /* build the path */
+    for (i = 0; i < scan_cache.capacity; i++) {
+        const ScanCacheEntry *e = &scan_cache.entries[i];
+        size_t count = 0, pos;
 
-    switch (pathType) {
-        case XPathLibrary:
-            *path = nvstrcat(op->x_prefix, "/", op->x_libdir, NULL);
-            break;
+        if (!e->used || !e->seen) continue;
 
-        case XPathModule:
-            *path = nvstrcat(op->x_library_path, "/", op->x_moddir, NULL);
-            break;
+        for (pos = 0; pos < e->entries_len;
+             pos += strlen(e->entries + pos) + 1) {
+            count++;
+        }
 
-        case XPathSysConfig:
-            *path = nvstrcat(DEFAULT_X_DATAROOT_PATH, "/", DEFAULT_CONFDIR, NULL);
-            break;
+        fprintf(file, "%llu %llu %llu %ld %llu %ld %llu\n",
+                (unsigned long long) e->dev,
+                (unsigned long long) e->ino,
+                (unsigned long long) e->mtime.tv_sec, e->mtime.tv_nsec,
+                (unsigned long long) e->ctime.tv_sec, e->ctime.tv_nsec,
+                (unsigned long long) count);
+
+        for (pos = 0; pos < e->entries_len;
+             pos += strlen(e->entries + pos) + 1) {
+            fprintf(file, "%c %s\n", e->entries[pos], e->entries + pos + 1);
+        }
     }
-    
-    remove_trailing_slashes(*path);
-    collapse_multiple_slashes(*path);
-    
-    return guessed;
+
+    if (fclose(file) != 0) {
+        ui_log(op, "Error while closing directory scan cache '%s' (%s).",
+               tmpname, strerror(errno));
+        unlink(tmpname);
+        goto done;
+    }
+
+    if (rename(tmpname, filename) == -1) {
+        ui_log(op, "Unable to rename '%s' to '%s' (%s).",
+               tmpname, filename, strerror(errno));
+        unlink(tmpname);
+        goto done;
+    }
+
+    scan_cache.dirty = FALSE;
+    ret = TRUE;
+
+ done:
+    pthread_mutex_unlock(&scan_cache.lock);
+    nvfree(tmpname);
+
+    return ret;
 }
 
 
+
 /*
- * get_x_library_and_module_paths() - assign op->x_library_path and
- * op->x_module_path; this cannot fail.
+ * Parallel directory tree search: find_files_in_trees() walks the
+ * hierarchies under a list of roots, on a pool of worker threads, and
+ * returns the paths of the files whose names are accepted by a
+ * caller-supplied filter.  The traversal is "logical", as with
+ * fts(3)'s FTS_LOGICAL: symbolic links are followed; a symbolic link
+ * to a regular file is reported as a file, under the link's path, and
+ * so is a symbolic link whose target does not exist.
+ *
+ * Each worker thread keeps a deque of directories still to be read: it
+ * pushes the subdirectories it finds onto, and takes its next directory
+ * from, the back of its own deque, and when that is empty, it steals
+ * from the front of another thread's deque.  Directories are read with
+ * getdents64(2) where available, and their entries are only stat(2)ed,
+ * relative to the directory (with fstatat(2)), when their type is not
+ * known from the directory entry itself or they are symbolic links.
+ *
+ * Each directory is only read once, even if it can be reached through
+ * several paths (e.g. via symbolic links to directories).  So that the
+ * path through which a directory is read does not depend on the timing
+ * of the threads, directories reached through symbolic links are not
+ * read during the pass that found them: they are read in a subsequent
+ * pass, and are claimed, in order of their paths, before that pass
+ * starts.  (Only bind mounts can still make a directory reachable
+ * through several paths within a pass.)  The returned paths are sorted.
  */
 
-static void get_x_library_and_module_paths(Options *op)
+typedef struct {
+    char *path;
+    int level;
+    int claimed;                /* already added to the visited set */
+} DirectoryWalkItem;
+
+typedef struct {
+    pthread_mutex_t lock;
+    DirectoryWalkItem *items;
+    size_t head, tail, capacity;
+} DirectoryWalkDeque;
+
+typedef struct {
+    char **paths;
+    size_t num, capacity;
+} PathArray;
+
+typedef struct {
+    const DirectoryWalk *walk;
+    int use_cache;              /* consult and update the scan cache */
+    int num_workers;
+    DirectoryWalkDeque *deques;
+    PathArray *found;           /* one per worker */
+
+    pthread_mutex_t lock;       /* protects all of the following */
+    pthread_cond_t work;        /* signalled when a directory is queued
+                                   or 'pending' drops to zero */
+    InodeSet visited;
+    DirectoryWalkItem *deferred; /* directories reached via symlinks */
+    size_t num_deferred, deferred_capacity;
+    size_t pending;             /* directories queued or being read */
+    size_t queued;              /* directories queued so far */
+    size_t dirs_found, dirs_done;
+} DirectoryWalkState;
+
+typedef struct {
+    DirectoryWalkState *state;
+    int id;
+} DirectoryWalkWorker;
+
+#define DIRECTORY_WALK_PROGRESS_INTERVAL 64
+
+
+static void append_path(PathArray *a, char *path)
 {
-    int guessed = FALSE;
-    
-    /*
-     * get the library path, and then get the module path; note that
-     * the module path depends on already having the library path
-     */
-    
-    guessed |= get_x_paths_helper(op,
-                                  XPathLibrary,
-                                  "-showDefaultLibPath",
-                                  "--variable=libdir xorg-server",
-                                  "library",
-                                  &op->x_library_path,
-                                  TRUE);
-    
-    guessed |= get_x_paths_helper(op,
-                                  XPathModule,
-                                  "-showDefaultModulePath",
-                                  "--variable=moduledir xorg-server",
-                                  "module",
-                                  &op->x_module_path,
-                                  TRUE);
+    if (a->num == a->capacity) {
+        a->capacity = a->capacity ? a->capacity * 2 : 64;
+        a->paths = nvrealloc(a->paths, a->capacity * sizeof(char *));
+    }
+    a->paths[a->num++] = path;
+}
 
-    /*
-     * Get the sysconfig path (typically /usr/share/X11/xorg.conf.d).  This is
-     * only needed if the nvidia.conf OutputClass config snippet is going to be
-     * installed.  Don't complain if we had to guess the path; the server will
-     * still work without it if xorg.conf is set up.
-     */
-    get_x_paths_helper(op,
-                       XPathSysConfig,
-                       NULL,
-                       "--variable=sysconfigdir xorg-server",
-                       "sysconfig",
-                       &op->x_sysconfig_path,
-                       FALSE);
 
-    /*
-     * done assigning op->x_library_path and op->x_module_path; if we
-     * had to guess at either of the paths, print a warning
-     */
-    
-    if (guessed) {
-        ui_warn(op, "nvidia-installer was forced to guess the X library "
-                "path '%s' and X module path '%s'; these paths were not "
-                "queryable from the system.  If X fails to find the "
-                "NVIDIA X driver module, please install the `pkg-config` "
-                "utility and the X.Org SDK/development package for your "
-                "distribution and reinstall the driver.",
-                op->x_library_path, op->x_module_path);
+static void push_directory(DirectoryWalkDeque *d, char *path, int level,
+                           int claimed)
+{
+    pthread_mutex_lock(&d->lock);
+
+    if (d->tail == d->capacity) {
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head,
+                    (d->tail - d->head) * sizeof(DirectoryWalkItem));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            d->capacity = d->capacity ? d->capacity * 2 : 64;
+            d->items = nvrealloc(d->items,
+                                 d->capacity * sizeof(DirectoryWalkItem));
+        }
     }
-    
-} /* get_x_library_and_module_paths() */
 
+    d->items[d->tail].path = path;
+    d->items[d->tail].level = level;
+    d->items[d->tail].claimed = claimed;
+    d->tail++;
+
+    pthread_mutex_unlock(&d->lock);
+}
 
 
 /*
- * get_filename() - Prompt the user for the path to a file. If no file exists
- * at the given path, keep reprompting until a valid path to a regular file or
- * symbolic link is given. This is just a thin wrapper around ui_get_input().
+ * take_directory() - take an item from the back ('steal' FALSE) or the
+ * front ('steal' TRUE) of the deque; returns FALSE if it is empty.
  */
-char *get_filename(Options *op, const char *def, const char *msg)
+
+static int take_directory(DirectoryWalkDeque *d, int steal,
+                          DirectoryWalkItem *item)
 {
-    char *oldfile = nvstrdup(def);
+    int found = FALSE;
+
+    pthread_mutex_lock(&d->lock);
 
-    /* XXX This function should never be called if op->no_questions is set,
-     * but just in case that happens by accident, do something besides looping
-     * infinitely if def is a filename that doesn't exist. */
-    if (op->no_questions) {
-        return oldfile;
+    if (d->head < d->tail) {
+        *item = steal ? d->items[d->head++] : d->items[--d->tail];
+        found = TRUE;
     }
 
-    while (TRUE) {
-        struct stat stat_buf;
-        char *file = ui_get_input(op, oldfile, "%s", msg);
+    if (d->head == d->tail) {
+        d->head = d->tail = 0;
+    }
 
-        nvfree(oldfile);
+    pthread_mutex_unlock(&d->lock);
 
-        if (file && stat(file, &stat_buf) != -1 &&
-           (S_ISREG(stat_buf.st_mode) || S_ISLNK(stat_buf.st_mode))) {
-            return file;
-        }
+    return found;
+}
 
-        ui_message(op, "File \"%s\" does not exist, or is not a regular "
-                   "file. Please enter another filename.", file ?
-                   file : "(null)");
 
-        oldfile = file;
-    }
+static void add_directory(DirectoryWalkState *s, int id, const char *dir,
+                          const char *name, int level)
+{
+    pthread_mutex_lock(&s->lock);
+    s->pending++;
+    s->dirs_found++;
+    pthread_mutex_unlock(&s->lock);
+
+    push_directory(&s->deques[id], nvstrcat(dir, "/", name, NULL), level,
+                   FALSE);
+
+    pthread_mutex_lock(&s->lock);
+    s->queued++;
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
 }
 
 
+static void defer_directory(DirectoryWalkState *s, const char *dir,
+                            const char *name, int level)
+{
+    pthread_mutex_lock(&s->lock);
+
+    if (s->num_deferred == s->deferred_capacity) {
+        s->deferred_capacity = s->deferred_capacity ?
+                               s->deferred_capacity * 2 : 16;
+        s->deferred = nvrealloc(s->deferred, s->deferred_capacity *
+                                             sizeof(DirectoryWalkItem));
+    }
+
+    s->deferred[s->num_deferred].path = nvstrcat(dir, "/", name, NULL);
+    s->deferred[s->num_deferred].level = level;
+    s->deferred[s->num_deferred].claimed = TRUE;
+    s->num_deferred++;
+
+    pthread_mutex_unlock(&s->lock);
+}
+
 
 /*
- * secure_delete() - Securely delete a file, using `shred -u`. If `shred` isn't
- * found, fall back to just unlinking, but print a warning message.
+ * DirectoryRecord: the entries of a directory being read, to be recorded
+ * in the scan cache; see record_directory_entries().
  */
-int secure_delete(Options *op, const char *file)
-{
-    char *cmd;
-
-    cmd = find_system_util("shred");
 
-    if (cmd) {
-        int ret;
-        char *cmdline = nvstrcat(cmd, " -u \"", file, "\"", NULL);
+typedef struct {
+    char *entries;
+    size_t len, capacity;
+    int complete;               /* FALSE if an entry could not be recorded */
+} DirectoryRecord;
 
-        ret = run_command(op, cmdline, NULL, FALSE, 0, TRUE);
-        log_printf(op, NULL, "%s: %s", cmdline, ret == 0 ? "" : "failed!");
 
-        nvfree(cmd);
-        nvfree(cmdline);
+static void record_directory_entry(DirectoryRecord *r, const char *name,
+                                   int type)
+{
+    size_t len = strlen(name) + 2;
+    char c;
 
-        return ret == 0;
-    } else {
-        ui_warn(op, "`shred` was not found on the system. The file %s will "
-                "be deleted, but not securely. It may be possible to recover "
-                "the file after deletion.", file);
-        unlink(file);
-        return FALSE;
+    switch (type) {
+        case DT_REG: c = 'f'; break;
+        case DT_DIR: c = 'd'; break;
+        case DT_LNK: c = 'l'; break;
+        case DT_UNKNOWN: r->complete = FALSE; return;
+        default: return;
     }
-} /* secure_delete() */
 
+    /* the cache file has one entry per line */
 
-/* invalidate_package_entry() - clear a package entry */
+    if (strchr(name, '\n')) {
+        r->complete = FALSE;
+        return;
+    }
 
-void invalidate_package_entry(PackageEntry *entry)
-{
-    entry->type = FILE_TYPE_NONE;
-    /*
-     * XXX don't try to free the destination string for
-     * these invalidated package entries; this prevents
-     * a crash on some Slackware 10.0 installations that
-     * we've been unable to reproduce/root cause.
-     */
-    entry->dst = NULL;
-    memset(&(entry->caps), 0, sizeof(entry->caps));
+    if (r->len + len > r->capacity) {
+        r->capacity = NV_MAX(r->capacity * 2, r->len + len + 256);
+        r->entries = nvrealloc(r->entries, r->capacity);
+    }
+
+    r->entries[r->len] = c;
+    memcpy(r->entries + r->len + 1, name, len - 1);
+    r->len += len;
 }
 
 
 /*
- * is_subdirectory() - test whether subdir is a subdir of dir
- * returns TRUE on successful test, or FALSE on error
- * sets *is_subdir based on the result of a successful test
- *
- * The testing is performed two ways: first, walk from subdir up to "/"
- * and check at each step along the way if subdir's device and inode
- * match dir's. If a match is not found this way, simply compare dir
- * and subdir as normalized strings, up to the length of subdir, since
- * the first method will fail if subdir is a symlink located inside dir
- * whose target is outside of dir.
+ * walk_directory_entry() - handle one entry, of type 'type' (a DT_*
+ * value), of the directory open on 'fd'.  Returns the type of the
+ * entry, which is DT_UNKNOWN if it could not be determined.
  */
 
-int is_subdirectory(const char *dir, const char *subdir, int *is_subdir)
+static int walk_directory_entry(DirectoryWalkState *s, int id, int fd,
+                                const DirectoryWalkItem *item,
+                                const char *name, int type)
 {
-    struct stat root_st, dir_st;
+    const DirectoryWalk *walk = s->walk;
+    struct stat stat_buf;
 
-    if (stat("/", &root_st) != 0 || stat(dir, &dir_st) != 0) {
-        return FALSE;
-    } else {
-        struct stat testdir_st;
-        char *testdir = nvstrdup(subdir);
+    if (type == DT_UNKNOWN) {
+        if (fstatat(fd, name, &stat_buf, AT_SYMLINK_NOFOLLOW) != 0) {
+            return DT_UNKNOWN;
+        }
+        if (S_ISLNK(stat_buf.st_mode))      type = DT_LNK;
+        else if (S_ISDIR(stat_buf.st_mode)) type = DT_DIR;
+        else if (S_ISREG(stat_buf.st_mode)) type = DT_REG;
+        else return DT_FIFO; /* any type that is neither searched nor cached */
+    }
 
-        *is_subdir = FALSE;
+    switch (type) {
 
-        do {
-            char *oldtestdir;
+    case DT_DIR:
+        if (walk->descend(name, item->level + 1, walk->data)) {
+            add_directory(s, id, item->path, name, item->level + 1);
+        }
+        break;
 
-            if (stat(testdir, &testdir_st) != 0) {
-                nvfree(testdir);
-                return FALSE;
+    case DT_REG:
+        if (walk->match(name, walk->data)) {
+            append_path(&s->found[id], nvstrcat(item->path, "/", name, NULL));
+        }
+        break;
+
+    case DT_LNK:
+        if (fstatat(fd, name, &stat_buf, 0) != 0) {
+            /* report broken symbolic links */
+            if (errno == ENOENT && walk->match(name, walk->data)) {
+                append_path(&s->found[id],
+                            nvstrcat(item->path, "/", name, NULL));
             }
-
-            if (testdir_st.st_dev == dir_st.st_dev &&
-                testdir_st.st_ino == dir_st.st_ino) {
-                *is_subdir = TRUE;
-                break;
+        } else if (S_ISDIR(stat_buf.st_mode)) {
+            if (walk->descend(name, item->level + 1, walk->data)) {
+                defer_directory(s, item->path, name, item->level + 1);
             }
+        } else if (S_ISREG(stat_buf.st_mode)) {
+            if (walk->match(name, walk->data)) {
+                append_path(&s->found[id],
+                            nvstrcat(item->path, "/", name, NULL));
+            }
+        }
+        break;
 
-            oldtestdir = testdir;
-            testdir = nvstrcat(oldtestdir, "/..", NULL);
-            nvfree(oldtestdir);
-        } while (testdir_st.st_dev != root_st.st_dev ||
-                 testdir_st.st_ino != root_st.st_ino);
-
-        nvfree(testdir);
+    default:
+        break;
     }
 
-    if (!*is_subdir) {
-        char *dir_with_slash, *subdir_with_slash;
+    return type;
+}
 
-        dir_with_slash = nvstrcat(dir, "/", NULL);
-        collapse_multiple_slashes(dir_with_slash);
-        subdir_with_slash = nvstrcat(subdir, "/", NULL);
-        collapse_multiple_slashes(subdir_with_slash);
 
-        *is_subdir = (strncmp(dir_with_slash, subdir_with_slash,
-                              strlen(dir_with_slash)) == 0);
+#if defined(__linux__) && defined(SYS_getdents64)
 
-        nvfree(dir_with_slash);
-        nvfree(subdir_with_slash);
-    }
+struct nv_linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
 
-    return TRUE;
-}
+#define DIRECTORY_WALK_BUFFER_SIZE (32 * 1024)
 
-/*
- * directory_equals() - if a is a subdirectory of b, and b is a subdirectory
- * of a, then a and b are the same directory. Uses is_subdirectory() to do the
- * subdirectory check, since the inode-based comparison will be resilient
- * against symbolic links in either direction.
- */
-static int directory_equals(const char *a, const char *b)
+static void read_directory_entries(DirectoryWalkState *s, int id, int fd,
+                                   const DirectoryWalkItem *item,
+                                   DirectoryRecord *record)
 {
-    int a_b, b_a;
+    char *buf = nvalloc(DIRECTORY_WALK_BUFFER_SIZE);
+    long len, pos;
+    int type;
 
-    if (is_subdirectory(a, b, &a_b) && is_subdirectory(b, a, &b_a)) {
-        return a_b && b_a;
+    while ((len = syscall(SYS_getdents64, fd, buf,
+                          DIRECTORY_WALK_BUFFER_SIZE)) > 0) {
+        for (pos = 0; pos < len; ) {
+            struct nv_linux_dirent64 *ent =
+                (struct nv_linux_dirent64 *) (buf + pos);
+
+            pos += ent->d_reclen;
+
+            if (strcmp(ent->d_name, ".") == 0 ||
+                strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+
+            type = walk_directory_entry(s, id, fd, item, ent->d_name,
+                                        ent->d_type);
+            if (record) {
+                record_directory_entry(record, ent->d_name, type);
+            }
+        }
     }
 
-    return FALSE;
-}
+    if (len < 0 && record) {
+        record->complete = FALSE;
+    }
 
-/*
- * get_opengl_libdir() - get the path where OpenGL libraries will be installed.
- */
-static char *get_opengl_libdir(const Options *op)
-{
-    return nvstrcat(op->opengl_prefix, "/", op->opengl_libdir, "/", NULL);
+    nvfree(buf);
 }
 
-/*
- * get_compat32_libdir() - get the path where 32-bit compatibility libraries
- * will be installed, where applicable, or NULL when not applicable.
- */
-static char *get_compat32_libdir(const Options *op)
-{
-#if defined NV_X86_64
-    return nvstrcat(op->compat32_chroot ? op->compat32_chroot : "", "/",
-                    op->compat32_prefix, "/", op->compat32_libdir, "/", NULL);
 #else
-    return NULL;
-#endif
-}
 
-/*
- * add_libgl_abi_symlink() - check to see if either native or compatibility
- * OpenGL libraries are destined to be installed to /usr/lib. If not, then
- * create a symlink /usr/lib/libGL.so.1 that points to the native libGL.so.1,
- * for compliance with the OpenGL ABI. Note: this function must be called
- * after set_destinations() to avoid the hardcoded "/usr/lib" destination from
- * being overwritten.
- */
-void add_libgl_abi_symlink(Options *op, Package *p)
+static void read_directory_entries(DirectoryWalkState *s, int id, int fd,
+                                   const DirectoryWalkItem *item,
+                                   DirectoryRecord *record)
 {
-    static const char *usrlib = "/usr/lib/";
-    char *libgl = nvstrdup("libGL.so.1");
-    char *opengl_path = get_opengl_libdir(op);
-    char *opengl32_path = get_compat32_libdir(op);
+    int dir_fd = dup(fd);
+    DIR *dir = (dir_fd >= 0) ? fdopendir(dir_fd) : NULL;
+    struct dirent *ent;
+    int type;
 
-    if (!directory_equals(usrlib, opengl_path)
-#if defined (NV_X86_64)
-        && !directory_equals(usrlib, opengl32_path)
-#endif
-       ) {
-        char *target = nvstrcat(opengl_path, "libGL.so.1", NULL);
-        add_package_entry(p,
-                          libgl,
-                          NULL,
-                          libgl,
-                          target,
-                          nvstrcat(usrlib, libgl, NULL),
-                          FILE_TYPE_OPENGL_SYMLINK,
-                          FILE_COMPAT_ARCH_NATIVE,
-                          0000);
-    } else {
-        nvfree(libgl);
+    if (!dir) {
+        if (dir_fd >= 0) close(dir_fd);
+        if (record) record->complete = FALSE;
+        return;
     }
 
-    nvfree(opengl_path);
-    nvfree(opengl32_path);
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 ||
+            strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        type = walk_directory_entry(s, id, fd, item, ent->d_name,
+                                    ent->d_type);
+        if (record) {
+            record_directory_entry(record, ent->d_name, type);
+        }
+    }
+
+    closedir(dir);
 }
 
-typedef enum {
-    LIBGLVND_CHECK_RESULT_INSTALLED = 0,
-    LIBGLVND_CHECK_RESULT_NOT_INSTALLED = 1,
-    LIBGLVND_CHECK_RESULT_PARTIAL = 2,
-    LIBGLVND_CHECK_RESULT_ERROR = 3,
-} LibglvndInstallCheckResult;
+#endif
+
 
 /*
- * run_libglvnd_script() - Finds and runs the libglvnd install checker script.
- *
- * This runs a helper script which determines whether the libglvnd libraries
- * are installed, missing, or partially installed.
- *
- * If the helper script is not included in the package, then it will just
- * return LIBGLVND_CHECK_RESULT_NOT_INSTALLED.
+ * replay_directory_entries() - handle the entries of a directory, as
+ * recorded in the scan cache.
  */
-static LibglvndInstallCheckResult run_libglvnd_script(Options *op, Package *p,
-                                                      char **missing_libs)
+
+static void replay_directory_entries(DirectoryWalkState *s, int id, int fd,
+                                     const DirectoryWalkItem *item,
+                                     const char *entries, size_t len)
 {
-    const char *scriptPath = "./libglvnd_install_checker/check-libglvnd-install.sh";
-    char *cmdline = NULL, *output = NULL;
-    int status;
-    LibglvndInstallCheckResult result = LIBGLVND_CHECK_RESULT_ERROR;
+    size_t pos;
 
-    if (missing_libs) {
-        *missing_libs = "";
-    }
+    for (pos = 0; pos < len; pos += strlen(entries + pos) + 1) {
+        int type;
 
-    log_printf(op, NULL, "Looking for install checker script at %s", scriptPath);
-    if (access(scriptPath, R_OK) != 0) {
-        // We don't have the install check script, so assume that it's not
-        // installed.
-        log_printf(op, NULL, "No libglvnd install checker script, assuming not installed.");
-        result = LIBGLVND_CHECK_RESULT_NOT_INSTALLED;
-        goto done;
+        switch (entries[pos]) {
+            case 'f': type = DT_REG; break;
+            case 'd': type = DT_DIR; break;
+            default:  type = DT_LNK; break;
+        }
+
+        walk_directory_entry(s, id, fd, item, entries + pos + 1, type);
     }
+}
 
-    cmdline = nvasprintf("/bin/sh %s", scriptPath);
-    status = run_command(op, cmdline, &output, TRUE, 0, FALSE);
-    if (WIFEXITED(status)) {
-        result = WEXITSTATUS(status);
-    } else {
-        result = LIBGLVND_CHECK_RESULT_ERROR;
+
+static void walk_directory(DirectoryWalkState *s, int id,
+                           const DirectoryWalkItem *item)
+{
+    struct stat stat_buf;
+    int fd, is_new = TRUE;
+    const char *entries;
+    size_t len;
+
+    fd = open(item->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
     }
 
-    // If the installation is partial, pass the list of missing libraries
-    // reported by the script back to the caller.
-    if (result == LIBGLVND_CHECK_RESULT_PARTIAL && missing_libs) {
-        char *line, *end, *buf;
-        int len = strlen(output);
-        static const char *missing_label = "Missing libglvnd libraries: ";
+    if (!item->claimed || s->use_cache) {
+        if (fstat(fd, &stat_buf) != 0) {
+            close(fd);
+            return;
+        }
+    }
 
-        for (buf = output;
-             (line = get_next_line(buf, &end, output, len));
-             buf = end) {
-            int found = FALSE;
+    if (!item->claimed) {
+        pthread_mutex_lock(&s->lock);
+        is_new = add_to_inode_set(&s->visited, stat_buf.st_dev,
+                                  stat_buf.st_ino);
+        pthread_mutex_unlock(&s->lock);
+    }
 
-            if (strncmp(line, missing_label, strlen(missing_label)) == 0) {
-                *missing_libs = nvstrdup(line + strlen(missing_label));
-                found = TRUE;
-            }
+    if (is_new && s->walk->visit) {
+        s->walk->visit(item->path, s->walk->data);
+    }
 
-            free(line);
+    if (!is_new) {
+        /* already read */
+    } else if (!s->use_cache) {
+        read_directory_entries(s, id, fd, item, NULL);
+    } else if (get_cached_directory_entries(&stat_buf, &entries, &len)) {
+        replay_directory_entries(s, id, fd, item, entries, len);
+    } else {
+        DirectoryRecord record;
 
-            if (found) {
-                break;
-            }
+        memset(&record, 0, sizeof(record));
+        record.complete = TRUE;
+
+        read_directory_entries(s, id, fd, item, &record);
+
+        if (record.complete) {
+            record_directory_entries(&stat_buf, record.entries, record.len);
+        } else {
+            nvfree(record.entries);
         }
     }
 
-done:
-    nvfree(output);
-    nvfree(cmdline);
-    return result;
+    close(fd);
 }
 
-/*
- * set_libglvnd_egl_json_path() - Tries to figure out what path to install the
- * JSON file to for a libglvnd EGL vendor library.
- *
- * This is only needed to work with an existing copy of the libglvnd libraries.
- * If we're installing our own build, then we already know what path libEGL
- * expects.
- */
-static void set_libglvnd_egl_json_path(Options *op)
+
+static void *directory_walk_worker(void *arg)
 {
-    if (op->libglvnd_json_path == NULL) {
-        if (op->utils[PKG_CONFIG]) {
-            char *path = NULL;
-            char *cmd = nvstrcat(op->utils[PKG_CONFIG], " --variable=datadir libglvnd", NULL);
-            int ret = run_command(op, cmd, &path, FALSE, 0, TRUE);
-            nvfree(cmd);
+    DirectoryWalkWorker *worker = arg;
+    DirectoryWalkState *s = worker->state;
+    const DirectoryWalk *walk = s->walk;
+    unsigned int num_done = 0;
 
-            if (ret == 0) {
-                op->libglvnd_json_path = nvstrcat(path, "/glvnd/egl_vendor.d", NULL);
-                collapse_multiple_slashes(op->libglvnd_json_path);
+    while (1) {
+        DirectoryWalkItem item;
+        size_t queued;
+        int i, found, done;
+
+        pthread_mutex_lock(&s->lock);
+        queued = s->queued;
+        pthread_mutex_unlock(&s->lock);
+
+        found = take_directory(&s->deques[worker->id], FALSE, &item);
+
+        for (i = 1; !found && i < s->num_workers; i++) {
+            found = take_directory(&s->deques[(worker->id + i) %
+                                              s->num_workers], TRUE, &item);
+        }
+
+        if (!found) {
+
+            /*
+             * wait for another worker to queue a directory, unless one
+             * was queued since the deques were searched, or for the
+             * last one to be read
+             */
+
+            pthread_mutex_lock(&s->lock);
+            while (s->pending > 0 && s->queued == queued) {
+                pthread_cond_wait(&s->work, &s->lock);
             }
-            nvfree(path);
+            done = (s->pending == 0);
+            pthread_mutex_unlock(&s->lock);
+
+            if (done) break;
+
+            continue;
         }
-    }
 
-    if (op->libglvnd_json_path == NULL) {
-        ui_warn(op, "Unable to determine the path to install the "
-                "libglvnd EGL vendor library config files. Check that "
-                "you have pkg-config and the libglvnd development "
-                "libraries installed, or specify a path with "
-                "--glvnd-egl-config-path.");
-        op->libglvnd_json_path = nvstrdup(DEFAULT_GLVND_EGL_JSON_PATH);
+        /* only the calling thread reports progress */
+
+        if (worker->id == 0 && walk->progress &&
+            (num_done++ % DIRECTORY_WALK_PROGRESS_INTERVAL) == 0) {
+            float fraction;
+
+            pthread_mutex_lock(&s->lock);
+            fraction = (float) s->dirs_done / (float) s->dirs_found;
+            pthread_mutex_unlock(&s->lock);
+
+            walk->progress(fraction, item.path, walk->data);
+        }
+
+        walk_directory(s, worker->id, &item);
+        nvfree(item.path);
+
+        pthread_mutex_lock(&s->lock);
+        s->pending--;
+        s->dirs_done++;
+        if (s->pending == 0) {
+            pthread_cond_broadcast(&s->work);
+        }
+        pthread_mutex_unlock(&s->lock);
     }
+
+    return NULL;
 }
 
-/*
- * Reports whether the given library is an optional part of libglvnd.
- */
-static int library_is_optional(const char *library)
+
+static int compare_paths(const void *a, const void *b)
 {
-    const char * const optional_libs[] = {
-        "libOpenGL.so", // libOpenGL.so is not needed for classic GLX/EGL ABIs
-    };
-    int i;
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
 
-    for (i = 0; i < ARRAY_LEN(optional_libs); i++) {
-        // Do a partial name match to allow versioned and unversioned SONAMEs
-        if (strncmp(library, optional_libs[i], strlen(optional_libs[i])) == 0) {
-            return TRUE;
-        }
-    }
 
-    return FALSE;
+static int compare_walk_items(const void *a, const void *b)
+{
+    return strcmp(((const DirectoryWalkItem *) a)->path,
+                  ((const DirectoryWalkItem *) b)->path);
 }
 
+
 /*
- * Reports whether the given space-delimited list of libraries includes a
- * mandatory part of the libglvnd stack.
+ * start_directory_walk_pass() - claim the given directories, in order,
+ * and queue those that had not been visited yet.  Takes ownership of
+ * the paths.
  */
-static int list_includes_essential_library(const char *libraries)
-{
-    int essential_library_found = FALSE;
-    char *libs = nvstrdup(libraries);
-    char *lib;
 
-    for (lib = strtok(libs, " "); lib; lib = strtok(NULL, " ")) {
-        if (!library_is_optional(lib)) {
-            essential_library_found = TRUE;
-            break;
+static void start_directory_walk_pass(DirectoryWalkState *s,
+                                      DirectoryWalkItem *items, size_t num)
+{
+    struct stat stat_buf;
+    size_t i, queued = 0;
+
+    for (i = 0; i < num; i++) {
+        if (stat(items[i].path, &stat_buf) != 0 ||
+            !S_ISDIR(stat_buf.st_mode) ||
+            !add_to_inode_set(&s->visited, stat_buf.st_dev,
+                              stat_buf.st_ino)) {
+            nvfree(items[i].path);
+            continue;
         }
-    }
 
-    nvfree(libs);
-    return essential_library_found;
+        s->pending++;
+        s->dirs_found++;
+        push_directory(&s->deques[queued++ % s->num_workers], items[i].path,
+                       items[i].level, TRUE);
+    }
 }
 
+
 /*
- * check_libglvnd_files() - Checks whether or not the installer should install
- * the libglvnd libraries.
- *
- * If the libglvnd libraries are already installed, then we'll leave them
- * alone. If they're not already installed, then we'll install our own copies.
- *
- * Note that we only check for the native libraries, and use that result for
- * both the native and 32-bit compatibility libraries. The reason for that is
- * that the conflicting file list can't distinguish between 32-bit and 64-bit
- * files that have the same filename, so it won't correctly handle installing
- * one but not the other.
+ * find_files_in_trees() - search the hierarchies under the
+ * NULL-terminated list of 'roots', as described above.  Returns the
+ * number of files found, and sets '*files' to a newly allocated array
+ * of their paths, which the caller should free with
+ * free_found_files().
  */
-int check_libglvnd_files(Options *op, Package *p)
+
+int find_files_in_trees(Options *op, char * const *roots,
+                        const DirectoryWalk *walk, char ***files)
 {
-    int shouldInstall = op->install_libglvnd_libraries;
-    int foundAnyFiles = FALSE;
-    int foundJSONFile = FALSE;
-    int i;
+    DirectoryWalkState s;
+    DirectoryWalkWorker *workers;
+    DirectoryWalkItem *phase = NULL;
+    size_t num_phase = 0, j;
+    pthread_t *threads;
+    PathArray result;
+    int i, num_started;
+
+    memset(&s, 0, sizeof(s));
+    memset(&result, 0, sizeof(result));
+
+    s.walk = walk;
+    s.use_cache = walk->use_cache && scan_cache.enabled;
+    s.num_workers = NV_MAX(op->concurrency_level, 1);
+    s.deques = nvalloc(s.num_workers * sizeof(DirectoryWalkDeque));
+    s.found = nvalloc(s.num_workers * sizeof(PathArray));
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.work, NULL);
+
+    for (i = 0; i < s.num_workers; i++) {
+        pthread_mutex_init(&s.deques[i].lock, NULL);
+    }
+
+    workers = nvalloc(s.num_workers * sizeof(DirectoryWalkWorker));
+    threads = nvalloc(s.num_workers * sizeof(pthread_t));
+
+    for (i = 0; i < s.num_workers; i++) {
+        workers[i].state = &s;
+        workers[i].id = i;
+    }
+
+    /* the first pass starts from the roots, in the order given */
+
+    for (i = 0; roots[i]; i++) {
+        if (walk->descend(roots[i], 0, walk->data)) {
+            phase = nvrealloc(phase, (num_phase + 1) *
+                                     sizeof(DirectoryWalkItem));
+            phase[num_phase].path = nvstrdup(roots[i]);
+            phase[num_phase].level = 0;
+            phase[num_phase].claimed = TRUE;
+            num_phase++;
+        }
+    }
 
-    // Start by checking for any libGLX_indirect.so.0 links.
-    check_libGLX_indirect_links(op, p);
+    while (num_phase > 0) {
 
-    // Then, check to see if there are any libglvnd files in the package.
-    for (i = 0; i < p->num_entries; i++) {
-        if (p->entries[i].type == FILE_TYPE_GLVND_LIB ||
-            p->entries[i].type == FILE_TYPE_GLVND_SYMLINK) {
-            foundAnyFiles = TRUE;
+        start_directory_walk_pass(&s, phase, num_phase);
+        nvfree(phase);
+
+        /* the calling thread is worker 0 */
+
+        for (i = 1, num_started = 0; i < s.num_workers; i++) {
+            if (pthread_create(&threads[num_started], NULL,
+                               directory_walk_worker, &workers[i]) != 0) {
+                break;
+            }
+            num_started++;
         }
 
-        if (p->entries[i].type == FILE_TYPE_GLVND_EGL_ICD_JSON) {
-            foundAnyFiles = TRUE;
-            foundJSONFile = TRUE;
+        directory_walk_worker(&workers[0]);
+
+        for (i = 0; i < num_started; i++) {
+            pthread_join(threads[i], NULL);
         }
-    }
-    if (!foundAnyFiles) {
-        return TRUE;
-    }
 
-    if (shouldInstall == NV_OPTIONAL_BOOL_DEFAULT) {
-        char *missing_libs;
+        /*
+         * the next pass reads the directories reached through symbolic
+         * links, claimed in order of their paths
+         */
 
-        // Try to figure out whether libglvnd is already installed. We'll defer
-        // to a separate program to do that.
+        phase = s.deferred;
+        num_phase = s.num_deferred;
 
-        LibglvndInstallCheckResult result = run_libglvnd_script(op, p, &missing_libs);
-        if (result == LIBGLVND_CHECK_RESULT_INSTALLED) {
-            // The libraries are already installed, so leave them alone.
-            shouldInstall = NV_OPTIONAL_BOOL_FALSE;
-        } else if (result == LIBGLVND_CHECK_RESULT_NOT_INSTALLED) {
-            // The libraries are not installed, so install our own copies.
-            shouldInstall = NV_OPTIONAL_BOOL_TRUE;
-        } else if (result == LIBGLVND_CHECK_RESULT_PARTIAL) {
-            // The libraries are partially installed. Ask the user what to do.
-            static int partialAction = -1;
-            if (partialAction < 0) {
-                static const char *ANSWERS[] = {
-                    "Don't install libglvnd files",
-                    "Install and overwrite existing files",
-                    "Abort installation."
-                };
+        if (num_phase > 0) {
+            qsort(phase, num_phase, sizeof(DirectoryWalkItem),
+                  compare_walk_items);
+        }
 
-                int default_choice;
-                const char *optional_only;
+        s.deferred = NULL;
+        s.num_deferred = s.deferred_capacity = 0;
+    }
 
-                // If GLVND was partially installed, but none of the missing
-                // libraries are essential, default to allowing the installation
-                // to continue without installing libglvnd by. If any of the
-                // missing libraries in a partial libglvnd installation are
-                // essential, default to aborting the installation.
-                if (list_includes_essential_library(missing_libs)) {
-                    default_choice = 2; // Abort installation
-                    optional_only = "";
-                } else {
-                    default_choice = 0; // Don't install
-                    optional_only = "All of the essential libglvnd libraries "
-                                    "are present, but one or more optional "
-                                    "components are missing. ";
-                }
+    nvfree(phase);
 
-                partialAction = ui_multiple_choice(op, ANSWERS, 3, default_choice,
-                        "An incomplete installation of libglvnd was found. %s"
-                        "Do you want to install a full copy of libglvnd? "
-                        "This will overwrite any existing libglvnd libraries.",
-                        optional_only);
-            }
-            if (partialAction == 0) {
-                // Don't install
-                shouldInstall = NV_OPTIONAL_BOOL_FALSE;
-            } else if (partialAction == 1) {
-                // Install and overwrite
-                shouldInstall = NV_OPTIONAL_BOOL_TRUE;
-            } else {
-                // Abort.
-                return FALSE;
-            }
-        } else {
-            // Some error occurred.
-            return FALSE;
+    /* merge and sort the files found by each worker */
+
+    for (i = 0; i < s.num_workers; i++) {
+        for (j = 0; j < s.found[i].num; j++) {
+            append_path(&result, s.found[i].paths[j]);
         }
+        nvfree(s.found[i].paths);
+        nvfree(s.deques[i].items);
+        pthread_mutex_destroy(&s.deques[i].lock);
     }
 
-    // Sanity check: We should have set shouldInstall to true or false by now.
-    if (shouldInstall != NV_OPTIONAL_BOOL_FALSE && shouldInstall != NV_OPTIONAL_BOOL_TRUE) {
-        ui_error(op, "Internal error: Could not determine whether to install libglvnd");
-        return FALSE;
+    if (result.num > 0) {
+        qsort(result.paths, result.num, sizeof(char *), compare_paths);
     }
 
-    if (shouldInstall != NV_OPTIONAL_BOOL_TRUE) {
-        log_printf(op, NULL, "Will not install libglvnd libraries.");
-        for (i = 0; i < p->num_entries; i++) {
-            if (p->entries[i].type == FILE_TYPE_GLVND_LIB ||
-                p->entries[i].type == FILE_TYPE_GLVND_SYMLINK ||
-                p->entries[i].type == FILE_TYPE_GLX_CLIENT_LIB ||
-                p->entries[i].type == FILE_TYPE_GLX_CLIENT_SYMLINK ||
-                p->entries[i].type == FILE_TYPE_EGL_CLIENT_LIB ||
-                p->entries[i].type == FILE_TYPE_EGL_CLIENT_SYMLINK) {
-                ui_log(op, "Skipping GLVND file: \"%s\"", p->entries[i].file);
-                invalidate_package_entry(&(p->entries[i]));
-            }
-        }
+    pthread_cond_destroy(&s.work);
+    pthread_mutex_destroy(&s.lock);
+    free_inode_set(&s.visited);
+    nvfree(s.found);
+    nvfree(s.deques);
+    nvfree(workers);
+    nvfree(threads);
 
-        if (foundJSONFile) {
-            set_libglvnd_egl_json_path(op);
-        }
-    } else {
-        log_printf(op, NULL, "Will install libglvnd libraries.");
+    *files = result.paths;
 
-        if (foundJSONFile && op->libglvnd_json_path == NULL) {
-            op->libglvnd_json_path = nvstrdup(DEFAULT_GLVND_EGL_JSON_PATH);
-        }
-    }
-    if (foundJSONFile) {
-        log_printf(op, NULL,
-                "Will install libEGL vendor library config file to %s",
-                op->libglvnd_json_path);
-        for (i = 0; i < p->num_entries; i++) {
-            if (p->entries[i].type == FILE_TYPE_GLVND_EGL_ICD_JSON) {
-                p->entries[i].dst = nvstrcat(op->libglvnd_json_path, "/", p->entries[i].name, NULL);
-                collapse_multiple_slashes(p->entries[i].dst);
-            }
-        }
+    return result.num;
+
+} /* find_files_in_trees() */
+
+
+
+/*
+ * free_found_files() - free the array returned by find_files_in_trees().
+ */
+
+void free_found_files(char **files, int num)
+{
+    int i;
+
+    for (i = 0; i < num; i++) {
+        nvfree(files[i]);
     }
-    return TRUE;
+    nvfree(files);
 }
@@ -22,11 +22,77 @@
 
 #include "nvidia-installer.h"
 #include "precompiled.h"
+#include "digest.h"
+
+/*
+ * InodeSet: a set of files, identified by device and inode number (an
+ * open-addressing hash table); zero-initialize it before use, and free
+ * it with free_inode_set().
+ */
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int used;
+} InodeSetEntry;
+
+typedef struct {
+    InodeSetEntry *slots;       /* a power of two */
+    size_t num_slots;
+    size_t count;
+} InodeSet;
+
+/*
+ * DirectoryWalk: the callbacks used by find_files_in_trees() to filter
+ * and report on its search.  'descend' is called, with the directory's
+ * name and its depth below the root (the root itself is level 0, and
+ * is passed by its full path), to decide whether to search a directory;
+ * 'match' is called with a file's name to decide whether to report it.
+ * Both may be called from any thread.  'progress', if not NULL, is
+ * only called from the calling thread.  'visit', if not NULL, is called,
+ * from any thread, with the path of each directory searched.  If
+ * 'use_cache' is set, and the scan cache has been loaded with
+ * load_scan_cache(), directories whose contents have not changed are
+ * not read again.
+ */
+
+typedef struct {
+    int (*descend)(const char *name, int level, void *data);
+    int (*match)(const char *name, void *data);
+    void (*progress)(float fraction, const char *path, void *data);
+    void (*visit)(const char *path, void *data);
+    void *data;
+    int use_cache;
+} DirectoryWalk;
+
+typedef enum {
+    SCAN_CACHE_USE = 0,
+    SCAN_CACHE_REBUILD,
+    SCAN_CACHE_OFF,
+} ScanCacheMode;
 
 int remove_directory(Options *op, const char *victim);
 int touch_directory(Options *op, const char *victim);
 int copy_file(Options *op, const char *srcfile,
               const char *dstfile, mode_t mode);
+int copy_file_with_checksum(Options *op, const char *srcfile,
+                            const char *dstfile, mode_t mode,
+                            FileChecksum *sum);
+int try_copy_file_with_checksum(const char *srcfile, const char *dstfile,
+                                mode_t mode, FileChecksum *sum,
+                                char **error_str);
+int try_stage_file_with_checksum(const char *srcfile, const char *dstfile,
+                                 mode_t mode, FileChecksum *sum,
+                                 char **error_str);
+int sync_installed_filesystems(Options *op);
+void stage_package_files(Options *op, Package *p);
+int stage_install_file(Options *op, const char *srcfile,
+                       const char *dstfile, mode_t mode);
+int stage_install_symlink(Options *op, const char *linkname,
+                          const char *dstfile);
+char *exchange_staged_file(Options *op, const char *dstfile);
+int commit_staged_file(Options *op, const char *dstfile, FileChecksum *sum);
+void discard_staged_files(void);
 char *write_temp_file(Options *op, const int len,
                       const unsigned char *data, mode_t perm);
 int set_destinations(Options *op, Package *p); /* XXX move? */
@@ -42,7 +108,7 @@ int mkdir_with_log(Options *op, const char *path, const mode_t mode);
 char *get_symlink_target(Options *op, const char *filename);
 char *get_resolved_symlink_target(Options *op, const char *filename);
 int install_file(Options *op, const char *srcfile,
-                 const char *dstfile, mode_t mode);
+                 const char *dstfile, mode_t mode, FileChecksum *sum);
 int install_symlink(Options *op, const char *linkname, const char *dstfile);
 size_t get_file_size(Options *op, const char *filename);
 size_t fget_file_size(Options *op, const int fd);
@@ -66,6 +132,16 @@ char *get_filename(Options *op, const char *def, const char *msg);
 int secure_delete(Options *op, const char *file);
 void invalidate_package_entry(PackageEntry *entry);
 int is_subdirectory(const char *dir, const char *subdir, int *is_subdir);
+int add_to_inode_set(InodeSet *set, dev_t dev, ino_t ino);
+int inode_set_contains(const InodeSet *set, dev_t dev, ino_t ino);
+void free_inode_set(InodeSet *set);
+int get_file_identity(const char *path, dev_t *dev, ino_t *ino);
+int parse_scan_cache_mode(const char *name, int *mode);
+void load_scan_cache(Options *op, const char *filename);
+int save_scan_cache(Options *op, const char *filename);
+int find_files_in_trees(Options *op, char * const *roots,
+                        const DirectoryWalk *walk, char ***files);
+void free_found_files(char **files, int num);
 void add_libgl_abi_symlink(Options *op, Package *p);
 
 int check_libglvnd_files(Options *op, Package *p);
@@ -276,19 +276,40 @@ int install_from_cwd(Options *op)
      * then ask the user if they really want to execute the
      * command list, if the user decides not to execute the
      * command list, they'll be left with no driver installed.
+     *
+     * With --delta-reinstall, an installation of this same version is
+     * not uninstalled, but reinstalled in place; with --delta-upgrade
+     * (implied by --swap-install), so is one of any other version.
+     * Otherwise, with --swap-install, the new files are first copied
+     * next to their destinations while the existing driver is still in
+     * place.
      */
 
     if (!op->kernel_module_only) {
-        if (!run_existing_uninstaller(op)) goto failed;
+        if (!(op->delta_reinstall && prepare_delta_reinstall(op, p))) {
+            if (op->swap_install) {
+                stage_package_files(op, p);
+            }
+            if (!run_existing_uninstaller(op)) goto failed;
+        }
     }
 
     if (!check_libglvnd_files(op, p)) {
         goto failed;
     }
 
-    /* build a list of operations to execute to do the install */
-    
-    if ((c = build_command_list(op, p)) == NULL) goto failed;
+    /*
+     * build a list of operations to execute to do the install, unless
+     * a still valid install plan provides one
+     */
+
+    c = op->install_plan ? import_install_plan(op, p) : NULL;
+
+    if (!c && (c = build_command_list(op, p)) == NULL) goto failed;
+
+    if (op->export_install_plan && !export_install_plan(op, p, c)) {
+        goto failed;
+    }
 
     /* call the ui to get approval for the list of commands */
     
@@ -302,10 +323,24 @@ int install_from_cwd(Options *op)
         if (!init_backup(op, p)) goto failed;
     }
 
+    /* save the cache of the directories searched for conflicting files */
+
+    save_conflict_scan_cache(op);
+
     /* execute the command list */
 
     if (!do_install(op, p, c)) goto failed;
 
+    /* remove what a reinstalled installation no longer installs */
+
+    finish_delta_reinstall(op);
+
+    /* index the backup log, for a later uninstall or sanity check */
+
+    if (!op->kernel_module_only) {
+        update_backup_log_index(op);
+    }
+
     /* Register, build, and install the module with DKMS, if requested */
 
     if (op->dkms && !dkms_install_module(op, p->version, get_kernel_name(op)))
@@ -408,7 +443,9 @@ int install_from_cwd(Options *op)
      * do not merit the error message (e.g., the user declined the
      * license agreement)
      */
-    
+
+    discard_staged_files();
+
     free_package(p);
     
     return FALSE;
@@ -38,6 +38,7 @@
 #include <pciaccess.h>
 #include <elf.h>
 #include <link.h>
+#include <pthread.h>
 
 #include "nvidia-installer.h"
 #include "user-interface.h"
@@ -1193,7 +1194,8 @@ void check_installed_files_from_package(Options *op, Package *p)
             }
         } else if (installable_files.types[p->entries[i].type]) {
             if (!check_installed_file(op, p->entries[i].dst,
-                                      p->entries[i].mode, 0, ui_warn)) {
+                                      p->entries[i].mode, 0, NULL,
+                                      ui_warn)) {
                 ret = FALSE;
             }
         }
@@ -1300,11 +1302,29 @@ int verify_crc(Options *op, const char *filename, unsigned int crc,
 
 
 
+/*
+ * verify_installed_checksum() - as verify_file_checksum(), but, like
+ * verify_crc(), a zero crc without a digest is not checked.
+ */
+
+static int verify_installed_checksum(Options *op, const char *filename,
+                                     uint32 crc, const Digest *digest,
+                                     char **actual, char **expected)
+{
+    if ((!digest || digest->type == DIGEST_NONE) && crc == 0) {
+        return TRUE;
+    }
+
+    return verify_file_checksum(op, filename, crc, digest, actual, expected);
+}
+
+
+
 /*
  * check_installed_file() - check that the specified installed file exists,
- * has the correct permissions, and has the correct crc. Takes a function
- * pointer to either ui_log() or ui_warn() depending on how errors should
- * be reported.
+ * has the correct permissions, and has the correct checksum: the digest,
+ * if one is given, otherwise the crc. Takes a function pointer to either
+ * ui_log() or ui_warn() depending on how errors should be reported.
  *
  * If anything is incorrect, print a warning and return FALSE,
  * otherwise return TRUE.
@@ -1312,10 +1332,11 @@ int verify_crc(Options *op, const char *filename, unsigned int crc,
 
 int check_installed_file(Options *op, const char *filename,
                          const mode_t mode, const uint32 crc,
-                         ui_message_func *logwarn)
+                         const Digest *digest, ui_message_func *logwarn)
 {
     struct stat stat_buf;
-    uint32 actual_crc;
+    char *actual = NULL, *expected = NULL;
+    int ret = FALSE;
 
     if (lstat(filename, &stat_buf) == -1) {
         logwarn(op, "Unable to find installed file '%s' (%s).",
@@ -1341,46 +1362,56 @@ int check_installed_file(Options *op, const char *filename,
     }
 
 
-    if (!verify_crc(op, filename, crc, &actual_crc)) {
-        int ret;
+    if (!verify_installed_checksum(op, filename, crc, digest,
+                                   &actual, &expected)) {
 
         /* If this is not an ELF file, we should not try to unprelink it. */
 
         if (get_elf_architecture(filename) == ELF_INVALID_FILE) {
             logwarn(op, "The installed file '%s' has a different checksum "
-                    "(%ul) than when it was installed (%ul).", filename,
-                    actual_crc, crc);
-            return FALSE;
+                    "(%s) than when it was installed (%s).", filename,
+                    actual, expected);
+            goto done;
         }
 
         /* Otherwise, unprelinking may be able to restore the original file. */
 
-        ui_expert(op, "The installed file '%s' has a different checksum (%ul) "
-                  "than when it was installed (%ul). This may be due to "
+        ui_expert(op, "The installed file '%s' has a different checksum (%s) "
+                  "than when it was installed (%s). This may be due to "
                   "prelinking; attemping `prelink -u %s` to restore the file.",
-                  filename, actual_crc, crc, filename);
+                  filename, actual, expected, filename);
 
-        ret = unprelink(op, filename);
-        if (ret != 0) {
+        if (unprelink(op, filename) != 0) {
             logwarn(op, "The installed file '%s' seems to have changed, but "
                     "`prelink -u` failed; unable to restore '%s' to an "
                     "un-prelinked state.", filename, filename);
-            return FALSE;
+            goto done;
         }
 
-        if (!verify_crc(op, filename, crc, &actual_crc)) {
+        nvfree(actual);
+        nvfree(expected);
+        actual = expected = NULL;
+
+        if (!verify_installed_checksum(op, filename, crc, digest,
+                                       &actual, &expected)) {
             logwarn(op, "The installed file '%s' has a different checksum "
-                    "(%ul) after running `prelink -u` than when it was "
-                    "installed (%ul).",
-                    filename, actual_crc, crc);
-            return FALSE;
+                    "(%s) after running `prelink -u` than when it was "
+                    "installed (%s).",
+                    filename, actual, expected);
+            goto done;
         }
 
         ui_expert(op, "Un-prelinking successful: %s was restored to its "
                   "original state.", filename);
     }
 
-    return TRUE;
+    ret = TRUE;
+
+ done:
+    nvfree(actual);
+    nvfree(expected);
+
+    return ret;
     
 }
 
@@ -2878,6 +2909,132 @@ ElfFileType get_elf_architecture(const char *filename)
 
 
 
+/*
+ * find_terminated_string() - search the bytes [start, end) of 'buf', a
+ * buffer of 'size' bytes, for an occurrence of the 'len' byte string
+ * 'str' that is followed by '\0' or by the end of the buffer (which may
+ * lie beyond 'end'); candidate positions are found with memchr(3), which
+ * is vectorized in the C library.
+ */
+
+static int find_terminated_string(const char *buf, size_t size,
+                                  size_t start, size_t end,
+                                  const char *str, size_t len)
+{
+    const char *p = buf + start;
+    const char *last;
+
+    if (len == 0) {
+        return TRUE;    /* the empty string is always found at the end */
+    }
+
+    if (end - start < len) {
+        return FALSE;
+    }
+
+    last = buf + end - len;
+
+    while (p <= last &&
+           (p = memchr(p, str[0], last - p + 1)) != NULL) {
+        size_t i = p - buf;
+
+        if (memcmp(p, str, len) == 0 &&
+            (i + len == size || buf[i + len] == '\0')) {
+            return TRUE;
+        }
+        p++;
+    }
+
+    return FALSE;
+}
+
+
+/*
+ * find_elf_section() - if 'buf' holds a native ELF object, find the
+ * section named 'name', and return its offset and size in the buffer.
+ */
+
+static int find_elf_section(const char *buf, size_t size, const char *name,
+                            size_t *offset, size_t *section_size)
+{
+    const ElfW(Ehdr) *header = (const ElfW(Ehdr) *) buf;
+    const ElfW(Shdr) *sections, *strtab;
+    size_t i;
+
+    if (size < sizeof(*header) ||
+        memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 ||
+        header->e_ident[EI_CLASS] != ((sizeof(void *) == 8) ? ELFCLASS64 :
+                                                              ELFCLASS32) ||
+        header->e_shentsize != sizeof(ElfW(Shdr)) ||
+        header->e_shoff == 0 ||
+        header->e_shoff > size ||
+        header->e_shnum > (size - header->e_shoff) / sizeof(ElfW(Shdr)) ||
+        header->e_shstrndx >= header->e_shnum ||
+        (header->e_shoff % sizeof(ElfW(Addr))) != 0) {
+        return FALSE;
+    }
+
+    sections = (const ElfW(Shdr) *) (buf + header->e_shoff);
+    strtab = &sections[header->e_shstrndx];
+
+    if (strtab->sh_offset > size || strtab->sh_size > size - strtab->sh_offset) {
+        return FALSE;
+    }
+
+    for (i = 0; i < header->e_shnum; i++) {
+        const ElfW(Shdr) *section = &sections[i];
+        size_t name_len = strlen(name);
+
+        if (section->sh_type == SHT_NOBITS ||
+            section->sh_name >= strtab->sh_size ||
+            name_len >= strtab->sh_size - section->sh_name ||
+            memcmp(buf + strtab->sh_offset + section->sh_name, name,
+                   name_len + 1) != 0) {
+            continue;
+        }
+
+        if (section->sh_offset > size ||
+            section->sh_size > size - section->sh_offset) {
+            return FALSE;
+        }
+
+        *offset = section->sh_offset;
+        *section_size = section->sh_size;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+/*
+ * buffer_contains_string() - determine whether the buffer 'buf' of
+ * 'size' bytes (typically a mapped file) contains the string 'str',
+ * followed either by '\0' or by the end of the buffer.  If the buffer
+ * holds an ELF object, the sections where such strings usually live are
+ * searched first, so the whole buffer only needs to be searched when the
+ * string is not found there.
+ */
+
+int buffer_contains_string(const char *buf, size_t size, const char *str)
+{
+    static const char *sections[] = { ".dynstr", ".rodata", NULL };
+    size_t len = strlen(str), offset, section_size;
+    int i;
+
+    for (i = 0; sections[i]; i++) {
+        if (find_elf_section(buf, size, sections[i], &offset, &section_size) &&
+            find_terminated_string(buf, size, offset, offset + section_size,
+                                   str, len)) {
+            return TRUE;
+        }
+    }
+
+    return find_terminated_string(buf, size, 0, size, str, len);
+}
+
+
+
 /*
  * set_concurrency_level() - automatically determine the concurrency level,
  * if the user has not specified it.
@@ -2928,4 +3085,86 @@ to detect the number of processors.
         } while (val < 1);
         op->concurrency_level = val;
     }
+
+    set_crc_concurrency_level(op->concurrency_level);
 }
+
+
+
+/*
+ * Simple worker pool: run_parallel_tasks() calls 'func' once for each
+ * index in [0, count), from up to op->concurrency_level threads
+ * (including the calling thread), and returns once all calls have
+ * completed.  Indices are handed out in increasing order, but may
+ * complete in any order; 'func' should store its result at its index
+ * for the caller to merge.  'func' must not call any of the ui_*()
+ * functions, which are not thread-safe.
+ */
+
+typedef struct {
+    size_t count;
+    ParallelTaskFunc func;
+    void *data;
+
+    pthread_mutex_t lock;
+    size_t next;
+} ParallelTaskJob;
+
+
+static void *parallel_task_worker(void *arg)
+{
+    ParallelTaskJob *job = arg;
+
+    while (1) {
+        size_t i;
+
+        pthread_mutex_lock(&job->lock);
+        i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (i >= job->count) break;
+
+        job->func(i, job->data);
+    }
+
+    return NULL;
+}
+
+
+void run_parallel_tasks(Options *op, size_t count, ParallelTaskFunc func,
+                        void *data)
+{
+    ParallelTaskJob job;
+    pthread_t *threads;
+    int i, num_threads, num_started = 0;
+
+    memset(&job, 0, sizeof(job));
+    job.count = count;
+    job.func = func;
+    job.data = data;
+    pthread_mutex_init(&job.lock, NULL);
+
+    /* the calling thread is one of the workers */
+
+    num_threads = (int) NV_MIN((size_t) NV_MAX(op->concurrency_level, 1),
+                               count) - 1;
+    threads = nvalloc(NV_MAX(num_threads, 1) * sizeof(pthread_t));
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, parallel_task_worker,
+                           &job) != 0) {
+            break;
+        }
+        num_started++;
+    }
+
+    parallel_task_worker(&job);
+
+    for (i = 0; i < num_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    nvfree(threads);
+    pthread_mutex_destroy(&job.lock);
+
+} /* run_parallel_tasks() */
@@ -30,6 +30,7 @@
 #include "nvidia-installer.h"
 #include "command-list.h"
 #include "user-interface.h"
+#include "digest.h"
 
 /*
  * Enumeration to identify whether the execution of a distro hook script has
@@ -74,7 +75,7 @@ void should_install_optional_modules(Options *op, Package *p,
                                      int num_optional_modules);
 void check_installed_files_from_package(Options *op, Package *p);
 int check_installed_file(Options*, const char*, const mode_t, const uint32,
-                         ui_message_func *logwarn);
+                         const Digest*, ui_message_func *logwarn);
 int check_runtime_configuration(Options *op, Package *p);
 void collapse_multiple_slashes(char *s);
 int is_symbolic_link_to(const char *path, const char *dest);
@@ -92,6 +93,11 @@ int verify_crc(Options *op, const char *filename, unsigned int crc,
                unsigned int *actual_crc);
 int secure_boot_enabled(void);
 ElfFileType get_elf_architecture(const char *filename);
+int buffer_contains_string(const char *buf, size_t size, const char *str);
 void set_concurrency_level(Options *op);
 
+typedef void (*ParallelTaskFunc)(size_t i, void *data);
+void run_parallel_tasks(Options *op, size_t count, ParallelTaskFunc func,
+                        void *data);
+
 #endif /* __NVIDIA_INSTALLER_MISC_H__ */
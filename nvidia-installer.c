@@ -44,6 +44,7 @@
 #include "option_table.h"
 #include "msg.h"
 #include "manifest.h"
+#include "digest.h"
 
 static void print_version(void);
 static void print_help(const char* name, int is_uninstall, int advanced);
@@ -179,6 +180,36 @@ static int assign_file_type_override(Options *op, char *optarg)
 }
 
 
+/* Parse the comma-separated list of optional entries ("dir", "config",
+ * "symlink") given to the --rpm-file-list-entries command line option.
+ * Return TRUE if parsing was successful, or FALSE on a parse error. */
+static int parse_rpm_file_list_entries(Options *op, const char *optarg)
+{
+    char *list = nvstrdup(optarg), *entry, *saveptr = NULL;
+    int ret = TRUE;
+
+    op->rpm_file_list_entries = 0;
+
+    for (entry = strtok_r(list, ",", &saveptr); entry;
+         entry = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(entry, "dir") == 0) {
+            op->rpm_file_list_entries |= RPM_FILE_LIST_DIRS;
+        } else if (strcmp(entry, "config") == 0) {
+            op->rpm_file_list_entries |= RPM_FILE_LIST_CONFIG;
+        } else if (strcmp(entry, "symlink") == 0) {
+            op->rpm_file_list_entries |= RPM_FILE_LIST_SYMLINKS;
+        } else {
+            ret = FALSE;
+            break;
+        }
+    }
+
+    nvfree(list);
+
+    return ret;
+}
+
+
 /*
  * parse_commandline() - Populate the Options structure with
  * appropriate values, based on the arguments passed at the commandline.
@@ -197,6 +228,7 @@ static void parse_commandline(int argc, char *argv[], Options *op)
     char *strval = NULL, *program_name = NULL;
     int boolval;
     int intval = 0;
+    DigestType digest_type;
 
     /*
      * if the installer was invoked as "nvidia-uninstall", perform an
@@ -345,6 +377,14 @@ static void parse_commandline(int argc, char *argv[], Options *op)
         case RPM_FILE_LIST_OPTION:
             op->rpm_file_list = strval;
             break;
+        case RPM_FILE_LIST_ENTRIES_OPTION:
+            if (!parse_rpm_file_list_entries(op, strval)) {
+                nv_error_msg("Invalid RPM file list entries '%s': valid "
+                             "entries are 'dir', 'config', and 'symlink'.",
+                             strval);
+                goto fail;
+            }
+            break;
         case NO_RUNLEVEL_CHECK_OPTION:
             /* This option is no longer used; ignore it. */
             nv_warning_msg("The '--no-runlevel-check' option is deprecated:  "
@@ -491,6 +531,43 @@ static void parse_commandline(int argc, char *argv[], Options *op)
         case SKIP_DEPMOD_OPTION:
             op->skip_depmod = TRUE;
             break;
+        case BACKUP_LOG_DIGEST_OPTION:
+            if (!parse_digest_type(strval, &digest_type)) {
+                nv_error_msg("Invalid backup log digest '%s': valid digests "
+                             "are 'crc32', 'xxh64', and 'blake3'.", strval);
+                goto fail;
+            }
+            op->backup_log_digest = digest_type;
+            break;
+        case STAGED_INSTALL_OPTION:
+            op->staged_install = TRUE;
+            break;
+        case SWAP_INSTALL_OPTION:
+            op->swap_install = TRUE;
+            op->staged_install = TRUE;
+            op->delta_upgrade = TRUE;
+            op->delta_reinstall = TRUE;
+            break;
+        case DELTA_REINSTALL_OPTION:
+            op->delta_reinstall = TRUE;
+            break;
+        case DELTA_UPGRADE_OPTION:
+            op->delta_upgrade = TRUE;
+            op->delta_reinstall = TRUE;
+            break;
+        case INSTALL_PLAN_OPTION:
+            op->install_plan = strval;
+            break;
+        case EXPORT_INSTALL_PLAN_OPTION:
+            op->export_install_plan = strval;
+            break;
+        case CONFLICT_SCAN_CACHE_OPTION:
+            if (!parse_scan_cache_mode(strval, &op->scan_cache)) {
+                nv_error_msg("Invalid conflict scan cache mode '%s': valid "
+                             "modes are 'use', 'rebuild', and 'off'.", strval);
+                goto fail;
+            }
+            break;
         default:
             goto fail;
         }
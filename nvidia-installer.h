@@ -213,6 +213,12 @@ typedef struct __options {
     int concurrency_level;
     int skip_module_load;
     int skip_depmod;
+    int backup_log_digest; /* a DigestType */
+    int scan_cache; /* a ScanCacheMode */
+    int staged_install;
+    int swap_install;
+    int delta_reinstall;
+    int delta_upgrade;
 
     NVOptionalBool install_libglx_indirect;
     NVOptionalBool install_libglvnd_libraries;
@@ -265,6 +271,9 @@ typedef struct __options {
     char *tmpdir;
     char *kernel_name;
     char *rpm_file_list;
+    int rpm_file_list_entries; /* RPM_FILE_LIST_* bits */
+    char *install_plan;
+    char *export_install_plan;
     char *precompiled_kernel_interfaces_path;
     const char *selinux_chcon_type;
 
@@ -431,6 +440,11 @@ typedef struct __package {
 #define SELINUX_FORCE_YES           0x0001
 #define SELINUX_FORCE_NO            0x0002
 
+/* optional entries in the --rpm-file-list output */
+#define RPM_FILE_LIST_DIRS          0x0001
+#define RPM_FILE_LIST_CONFIG        0x0002
+#define RPM_FILE_LIST_SYMLINKS      0x0004
+
 #define PERM_MASK (S_IRWXU|S_IRWXG|S_IRWXO)
 
 #define PRECOMPILED_PACKAGE_FILENAME "nvidia-precompiled"
@@ -106,6 +106,15 @@ enum {
     EGL_EXTERNAL_PLATFORM_CONFIG_FILE_PATH_OPTION,
     OVERRIDE_FILE_TYPE_DESTINATION_OPTION,
     SKIP_DEPMOD_OPTION,
+    BACKUP_LOG_DIGEST_OPTION,
+    CONFLICT_SCAN_CACHE_OPTION,
+    RPM_FILE_LIST_ENTRIES_OPTION,
+    INSTALL_PLAN_OPTION,
+    EXPORT_INSTALL_PLAN_OPTION,
+    STAGED_INSTALL_OPTION,
+    SWAP_INSTALL_OPTION,
+    DELTA_REINSTALL_OPTION,
+    DELTA_UPGRADE_OPTION,
 };
 
 static const NVGetoptOption __options[] = {
@@ -639,6 +648,92 @@ static const NVGetoptOption __options[] = {
       "running nvidia-installer."
     },
 
+    { "backup-log-digest", BACKUP_LOG_DIGEST_OPTION,
+      NVGETOPT_STRING_ARGUMENT, NULL,
+      "Select the digest recorded in the backup log for each installed and "
+      "backed up file, and used to check whether these files have been "
+      "modified when uninstalling the driver or when running `"
+      "nvidia-installer --sanity`.  Valid values are 'crc32' (a 32-bit CRC), "
+      "'xxh64' (a fast 64-bit hash), and 'blake3' (a cryptographic hash, "
+      "suited to detecting deliberate modification).  A CRC is recorded for "
+      "each file in addition to the selected digest, so that the backup log "
+      "remains readable by older versions of nvidia-installer.  Default: "
+      "'crc32'."
+    },
+
+    { "conflict-scan-cache", CONFLICT_SCAN_CACHE_OPTION,
+      NVGETOPT_STRING_ARGUMENT, NULL,
+      "Control the cache of the directories searched for conflicting files, "
+      "which nvidia-installer keeps in /var/cache/nvidia-installer so that "
+      "later installations only need to read the directories that have "
+      "changed.  Valid values are 'use' (use and update the cache), "
+      "'rebuild' (discard the cache and search every directory, saving a "
+      "new cache), and 'off' (neither use nor update the cache).  Default: "
+      "'use'."
+    },
+
+    { "staged-install", STAGED_INSTALL_OPTION, 0, NULL,
+      "Install each file by writing it under a temporary name in its "
+      "destination directory, and then renaming it into place, so that an "
+      "interrupted installer never leaves a partially written file at any "
+      "installed path; each filesystem installed into is flushed to disk "
+      "once, at the end of the installation.  A system crash before then "
+      "may still leave incomplete files; see '--swap-install'."
+    },
+
+    { "swap-install", SWAP_INSTALL_OPTION, 0, NULL,
+      "Stage all of the files to install under temporary names, and only "
+      "then move them into place together, libraries before symbolic "
+      "links, replacing the files of the previous driver, so that "
+      "applications using the driver find its files missing for as short "
+      "a time as possible.  The staged files are flushed to disk before "
+      "any is moved into place, so that even a system crash never leaves "
+      "an incomplete file at an installed path.  The files of the previous "
+      "driver that are not replaced are removed afterwards.  Implies "
+      "'--staged-install' and '--delta-upgrade'."
+    },
+
+    { "delta-reinstall", DELTA_REINSTALL_OPTION, 0, NULL,
+      "If the driver version being installed is already installed, do not "
+      "uninstall it first; instead, only install the files that have "
+      "changed since they were installed (according to the checksums "
+      "recorded when they were installed), or that differ from the files "
+      "to install, and remove the files that are no longer part of the "
+      "installation.  This is useful to repair an "
+      "installation quickly.  If a different version is installed, it is "
+      "uninstalled as usual."
+    },
+
+    { "delta-upgrade", DELTA_UPGRADE_OPTION, 0, NULL,
+      "Like '--delta-reinstall', but also when a different driver version "
+      "is installed: instead of uninstalling it and then installing "
+      "everything again, keep the installed files that are unchanged, "
+      "rename those that only differ by the version number in their "
+      "names, replace the files that have changed, re-point the symbolic "
+      "links, and remove the files that are no longer part of the "
+      "installation.  The previous version's own uninstaller is not run.  "
+      "Implies '--delta-reinstall'."
+    },
+
+    { "export-install-plan", EXPORT_INSTALL_PLAN_OPTION,
+      NVGETOPT_STRING_ARGUMENT, NULL,
+      "Write the list of operations computed for this installation (the "
+      "files to back up, install and link, and their destinations) to the "
+      "specified file, together with fingerprints of the directories "
+      "searched for conflicting files, so that it can be reused on "
+      "identical systems with '--install-plan'."
+    },
+
+    { "install-plan", INSTALL_PLAN_OPTION,
+      NVGETOPT_STRING_ARGUMENT, NULL,
+      "Use the list of operations from the specified file, written by "
+      "'--export-install-plan', instead of searching for conflicting files.  "
+      "The plan is only used if it was written for the same driver version, "
+      "installation options and utilities, and if none of the directories it "
+      "fingerprinted has changed; otherwise, nvidia-installer warns and "
+      "searches for conflicting files as usual."
+    },
+
     /* Orphaned options: These options were in the long_options table in
      * nvidia-installer.c but not in the help. */
     { "debug",                    'd', 0, NULL,NULL },
@@ -646,6 +741,8 @@ static const NVGetoptOption __options[] = {
     { "add-this-kernel",          ADD_THIS_KERNEL_OPTION, 0, NULL, NULL },
     { "rpm-file-list",            RPM_FILE_LIST_OPTION,
       NVGETOPT_STRING_ARGUMENT, NULL, NULL },
+    { "rpm-file-list-entries",    RPM_FILE_LIST_ENTRIES_OPTION,
+      NVGETOPT_STRING_ARGUMENT, NULL, NULL },
     { "no-rpms",                  NO_RPMS_OPTION, 0, NULL, NULL},
     { "advanced-options-args-only", ADVANCED_OPTIONS_ARGS_ONLY_OPTION, 0,
       NULL, NULL },